@@ -1,6 +1,7 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <malloc/malloc.h>
@@ -20,10 +21,378 @@ clock_t print_time_taken(clock_t t, const char *msg) {
   return clock();
 }
 
+int count_cb(void *data, const unsigned char *, uint32_t, void *) {
+  (*(uint64_t *)data)++;
+  return 0;
+}
+
+// A fuzzy query checked against every key in turn
+struct brute_query {
+  const uint8_t *key;
+  int key_len;
+  int max_edits;
+  uint64_t found;
+};
+
+int brute_cb(void *data, const unsigned char *key, uint32_t key_len, void *) {
+  brute_query *q = (brute_query *)data;
+  std::vector<int> prev(q->key_len + 1), row(q->key_len + 1);
+  for (int j = 0; j <= q->key_len; j++)
+    prev[j] = j;
+  for (uint32_t i = 1; i <= key_len; i++) {
+    row[0] = i;
+    for (int j = 1; j <= q->key_len; j++)
+      row[j] = std::min(std::min(prev[j] + 1, row[j-1] + 1),
+          prev[j-1] + (key[i-1] != q->key[j-1]));
+    prev.swap(row);
+  }
+  if (prev[q->key_len] <= q->max_edits)
+    q->found++;
+  return 0;
+}
+
+// Counts the keys a compiled glob accepts, stepping it over each
+int dfa_cb(void *data, const unsigned char *key, uint32_t key_len, void *) {
+  std::pair<const art_dfa *, uint64_t> *q = (std::pair<const art_dfa *, uint64_t> *)data;
+  int state = q->first->start;
+  for (uint32_t i = 0; i < key_len && state; i++)
+    state = art_dfa_step(q->first, state, key[i]);
+  if (q->first->accept[state])
+    q->second++;
+  return 0;
+}
+
+// Loads, looks up and batch looks up every line with
+// PrefixLen bytes of each node prefix kept inline
+template <int PrefixLen>
+void run(std::vector<uint8_t *> &lines, std::vector<int> &line_lens, int flags) {
+
+  art::basic_art_trie<PrefixLen> at(flags);
+  printf("Prefix len: %d, node4 size: %lu\n", PrefixLen,
+      sizeof(typename art::basic_art_trie<PrefixLen>::art_node4));
+  art::art_stats_reset();
+
+  clock_t t = clock();
+  // Sorted input is built in one pass, anything else is
+  // partitioned across all cores
+  if (at.art_bulk_load((const unsigned char **) lines.data(), line_lens.data(), lines.size(), (void **) lines.data()) == 0) {
+    std::cout << "Bulk loaded sorted keys" << std::endl;
+  } else {
+    int threads = std::thread::hardware_concurrency();
+    at.art_parallel_load((const unsigned char **) lines.data(), line_lens.data(), lines.size(), (void **) lines.data(), threads);
+    std::cout << "Loaded with " << threads << " threads" << std::endl;
+  }
+  t = print_time_taken(t, "Time taken for insert/append: ");
+  printf("ART Size: %lu\n", at.art_size_in_bytes());
+
+  // Where the bytes go, and how well the node types and
+  // inline prefix fit the keys
+  art::art_analysis an = at.art_analyze();
+  // In size order, NODE32 has the last type code
+  const int types[] = {NODE4, NODE16, NODE32, NODE48, NODE256};
+  const char *names[] = {"node4", "node16", "node32", "node48", "node256"};
+  printf("Bytes: %lu, malloc usable: %lu, leaves: %lu (%lu bytes, %lu key bytes)\n",
+      (unsigned long) an.bytes, (unsigned long) an.usable, (unsigned long) an.leaves,
+      (unsigned long) an.leaf_bytes, (unsigned long) an.key_bytes);
+  for (int i = 0; i < ART_NODE_TYPES; i++) {
+    int type = types[i] - 1;
+    printf("%8s: %9lu nodes %11lu bytes, fill by tenths:", names[i],
+        (unsigned long) an.nodes[type], (unsigned long) an.node_bytes[type]);
+    for (int b = 0; b < ART_FILL_BUCKETS; b++)
+      printf(" %lu", (unsigned long) an.fill[type][b]);
+    printf("\n");
+  }
+  printf("Prefixes over %d bytes: %lu, longest: %u, deepest leaf: %u\n", PrefixLen,
+      (unsigned long) an.partial_len[PrefixLen + 1], an.max_partial_len, an.max_leaf_depth);
+  printf("Leaves by depth:");
+  for (uint32_t d = 0; d <= an.max_leaf_depth && d < ART_DEPTH_BUCKETS; d++)
+    printf(" %lu", (unsigned long) an.leaf_depth[d]);
+  printf("\n");
+
+  // The same keys one at a time, each resuming from the path
+  // of the one before
+  {
+    art::basic_art_trie<PrefixLen> ht(flags);
+    typename art::basic_art_trie<PrefixLen>::art_hint hint;
+    for (size_t i = 0; i < lines.size(); i++)
+      ht.art_insert_hint(hint, lines[i], line_lens[i], lines[i]);
+    print_time_taken(t, "Time taken for hinted insert: ");
+  }
+  t = clock();
+
+  uint8_t val_buf[100];
+
+  int err_count = 0;
+  int line_count = 0;
+  for (size_t i = 0; i < lines.size(); i++) {
+    uint8_t *line = lines[i];
+    size_t line_len = line_lens[i];
+    uint8_t *res_val = (uint8_t *) at.art_search(line, line_len);
+    if (res_val != NULL) {
+      int val_len = line_len > 6 ? 7 : line_len;
+      memcpy(val_buf, res_val, val_len);
+      if (memcmp(line, val_buf, val_len) != 0) {
+        printf("key: [%.*s], val: [%.*s]\n", (int) line_len, line, val_len, res_val);
+        err_count++;
+      }
+    } else {
+      std::cout << "Not found: " << line << std::endl;
+      err_count++;
+    }
+    line_count++;
+  }
+  printf("\nKeys per sec: %lf\n", line_count / time_taken_in_secs(t) / 1000);
+  t = print_time_taken(t, "Time taken for retrieve: ");
+  printf("Lines: %d, Errors: %d\n", line_count, err_count);
+
+  const int batch_size = 256;
+  const unsigned char *batch_keys[batch_size];
+  int batch_lens[batch_size];
+  void *batch_vals[batch_size];
+  err_count = 0;
+  line_count = 0;
+  for (size_t i = 0; i < lines.size(); i += batch_size) {
+    int n = lines.size() - i < batch_size ? lines.size() - i : batch_size;
+    for (int j = 0; j < n; j++) {
+      batch_keys[j] = lines[i + j];
+      batch_lens[j] = line_lens[i + j];
+    }
+    at.art_search_batch(batch_keys, batch_lens, n, batch_vals);
+    for (int j = 0; j < n; j++) {
+      if (batch_vals[j] != lines[i + j])
+        err_count++;
+    }
+    line_count += n;
+  }
+  printf("\nBatched keys per sec: %lf\n", line_count / time_taken_in_secs(t) / 1000);
+  t = print_time_taken(t, "Time taken for batched retrieve: ");
+  printf("Lines: %d, Errors: %d\n", line_count, err_count);
+
+  // Rank every key and select it back by position,
+  // reading subtree counts instead of counting leaves
+  if (flags & ART_SUBTREE_COUNT) {
+    err_count = 0;
+    for (size_t i = 0; i < lines.size(); i++) {
+      uint64_t rank = at.art_rank(lines[i], line_lens[i]);
+      typename art::basic_art_trie<PrefixLen>::art_leaf *l = at.art_select(rank);
+      if (!l || l->value != lines[i])
+        err_count++;
+    }
+    printf("\nRank and select per sec: %lf\n", lines.size() / time_taken_in_secs(t) / 1000);
+    t = print_time_taken(t, "Time taken for rank and select: ");
+    printf("Lines: %d, Errors: %d\n", (int) lines.size(), err_count);
+  }
+
+  // Top 10 under the first two bytes of each line, scored by value
+  if (flags & ART_MAX_SCORE) {
+    uint64_t found = 0;
+    for (size_t i = 0; i < lines.size(); i++)
+      at.art_topk_prefix(lines[i], line_lens[i] < 2 ? line_lens[i] : 2, 10, count_cb, &found);
+    printf("\nTop 10 per sec: %lf\n", lines.size() / time_taken_in_secs(t) / 1000);
+    t = print_time_taken(t, "Time taken for top 10: ");
+    printf("Lines: %d, Found: %d\n", (int) lines.size(), (int) found);
+  }
+
+  // Keys within 2 edits of a sample of lines, walking the trie
+  // against computing the distance to every key
+  uint64_t fuzzy_found = 0, brute_found = 0;
+  int queries = 0;
+  for (size_t i = 0; i < lines.size(); i += 5000, queries++)
+    at.art_fuzzy_search(lines[i], line_lens[i], 2, count_cb, &fuzzy_found);
+  printf("\nFuzzy queries per sec: %lf\n", queries / time_taken_in_secs(t) / 1000);
+  t = print_time_taken(t, "Time taken for fuzzy search: ");
+  for (size_t i = 0; i < lines.size(); i += 5000) {
+    brute_query q = {lines[i], line_lens[i], 2, 0};
+    at.art_iter(brute_cb, &q);
+    brute_found += q.found;
+  }
+  printf("Brute force queries per sec: %lf\n", queries / time_taken_in_secs(t) / 1000);
+  t = print_time_taken(t, "Time taken for brute force: ");
+  printf("Queries: %d, Found: %d, Errors: %d\n", queries, (int) fuzzy_found,
+      (int) (fuzzy_found > brute_found ? fuzzy_found - brute_found : brute_found - fuzzy_found));
+
+  // Glob matches walking the trie with the DFA against
+  // running it over every key
+  const char *globs[] = {"*ing", "a*b*c", "?[aeiou]x*", "*:*:session"};
+  art_dfa dfas[4];
+  uint64_t pattern_found = 0;
+  std::pair<const art_dfa *, uint64_t> scan_found(NULL, 0);
+  for (int i = 0; i < 4; i++)
+    art_dfa_compile_glob(&dfas[i], globs[i]);
+  t = clock();
+  for (int i = 0; i < 4; i++)
+    at.art_iter_pattern(&dfas[i], count_cb, &pattern_found);
+  t = print_time_taken(t, "\nTime taken for 4 globs: ");
+  for (int i = 0; i < 4; i++) {
+    scan_found.first = &dfas[i];
+    at.art_iter(dfa_cb, &scan_found);
+    art_dfa_free(&dfas[i]);
+  }
+  t = print_time_taken(t, "Time taken for 4 globs by full scan: ");
+  printf("Found: %d, Errors: %d\n", (int) pattern_found,
+      (int) (pattern_found > scan_found.second ? pattern_found - scan_found.second : scan_found.second - pattern_found));
+
+#ifdef ART_STATS
+  // Counted on this thread only, so a parallel load is left out
+  art::art_stats st = art::art_stats_get();
+  printf("\nSearches: %lu, mean depth: %.2f, max depth: %lu, leaf mismatches: %lu\n",
+      (unsigned long) st.searches, (double) st.search_depth / (st.searches ? st.searches : 1),
+      (unsigned long) st.max_search_depth, (unsigned long) st.leaf_mismatches);
+  printf("Grows 4/16/32/48: %lu %lu %lu %lu, prefix leaf reads: %lu, leaves: %lu\n",
+      (unsigned long) st.grows[NODE4-1], (unsigned long) st.grows[NODE16-1], (unsigned long) st.grows[NODE32-1],
+      (unsigned long) st.grows[NODE48-1], (unsigned long) st.prefix_leaf_reads, (unsigned long) st.leaf_allocs);
+#endif
+}
+
+int top_cb(void *data, const unsigned char *, uint32_t, void *value) {
+  *(void **)data = value;
+  return 0;
+}
+
+// Builds the lines with art_parallel_load on 4 threads, whatever
+// the core count, and compares it with inserting them one by one.
+// Each line gets a first byte out of 255, so the subtrees are
+// stitched under a node256 in an order that is not sorted, and
+// every 10th line comes again with a new value.
+void check_parallel_load(std::vector<uint8_t *> &lines, std::vector<int> &line_lens) {
+  int flags = ART_NODE_POOL | ART_LEAF_ARENA | ART_SUBTREE_COUNT | ART_MAX_SCORE;
+  size_t total = 0;
+  for (size_t i = 0; i < lines.size(); i++)
+    total += line_lens[i] + 1;
+  std::vector<unsigned char> buf(total);
+  std::vector<const unsigned char *> keys;
+  std::vector<int> key_lens;
+  std::vector<void *> values;
+  unsigned char *p = buf.data();
+  for (size_t i = 0; i < lines.size(); i++) {
+    p[0] = 1 + (i * 37) % 255;
+    memcpy(p + 1, lines[i], line_lens[i]);
+    keys.push_back(p);
+    key_lens.push_back(line_lens[i] + 1);
+    values.push_back((void *) (uintptr_t) (i + 1));
+    p += line_lens[i] + 1;
+  }
+  for (size_t i = 0; i < lines.size(); i += 10) {
+    keys.push_back(keys[i]);
+    key_lens.push_back(key_lens[i]);
+    values.push_back((void *) (uintptr_t) (lines.size() + i + 1));
+  }
+
+  art::art_trie pt(flags), st(flags);
+  int err_count = 0;
+  clock_t t = clock();
+  pt.art_parallel_load(keys.data(), key_lens.data(), keys.size(), values.data(), 4);
+  t = print_time_taken(t, "\nTime taken for parallel load on 4 threads: ");
+  for (size_t i = 0; i < keys.size(); i++)
+    st.art_insert(keys[i], key_lens[i], values[i]);
+  t = print_time_taken(t, "Time taken for the same inserts: ");
+
+  // Deletes go back to the pools and arena the workers handed over
+  for (size_t i = 0; i < lines.size(); i += 7) {
+    if (pt.art_delete(keys[i], key_lens[i]) != st.art_delete(keys[i], key_lens[i]))
+      err_count++;
+  }
+
+  // Ranks and selects read the subtree counts and the top value
+  // under a prefix, the empty one included, reads the max scores
+  if (pt.art_size() != st.art_size() ||
+      pt.art_count_range(NULL, 0, NULL, 0) != st.art_size())
+    err_count++;
+  for (size_t i = 0; i < lines.size(); i++) {
+    uint64_t rank = pt.art_rank(keys[i], key_lens[i]);
+    void *value = st.art_search(keys[i], key_lens[i]);
+    art::art_leaf *l = pt.art_select(rank);
+    if (pt.art_search(keys[i], key_lens[i]) != value || rank != st.art_rank(keys[i], key_lens[i]) ||
+        (value && (!l || l->value != value)))
+      err_count++;
+    if (i % 50 == 0) {
+      for (int len = 0; len <= 2 && len <= key_lens[i]; len++) {
+        void *ptop = NULL, *stop = NULL;
+        pt.art_topk_prefix(keys[i], len, 1, top_cb, &ptop);
+        st.art_topk_prefix(keys[i], len, 1, top_cb, &stop);
+        if (ptop != stop)
+          err_count++;
+      }
+    }
+  }
+  printf("Keys: %d, Errors: %d\n", (int) keys.size(), err_count);
+}
+
+// Loads the lines again as 16 byte binary keys when every one of
+// them is a UUID, such as session IDs, and checks that strings of
+// any other width stay out, inserted one by one or in parallel
+void run_uuid(std::vector<uint8_t *> &lines, std::vector<int> &line_lens) {
+  typedef art::basic_art_trie<MAX_PREFIX_LEN, void *, 16> uuid_trie;
+  std::vector<unsigned char> uuids(lines.size() * 16);
+  for (size_t i = 0; i < lines.size(); i++) {
+    if (!art::art_key_uuid((const char *) lines[i], line_lens[i], &uuids[i * 16]))
+      return;
+  }
+  printf("\nUUID keys, node4 size: %lu, leaf size: %lu\n",
+      sizeof(uuid_trie::art_node4), sizeof(uuid_trie::art_leaf));
+
+  uuid_trie ut;
+  clock_t t = clock();
+  for (size_t i = 0; i < lines.size(); i++)
+    ut.art_insert(&uuids[i * 16], 16, lines[i]);
+  t = print_time_taken(t, "Time taken for insert: ");
+  printf("ART Size: %lu\n", ut.art_size_in_bytes());
+
+  // A repeated line keeps the value of its last copy
+  int err_count = 0;
+  for (size_t i = 0; i < lines.size(); i++) {
+    uint8_t *res_val = (uint8_t *) ut.art_search(&uuids[i * 16], 16);
+    if (res_val == NULL || memcmp(res_val, lines[i], line_lens[i]) != 0)
+      err_count++;
+  }
+  printf("Keys per sec: %lf\n", lines.size() / time_taken_in_secs(t) / 1000);
+  t = print_time_taken(t, "Time taken for retrieve: ");
+
+  // The text form of a UUID is not a key of this trie
+  uint64_t size = ut.art_size();
+  int status = ART_KEY_ADDED;
+  if (ut.art_insert(lines[0], line_lens[0], lines[0], &status) != NULL ||
+      status != ART_KEY_CONFLICT || ut.art_size() != size ||
+      ut.art_search(lines[0], line_lens[0]) != NULL)
+    err_count++;
+
+  // Built in parallel with every 100th line also given as text
+  std::vector<const unsigned char *> keys;
+  std::vector<int> key_lens;
+  std::vector<void *> values;
+  for (size_t i = 0; i < lines.size(); i++) {
+    keys.push_back(&uuids[i * 16]);
+    key_lens.push_back(16);
+    values.push_back(lines[i]);
+    if (i % 100 == 0) {
+      keys.push_back(lines[i]);
+      key_lens.push_back(line_lens[i]);
+      values.push_back(NULL);
+    }
+  }
+  uuid_trie pt;
+  pt.art_parallel_load(keys.data(), key_lens.data(), keys.size(), values.data(), 4);
+  t = print_time_taken(t, "Time taken for parallel load: ");
+  if (pt.art_size() != ut.art_size())
+    err_count++;
+  for (size_t i = 0; i < lines.size(); i++) {
+    if (pt.art_search(&uuids[i * 16], 16) != ut.art_search(&uuids[i * 16], 16))
+      err_count++;
+  }
+  printf("Lines: %d, Errors: %d\n", (int) lines.size(), err_count);
+}
+
+// Usage: art_insert <file> [prefix_len] [key_prefix] [flags]
+// prefix_len picks the inline prefix of each node (4, 10, 16, 32
+// or 64) and key_prefix is put in front of every line, so the same
+// file can be measured as short keys and as long ones sharing a
+// common start, such as URLs. flags are passed to the trie, e.g.
+// 4 for ART_OPTIMISTIC_PREFIX, 16 for ART_SUBTREE_COUNT or 32 for
+// ART_MAX_SCORE.
 int main(int argc, char *argv[]) {
 
-  art::art_trie at;
   std::vector<uint8_t *> lines;
+  std::vector<int> line_lens;
 
   clock_t t = clock();
 
@@ -31,7 +400,7 @@ int main(int argc, char *argv[]) {
   memset(&file_stat, '\0', sizeof(file_stat));
   stat(argv[1], &file_stat);
   uint8_t *file_buf = (uint8_t *) malloc(file_stat.st_size + 1);
-  printf("File_size: %lld\n", file_stat.st_size);
+  printf("File_size: %lld\n", (long long)file_stat.st_size);
 
   FILE *fp = fopen(argv[1], "rb");
   if (fp == NULL) {
@@ -40,7 +409,7 @@ int main(int argc, char *argv[]) {
     return 1;
   }
   size_t res = fread(file_buf, 1, file_stat.st_size, fp);
-  if (res != file_stat.st_size) {
+  if (res != (size_t)file_stat.st_size) {
     perror("Error reading file: ");
     free(file_buf);
     return 1;
@@ -62,8 +431,8 @@ int main(int argc, char *argv[]) {
   size_t line_len = cr_pos - line;
   do {
     if (prev_line_len != line_len || strncmp((const char *) line, (const char *) prev_line, prev_line_len) != 0) {
-      at.art_insert(line, line_len, line);
       lines.push_back(line);
+      line_lens.push_back(line_len);
       prev_line = line;
       prev_line_len = line_len;
       line_count++;
@@ -82,35 +451,41 @@ int main(int argc, char *argv[]) {
     }
   } while (cr_pos != NULL);
   std::cout << std::endl;
-  t = print_time_taken(t, "Time taken for insert/append: ");
-  printf("ART Size: %lu\n", at.art_size_in_bytes());
 
-  uint8_t val_buf[100];
-
-  int err_count = 0;
-  line_count = 0;
-  bool success = false;
-  for (int i = 0; i < lines.size(); i++) {
-    line = lines[i];
-    line_len = strlen((const char *) line);
-    uint8_t *res_val = (uint8_t *) at.art_search(line, line_len);
-    if (res_val != NULL) {
-      int val_len = line_len > 6 ? 7 : line_len;
-      memcpy(val_buf, res_val, val_len);
-      if (memcmp(line, val_buf, val_len) != 0) {
-        printf("key: [%.*s], val: [%.*s]\n", (int) line_len, line, val_len, res_val);
-        err_count++;
-      }
-    } else {
-      std::cout << "Not found: " << line << std::endl;
-      err_count++;
+  // Put key_prefix in front of every line
+  uint8_t *long_buf = NULL;
+  if (argc > 3 && argv[3][0]) {
+    size_t key_prefix_len = strlen(argv[3]);
+    size_t total = 0;
+    for (size_t i = 0; i < lines.size(); i++)
+      total += key_prefix_len + line_lens[i] + 1;
+    long_buf = (uint8_t *) malloc(total);
+    uint8_t *p = long_buf;
+    for (size_t i = 0; i < lines.size(); i++) {
+      memcpy(p, argv[3], key_prefix_len);
+      memcpy(p + key_prefix_len, lines[i], line_lens[i] + 1);
+      lines[i] = p;
+      line_lens[i] += key_prefix_len;
+      p += line_lens[i] + 1;
     }
-    line_count++;
   }
-  printf("\nKeys per sec: %lf\n", line_count / time_taken_in_secs(t) / 1000);
-  t = print_time_taken(t, "Time taken for retrieve: ");
-  printf("Lines: %d, Errors: %d\n", line_count, err_count);
+  t = print_time_taken(t, "Time taken for reading: ");
+
+  int prefix_len = argc > 2 ? atoi(argv[2]) : MAX_PREFIX_LEN;
+  int flags = argc > 4 ? atoi(argv[4]) : 0;
+  switch (prefix_len) {
+    case 4: run<4>(lines, line_lens, flags); break;
+    case 10: run<10>(lines, line_lens, flags); break;
+    case 16: run<16>(lines, line_lens, flags); break;
+    case 32: run<32>(lines, line_lens, flags); break;
+    case 64: run<64>(lines, line_lens, flags); break;
+    default:
+      printf("Unsupported prefix len: %d\n", prefix_len);
+  }
+  check_parallel_load(lines, line_lens);
+  run_uuid(lines, line_lens);
 
+  free(long_buf);
   free(file_buf);
 
 }
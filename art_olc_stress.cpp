@@ -0,0 +1,173 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "cpp_src/art_olc.hpp"
+
+using namespace std;
+
+// Multithreaded stress test for art::art_trie_olc.
+// Usage: art_olc_stress <file> [max_threads] [epoch|deferred]
+// Runs each phase with 1, 2, 4 ... max_threads threads and
+// prints the throughput of each so scaling can be compared.
+
+static double secs_since(chrono::steady_clock::time_point t) {
+  return chrono::duration<double>(chrono::steady_clock::now() - t).count();
+}
+
+static int load_lines(const char *file_name, uint8_t *&file_buf, vector<uint8_t *> &lines) {
+  struct stat file_stat;
+  memset(&file_stat, '\0', sizeof(file_stat));
+  if (stat(file_name, &file_stat) != 0) {
+    perror("Could not stat file; ");
+    return 1;
+  }
+  file_buf = (uint8_t *) malloc(file_stat.st_size + 1);
+  FILE *fp = fopen(file_name, "rb");
+  if (fp == NULL) {
+    perror("Could not open file; ");
+    return 1;
+  }
+  size_t res = fread(file_buf, 1, file_stat.st_size, fp);
+  fclose(fp);
+  if (res != (size_t) file_stat.st_size) {
+    perror("Error reading file: ");
+    return 1;
+  }
+  file_buf[file_stat.st_size] = 0;
+  uint8_t *line = file_buf;
+  uint8_t *end = file_buf + file_stat.st_size;
+  while (line < end) {
+    uint8_t *cr_pos = (uint8_t *) memchr(line, '\n', end - line);
+    if (cr_pos == NULL)
+      cr_pos = end;
+    uint8_t *next = cr_pos + 1;
+    if (cr_pos > line && cr_pos[-1] == '\r')
+      cr_pos--;
+    *cr_pos = 0;
+    if (cr_pos > line)
+      lines.push_back(line);
+    line = next;
+  }
+  return 0;
+}
+
+// Keys include the terminating NUL so no key is a prefix of another
+static inline int key_len(const uint8_t *line) {
+  return strlen((const char *) line) + 1;
+}
+
+// Runs fn(thread_id, thread_count) on thread_count threads
+template <typename F>
+static double run_threads(int thread_count, F fn) {
+  vector<thread> threads;
+  auto t = chrono::steady_clock::now();
+  for (int i = 0; i < thread_count; i++)
+    threads.push_back(thread(fn, i, thread_count));
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+  return secs_since(t);
+}
+
+int main(int argc, char *argv[]) {
+
+  if (argc < 2) {
+    printf("Usage: %s <file> [max_threads] [epoch|deferred]\n", argv[0]);
+    return 1;
+  }
+  int max_threads = argc > 2 ? atoi(argv[2]) : thread::hardware_concurrency();
+  if (max_threads < 1)
+    max_threads = 1;
+  bool deferred = argc > 3 && strcmp(argv[3], "deferred") == 0;
+
+  uint8_t *file_buf = NULL;
+  vector<uint8_t *> lines;
+  if (load_lines(argv[1], file_buf, lines)) {
+    free(file_buf);
+    return 1;
+  }
+  printf("Lines: %lu, max threads: %d, reclaimer: %s\n", lines.size(), max_threads,
+         deferred ? "deferred" : "epoch");
+
+  atomic<long> err_count(0);
+  size_t n = lines.size();
+  printf("%8s %14s %14s %14s\n", "threads", "insert Mops", "lookup Mops", "mixed Mops");
+  for (int threads = 1; ; threads *= 2) {
+    if (threads > max_threads)
+      threads = max_threads;
+    art::art_deferred_reclaimer deferred_reclaimer;
+    art::art_trie_olc at(deferred ? &deferred_reclaimer : NULL);
+
+    // Every thread inserts an interleaved share of the lines
+    double t_insert = run_threads(threads, [&](int id, int count) {
+      for (size_t i = id; i < n; i += count)
+        at.art_insert(lines[i], key_len(lines[i]), lines[i]);
+    });
+    if (at.art_size() != n) {
+      printf("Size mismatch: %lu != %lu\n", at.art_size(), n);
+      err_count++;
+    }
+
+    // Every thread looks up all the lines, starting at a different offset
+    double t_lookup = run_threads(threads, [&](int id, int count) {
+      size_t start = n / count * id;
+      for (size_t j = 0; j < n; j++) {
+        size_t i = (start + j) % n;
+        if (at.art_search(lines[i], key_len(lines[i])) != lines[i])
+          err_count++;
+      }
+    });
+
+    // Half the threads delete and reinsert their share of the lines
+    // while the others keep looking everything up. Readers may miss
+    // a key that is in flight, but must never see a wrong value.
+    atomic<long> mixed_ops(0);
+    double t_mixed = run_threads(threads, [&](int id, int count) {
+      long ops = 0;
+      int writers = count > 1 ? count / 2 : 1;
+      if (id < writers) {
+        for (size_t i = id; i < n; i += writers) {
+          if (at.art_delete(lines[i], key_len(lines[i])) != lines[i])
+            err_count++;
+          if (at.art_insert(lines[i], key_len(lines[i]), lines[i]) != NULL)
+            err_count++;
+          ops += 2;
+        }
+      } else {
+        for (size_t j = 0; j < n; j++) {
+          size_t i = (n / count * id + j) % n;
+          void *val = at.art_search(lines[i], key_len(lines[i]));
+          if (val != NULL && val != lines[i])
+            err_count++;
+          ops++;
+        }
+      }
+      mixed_ops += ops;
+    });
+    if (at.art_size() != n) {
+      printf("Size mismatch after mixed: %lu != %lu\n", at.art_size(), n);
+      err_count++;
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (at.art_search(lines[i], key_len(lines[i])) != lines[i])
+        err_count++;
+    }
+
+    printf("%8d %14lf %14lf %14lf\n", threads,
+           n / t_insert / 1000000,
+           n * (double) threads / t_lookup / 1000000,
+           mixed_ops / t_mixed / 1000000);
+    if (threads == max_threads)
+      break;
+  }
+  printf("Errors: %ld\n", err_count.load());
+
+  free(file_buf);
+  return err_count ? 1 : 0;
+
+}
@@ -7,6 +7,25 @@
 #include <strings.h>
 #include <stdio.h>
 #include <assert.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#if defined(__APPLE__)
+    #include <malloc/malloc.h>
+#elif defined(__GLIBC__)
+    #include <malloc.h>
+#endif
+
+#include "../src/art_key.h"
+#include "../src/art_pattern.h"
 
 #ifdef __i386__
     #include <emmintrin.h>
@@ -16,14 +35,99 @@
 #endif
 #endif
 
+/**
+ * Wider compares are built for their own target and
+ * picked at run time, so one binary runs on any x86
+ * and uses what the CPU has.
+ */
+#if (defined(__i386__) || defined(__amd64__)) && defined(__GNUC__)
+    #include <immintrin.h>
+    #define ART_SIMD_DISPATCH
+#endif
+
 namespace art {
 
 #define NODE4   1
 #define NODE16  2
 #define NODE48  3
 #define NODE256 4
+#define NODE32  5   // Came after the others, which keep their codes
+
+/**
+ * Number of node types, which is also the highest type code
+ */
+#define ART_NODE_TYPES 5
 
+/**
+ * Prefix bytes kept inline by the default art_trie.
+ * basic_art_trie takes its own as a template argument.
+ */
+#ifndef MAX_PREFIX_LEN
 #define MAX_PREFIX_LEN 10
+#endif
+
+/**
+ * Flags accepted by art_trie(int flags)
+ */
+#define ART_NODE_POOL 1     // Carve inner nodes out of per-type slabs
+#define ART_LEAF_ARENA 2    // Bump-allocate leaves out of large chunks
+#define ART_OPTIMISTIC_PREFIX 4 // Skip prefixes on lookup, verify at the leaf
+#define ART_SUBTREE_COUNT 16 // Keep the number of leaves under every inner node
+#define ART_MAX_SCORE 32    // Keep the highest value score under every inner node
+
+/**
+ * What an insert did, reported through its status argument.
+ * A key conflicts if it cannot be stored next to one already
+ * in the trie: keys read as if they ended in a 0 byte, so a
+ * key followed by a 0 byte and more would take the slot of
+ * the key itself. The trie is then left as it was.
+ */
+#define ART_KEY_ADDED 0         // The key was new
+#define ART_KEY_FOUND 1         // The key was there, its old value is returned
+#define ART_KEY_CONFLICT (-1)   // The key was refused
+
+/**
+ * Levels and leading key bytes an insert hint remembers
+ */
+#define ART_HINT_DEPTH 32
+#define ART_HINT_KEY_LEN 128
+
+/**
+ * Size of each slab requested from malloc
+ * when ART_NODE_POOL is set.
+ */
+#ifndef ART_SLAB_SIZE
+#define ART_SLAB_SIZE (64 * 1024)
+#endif
+
+/**
+ * Size of each chunk requested from malloc
+ * when ART_LEAF_ARENA is set.
+ */
+#ifndef ART_ARENA_CHUNK_SIZE
+#define ART_ARENA_CHUNK_SIZE (1024 * 1024)
+#endif
+
+/**
+ * Deleted arena leaves are kept on free lists
+ * in 8 byte size classes up to this many classes.
+ * Larger leaves share a single exact-size list.
+ */
+#define ART_ARENA_CLASSES 64
+
+/**
+ * Number of lookups art_search_batch keeps
+ * in flight at the same time.
+ */
+#ifndef ART_BATCH_WINDOW
+#define ART_BATCH_WINDOW 16
+#endif
+
+/**
+ * Buckets of the histograms in art_analysis
+ */
+#define ART_FILL_BUCKETS 10
+#define ART_DEPTH_BUCKETS 64
 
 #define IS_LEAF(x) (((uintptr_t)x & 1))
 #define SET_LEAF(x) ((void*)((uintptr_t)x | 1))
@@ -44,101 +148,788 @@ typedef int(*art_callback)(void *data, const unsigned char *key, uint32_t key_le
 
 /**
  * This struct is included as part
- * of all the various node sizes
+ * of all the various node sizes.
+ * The first PrefixLen bytes of the prefix are kept inline,
+ * longer prefixes are read back from a leaf below.
  */
-typedef struct {
+template <int PrefixLen>
+struct basic_art_node {
     uint32_t partial_len;
     uint8_t type;
     uint8_t num_children;
-    unsigned char partial[MAX_PREFIX_LEN];
-} art_node;
+    unsigned char partial[PrefixLen];
+};
 
 /**
  * Small node with only 4 children
  */
-typedef struct {
-    art_node n;
+template <int PrefixLen>
+struct basic_art_node4 {
+    basic_art_node<PrefixLen> n;
     unsigned char keys[4];
-    art_node *children[4];
-} art_node4;
+    basic_art_node<PrefixLen> *children[4];
+};
 
 /**
  * Node with 16 children
  */
-typedef struct {
-    art_node n;
+template <int PrefixLen>
+struct basic_art_node16 {
+    basic_art_node<PrefixLen> n;
     unsigned char keys[16];
-    art_node *children[16];
-} art_node16;
+    basic_art_node<PrefixLen> *children[16];
+};
+
+/**
+ * Node with 32 children, searched with one
+ * AVX2 compare or two SSE2 ones.
+ */
+template <int PrefixLen>
+struct basic_art_node32 {
+    basic_art_node<PrefixLen> n;
+    unsigned char keys[32];
+    basic_art_node<PrefixLen> *children[32];
+};
 
 /**
  * Node with 48 children, but
  * a full 256 byte field.
  */
-typedef struct {
-    art_node n;
+template <int PrefixLen>
+struct basic_art_node48 {
+    basic_art_node<PrefixLen> n;
     unsigned char keys[256];
-    art_node *children[48];
-} art_node48;
+    basic_art_node<PrefixLen> *children[48];
+};
 
 /**
  * Full node with 256 children
  */
-typedef struct {
-    art_node n;
-    art_node *children[256];
-} art_node256;
+template <int PrefixLen>
+struct basic_art_node256 {
+    basic_art_node<PrefixLen> n;
+    basic_art_node<PrefixLen> *children[256];
+};
+
+/**
+ * Represents a leaf of a trie with KeyLen byte keys.
+ * Every key has the same length, so it is not stored.
+ */
+template <typename V, int KeyLen = 0>
+struct basic_art_leaf {
+    static const uint32_t key_len = KeyLen;
+    V value;
+    unsigned char key[KeyLen];
+};
+
+template <typename V, int KeyLen>
+const uint32_t basic_art_leaf<V, KeyLen>::key_len;
 
 /**
  * Represents a leaf. These are
  * of arbitrary size, as they include the key.
  */
-typedef struct {
-    void *value;
+template <typename V>
+struct basic_art_leaf<V, 0> {
+    V value;
     uint32_t key_len;
     unsigned char key[];
-} art_leaf;
+};
+
+/**
+ * Nodes and leaves of the default art_trie,
+ * which art_trie_olc uses as well.
+ */
+typedef basic_art_node<MAX_PREFIX_LEN> art_node;
+typedef basic_art_node4<MAX_PREFIX_LEN> art_node4;
+typedef basic_art_node16<MAX_PREFIX_LEN> art_node16;
+typedef basic_art_node32<MAX_PREFIX_LEN> art_node32;
+typedef basic_art_node48<MAX_PREFIX_LEN> art_node48;
+typedef basic_art_node256<MAX_PREFIX_LEN> art_node256;
+typedef basic_art_leaf<void*> art_leaf;
+
+/**
+ * Header of a slab. The node slots follow it.
+ */
+typedef struct art_slab {
+    struct art_slab *next;
+} art_slab;
+
+/**
+ * Free list and slab chain for one node size.
+ */
+typedef struct {
+    void *free_list;
+    art_slab *slabs;
+    char *bump;
+    char *end;
+} art_node_pool;
+
+/**
+ * Chunk chain and size-class free lists for leaves.
+ */
+typedef struct {
+    void *free_lists[ART_ARENA_CLASSES];
+    void *large_free;
+    art_slab *chunks;
+    char *bump;
+    char *end;
+} art_leaf_arena;
 
 /**
  * Main struct, points to root.
  */
+template <int PrefixLen>
+struct basic_art_tree {
+    basic_art_node<PrefixLen> *root;
+    uint64_t size;
+    int flags;
+    art_node_pool *pools;
+    art_leaf_arena *arena;
+    uint64_t mods;      // Bumped by every insert or delete that reshapes the tree
+};
+
+/**
+ * Returns a bitmask of the keys of an
+ * art_node32 that are equal to c.
+ */
+inline unsigned art_match32_base(const unsigned char *keys, unsigned char c) {
+#if defined(__i386__) || defined(__amd64__)
+    // Two 16 byte compares
+    __m128i key = _mm_set1_epi8(c);
+    unsigned lo = _mm_movemask_epi8(_mm_cmpeq_epi8(key,
+                _mm_loadu_si128((const __m128i*)keys)));
+    unsigned hi = _mm_movemask_epi8(_mm_cmpeq_epi8(key,
+                _mm_loadu_si128((const __m128i*)(keys + 16))));
+    return lo | hi << 16;
+#else
+    unsigned bitfield = 0;
+    for (int i = 0; i < 32; ++i) {
+        if (keys[i] == c)
+            bitfield |= (1u << i);
+    }
+    return bitfield;
+#endif
+}
+
+#ifdef ART_SIMD_DISPATCH
+// One 32 byte compare
+__attribute__((target("avx2")))
+inline unsigned art_match32_avx2(const unsigned char *keys, unsigned char c) {
+    __m256i cmp = _mm256_cmpeq_epi8(_mm256_set1_epi8(c),
+            _mm256_loadu_si256((const __m256i*)keys));
+    return _mm256_movemask_epi8(cmp);
+}
+#endif
+
+/**
+ * The art_node32 compare in use. It starts out as the
+ * baseline one, which needs no start-up code to run, and
+ * is switched once when the program loads, so lookups
+ * make a plain indirect call. A template so that every
+ * translation unit shares the one pointer.
+ */
+template <typename T = void>
+struct art_simd {
+    static unsigned (*match32)(const unsigned char *keys, unsigned char c);
+};
+
+template <typename T>
+unsigned (*art_simd<T>::match32)(const unsigned char *keys, unsigned char c) = art_match32_base;
+
+#ifdef ART_SIMD_DISPATCH
+__attribute__((constructor))
+static void art_detect_simd() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        art_simd<>::match32 = art_match32_avx2;
+}
+#endif
+
+inline unsigned art_match32(const unsigned char *keys, unsigned char c) {
+    return art_simd<>::match32(keys, c);
+}
+
+/**
+ * Layout of a saved trie, the same as the one written by
+ * the C library. Nodes mirror the in-memory ones, with
+ * children stored as offsets from the start of the file.
+ * Offset 0 is the header, so it doubles as NULL, and the
+ * low bit tags leaves as in memory.
+ */
+#define ART_MAP_MAGIC "ARTMAP\0\0"
+#define ART_MAP_VERSION 2   // Adds NODE32, version 1 files read the same
+#define ART_MAP_BYTE_ORDER 0x01020304
+
 typedef struct {
-    art_node *root;
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t max_prefix_len;
+    uint32_t reserved;
     uint64_t size;
-} art_tree;
+    uint64_t root;
+    uint64_t file_len;
+} map_header;
+
+template <int PrefixLen>
+struct basic_map_node {
+    uint32_t partial_len;
+    uint8_t type;
+    uint8_t num_children;
+    unsigned char partial[PrefixLen];
+};
+
+template <int PrefixLen>
+struct basic_map_node4 {
+    basic_map_node<PrefixLen> n;
+    unsigned char keys[4];
+    uint64_t children[4];
+};
+
+template <int PrefixLen>
+struct basic_map_node16 {
+    basic_map_node<PrefixLen> n;
+    unsigned char keys[16];
+    uint64_t children[16];
+};
+
+template <int PrefixLen>
+struct basic_map_node32 {
+    basic_map_node<PrefixLen> n;
+    unsigned char keys[32];
+    uint64_t children[32];
+};
+
+template <int PrefixLen>
+struct basic_map_node48 {
+    basic_map_node<PrefixLen> n;
+    unsigned char keys[256];
+    uint64_t children[48];
+};
+
+template <int PrefixLen>
+struct basic_map_node256 {
+    basic_map_node<PrefixLen> n;
+    uint64_t children[256];
+};
+
+typedef struct {
+    uint64_t value;
+    uint32_t key_len;
+    unsigned char key[1];
+} map_leaf;
+
+/**
+ * Parses a UUID, as 36 characters with dashes or as 32 hex
+ * digits, into the 16 byte big-endian key of a trie with
+ * KeyLen 16. Keys sort like the lowercase text.
+ * @return false if the text is not a UUID.
+ */
+inline bool art_key_uuid(const char *s, size_t len, unsigned char out[16]) {
+    if (len != 36 && len != 32) return false;
+    int nibbles = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = s[i];
+        if (len == 36 && (i == 8 || i == 13 || i == 18 || i == 23)) {
+            if (c != '-') return false;
+            continue;
+        }
+        int v;
+        if (c >= '0' && c <= '9') v = c - '0';
+        else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') v = c - 'A' + 10;
+        else return false;
+        if (nibbles & 1) out[nibbles / 2] |= v;
+        else out[nibbles / 2] = v << 4;
+        nibbles++;
+    }
+    return true;
+}
+
+/**
+ * Writes v as the 8 byte big-endian key of a trie
+ * with KeyLen 8, so keys sort numerically.
+ */
+inline void art_key_u64(uint64_t v, unsigned char out[8]) {
+    art_encode_u64(out, v);
+}
+
+/**
+ * Writes the 128 bit number hi:lo as the 16 byte
+ * big-endian key of a trie with KeyLen 16.
+ */
+inline void art_key_u128(uint64_t hi, uint64_t lo, unsigned char out[16]) {
+    art_key_u64(hi, out);
+    art_key_u64(lo, out + 8);
+}
+
+/**
+ * The art_key.h encoding of a typed key, as taken by the typed
+ * overloads of basic_art_trie. Integers take 4 or 8 bytes by
+ * their size, floats and doubles 4 and 8, and an art_key_buf
+ * is used as built. key is NULL for an overflowed buffer.
+ */
+struct art_key_ref {
+    unsigned char buf[8];
+    const unsigned char *key;
+    int len;
+
+    template <typename K>
+    explicit art_key_ref(K v, typename std::enable_if<std::is_integral<K>::value>::type* = 0)
+            : key(buf) {
+        if (sizeof(K) > 4)
+            len = std::is_signed<K>::value ? art_encode_i64(buf, v) : art_encode_u64(buf, v);
+        else
+            len = std::is_signed<K>::value ? art_encode_i32(buf, v) : art_encode_u32(buf, v);
+    }
+    explicit art_key_ref(float v) : key(buf), len(art_encode_float(buf, v)) {}
+    explicit art_key_ref(double v) : key(buf), len(art_encode_double(buf, v)) {}
+    explicit art_key_ref(const art_key_buf &k)
+        : key(k.overflow ? NULL : k.key), len(k.len) {}
+};
+
+/**
+ * Returns the byte of a key at depth. A key reads as if it
+ * ended in a 0 byte, so one key may be a prefix of another
+ * without reading past either. Inserts refuse a key that
+ * is another one followed by a 0 byte, see keys_conflict.
+ */
+inline unsigned char key_at(const unsigned char *key, int key_len, int depth) {
+    return depth < key_len ? key[depth] : 0;
+}
+
+// Returns true if one key is the other followed by a 0 byte and
+// maybe more. The shorter one reads as ending in a 0 byte, so
+// both would need the same slot and neither could be found.
+inline bool keys_conflict(const unsigned char *k1, int k1_len, const unsigned char *k2, int k2_len) {
+    if (k1_len > k2_len)
+        return keys_conflict(k2, k2_len, k1, k1_len);
+    return k1_len < k2_len && !k2[k1_len] && !memcmp(k1, k2, k1_len);
+}
+
+// Returns how many bytes two keys share from depth on
+inline int art_common_prefix(const unsigned char *k1, int k1_len,
+        const unsigned char *k2, int k2_len, int depth) {
+    int max_cmp = (k1_len < k2_len ? k1_len : k2_len) - depth;
+    int idx;
+    for (idx=0; idx < max_cmp; idx++) {
+        if (k1[depth+idx] != k2[depth+idx])
+            return idx;
+    }
+    return idx;
+}
+
+/**
+ * Shape of the node types, shared by art_trie and art_trie_olc.
+ * Type codes do not follow size, so growing and shrinking
+ * goes through these rather than type + 1 or type - 1.
+ */
+inline int art_node_capacity(uint8_t type) {
+    static const int capacity[] = {4, 16, 48, 256, 32};
+    return capacity[type-1];
+}
+inline uint8_t art_grown_type(uint8_t type) {
+    switch (type) {
+        case NODE4: return NODE16;
+        case NODE16: return NODE32;
+        case NODE32: return NODE48;
+        default: return NODE256;
+    }
+}
+inline uint8_t art_shrunk_type(uint8_t type) {
+    switch (type) {
+        case NODE256: return NODE48;
+        case NODE48: return NODE32;
+        case NODE32: return NODE16;
+        default: return NODE4;
+    }
+}
+
+// Moves a value in and out of the 64 bits a map leaf keeps
+template <typename V>
+inline uint64_t art_value_bits(V value) {
+    uint64_t bits = 0;
+    memcpy(&bits, &value, sizeof(V));
+    return bits;
+}
+
+template <typename V>
+inline V art_value_from_bits(uint64_t bits) {
+    V value;
+    memcpy(&value, &bits, sizeof(V));
+    return value;
+}
+
+/**
+ * What the hot paths did, counted when built with ART_STATS
+ * defined and always zero otherwise. Each thread counts into
+ * its own copy, so counting takes no locks and shares no cache
+ * lines. Per type arrays are indexed by node type - 1.
+ */
+struct art_stats {
+    uint64_t grows[ART_NODE_TYPES];          // Nodes of each type full on add_child and replaced
+    uint64_t shrinks[ART_NODE_TYPES];        // Nodes of each type replaced on remove_child, a node4 by its child
+    uint64_t node_allocs[ART_NODE_TYPES];
+    uint64_t node_frees[ART_NODE_TYPES];     // Frees while the trie is in use, not by its destructor
+    uint64_t leaf_allocs;
+    uint64_t leaf_frees;
+    uint64_t prefix_leaf_reads; // Inserts comparing a prefix past PrefixLen against a leaf
+    uint64_t searches;          // Calls to art_search
+    uint64_t search_depth;      // Inner nodes those searches went through
+    uint64_t max_search_depth;
+    uint64_t leaf_mismatches;   // Searches that ended on a leaf with another key
+
+    // Adds the counters of another snapshot, keeping
+    // the deeper of the two max_search_depth
+    void merge(const art_stats &o) {
+        for (int i = 0; i < ART_NODE_TYPES; i++) {
+            grows[i] += o.grows[i];
+            shrinks[i] += o.shrinks[i];
+            node_allocs[i] += o.node_allocs[i];
+            node_frees[i] += o.node_frees[i];
+        }
+        leaf_allocs += o.leaf_allocs;
+        leaf_frees += o.leaf_frees;
+        prefix_leaf_reads += o.prefix_leaf_reads;
+        searches += o.searches;
+        search_depth += o.search_depth;
+        max_search_depth = std::max(max_search_depth, o.max_search_depth);
+        leaf_mismatches += o.leaf_mismatches;
+    }
+};
+
+// The counters of the calling thread
+inline art_stats& art_thread_stats() {
+    static thread_local art_stats stats = art_stats();
+    return stats;
+}
+
+#ifdef ART_STATS
+#define ART_STAT(field) (art::art_thread_stats().field++)
+#define ART_STAT_MAX(field, v) (art::art_thread_stats().field < (uint64_t)(v) ? \
+        (void)(art::art_thread_stats().field = (v)) : (void)0)
+#else
+#define ART_STAT(field) ((void)0)
+#define ART_STAT_MAX(field, v) ((void)(v))
+#endif
+
+/**
+ * Copies the counters of the calling thread, which cover every
+ * trie it used since it started or last reset them. Worker
+ * threads take their own snapshot and merge them.
+ */
+inline art_stats art_stats_get() {
+    return art_thread_stats();
+}
+
+// Zeroes the counters of the calling thread
+inline void art_stats_reset() {
+    art_thread_stats() = art_stats();
+}
+
+/**
+ * Shape and memory use of a trie, as returned by art_analyze.
+ * Per type arrays are indexed by node type - 1. Bytes count
+ * what the trie asked for, usable bytes what the allocator set
+ * aside: malloc_usable_size of each node and leaf, or whole
+ * slabs and chunks with ART_NODE_POOL and ART_LEAF_ARENA.
+ */
+struct art_analysis {
+    uint64_t nodes[ART_NODE_TYPES];
+    uint64_t node_bytes[ART_NODE_TYPES];     // With the words kept in front of each node
+    uint64_t node_usable[ART_NODE_TYPES];
+    uint64_t fill[ART_NODE_TYPES][ART_FILL_BUCKETS]; // Nodes by children per tenth of capacity, full ones in the last
+    std::vector<uint64_t> partial_len; // Nodes by prefix length, longer than PrefixLen in the last
+    uint32_t max_partial_len;
+    uint64_t leaves;
+    uint64_t key_bytes;
+    uint64_t leaf_bytes;
+    uint64_t leaf_usable;
+    uint64_t leaf_depth[ART_DEPTH_BUCKETS]; // Leaves by inner nodes above them, deeper ones in the last
+    uint32_t max_leaf_depth;
+    uint64_t bytes;             // All of the above and the trie itself
+    uint64_t usable;
+};
+
+// Returns the bytes malloc set aside for an allocation
+// of the given size, where the platform can tell
+inline size_t art_usable_size(void *p, size_t size) {
+#if defined(__APPLE__)
+    return malloc_size(p);
+#elif defined(__GLIBC__)
+    (void)size;
+    return malloc_usable_size(p);
+#else
+    (void)p;
+    return size;
+#endif
+}
+
+/**
+ * An adaptive radix trie. PrefixLen is the number of prefix
+ * bytes each inner node keeps inline: a larger one makes nodes
+ * bigger but saves reading a leaf on every node whose prefix
+ * is longer, which pays off for keys with long shared prefixes
+ * such as URLs or paths. V is the value type, a pointer or an
+ * integer, and a missing key reads as V().
+ * A non-zero KeyLen makes every key exactly that many bytes,
+ * such as a binary UUID or a big-endian integer. Leaves then
+ * drop their length, keys compare a word at a time, and no key
+ * can be a prefix of another. Keys of any other length are
+ * never found and never inserted.
+ */
+template <int PrefixLen = MAX_PREFIX_LEN, typename V = void*, int KeyLen = 0>
+class basic_art_trie {
+  public:
+    typedef basic_art_node<PrefixLen> art_node;
+    typedef basic_art_node4<PrefixLen> art_node4;
+    typedef basic_art_node16<PrefixLen> art_node16;
+    typedef basic_art_node32<PrefixLen> art_node32;
+    typedef basic_art_node48<PrefixLen> art_node48;
+    typedef basic_art_node256<PrefixLen> art_node256;
+    typedef basic_art_leaf<V, KeyLen> art_leaf;
+    typedef int(*art_callback)(void *data, const unsigned char *key, uint32_t key_len, V value);
+    // Returns the score of a value, higher scores come first
+    typedef uint64_t(*art_scorer)(void *data, V value);
+
+    // The path taken by the last art_insert_hint, as the slot of
+    // each node from the root down and the key depth it was
+    // entered at. Any other insert or delete that reshapes the
+    // trie sends it back to the root.
+    struct art_hint {
+        const basic_art_trie *trie;
+        uint64_t mods;
+        int levels;
+        uint32_t key_len;
+        art_node **refs[ART_HINT_DEPTH];
+        uint32_t depths[ART_HINT_DEPTH];
+        unsigned char key[ART_HINT_KEY_LEN];
+
+        art_hint() : trie(NULL), mods(0), levels(0), key_len(0) {}
+    };
 
-class art_trie {
   private:
+    static_assert(PrefixLen > 0, "nodes need room for a prefix");
+    static_assert(KeyLen >= 0, "keys cannot have a negative length");
+    static_assert(sizeof(V) <= sizeof(uint64_t), "values are saved in 64 bits");
+
+    typedef basic_art_tree<PrefixLen> art_tree;
+    typedef basic_map_node<PrefixLen> map_node;
+    typedef basic_map_node4<PrefixLen> map_node4;
+    typedef basic_map_node16<PrefixLen> map_node16;
+    typedef basic_map_node32<PrefixLen> map_node32;
+    typedef basic_map_node48<PrefixLen> map_node48;
+    typedef basic_map_node256<PrefixLen> map_node256;
+
     art_tree t;
-    art_node* alloc_node(uint8_t type) {
-      art_node* n;
+    art_scorer scorer;
+    void *scorer_data;
+    size_t node_size(uint8_t type) {
       switch (type) {
           case NODE4:
-              n = (art_node*)calloc(1, sizeof(art_node4));
-              break;
+              return sizeof(art_node4);
           case NODE16:
-              n = (art_node*)calloc(1, sizeof(art_node16));
-              break;
+              return sizeof(art_node16);
+          case NODE32:
+              return sizeof(art_node32);
           case NODE48:
-              n = (art_node*)calloc(1, sizeof(art_node48));
-              break;
+              return sizeof(art_node48);
           case NODE256:
-              n = (art_node*)calloc(1, sizeof(art_node256));
-              break;
+              return sizeof(art_node256);
           default:
               abort();
       }
+    }
+    // Takes a slot from the pool, reusing freed
+    // nodes before carving a new one out of the slab
+    void* pool_alloc(art_node_pool *p, size_t size) {
+      void *slot = p->free_list;
+      if (slot) {
+          p->free_list = *(void**)slot;
+          return slot;
+      }
+      if ((size_t)(p->end - p->bump) < size) {
+          size_t header = (sizeof(art_slab) + 15) & ~(size_t)15;
+          size_t slab_size = ART_SLAB_SIZE;
+          if (slab_size < header + size) slab_size = header + size;
+          art_slab *s = (art_slab*)malloc(slab_size);
+          if (!s) return NULL;
+          s->next = p->slabs;
+          p->slabs = s;
+          p->bump = (char*)s + header;
+          p->end = (char*)s + slab_size;
+      }
+      slot = p->bump;
+      p->bump += size;
+      return slot;
+    }
+    void pool_free(art_node_pool *p, void *slot) {
+      *(void**)slot = p->free_list;
+      p->free_list = slot;
+    }
+    void pool_release(art_node_pool *p) {
+      art_slab *s = p->slabs;
+      while (s) {
+          art_slab *next = s->next;
+          free(s);
+          s = next;
+      }
+      memset(p, 0, sizeof(art_node_pool));
+    }
+    // Bytes in a leaf, fixed keys are part of the struct
+    size_t leaf_size(uint32_t key_len) {
+      return KeyLen ? sizeof(art_leaf) : sizeof(art_leaf) + key_len;
+    }
+    // Rounds a leaf allocation up to its size class
+    size_t leaf_alloc_size(uint32_t key_len) {
+      return (leaf_size(key_len) + 7) & ~(size_t)7;
+    }
+    // Takes space for a leaf from the arena, reusing
+    // deleted leaves of the same size first
+    void* arena_alloc(art_leaf_arena *a, size_t size) {
+      void **head;
+      size_t cls = size / 8 - 1;
+      if (cls < ART_ARENA_CLASSES) {
+          head = &a->free_lists[cls];
+      } else {
+          // Oversized leaves are reused only on an exact size match
+          head = &a->large_free;
+          while (*head && ((size_t*)*head)[1] != size)
+              head = (void**)*head;
+      }
+      void *slot = *head;
+      if (slot) {
+          *head = *(void**)slot;
+          return slot;
+      }
+      if ((size_t)(a->end - a->bump) < size) {
+          size_t header = (sizeof(art_slab) + 15) & ~(size_t)15;
+          size_t chunk_size = ART_ARENA_CHUNK_SIZE;
+          art_slab *s;
+          if (chunk_size < header + size) {
+              // Give a huge leaf a chunk of its own and keep
+              // bumping through the current one
+              s = (art_slab*)malloc(header + size);
+              if (!s) return NULL;
+              if (a->chunks) {
+                  s->next = a->chunks->next;
+                  a->chunks->next = s;
+              } else {
+                  s->next = NULL;
+                  a->chunks = s;
+              }
+              return (char*)s + header;
+          }
+          s = (art_slab*)malloc(chunk_size);
+          if (!s) return NULL;
+          s->next = a->chunks;
+          a->chunks = s;
+          a->bump = (char*)s + header;
+          a->end = (char*)s + chunk_size;
+      }
+      slot = a->bump;
+      a->bump += size;
+      return slot;
+    }
+    void arena_free(art_leaf_arena *a, void *slot, size_t size) {
+      size_t cls = size / 8 - 1;
+      if (cls < ART_ARENA_CLASSES) {
+          *(void**)slot = a->free_lists[cls];
+          a->free_lists[cls] = slot;
+      } else {
+          ((size_t*)slot)[1] = size;
+          *(void**)slot = a->large_free;
+          a->large_free = slot;
+      }
+    }
+    void arena_release(art_leaf_arena *a) {
+      art_slab *s = a->chunks;
+      while (s) {
+          art_slab *next = s->next;
+          free(s);
+          s = next;
+      }
+      memset(a, 0, sizeof(art_leaf_arena));
+    }
+    // Prepends the list at src, linked through the first
+    // word of each element, to the list at dst
+    void list_splice(void **dst, void *src) {
+      if (!src) return;
+      void **tail = &src;
+      while (*tail) tail = (void**)*tail;
+      *tail = *dst;
+      *dst = src;
+    }
+    // Hands the slabs and free slots of src over to dst
+    void pool_splice(art_node_pool *dst, art_node_pool *src) {
+      list_splice((void**)&dst->slabs, src->slabs);
+      list_splice(&dst->free_list, src->free_list);
+      memset(src, 0, sizeof(art_node_pool));
+    }
+    // Hands the chunks and free leaves of src over to dst
+    void arena_splice(art_leaf_arena *dst, art_leaf_arena *src) {
+      list_splice((void**)&dst->chunks, src->chunks);
+      for (int i = 0; i < ART_ARENA_CLASSES; i++)
+          list_splice(&dst->free_lists[i], src->free_lists[i]);
+      list_splice(&dst->large_free, src->large_free);
+      memset(src, 0, sizeof(art_leaf_arena));
+    }
+    // With ART_SUBTREE_COUNT every inner node is preceded
+    // by the number of leaves below it
+    static uint64_t& node_count(const art_node *n) {
+      return ((uint64_t*)n)[-1];
+    }
+    // With ART_MAX_SCORE it is also preceded by the highest
+    // score of a value below it, in front of the count if
+    // there is one
+    uint64_t& node_score(const art_node *n) {
+      return ((uint64_t*)n)[(t.flags & ART_SUBTREE_COUNT) ? -2 : -1];
+    }
+    size_t node_header() {
+      return sizeof(uint64_t) * (((t.flags & ART_SUBTREE_COUNT) ? 1 : 0) +
+              ((t.flags & ART_MAX_SCORE) ? 1 : 0));
+    }
+    art_node* alloc_node(uint8_t type) {
+      char *p;
+      size_t header = node_header();
+      size_t size = header + node_size(type);
+      if (t.pools) {
+          p = (char*)pool_alloc(&t.pools[type-1], size);
+          if (p) memset(p, 0, size);
+      } else {
+          p = (char*)calloc(1, size);
+      }
+      art_node *n = (art_node*)(p + header);
       n->type = type;
+      ART_STAT(node_allocs[type-1]);
       return n;
     }
+    // Returns a node to its pool or to malloc
+    void free_node(art_node *n) {
+      ART_STAT(node_frees[n->type-1]);
+      if (t.pools)
+          pool_free(&t.pools[n->type-1], (char*)n - node_header());
+      else
+          free((char*)n - node_header());
+    }
+    // Returns a leaf to the arena or to malloc
+    void free_leaf(art_leaf *l) {
+      ART_STAT(leaf_frees);
+      if (t.arena)
+          arena_free(t.arena, l, leaf_alloc_size(l->key_len));
+      else
+          free(l);
+    }
     // Recursively destroys the tree
     void destroy_node(art_node *n) {
       // Break if null
       if (!n) return;
   
-      // Special case leafs
+      // Special case leafs, arena leaves
+      // go away with their chunks
       if (IS_LEAF(n)) {
-          free(LEAF_RAW(n));
+          if (!t.arena) free(LEAF_RAW(n));
           return;
       }
   
@@ -149,6 +940,7 @@ class art_trie {
           art_node16 *p2;
           art_node48 *p3;
           art_node256 *p4;
+          art_node32 *p5;
       } p;
       switch (n->type) {
           case NODE4:
@@ -165,6 +957,13 @@ class art_trie {
               }
               break;
   
+          case NODE32:
+              p.p5 = (art_node32*)n;
+              for (i=0;i<n->num_children;i++) {
+                  destroy_node(p.p5->children[i]);
+              }
+              break;
+  
           case NODE48:
               p.p3 = (art_node48*)n;
               for (i=0;i<256;i++) {
@@ -186,8 +985,9 @@ class art_trie {
               abort();
       }
   
-      // Free ourself on the way up
-      free(n);
+      // Free ourself on the way up, pooled
+      // nodes go away with their slabs
+      if (!t.pools) free((char*)n - node_header());
     }
     art_node** find_child(art_node *n, unsigned char c) {
       int i, mask, bitfield;
@@ -196,10 +996,23 @@ class art_trie {
           art_node16 *p2;
           art_node48 *p3;
           art_node256 *p4;
+          art_node32 *p5;
       } p;
       switch (n->type) {
           case NODE4:
               p.p1 = (art_node4*)n;
+              #if defined(__i386__) || defined(__amd64__)
+              {
+                  // Compare the key to all 4 stored keys at once
+                  uint32_t keys;
+                  memcpy(&keys, p.p1->keys, 4);
+                  bitfield = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(c),
+                              _mm_cvtsi32_si128(keys)));
+                  bitfield &= (1 << n->num_children) - 1;
+                  if (bitfield)
+                      return &p.p1->children[__builtin_ctz(bitfield)];
+              }
+              #else
               for (i=0 ; i < n->num_children; i++) {
   		/* this cast works around a bug in gcc 5.1 when unrolling loops
   		 * https://gcc.gnu.org/bugzilla/show_bug.cgi?id=59124
@@ -207,6 +1020,7 @@ class art_trie {
                   if (((unsigned char*)p.p1->keys)[i] == c)
                       return &p.p1->children[i];
               }
+              #endif
               break;
   
           {
@@ -257,6 +1071,18 @@ class art_trie {
               break;
           }
   
+          case NODE32: {
+              p.p5 = (art_node32*)n;
+              unsigned matches = art_match32(p.p5->keys, c);
+  
+              // Use a mask to ignore children that don't exist
+              if (n->num_children < 32)
+                  matches &= (1u << n->num_children) - 1;
+              if (matches)
+                  return &p.p5->children[__builtin_ctz(matches)];
+              break;
+          }
+  
           case NODE48:
               p.p3 = (art_node48*)n;
               i = p.p3->keys[c];
@@ -279,7 +1105,7 @@ class art_trie {
       return (a < b) ? a : b;
     }
     int check_prefix(const art_node *n, const unsigned char *key, int key_len, int depth) {
-      int max_cmp = min(min(n->partial_len, MAX_PREFIX_LEN), key_len - depth);
+      int max_cmp = min(min(n->partial_len, PrefixLen), key_len - depth);
       int idx;
       for (idx=0; idx < max_cmp; idx++) {
           if (n->partial[idx] != key[depth+idx])
@@ -291,10 +1117,36 @@ class art_trie {
       (void)depth;
       // Fail if the key lengths are different
       if (n->key_len != (uint32_t)key_len) return 1;
-  
+
+      // Fixed keys compare a word at a time
+      if (KeyLen) {
+          int i;
+          for (i = 0; i + 8 <= KeyLen; i += 8) {
+              uint64_t a, b;
+              memcpy(&a, n->key + i, 8);
+              memcpy(&b, key + i, 8);
+              if (a != b) return 1;
+          }
+          return memcmp(n->key + i, key + i, KeyLen - i);
+      }
+
       // Compare the keys starting at the depth
       return memcmp(n->key, key, key_len);
     }
+    // Sets the length of a variable-length leaf
+    static void set_key_len(basic_art_leaf<V, 0> *l, uint32_t key_len) {
+        l->key_len = key_len;
+    }
+    template <int N>
+    static void set_key_len(basic_art_leaf<V, N> *, uint32_t) {}
+    inline void prefetch_node(const art_node *n) {
+        if (IS_LEAF(n)) {
+            __builtin_prefetch(LEAF_RAW(n));
+        } else {
+            __builtin_prefetch(n);
+            __builtin_prefetch((const char*)n + 64);
+        }
+    }
     art_leaf* minimum(const art_node *n) {
         // Handle base cases
         if (!n) return NULL;
@@ -306,6 +1158,8 @@ class art_trie {
                 return minimum(((const art_node4*)n)->children[0]);
             case NODE16:
                 return minimum(((const art_node16*)n)->children[0]);
+            case NODE32:
+                return minimum(((const art_node32*)n)->children[0]);
             case NODE48:
                 idx=0;
                 while (!((const art_node48*)n)->keys[idx]) idx++;
@@ -331,6 +1185,8 @@ class art_trie {
                 return maximum(((const art_node4*)n)->children[n->num_children-1]);
             case NODE16:
                 return maximum(((const art_node16*)n)->children[n->num_children-1]);
+            case NODE32:
+                return maximum(((const art_node32*)n)->children[n->num_children-1]);
             case NODE48:
                 idx=255;
                 while (!((const art_node48*)n)->keys[idx]) idx--;
@@ -344,28 +1200,31 @@ class art_trie {
                 abort();
         }
     }
-    art_leaf* make_leaf(const unsigned char *key, int key_len, void *value) {
-        art_leaf *l = (art_leaf*)calloc(1, sizeof(art_leaf)+key_len);
+    art_leaf* make_leaf(const unsigned char *key, int key_len, V value) {
+        art_leaf *l;
+        if (t.arena)
+            l = (art_leaf*)arena_alloc(t.arena, leaf_alloc_size(key_len));
+        else
+            l = (art_leaf*)calloc(1, leaf_size(key_len));
+        ART_STAT(leaf_allocs);
         l->value = value;
-        l->key_len = key_len;
+        set_key_len(l, key_len);
         memcpy(l->key, key, key_len);
         return l;
     }
 
     int longest_common_prefix(art_leaf *l1, art_leaf *l2, int depth) {
-        int max_cmp = min(l1->key_len, l2->key_len) - depth;
-        int idx;
-        for (idx=0; idx < max_cmp; idx++) {
-            if (l1->key[depth+idx] != l2->key[depth+idx])
-                return idx;
-        }
-        return idx;
+        return art_common_prefix(l1->key, l1->key_len, l2->key, l2->key_len, depth);
     }
 
     void copy_header(art_node *dest, art_node *src) {
+        if (t.flags & ART_SUBTREE_COUNT)
+            node_count(dest) = node_count(src);
+        if (t.flags & ART_MAX_SCORE)
+            node_score(dest) = node_score(src);
         dest->num_children = src->num_children;
         dest->partial_len = src->partial_len;
-        memcpy(dest->partial, src->partial, min(MAX_PREFIX_LEN, src->partial_len));
+        memcpy(dest->partial, src->partial, min(PrefixLen, src->partial_len));
     }
 
     void add_child256(art_node256 *n, art_node **ref, unsigned char c, void *child) {
@@ -382,6 +1241,7 @@ class art_trie {
             n->keys[c] = pos + 1;
             n->n.num_children++;
         } else {
+            ART_STAT(grows[NODE48-1]);
             art_node256 *new_node = (art_node256*)alloc_node(NODE256);
             for (int i=0;i<256;i++) {
                 if (n->keys[i]) {
@@ -390,32 +1250,68 @@ class art_trie {
             }
             copy_header((art_node*)new_node, (art_node*)n);
             *ref = (art_node*)new_node;
-            free(n);
+            free_node((art_node*)n);
             add_child256(new_node, ref, c, child);
         }
     }
 
-    void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *child) {
-        if (n->n.num_children < 16) {
-            unsigned mask = (1 << n->n.num_children) - 1;
-            
-            // support non-x86 architectures
-            #ifdef __i386__
-                __m128i cmp;
-
-                // Compare the key to all 16 stored keys
-                cmp = _mm_cmplt_epi8(_mm_set1_epi8(c),
-                        _mm_loadu_si128((__m128i*)n->keys));
+    void add_child32(art_node32 *n, art_node **ref, unsigned char c, void *child) {
+        if (n->n.num_children < 32) {
+            int idx;
+            for (idx=0; idx < n->n.num_children; idx++) {
+                if (c < n->keys[idx]) break;
+            }
 
-                // Use a mask to ignore children that don't exist
-                unsigned bitfield = _mm_movemask_epi8(cmp) & mask;
-            #else
-            #ifdef __amd64__
-                __m128i cmp;
+            // Shift to make room
+            memmove(n->keys+idx+1, n->keys+idx, n->n.num_children - idx);
+            memmove(n->children+idx+1, n->children+idx,
+                    (n->n.num_children - idx)*sizeof(void*));
 
-                // Compare the key to all 16 stored keys
-                cmp = _mm_cmplt_epi8(_mm_set1_epi8(c),
-                        _mm_loadu_si128((__m128i*)n->keys));
+            // Insert element
+            n->keys[idx] = c;
+            n->children[idx] = (art_node*)child;
+            n->n.num_children++;
+
+        } else {
+            ART_STAT(grows[NODE32-1]);
+            art_node48 *new_node = (art_node48*)alloc_node(NODE48);
+
+            // Copy the child pointers and populate the key map
+            memcpy(new_node->children, n->children,
+                    sizeof(void*)*n->n.num_children);
+            for (int i=0;i<n->n.num_children;i++) {
+                new_node->keys[n->keys[i]] = i + 1;
+            }
+            copy_header((art_node*)new_node, (art_node*)n);
+            *ref = (art_node*)new_node;
+            free_node((art_node*)n);
+            add_child48(new_node, ref, c, child);
+        }
+    }
+
+    void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *child) {
+        if (n->n.num_children < 16) {
+            unsigned mask = (1 << n->n.num_children) - 1;
+            
+            // support non-x86 architectures
+            #ifdef __i386__
+                __m128i cmp;
+
+                // Compare the key to all 16 stored keys, flipping the
+                // sign bits so the signed compare orders bytes unsigned
+                cmp = _mm_cmplt_epi8(_mm_set1_epi8(c ^ 0x80),
+                        _mm_xor_si128(_mm_loadu_si128((__m128i*)n->keys), _mm_set1_epi8((char)0x80)));
+
+                // Use a mask to ignore children that don't exist
+                unsigned bitfield = _mm_movemask_epi8(cmp) & mask;
+            #else
+            #ifdef __amd64__
+                __m128i cmp;
+
+                // Compare the key to all 16 stored keys, flipping the
+                // sign bits so the signed compare orders bytes unsigned
+                cmp = _mm_cmplt_epi8(_mm_set1_epi8(c ^ 0x80),
+                        _mm_xor_si128(_mm_loadu_si128((__m128i*)n->keys), _mm_set1_epi8((char)0x80)));
 
                 // Use a mask to ignore children that don't exist
                 unsigned bitfield = _mm_movemask_epi8(cmp) & mask;
@@ -448,18 +1344,18 @@ class art_trie {
             n->n.num_children++;
 
         } else {
-            art_node48 *new_node = (art_node48*)alloc_node(NODE48);
+            ART_STAT(grows[NODE16-1]);
+            art_node32 *new_node = (art_node32*)alloc_node(NODE32);
 
-            // Copy the child pointers and populate the key map
+            // Copy the child pointers and the key map
             memcpy(new_node->children, n->children,
                     sizeof(void*)*n->n.num_children);
-            for (int i=0;i<n->n.num_children;i++) {
-                new_node->keys[n->keys[i]] = i + 1;
-            }
+            memcpy(new_node->keys, n->keys,
+                    sizeof(unsigned char)*n->n.num_children);
             copy_header((art_node*)new_node, (art_node*)n);
             *ref = (art_node*)new_node;
-            free(n);
-            add_child48(new_node, ref, c, child);
+            free_node((art_node*)n);
+            add_child32(new_node, ref, c, child);
         }
     }
 
@@ -481,6 +1377,7 @@ class art_trie {
             n->n.num_children++;
 
         } else {
+            ART_STAT(grows[NODE4-1]);
             art_node16 *new_node = (art_node16*)alloc_node(NODE16);
 
             // Copy the child pointers and the key map
@@ -490,7 +1387,7 @@ class art_trie {
                     sizeof(unsigned char)*n->n.num_children);
             copy_header((art_node*)new_node, (art_node*)n);
             *ref = (art_node*)new_node;
-            free(n);
+            free_node((art_node*)n);
             add_child16(new_node, ref, c, child);
         }
     }
@@ -501,6 +1398,8 @@ class art_trie {
                 return add_child4((art_node4*)n, ref, c, child);
             case NODE16:
                 return add_child16((art_node16*)n, ref, c, child);
+            case NODE32:
+                return add_child32((art_node32*)n, ref, c, child);
             case NODE48:
                 return add_child48((art_node48*)n, ref, c, child);
             case NODE256:
@@ -514,7 +1413,7 @@ class art_trie {
     * Calculates the index at which the prefixes mismatch
     */
     int prefix_mismatch(const art_node *n, const unsigned char *key, int key_len, int depth) {
-        int max_cmp = min(min(MAX_PREFIX_LEN, n->partial_len), key_len - depth);
+        int max_cmp = min(min(PrefixLen, n->partial_len), key_len - depth);
         int idx;
         for (idx=0; idx < max_cmp; idx++) {
             if (n->partial[idx] != key[depth+idx])
@@ -522,8 +1421,9 @@ class art_trie {
         }
 
         // If the prefix is short we can avoid finding a leaf
-        if (n->partial_len > MAX_PREFIX_LEN) {
+        if (n->partial_len > PrefixLen) {
             // Prefix is longer than what we've checked, find a leaf
+            ART_STAT(prefix_leaf_reads);
             art_leaf *l = minimum(n);
             max_cmp = min(l->key_len, key_len)- depth;
             for (; idx < max_cmp; idx++) {
@@ -534,89 +1434,279 @@ class art_trie {
         return idx;
     }
 
-    void* recursive_insert(art_node *n, art_node **ref, const unsigned char *key, int key_len, void *value, int depth, int *old, int replace) {
-        // If we are at a NULL node, inject a leaf
-        if (!n) {
-            *ref = (art_node*)SET_LEAF(make_leaf(key, key_len, value));
-            return NULL;
+    // Adds delta to the count of each inner node on the path of
+    // a key, from the one in ref down to stop or to where the
+    // path ends. The path only depends on the key bytes past
+    // each prefix, so the prefixes are not compared.
+    void count_path(art_node **ref, int depth, const unsigned char *key, int key_len,
+            const art_node *stop, int delta) {
+        art_node *n = *ref;
+        while (n && !IS_LEAF(n)) {
+            node_count(n) += delta;
+            if (n == stop) return;
+            depth = depth + n->partial_len;
+            if (depth > key_len) return;
+            art_node **child = find_child(n, key_at(key, key_len, depth));
+            n = (child) ? *child : NULL;
+            depth++;
         }
+    }
 
-        // If we are at a leaf, we need to replace it with a node
-        if (IS_LEAF(n)) {
-            art_leaf *l = LEAF_RAW(n);
+    static uint64_t max_score(uint64_t a, uint64_t b) {
+        return (a > b) ? a : b;
+    }
+    // Returns the score of a value, its bits read as an
+    // unsigned integer unless the trie has a scorer
+    uint64_t value_score(V value) {
+        if (scorer) return scorer(scorer_data, value);
+        uint64_t score = 0;
+        memcpy(&score, &value, sizeof(V));
+        return score;
+    }
+    // Returns the highest score under a child with ART_MAX_SCORE
+    uint64_t child_score(const art_node *n) {
+        return IS_LEAF(n) ? value_score(LEAF_RAW(n)->value) : node_score(n);
+    }
+    // Recomputes the score of an inner node from its children
+    void rescore_node(art_node *n) {
+        uint64_t score = 0;
+        for (int idx = next_child(n, -1); idx >= 0; idx = next_child(n, idx))
+            score = max_score(score, child_score(child_at(n, idx)));
+        node_score(n) = score;
+    }
+    // Recomputes the scores on the path of a key bottom up, once
+    // a value on it went away or lost score. Raising a score
+    // never needs this, the walk down raises each node it passes.
+    void score_path(art_node *n, int depth, const unsigned char *key, int key_len) {
+        if (!n || IS_LEAF(n)) return;
+        depth = depth + n->partial_len;
+        if (depth <= key_len) {
+            art_node **child = find_child(n, key_at(key, key_len, depth));
+            if (child) score_path(*child, depth + 1, key, key_len);
+        }
+        rescore_node(n);
+    }
 
-            // Check if we are updating an existing value
-            if (!leaf_matches(l, key, key_len, depth)) {
-                *old = 1;
-                void *old_val = l->value;
-                if(replace) l->value = value;
-                return old_val;
+    // Inserts from the root, keeping the size and status
+    V insert_root(const unsigned char *key, int key_len, V value, int replace, int *status) {
+        int old_val = ART_KEY_CONFLICT;
+        V old = V();
+        if (!KeyLen || key_len == KeyLen) {
+            old_val = ART_KEY_ADDED;
+            old = insert_key(&t.root, key, key_len, value, 0, &old_val, replace, NULL);
+        }
+        if (old_val == ART_KEY_ADDED) {
+            t.size++;
+            t.mods++;
+        }
+        if (status) *status = old_val;
+        return old;
+    }
+
+    // Takes back what the walk down did for a key that conflicts,
+    // counts from start down to stop and the raised scores
+    V refuse_key(art_node **start, int start_depth, const unsigned char *key, int key_len,
+            const art_node *stop, int *old) {
+        if (t.flags & ART_SUBTREE_COUNT)
+            count_path(start, start_depth, key, key_len, stop, -1);
+        if (t.flags & ART_MAX_SCORE)
+            score_path(t.root, 0, key, key_len);
+        *old = ART_KEY_CONFLICT;
+        return V();
+    }
+
+    // Walks down from the slot ref, whose keys share their first
+    // depth bytes, to where the key belongs. Splices only touch
+    // the slot pointing at the current node, so that is all the
+    // walk keeps, apart from the path left in a hint.
+    V insert_key(art_node **ref, const unsigned char *key, int key_len, V value, int depth, int *old, int replace,
+            art_hint *hint) {
+        art_node **start = ref;
+        int start_depth = depth;
+        bool counted = t.flags & ART_SUBTREE_COUNT;
+        bool scored = t.flags & ART_MAX_SCORE;
+        uint64_t score = scored ? value_score(value) : 0;
+        for (;;) {
+            art_node *n = *ref;
+
+            // Remember the slot while the hint can still check it
+            if (hint && hint->levels < ART_HINT_DEPTH && depth <= ART_HINT_KEY_LEN) {
+                hint->refs[hint->levels] = ref;
+                hint->depths[hint->levels++] = depth;
             }
 
-            // New value, we must split the leaf into a node4
-            art_node4 *new_node = (art_node4*)alloc_node(NODE4);
+            // If we are at a NULL node, inject a leaf
+            if (!n) {
+                *ref = (art_node*)SET_LEAF(make_leaf(key, key_len, value));
+                return V();
+            }
 
-            // Create a new leaf
-            art_leaf *l2 = make_leaf(key, key_len, value);
+            // If we are at a leaf, we need to replace it with a node
+            if (IS_LEAF(n)) {
+                art_leaf *l = LEAF_RAW(n);
+
+                // Check if we are updating an existing value
+                if (!leaf_matches(l, key, key_len, depth)) {
+                    // Nodes were counted on the way down
+                    // as if the key were new
+                    if (counted) count_path(start, start_depth, key, key_len, NULL, -1);
+                    *old = ART_KEY_FOUND;
+                    V old_val = l->value;
+                    if(replace) l->value = value;
+
+                    // Scores were raised on the way down to one that
+                    // may not be there, redo them if it differs
+                    if (scored && value_score(old_val) != score)
+                        score_path(t.root, 0, key, key_len);
+                    return old_val;
+                }
 
-            // Determine longest prefix
-            int longest_prefix = longest_common_prefix(l, l2, depth);
-            new_node->n.partial_len = longest_prefix;
-            memcpy(new_node->n.partial, key+depth, min(MAX_PREFIX_LEN, longest_prefix));
-            // Add the leafs to the new node4
-            *ref = (art_node*)new_node;
-            add_child4(new_node, ref, l->key[depth+longest_prefix], SET_LEAF(l));
-            add_child4(new_node, ref, l2->key[depth+longest_prefix], SET_LEAF(l2));
-            return NULL;
-        }
+                if (!KeyLen && keys_conflict(l->key, l->key_len, key, key_len))
+                    return refuse_key(start, start_depth, key, key_len, NULL, old);
+
+                // New value, we must split the leaf into a node4
+                art_node4 *new_node = (art_node4*)alloc_node(NODE4);
+                if (counted) node_count(&new_node->n) = 2;
+                if (scored) node_score(&new_node->n) = max_score(value_score(l->value), score);
+
+                // Create a new leaf
+                art_leaf *l2 = make_leaf(key, key_len, value);
+
+                // Determine longest prefix
+                int longest_prefix = longest_common_prefix(l, l2, depth);
+                new_node->n.partial_len = longest_prefix;
+                memcpy(new_node->n.partial, key+depth, min(PrefixLen, longest_prefix));
+                // Add the leafs to the new node4
+                *ref = (art_node*)new_node;
+                add_child4(new_node, ref, key_at(l->key, l->key_len, depth+longest_prefix), SET_LEAF(l));
+                add_child4(new_node, ref, key_at(key, key_len, depth+longest_prefix), SET_LEAF(l2));
+                return V();
+            }
 
-        // Check if given node has a prefix
-        if (n->partial_len) {
-            // Determine if the prefixes differ, since we need to split
-            int prefix_diff = prefix_mismatch(n, key, key_len, depth);
-            if ((uint32_t)prefix_diff >= n->partial_len) {
+            // Check if given node has a prefix
+            if (n->partial_len) {
+                // Determine if the prefixes differ, since we need to split
+                int prefix_diff = prefix_mismatch(n, key, key_len, depth);
+                if ((uint32_t)prefix_diff < n->partial_len) {
+                    // The byte the keys under n go on with
+                    art_leaf *min_leaf = n->partial_len <= PrefixLen ? NULL : minimum(n);
+                    unsigned char c = min_leaf ? min_leaf->key[depth+prefix_diff] : n->partial[prefix_diff];
+
+                    // A key ending here would go under 0 next to them
+                    if (!KeyLen && depth + prefix_diff == key_len && !c) {
+                        // n itself was not counted yet
+                        if (counted) node_count(n)++;
+                        return refuse_key(start, start_depth, key, key_len, n, old);
+                    }
+
+                    // Create a new node
+                    art_node4 *new_node = (art_node4*)alloc_node(NODE4);
+                    if (counted) node_count(&new_node->n) = node_count(n) + 1;
+                    if (scored) node_score(&new_node->n) = max_score(node_score(n), score);
+                    *ref = (art_node*)new_node;
+                    new_node->n.partial_len = prefix_diff;
+                    memcpy(new_node->n.partial, n->partial, min(PrefixLen, prefix_diff));
+
+                    // Adjust the prefix of the old node
+                    add_child4(new_node, ref, c, n);
+                    n->partial_len -= (prefix_diff+1);
+                    if (!min_leaf) {
+                        memmove(n->partial, n->partial+prefix_diff+1,
+                                min(PrefixLen, n->partial_len));
+                    } else {
+                        memcpy(n->partial, min_leaf->key+depth+prefix_diff+1,
+                                min(PrefixLen, n->partial_len));
+                    }
+
+                    // Insert the new leaf
+                    art_leaf *l = make_leaf(key, key_len, value);
+                    add_child4(new_node, ref, key_at(key, key_len, depth+prefix_diff), SET_LEAF(l));
+                    return V();
+                }
                 depth += n->partial_len;
-                goto RECURSE_SEARCH;
             }
 
-            // Create a new node
-            art_node4 *new_node = (art_node4*)alloc_node(NODE4);
-            *ref = (art_node*)new_node;
-            new_node->n.partial_len = prefix_diff;
-            memcpy(new_node->n.partial, n->partial, min(MAX_PREFIX_LEN, prefix_diff));
-
-            // Adjust the prefix of the old node
-            if (n->partial_len <= MAX_PREFIX_LEN) {
-                add_child4(new_node, ref, n->partial[prefix_diff], n);
-                n->partial_len -= (prefix_diff+1);
-                memmove(n->partial, n->partial+prefix_diff+1,
-                        min(MAX_PREFIX_LEN, n->partial_len));
-            } else {
-                n->partial_len -= (prefix_diff+1);
-                art_leaf *l = minimum(n);
-                add_child4(new_node, ref, l->key[depth+prefix_diff], n);
-                memcpy(n->partial, l->key+depth+prefix_diff+1,
-                        min(MAX_PREFIX_LEN, n->partial_len));
+            // The key goes somewhere below n
+            if (counted) node_count(n)++;
+            if (scored && node_score(n) < score) node_score(n) = score;
+
+            // Find a child to descend to
+            art_node **child = find_child(n, key_at(key, key_len, depth));
+            if (!child) {
+                // No child, node goes within us
+                art_leaf *l = make_leaf(key, key_len, value);
+                add_child(n, ref, key_at(key, key_len, depth), SET_LEAF(l));
+                return V();
             }
 
-            // Insert the new leaf
-            art_leaf *l = make_leaf(key, key_len, value);
-            add_child4(new_node, ref, key[depth+prefix_diff], SET_LEAF(l));
-            return NULL;
+            // Past the end of the key only its own leaf may follow
+            if (!KeyLen && depth == key_len && !IS_LEAF(*child))
+                return refuse_key(start, start_depth, key, key_len, n, old);
+            ref = child;
+            depth++;
         }
-
-    RECURSE_SEARCH:;
-
-        // Find a child to recurse to
-        art_node **child = find_child(n, key[depth]);
-        if (child) {
-            return recursive_insert(*child, child, key, key_len, value, depth+1, old, replace);
+    }
+    // Builds the subtree holding keys [lo, hi), which share their
+    // first depth bytes, with every node at its final type
+    art_node* bulk_build(const unsigned char **keys, const int *key_lens,
+            V *values, int lo, int hi, int depth) {
+        if (hi - lo == 1)
+            return (art_node*)SET_LEAF(make_leaf(keys[lo], key_lens[lo], values[lo]));
+
+        // Keys are sorted, so the first and last share
+        // the prefix common to the whole range
+        const unsigned char *first = keys[lo], *last = keys[hi-1];
+        int max_cmp = min(key_lens[lo], key_lens[hi-1]);
+        int prefix_len = 0;
+        while (depth + prefix_len < max_cmp && first[depth+prefix_len] == last[depth+prefix_len])
+            prefix_len++;
+        int d = depth + prefix_len;
+
+        // Count the children to pick the node type
+        int i, start, children = 1;
+        for (i=lo+1; i < hi; i++) {
+            if (keys[i][d] != keys[i-1][d]) children++;
         }
-
-        // No child, node goes within us
-        art_leaf *l = make_leaf(key, key_len, value);
-        add_child(n, ref, key[depth], SET_LEAF(l));
-        return NULL;
+        uint8_t type = children <= 4 ? NODE4 : children <= 16 ? NODE16 :
+            children <= 32 ? NODE32 : children <= 48 ? NODE48 : NODE256;
+        art_node *n = alloc_node(type);
+        n->partial_len = prefix_len;
+        memcpy(n->partial, first+depth, min(PrefixLen, prefix_len));
+        if (t.flags & ART_SUBTREE_COUNT)
+            node_count(n) = hi - lo;
+
+        // Children arrive in key order, so they are appended
+        for (start=lo, i=lo+1; i <= hi; i++) {
+            if (i < hi && keys[i][d] == keys[start][d]) continue;
+            unsigned char c = keys[start][d];
+            art_node *child = bulk_build(keys, key_lens, values, start, i, d+1);
+            switch (type) {
+                case NODE4:
+                    ((art_node4*)n)->keys[n->num_children] = c;
+                    ((art_node4*)n)->children[n->num_children] = child;
+                    break;
+                case NODE16:
+                    ((art_node16*)n)->keys[n->num_children] = c;
+                    ((art_node16*)n)->children[n->num_children] = child;
+                    break;
+                case NODE32:
+                    ((art_node32*)n)->keys[n->num_children] = c;
+                    ((art_node32*)n)->children[n->num_children] = child;
+                    break;
+                case NODE48:
+                    ((art_node48*)n)->keys[c] = n->num_children + 1;
+                    ((art_node48*)n)->children[n->num_children] = child;
+                    break;
+                case NODE256:
+                    ((art_node256*)n)->children[c] = child;
+                    break;
+            }
+            n->num_children++;
+            start = i;
+        }
+        if (t.flags & ART_MAX_SCORE)
+            rescore_node(n);
+        return n;
     }
     void remove_child256(art_node256 *n, art_node **ref, unsigned char c) {
         n->children[c] = NULL;
@@ -625,6 +1715,7 @@ class art_trie {
         // Resize to a node48 on underflow, not immediately to prevent
         // trashing if we sit on the 48/49 boundary
         if (n->n.num_children == 37) {
+            ART_STAT(shrinks[NODE256-1]);
             art_node48 *new_node = (art_node48*)alloc_node(NODE48);
             *ref = (art_node*)new_node;
             copy_header((art_node*)new_node, (art_node*)n);
@@ -637,7 +1728,7 @@ class art_trie {
                     pos++;
                 }
             }
-            free(n);
+            free_node((art_node*)n);
         }
     }
 
@@ -647,8 +1738,9 @@ class art_trie {
         n->children[pos-1] = NULL;
         n->n.num_children--;
 
-        if (n->n.num_children == 12) {
-            art_node16 *new_node = (art_node16*)alloc_node(NODE16);
+        if (n->n.num_children == 24) {
+            ART_STAT(shrinks[NODE48-1]);
+            art_node32 *new_node = (art_node32*)alloc_node(NODE32);
             *ref = (art_node*)new_node;
             copy_header((art_node*)new_node, (art_node*)n);
 
@@ -661,7 +1753,24 @@ class art_trie {
                     child++;
                 }
             }
-            free(n);
+            free_node((art_node*)n);
+        }
+    }
+
+    void remove_child32(art_node32 *n, art_node **ref, art_node **l) {
+        int pos = l - n->children;
+        memmove(n->keys+pos, n->keys+pos+1, n->n.num_children - 1 - pos);
+        memmove(n->children+pos, n->children+pos+1, (n->n.num_children - 1 - pos)*sizeof(void*));
+        n->n.num_children--;
+
+        if (n->n.num_children == 12) {
+            ART_STAT(shrinks[NODE32-1]);
+            art_node16 *new_node = (art_node16*)alloc_node(NODE16);
+            *ref = (art_node*)new_node;
+            copy_header((art_node*)new_node, (art_node*)n);
+            memcpy(new_node->keys, n->keys, 12);
+            memcpy(new_node->children, n->children, 12*sizeof(void*));
+            free_node((art_node*)n);
         }
     }
 
@@ -672,12 +1781,13 @@ class art_trie {
         n->n.num_children--;
 
         if (n->n.num_children == 3) {
+            ART_STAT(shrinks[NODE16-1]);
             art_node4 *new_node = (art_node4*)alloc_node(NODE4);
             *ref = (art_node*)new_node;
             copy_header((art_node*)new_node, (art_node*)n);
             memcpy(new_node->keys, n->keys, 4);
             memcpy(new_node->children, n->children, 4*sizeof(void*));
-            free(n);
+            free_node((art_node*)n);
         }
     }
 
@@ -689,26 +1799,27 @@ class art_trie {
 
         // Remove nodes with only a single child
         if (n->n.num_children == 1) {
+            ART_STAT(shrinks[NODE4-1]);
             art_node *child = n->children[0];
             if (!IS_LEAF(child)) {
                 // Concatenate the prefixes
                 int prefix = n->n.partial_len;
-                if (prefix < MAX_PREFIX_LEN) {
+                if (prefix < PrefixLen) {
                     n->n.partial[prefix] = n->keys[0];
                     prefix++;
                 }
-                if (prefix < MAX_PREFIX_LEN) {
-                    int sub_prefix = min(child->partial_len, MAX_PREFIX_LEN - prefix);
+                if (prefix < PrefixLen) {
+                    int sub_prefix = min(child->partial_len, PrefixLen - prefix);
                     memcpy(n->n.partial+prefix, child->partial, sub_prefix);
                     prefix += sub_prefix;
                 }
 
                 // Store the prefix in the child
-                memcpy(child->partial, n->n.partial, min(prefix, MAX_PREFIX_LEN));
+                memcpy(child->partial, n->n.partial, min(prefix, PrefixLen));
                 child->partial_len += n->n.partial_len + 1;
             }
             *ref = child;
-            free(n);
+            free_node((art_node*)n);
         }
     }
 
@@ -718,6 +1829,8 @@ class art_trie {
                 return remove_child4((art_node4*)n, ref, l);
             case NODE16:
                 return remove_child16((art_node16*)n, ref, l);
+            case NODE32:
+                return remove_child32((art_node32*)n, ref, l);
             case NODE48:
                 return remove_child48((art_node48*)n, ref, c);
             case NODE256:
@@ -727,11 +1840,17 @@ class art_trie {
         }
     }
 
-    art_leaf* recursive_delete(art_node *n, art_node **ref, const unsigned char *key, int key_len, int depth) {
+    // Unlinks the matching leaf, keeping only the slot of the
+    // current node, which remove_child needs when it shrinks
+    art_leaf* delete_key(const unsigned char *key, int key_len) {
+        art_node **ref = &t.root;
+        art_node *n = *ref;
+        int depth = 0;
+
         // Search terminated
         if (!n) return NULL;
 
-        // Handle hitting a leaf node
+        // Handle a leaf at the root
         if (IS_LEAF(n)) {
             art_leaf *l = LEAF_RAW(n);
             if (!leaf_matches(l, key, key_len, depth)) {
@@ -741,31 +1860,47 @@ class art_trie {
             return NULL;
         }
 
-        // Bail if the prefix does not match
-        if (n->partial_len) {
-            int prefix_len = check_prefix(n, key, key_len, depth);
-            if (prefix_len != min(MAX_PREFIX_LEN, n->partial_len)) {
-                return NULL;
+        for (;;) {
+            // Bail if the prefix does not match
+            if (n->partial_len) {
+                if (!(t.flags & ART_OPTIMISTIC_PREFIX)) {
+                    int prefix_len = check_prefix(n, key, key_len, depth);
+                    if (prefix_len != min(PrefixLen, n->partial_len)) {
+                        return NULL;
+                    }
+                }
+                depth = depth + n->partial_len;
             }
-            depth = depth + n->partial_len;
-        }
 
-        // Find child node
-        art_node **child = find_child(n, key[depth]);
-        if (!child) return NULL;
+            if (depth > key_len)
+                return NULL;
 
-        // If the child is leaf, delete from this node
-        if (IS_LEAF(*child)) {
-            art_leaf *l = LEAF_RAW(*child);
-            if (!leaf_matches(l, key, key_len, depth)) {
-                remove_child(n, ref, key[depth], child);
-                return l;
+            // Find child node
+            art_node **child = find_child(n, key_at(key, key_len, depth));
+            if (!child) return NULL;
+
+            // If the child is leaf, delete from this node
+            if (IS_LEAF(*child)) {
+                art_leaf *l = LEAF_RAW(*child);
+                if (!leaf_matches(l, key, key_len, depth)) {
+                    // Uncount the path while it is still intact
+                    if (t.flags & ART_SUBTREE_COUNT)
+                        count_path(&t.root, 0, key, key_len, n, -1);
+
+                    // Scores on the path only drop if this was the best
+                    bool rescore = (t.flags & ART_MAX_SCORE) && value_score(l->value) >= node_score(n);
+                    remove_child(n, ref, key_at(key, key_len, depth), child);
+                    if (rescore)
+                        score_path(t.root, 0, key, key_len);
+                    return l;
+                }
+                return NULL;
             }
-            return NULL;
 
-        // Recurse
-        } else {
-            return recursive_delete(*child, child, key, key_len, depth+1);
+            // Descend
+            ref = child;
+            n = *child;
+            depth++;
         }
     }
     int recursive_iter(art_node *n, art_callback cb, void *data) {
@@ -792,6 +1927,13 @@ class art_trie {
                 }
                 break;
 
+            case NODE32:
+                for (int i=0; i < n->num_children; i++) {
+                    res = recursive_iter(((art_node32*)n)->children[i], cb, data);
+                    if (res) return res;
+                }
+                break;
+
             case NODE48:
                 for (int i=0; i < 256; i++) {
                     idx = ((art_node48*)n)->keys[i];
@@ -822,186 +1964,1062 @@ class art_trie {
         // Compare the keys
         return memcmp(n->key, prefix, prefix_len);
     }
-    // Returns the size in bytes of the subtrie.
-    size_t art_size_in_bytes_at(const art_node *n) {
-        if (IS_LEAF(n)) {
-            //art_leaf *l = LEAF_RAW(n);
-            return sizeof(art_leaf); // + l->key_len;
-            // return malloc_size(l) - l->key_len; // sizeof(art_leaf) + l->key_len;
+    // Returns the child at an iterator position, or NULL
+    art_node* child_at(const art_node *n, int idx) {
+        int pos;
+        switch (n->type) {
+            case NODE4:
+                return ((const art_node4*)n)->children[idx];
+            case NODE16:
+                return ((const art_node16*)n)->children[idx];
+            case NODE32:
+                return ((const art_node32*)n)->children[idx];
+            case NODE48:
+                pos = ((const art_node48*)n)->keys[idx];
+                return pos ? ((const art_node48*)n)->children[pos-1] : NULL;
+            case NODE256:
+                return ((const art_node256*)n)->children[idx];
+            default:
+                abort();
         }
-        size_t size = 0;
-        union {
-            art_node4 *p1;
-            art_node16 *p2;
-            art_node48 *p3;
-            art_node256 *p4;
-        } p;
-        int i, idx;
+    }
+    // Returns the key byte that leads to the child at a position
+    unsigned char child_key(const art_node *n, int idx) {
         switch (n->type) {
-            case NODE4: {
-                size += sizeof(art_node4);
-                // size += malloc_size(n); // sizeof(art_node4);
-                p.p1 = (art_node4*)n;
-                for (i=0;i<n->num_children;i++) {
-                    size += art_size_in_bytes_at(p.p1->children[i]);
+            case NODE4:
+                return ((const art_node4*)n)->keys[idx];
+            case NODE16:
+                return ((const art_node16*)n)->keys[idx];
+            case NODE32:
+                return ((const art_node32*)n)->keys[idx];
+            default:
+                return idx;
+        }
+    }
+    // Returns the first position after idx holding a child, or -1
+    int next_child(const art_node *n, int idx) {
+        switch (n->type) {
+            case NODE4:
+            case NODE16:
+            case NODE32:
+                return idx + 1 < n->num_children ? idx + 1 : -1;
+            case NODE48:
+                for (idx++; idx < 256; idx++) {
+                    if (((const art_node48*)n)->keys[idx]) return idx;
                 }
-            } break;
-            case NODE16: {
-                size += sizeof(art_node16);
-                // size += malloc_size(n); // sizeof(art_node16);
-                p.p2 = (art_node16*)n;
-                for (i=0;i<n->num_children;i++) {
-                    size += art_size_in_bytes_at(p.p2->children[i]);
+                return -1;
+            case NODE256:
+                for (idx++; idx < 256; idx++) {
+                    if (((const art_node256*)n)->children[idx]) return idx;
                 }
-            } break;
-            case NODE48: {
-                size += sizeof(art_node48);
-                // size += malloc_size(n); // sizeof(art_node48);
-                p.p3 = (art_node48*)n;
-                for (i=0;i<256;i++) {
-                    idx = ((art_node48*)n)->keys[i]; 
-                    if (!idx) continue; 
-                    size += art_size_in_bytes_at(p.p3->children[idx-1]);
+                return -1;
+            default:
+                abort();
+        }
+    }
+    // Returns the last position before idx holding a child, or -1
+    int prev_child(const art_node *n, int idx) {
+        switch (n->type) {
+            case NODE4:
+            case NODE16:
+            case NODE32:
+                if (idx > n->num_children) idx = n->num_children;
+                return idx - 1;
+            case NODE48:
+                for (idx--; idx >= 0; idx--) {
+                    if (((const art_node48*)n)->keys[idx]) return idx;
                 }
-            } break;
-            case NODE256: {
-                size += sizeof(art_node256);
-                // size += malloc_size(n); // sizeof(art_node256);
-                p.p4 = (art_node256*)n;
-                for (i=0;i<256;i++) {
-                    if (p.p4->children[i])
-                        size += art_size_in_bytes_at(p.p4->children[i]);
+                return -1;
+            case NODE256:
+                for (idx--; idx >= 0; idx--) {
+                    if (((const art_node256*)n)->children[idx]) return idx;
                 }
-            } break;
+                return -1;
             default:
-                assert(false);
-                break;
+                abort();
         }
-        return size;
-    }
-
-  public:
-    art_trie() {
-        art_tree_init();
-    }
-    ~art_trie() {
-        art_tree_destroy();
-    }
-    int art_tree_init() {
-      t.root = NULL;
-      t.size = 0;
-      return 0;
-    }
-    int art_tree_destroy() {
-      destroy_node(t.root);
-      return 0;
     }
-    inline uint64_t art_size() {
-      return t.size;
-    }
-    void* art_insert(const unsigned char *key, int key_len, void *value) {
-        int old_val = 0;
-        void *old = recursive_insert(t.root, &t.root, key, key_len, value, 0, &old_val, 1);
-        if (!old_val) t.size++;
-        return old;
+    // Returns the first position whose key byte is >= c, or -1
+    int lower_child(const art_node *n, unsigned char c) {
+        int i;
+        switch (n->type) {
+            case NODE4:
+                for (i=0; i < n->num_children; i++) {
+                    if (((const art_node4*)n)->keys[i] >= c) return i;
+                }
+                return -1;
+            case NODE16:
+                for (i=0; i < n->num_children; i++) {
+                    if (((const art_node16*)n)->keys[i] >= c) return i;
+                }
+                return -1;
+            case NODE32:
+                for (i=0; i < n->num_children; i++) {
+                    if (((const art_node32*)n)->keys[i] >= c) return i;
+                }
+                return -1;
+            default:
+                return child_at(n, c) ? c : next_child(n, c);
+        }
     }
-    void* art_insert_no_replace(const unsigned char *key, int key_len, void *value) {
-        int old_val = 0;
-        void *old = recursive_insert(t.root, &t.root, key, key_len, value, 0, &old_val, 0);
-        if (!old_val) t.size++;
-        return old;
+    // Compares two keys byte-wise, a shorter key sorting first
+    int key_cmp(const unsigned char *a, int a_len, const unsigned char *b, int b_len) {
+        int res = memcmp(a, b, min(a_len, b_len));
+        return res ? res : a_len - b_len;
     }
-    void* art_delete(const unsigned char *key, int key_len) {
-        art_leaf *l = recursive_delete(t.root, &t.root, key, key_len, 0);
-        if (l) {
-            t.size--;
-            void *old = l->value;
-            free(l);
-            return old;
+    // Finds the first leaf under n above the key, or
+    // equal to it unless strict is set
+    art_leaf* recursive_bound(art_node *n, const unsigned char *key, int key_len, int depth, int strict) {
+        if (!n) return NULL;
+        if (IS_LEAF(n)) {
+            art_leaf *l = LEAF_RAW(n);
+            int cmp = key_cmp(l->key, l->key_len, key, key_len);
+            return (cmp > 0 || (cmp == 0 && !strict)) ? l : NULL;
         }
-        return NULL;
-    }
-    void* art_search(const unsigned char *key, int key_len) {
-        art_node **child;
-        art_node *n = t.root;
-        int prefix_len, depth = 0;
-        while (n) {
-            // Might be a leaf
-            if (IS_LEAF(n)) {
-                n = (art_node*)LEAF_RAW(n);
-                // Check if the expanded path matches
-                if (!leaf_matches((art_leaf*)n, key, key_len, depth)) {
-                    return ((art_leaf*)n)->value;
-                }
-                return NULL;
-            }
 
-            // Bail if the prefix does not match
-            if (n->partial_len) {
-                prefix_len = check_prefix(n, key, key_len, depth);
-                if (prefix_len != min(MAX_PREFIX_LEN, n->partial_len))
+        // Compare the prefix, the subtree is either
+        // wholly above the key, wholly below, or undecided
+        if (n->partial_len) {
+            art_leaf *l = n->partial_len > PrefixLen ? minimum(n) : NULL;
+            for (int i=0; i < (int)n->partial_len; i++) {
+                if (depth + i >= key_len)
+                    return minimum(n);
+                unsigned char p = i < PrefixLen ? n->partial[i] : l->key[depth+i];
+                if (p > key[depth+i])
+                    return minimum(n);
+                if (p < key[depth+i])
                     return NULL;
-                depth = depth + n->partial_len;
             }
+            depth = depth + n->partial_len;
+        }
+        // Past its end the key reads as a 0 byte, which
+        // leads to its own leaf if it is stored
+        if (depth > key_len)
+            return minimum(n);
+        unsigned char c = key_at(key, key_len, depth);
+
+        // Try the matching child, then the next one up
+        int idx = lower_child(n, c);
+        if (idx < 0) return NULL;
+        if (child_key(n, idx) == c) {
+            art_leaf *l = recursive_bound(child_at(n, idx), key, key_len, depth+1, strict);
+            if (l) return l;
+            idx = next_child(n, idx);
+            if (idx < 0) return NULL;
+        }
+        return minimum(child_at(n, idx));
+    }
+    // Recursively iterates over the leaves under n that fall in
+    // [start, end). lo and hi are set while the path to n still
+    // equals a prefix of start or end, only then do the bounds
+    // need comparing, and children outside them are skipped.
+    int recursive_iter_range(art_node *n, const unsigned char *start, int start_len,
+            const unsigned char *end, int end_len, int depth, int lo, int hi,
+            art_callback cb, void *data) {
+        // Handle base cases
+        if (!n) return 0;
+        if (!lo && !hi) return recursive_iter(n, cb, data);
+        if (IS_LEAF(n)) {
+            art_leaf *l = LEAF_RAW(n);
+            if (lo && key_cmp(l->key, l->key_len, start, start_len) < 0) return 0;
+            if (hi && key_cmp(l->key, l->key_len, end, end_len) >= 0) return 0;
+            return cb(data, (const unsigned char*)l->key, l->key_len, l->value);
+        }
 
-            // Recursively search
-            child = find_child(n, key[depth]);
-            n = (child) ? *child : NULL;
-            depth++;
+        // Compare the prefix against the bounds
+        if (n->partial_len) {
+            art_leaf *l = n->partial_len > PrefixLen ? minimum(n) : NULL;
+            for (int i=0; i < (int)n->partial_len && (lo || hi); i++) {
+                unsigned char p = i < PrefixLen ? n->partial[i] : l->key[depth+i];
+                if (lo) {
+                    if (depth + i >= start_len || p > start[depth+i]) lo = 0;
+                    else if (p < start[depth+i]) return 0;
+                }
+                if (hi) {
+                    if (depth + i >= end_len || p > end[depth+i]) return 0;
+                    if (p < end[depth+i]) hi = 0;
+                }
+            }
+            if (!lo && !hi) return recursive_iter(n, cb, data);
+            depth = depth + n->partial_len;
         }
-        return NULL;
+        if (lo && depth >= start_len) lo = 0;
+        if (hi && depth >= end_len) return 0;
+
+        // Visit only the children between the bounds
+        int res, idx = lo ? lower_child(n, start[depth]) : next_child(n, -1);
+        for (; idx >= 0; idx = next_child(n, idx)) {
+            unsigned char c = child_key(n, idx);
+            if (hi && c > end[depth]) break;
+            res = recursive_iter_range(child_at(n, idx), start, start_len, end, end_len, depth+1,
+                    lo && c == start[depth], hi && c == end[depth], cb, data);
+            if (res) return res;
+        }
+        return 0;
     }
-    art_leaf* art_minimum() {
-        return minimum((art_node*)t.root);
+    // Returns the number of leaves under a child, kept in the
+    // node with ART_SUBTREE_COUNT and counted one by one otherwise
+    uint64_t subtree_count(const art_node *n) {
+        if (!n) return 0;
+        if (IS_LEAF(n)) return 1;
+        if (t.flags & ART_SUBTREE_COUNT) return node_count(n);
+        uint64_t count = 0;
+        for (int idx = next_child(n, -1); idx >= 0; idx = next_child(n, idx))
+            count += subtree_count(child_at(n, idx));
+        return count;
     }
-    art_leaf* art_maximum() {
-        return maximum((art_node*)t.root);
+    // Returns the size in bytes of the subtrie, counting
+    // the key in each leaf and the words in front of each node
+    size_t art_size_in_bytes_at(const art_node *n) {
+        if (IS_LEAF(n)) {
+            art_leaf *l = LEAF_RAW(n);
+            return t.arena ? leaf_alloc_size(l->key_len) : leaf_size(l->key_len);
+        }
+        size_t size = node_header() + node_size(n->type);
+        for (int idx = next_child(n, -1); idx >= 0; idx = next_child(n, idx))
+            size += art_size_in_bytes_at(child_at(n, idx));
+        return size;
     }
-    int art_iter(art_callback cb, void *data) {
-        return recursive_iter(t.root, cb, data);
+    void analyze_node(art_node *n, uint32_t depth, art_analysis &a) {
+        if (IS_LEAF(n)) {
+            art_leaf *l = LEAF_RAW(n);
+            size_t size = t.arena ? leaf_alloc_size(l->key_len) : leaf_size(l->key_len);
+            a.leaves++;
+            a.key_bytes += l->key_len;
+            a.leaf_bytes += size;
+            if (!t.arena) a.leaf_usable += art_usable_size(l, size);
+            a.leaf_depth[std::min<uint32_t>(depth, ART_DEPTH_BUCKETS - 1)]++;
+            a.max_leaf_depth = std::max(a.max_leaf_depth, depth);
+            return;
+        }
+
+        // A full node256 wraps num_children, so count them
+        int type = n->type - 1, children = 0;
+        for (int idx = next_child(n, -1); idx >= 0; idx = next_child(n, idx)) {
+            analyze_node(child_at(n, idx), depth + 1, a);
+            children++;
+        }
+        size_t size = node_header() + node_size(n->type);
+        a.nodes[type]++;
+        a.node_bytes[type] += size;
+        if (!t.pools) a.node_usable[type] += art_usable_size((char*)n - node_header(), size);
+        a.fill[type][std::min(children * ART_FILL_BUCKETS / art_node_capacity(n->type), ART_FILL_BUCKETS - 1)]++;
+        a.partial_len[std::min<uint32_t>(n->partial_len, PrefixLen + 1)]++;
+        a.max_partial_len = std::max(a.max_partial_len, n->partial_len);
     }
-    int art_iter_prefix(const unsigned char *key, int key_len, art_callback cb, void *data) {
-        art_node **child;
-        art_node *n = t.root;
-        int prefix_len, depth = 0;
-        while (n) {
-            // Might be a leaf
-            if (IS_LEAF(n)) {
+    // Appends to the file, padded to 8 bytes
+    uint64_t map_write(FILE *f, uint64_t &off, int &err, const void *buf, size_t len) {
+        static const char pad[8] = {0};
+        uint64_t at = off;
+        size_t pad_len = ((len + 7) & ~(size_t)7) - len;
+        if (fwrite(buf, 1, len, f) != len || fwrite(pad, 1, pad_len, f) != pad_len)
+            err = 1;
+        off += len + pad_len;
+        return at;
+    }
+    // Writes the children before their parent, so
+    // every offset is known by the time it is stored
+    uint64_t map_save_node(FILE *f, uint64_t &off, int &err, const art_node *n) {
+        if (!n) return 0;
+        if (IS_LEAF(n)) {
+            art_leaf *l = LEAF_RAW(n);
+            std::vector<unsigned char> buf(sizeof(map_leaf) + l->key_len);
+            map_leaf *ml = (map_leaf*)buf.data();
+            ml->value = art_value_bits(l->value);
+            ml->key_len = l->key_len;
+            memcpy(ml->key, l->key, l->key_len);
+            return map_write(f, off, err, ml, offsetof(map_leaf, key) + l->key_len) | 1;
+        }
+
+        union {
+            map_node n;
+            map_node4 n4;
+            map_node16 n16;
+            map_node32 n32;
+            map_node48 n48;
+            map_node256 n256;
+        } out;
+        size_t len;
+        int i;
+        memset(&out, 0, sizeof(out));
+        out.n.partial_len = n->partial_len;
+        out.n.type = n->type;
+        out.n.num_children = n->num_children;
+        memcpy(out.n.partial, n->partial, PrefixLen);
+        switch (n->type) {
+            case NODE4:
+                memcpy(out.n4.keys, ((art_node4*)n)->keys, 4);
+                for (i=0; i < n->num_children; i++)
+                    out.n4.children[i] = map_save_node(f, off, err, ((art_node4*)n)->children[i]);
+                len = sizeof(map_node4);
+                break;
+            case NODE16:
+                memcpy(out.n16.keys, ((art_node16*)n)->keys, 16);
+                for (i=0; i < n->num_children; i++)
+                    out.n16.children[i] = map_save_node(f, off, err, ((art_node16*)n)->children[i]);
+                len = sizeof(map_node16);
+                break;
+            case NODE32:
+                memcpy(out.n32.keys, ((art_node32*)n)->keys, 32);
+                for (i=0; i < n->num_children; i++)
+                    out.n32.children[i] = map_save_node(f, off, err, ((art_node32*)n)->children[i]);
+                len = sizeof(map_node32);
+                break;
+            case NODE48:
+                memcpy(out.n48.keys, ((art_node48*)n)->keys, 256);
+                for (i=0; i < 48; i++)
+                    out.n48.children[i] = map_save_node(f, off, err, ((art_node48*)n)->children[i]);
+                len = sizeof(map_node48);
+                break;
+            case NODE256:
+                for (i=0; i < 256; i++)
+                    out.n256.children[i] = map_save_node(f, off, err, ((art_node256*)n)->children[i]);
+                len = sizeof(map_node256);
+                break;
+            default:
+                abort();
+        }
+        return map_write(f, off, err, &out, len);
+    }
+
+  public:
+    // Ordered, bidirectional cursor over the trie. It keeps the
+    // path from the root as a stack of (node, child position),
+    // where the position is an index into children for
+    // art_node4/16/32 and the key byte for art_node48/256.
+    // Any insert or delete invalidates it.
+    class iterator {
+      public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef art_leaf value_type;
+        typedef ptrdiff_t difference_type;
+        typedef const art_leaf* pointer;
+        typedef const art_leaf& reference;
+
+        iterator() : trie(NULL), leaf(NULL) {}
+
+        reference operator*() const {
+            return *leaf;
+        }
+        pointer operator->() const {
+            return leaf;
+        }
+        iterator& operator++() {
+            next();
+            return *this;
+        }
+        iterator operator++(int) {
+            iterator prev_it(*this);
+            next();
+            return prev_it;
+        }
+        // Decrementing end() gives the maximum
+        iterator& operator--() {
+            if (leaf)
+                prev();
+            else
+                last();
+            return *this;
+        }
+        iterator operator--(int) {
+            iterator next_it(*this);
+            --*this;
+            return next_it;
+        }
+        bool operator==(const iterator &other) const {
+            return leaf == other.leaf;
+        }
+        bool operator!=(const iterator &other) const {
+            return leaf != other.leaf;
+        }
+
+        // Positions on the minimum leaf, NULL if empty
+        art_leaf* first() {
+            stack.clear();
+            return descend_min(trie->t.root);
+        }
+        // Positions on the maximum leaf, NULL if empty
+        art_leaf* last() {
+            stack.clear();
+            return descend_max(trie->t.root);
+        }
+        // Moves to the next leaf, NULL once past the maximum
+        art_leaf* next() {
+            if (!leaf) return NULL;
+            while (!stack.empty()) {
+                frame &f = stack.back();
+                int idx = trie->next_child(f.node, f.idx);
+                if (idx >= 0) {
+                    f.idx = idx;
+                    return descend_min(trie->child_at(f.node, idx));
+                }
+                stack.pop_back();
+            }
+            leaf = NULL;
+            return NULL;
+        }
+        // Moves to the previous leaf, NULL once past the minimum
+        art_leaf* prev() {
+            if (!leaf) return NULL;
+            while (!stack.empty()) {
+                frame &f = stack.back();
+                int idx = trie->prev_child(f.node, f.idx);
+                if (idx >= 0) {
+                    f.idx = idx;
+                    return descend_max(trie->child_at(f.node, idx));
+                }
+                stack.pop_back();
+            }
+            leaf = NULL;
+            return NULL;
+        }
+        // Positions on the first leaf whose key is greater than
+        // or equal to the given key, NULL if all are smaller
+        art_leaf* seek(const unsigned char *key, int key_len) {
+            art_node *n = trie->t.root;
+            art_leaf *l;
+            int depth = 0, idx, i, cmp;
+            stack.clear();
+            while (n && !IS_LEAF(n)) {
+                // Compare the prefix, taking bytes past
+                // PrefixLen from any leaf below
+                if (n->partial_len) {
+                    l = n->partial_len > PrefixLen ? trie->minimum(n) : NULL;
+                    for (i=0; i < (int)n->partial_len; i++) {
+                        if (depth + i >= key_len)
+                            return descend_min(n);
+                        unsigned char p = i < PrefixLen ? n->partial[i] : l->key[depth+i];
+                        if (p > key[depth+i])
+                            return descend_min(n);
+                        if (p < key[depth+i])
+                            return skip(n);
+                    }
+                    depth = depth + n->partial_len;
+                }
+                if (depth >= key_len)
+                    return descend_min(n);
+
+                // Go down the matching child, or the
+                // smallest one above the key byte
+                idx = trie->lower_child(n, key[depth]);
+                if (idx < 0)
+                    return skip(n);
+                push(n, idx);
+                if (trie->child_key(n, idx) != key[depth])
+                    return descend_min(trie->child_at(n, idx));
+                n = trie->child_at(n, idx);
+                depth++;
+            }
+            if (!n) {
+                leaf = NULL;
+                return NULL;
+            }
+
+            // Compare the whole key at the leaf
+            l = LEAF_RAW(n);
+            leaf = l;
+            cmp = memcmp(l->key, key, trie->min(l->key_len, key_len));
+            if (cmp > 0 || (cmp == 0 && l->key_len >= (uint32_t)key_len))
+                return l;
+            return next();
+        }
+
+      private:
+        friend class basic_art_trie;
+        struct frame {
+            art_node *node;
+            int idx;
+        };
+        basic_art_trie *trie;
+        std::vector<frame> stack;
+        art_leaf *leaf;
+
+        explicit iterator(basic_art_trie *trie) : trie(trie), leaf(NULL) {}
+
+        void push(art_node *n, int idx) {
+            frame f = {n, idx};
+            stack.push_back(f);
+        }
+        // Walks down to the minimum leaf under n, recording the path
+        art_leaf* descend_min(art_node *n) {
+            while (n && !IS_LEAF(n)) {
+                int idx = trie->next_child(n, -1);
+                push(n, idx);
+                n = trie->child_at(n, idx);
+            }
+            leaf = n ? LEAF_RAW(n) : NULL;
+            return leaf;
+        }
+        // Walks down to the maximum leaf under n, recording the path
+        art_leaf* descend_max(art_node *n) {
+            while (n && !IS_LEAF(n)) {
+                int idx = trie->prev_child(n, 256);
+                push(n, idx);
+                n = trie->child_at(n, idx);
+            }
+            leaf = n ? LEAF_RAW(n) : NULL;
+            return leaf;
+        }
+        // Positions past every leaf under n, which are
+        // all smaller than the key being sought
+        art_leaf* skip(art_node *n) {
+            if (!descend_max(n)) return NULL;
+            return next();
+        }
+    };
+
+    basic_art_trie() {
+        art_tree_init();
+    }
+    explicit basic_art_trie(int flags) {
+        art_tree_init_flags(flags);
+    }
+    basic_art_trie(int flags, art_scorer scorer, void *data) {
+        art_tree_init_scored(flags, scorer, data);
+    }
+    ~basic_art_trie() {
+        art_tree_destroy();
+    }
+    int art_tree_init() {
+      return art_tree_init_flags(0);
+    }
+    // With ART_NODE_POOL inner nodes come from per-type slabs,
+    // freed nodes are reused on grow/shrink, and destroy
+    // releases the slabs in bulk.
+    // With ART_LEAF_ARENA leaves are bump-allocated out of large
+    // chunks and deleted leaves are reused by later inserts.
+    // When both are set destroy frees the chunks without
+    // walking the tree.
+    // With ART_OPTIMISTIC_PREFIX search and delete step over
+    // node prefixes without comparing them and leave the
+    // mismatch to the full key compare at the leaf, so lookups
+    // never read the stored prefix bytes and a small PrefixLen
+    // only costs inserts.
+    // With ART_SUBTREE_COUNT every inner node keeps the number
+    // of leaves below it, so art_rank, art_select and
+    // art_count_range take one walk down, and inserts and
+    // deletes update the counts along their path.
+    // With ART_MAX_SCORE every inner node keeps the highest
+    // score of a value below it, so art_topk_prefix only opens
+    // the subtrees that can still hold one of the top keys.
+    // Values are their own score unless a scorer is given.
+    int art_tree_init_flags(int flags) {
+      scorer = NULL;
+      scorer_data = NULL;
+      t.root = NULL;
+      t.size = 0;
+      t.flags = flags;
+      t.pools = NULL;
+      t.arena = NULL;
+      t.mods = 0;
+      if (flags & ART_NODE_POOL) {
+          t.pools = (art_node_pool*)calloc(ART_NODE_TYPES, sizeof(art_node_pool));
+          if (!t.pools) return -1;
+      }
+      if (flags & ART_LEAF_ARENA) {
+          t.arena = (art_leaf_arena*)calloc(1, sizeof(art_leaf_arena));
+          if (!t.arena) {
+              free(t.pools);
+              t.pools = NULL;
+              return -1;
+          }
+      }
+      return 0;
+    }
+    // Initializes a trie with ART_MAX_SCORE that takes the
+    // score of each value from a callback. The score of a
+    // stored value must not change while it is in the trie.
+    int art_tree_init_scored(int flags, art_scorer scorer, void *data) {
+      if (!scorer) return -1;
+      int res = art_tree_init_flags(flags | ART_MAX_SCORE);
+      if (res) return res;
+      this->scorer = scorer;
+      scorer_data = data;
+      return 0;
+    }
+    int art_tree_destroy() {
+      // Nothing to walk if every node and leaf lives in a pool
+      if (!t.pools || !t.arena)
+          destroy_node(t.root);
+      t.root = NULL;
+      if (t.pools) {
+          for (int i=0;i<ART_NODE_TYPES;i++)
+              pool_release(&t.pools[i]);
+          free(t.pools);
+          t.pools = NULL;
+      }
+      if (t.arena) {
+          arena_release(t.arena);
+          free(t.arena);
+          t.arena = NULL;
+      }
+      return 0;
+    }
+    inline uint64_t art_size() {
+      return t.size;
+    }
+    // Returns the old value of the key, or V() if it was new or
+    // refused. status, if given, tells which: ART_KEY_ADDED,
+    // ART_KEY_FOUND, or ART_KEY_CONFLICT for a key that conflicts
+    // or is not KeyLen bytes.
+    V art_insert(const unsigned char *key, int key_len, V value, int *status = NULL) {
+        return insert_root(key, key_len, value, 1, status);
+    }
+    V art_insert_no_replace(const unsigned char *key, int key_len, V value, int *status = NULL) {
+        return insert_root(key, key_len, value, 0, status);
+    }
+    // Inserts like art_insert, resuming below the deepest node of
+    // the previous hinted insert whose leading bytes the key
+    // shares, so sorted or clustered keys only walk the part of
+    // the path that changed. A hint must be reset after
+    // art_tree_destroy.
+    V art_insert_hint(art_hint &h, const unsigned char *key, int key_len, V value, int *status = NULL) {
+        if (KeyLen && key_len != KeyLen) {
+            if (status) *status = ART_KEY_CONFLICT;
+            return V();
+        }
+
+        // A path is only good while nothing else reshaped the trie
+        if (h.trie != this || h.mods != t.mods) {
+            h.trie = this;
+            h.levels = 0;
+            h.key_len = 0;
+        }
+
+        uint32_t common = 0, max_cmp = min(h.key_len, key_len);
+        while (common < max_cmp && h.key[common] == key[common])
+            common++;
+        int level = h.levels - 1;
+        while (level > 0 && h.depths[level] > common)
+            level--;
+        art_node **ref = level > 0 ? h.refs[level] : &t.root;
+        int depth = level > 0 ? h.depths[level] : 0;
+        h.levels = level > 0 ? level : 0;
+
+        int old_val = ART_KEY_ADDED;
+        V old = insert_key(ref, key, key_len, value, depth, &old_val, 1, &h);
+        if (old_val == ART_KEY_ADDED) {
+            t.size++;
+            t.mods++;
+
+            // The walk only counted from where it resumed
+            if (t.flags & ART_SUBTREE_COUNT) {
+                for (int i = 0; i < level; i++)
+                    node_count(*h.refs[i])++;
+            }
+        }
+
+        // Likewise for scores, a replaced or refused value was
+        // rescored from the root already if it changed
+        if ((t.flags & ART_MAX_SCORE) && level > 0 && old_val != ART_KEY_CONFLICT) {
+            uint64_t score = value_score(value);
+            for (int i = 0; i < level; i++)
+                node_score(*h.refs[i]) = max_score(node_score(*h.refs[i]), score);
+        }
+        h.mods = t.mods;
+        h.key_len = min(key_len, ART_HINT_KEY_LEN);
+        memcpy(h.key, key, h.key_len);
+        if (status) *status = old_val;
+        return old;
+    }
+    // Builds the trie from keys in strictly ascending order, none a
+    // prefix of another, creating each inner node at its final type.
+    // Returns -1 if the trie is not empty or the keys do not qualify.
+    int art_bulk_load(const unsigned char **keys, const int *key_lens, int n, V *values) {
+        if (t.root || n < 0) return -1;
+
+        // No key may be a prefix of the next one, which
+        // rules out a prefix of any later key
+        for (int i=1; i < n; i++) {
+            if (memcmp(keys[i-1], keys[i], min(key_lens[i-1], key_lens[i])) >= 0)
+                return -1;
+        }
+        for (int i=0; i < n && KeyLen; i++) {
+            if (key_lens[i] != KeyLen) return -1;
+        }
+        if (n) t.root = bulk_build(keys, key_lens, values, 0, n, 0);
+        t.size = n;
+        t.mods++;
+        return 0;
+    }
+    // Inserts n keys using up to thread_count threads. Keys are
+    // partitioned on their first byte, each partition is built
+    // as an independent subtree by a worker with its own pools,
+    // and the subtrees are stitched under a root sized to the
+    // number of partitions. Falls back to plain inserts if the
+    // trie is not empty, a key is empty, or there is only one
+    // partition. Later duplicates replace earlier ones, and keys
+    // that conflict with an earlier one are left out, see
+    // ART_KEY_CONFLICT, as are keys that are not KeyLen bytes.
+    void art_parallel_load(const unsigned char **keys, const int *key_lens, int n, V *values,
+            int thread_count) {
+        int i, begin[257] = {0};
+        bool sequential = t.root != NULL || thread_count < 2;
+        for (i = 0; i < n && !sequential; i++) {
+            if (KeyLen && key_lens[i] != KeyLen)
+                continue;
+            if (key_lens[i] <= 0)
+                sequential = true;
+            else
+                begin[keys[i][0] + 1]++;
+        }
+        int buckets = 0;
+        for (i = 1; i <= 256; i++) {
+            if (begin[i]) buckets++;
+            begin[i] += begin[i-1];
+        }
+        if (sequential || buckets < 2) {
+            for (i = 0; i < n; i++)
+                art_insert(keys[i], key_lens[i], values[i]);
+            return;
+        }
+
+        // Radix partition, keeping the input order in each bucket
+        std::vector<int> order(n);
+        int fill[256];
+        memcpy(fill, begin, sizeof(fill));
+        for (i = 0; i < n; i++) {
+            if (!KeyLen || key_lens[i] == KeyLen)
+                order[fill[keys[i][0]]++] = i;
+        }
+
+        // Workers take the biggest remaining bucket
+        std::vector<int> queue;
+        for (i = 0; i < 256; i++) {
+            if (begin[i+1] > begin[i]) queue.push_back(i);
+        }
+        std::sort(queue.begin(), queue.end(), [&](int a, int b) {
+            return begin[a+1] - begin[a] > begin[b+1] - begin[b];
+        });
+        if (thread_count > buckets) thread_count = buckets;
+
+        art_node *roots[256] = {0};
+        uint64_t sizes[256] = {0};
+        std::atomic<int> next(0);
+        std::vector<basic_art_trie*> workers;
+        std::vector<std::thread> threads;
+        for (i = 0; i < thread_count; i++) {
+            basic_art_trie *w = new basic_art_trie(t.flags);
+            w->scorer = scorer;
+            w->scorer_data = scorer_data;
+            workers.push_back(w);
+            threads.push_back(std::thread([&, w]() {
+                int q;
+                while ((q = next++) < (int)queue.size()) {
+                    int b = queue[q];
+                    for (int j = begin[b]; j < begin[b+1]; j++) {
+                        int k = order[j], old = 0;
+                        w->insert_key(&roots[b], keys[k], key_lens[k], values[k], 1, &old, 1, NULL);
+                        if (!old) sizes[b]++;
+                    }
+                }
+            }));
+        }
+        for (i = 0; i < thread_count; i++)
+            threads[i].join();
+
+        // Stitch the subtrees under the root in key order
+        uint8_t type = buckets <= 4 ? NODE4 : buckets <= 16 ? NODE16 :
+            buckets <= 32 ? NODE32 : buckets <= 48 ? NODE48 : NODE256;
+        art_node *root = alloc_node(type);
+        for (i = 0; i < 256; i++) {
+            if (!roots[i]) continue;
+            unsigned char c = i;
+            switch (type) {
+                case NODE4:
+                    ((art_node4*)root)->keys[root->num_children] = c;
+                    ((art_node4*)root)->children[root->num_children] = roots[i];
+                    break;
+                case NODE16:
+                    ((art_node16*)root)->keys[root->num_children] = c;
+                    ((art_node16*)root)->children[root->num_children] = roots[i];
+                    break;
+                case NODE32:
+                    ((art_node32*)root)->keys[root->num_children] = c;
+                    ((art_node32*)root)->children[root->num_children] = roots[i];
+                    break;
+                case NODE48:
+                    ((art_node48*)root)->keys[c] = root->num_children + 1;
+                    ((art_node48*)root)->children[root->num_children] = roots[i];
+                    break;
+                case NODE256:
+                    ((art_node256*)root)->children[c] = roots[i];
+                    break;
+            }
+            root->num_children++;
+            t.size += sizes[i];
+        }
+        if (t.flags & ART_SUBTREE_COUNT)
+            node_count(root) = t.size;
+        if (t.flags & ART_MAX_SCORE)
+            rescore_node(root);
+        t.root = root;
+        t.mods++;
+
+        // The nodes now belong to us, and so do their slabs
+        for (i = 0; i < thread_count; i++) {
+            if (t.pools) {
+                for (int j = 0; j < ART_NODE_TYPES; j++)
+                    pool_splice(&t.pools[j], &workers[i]->t.pools[j]);
+            }
+            if (t.arena)
+                arena_splice(t.arena, workers[i]->t.arena);
+            delete workers[i];
+        }
+    }
+    V art_delete(const unsigned char *key, int key_len) {
+        art_leaf *l = delete_key(key, key_len);
+        if (l) {
+            t.size--;
+            t.mods++;
+            V old = l->value;
+            free_leaf(l);
+            return old;
+        }
+        return V();
+    }
+    V art_search(const unsigned char *key, int key_len) {
+        art_node **child;
+        art_node *n = t.root;
+        int prefix_len, depth = 0, levels = 0;
+        int optimistic = t.flags & ART_OPTIMISTIC_PREFIX;
+        ART_STAT(searches);
+        while (n) {
+            // Might be a leaf
+            if (IS_LEAF(n)) {
                 n = (art_node*)LEAF_RAW(n);
                 // Check if the expanded path matches
-                if (!leaf_prefix_matches((art_leaf*)n, key, key_len)) {
-                    art_leaf *l = (art_leaf*)n;
-                    return cb(data, (const unsigned char*)l->key, l->key_len, l->value);
+                if (!leaf_matches((art_leaf*)n, key, key_len, depth)) {
+                    return ((art_leaf*)n)->value;
                 }
-                return 0;
+                ART_STAT(leaf_mismatches);
+                return V();
+            }
+            ART_STAT(search_depth);
+            ART_STAT_MAX(max_search_depth, ++levels);
+
+            // Bail if the prefix does not match, unless the
+            // leaf is left to catch it
+            if (n->partial_len) {
+                if (!optimistic) {
+                    prefix_len = check_prefix(n, key, key_len, depth);
+                    if (prefix_len != min(PrefixLen, n->partial_len))
+                        return V();
+                }
+                depth = depth + n->partial_len;
+            }
+
+            // The key may end inside a prefix longer than the stored part
+            if (depth > key_len)
+                return V();
+
+            // Recursively search
+            child = find_child(n, key_at(key, key_len, depth));
+            n = (child) ? *child : NULL;
+            depth++;
+        }
+        return V();
+    }
+    // Searches for many keys at once, keeping up to
+    // ART_BATCH_WINDOW lookups in flight. Each pass moves every
+    // lookup down one level and prefetches the node it lands on,
+    // so by the time we come back to it the node is in cache.
+    // Returns the number of keys found.
+    int art_search_batch(const unsigned char **keys, const int *key_lens, int n, V *values) {
+        struct {
+            art_node *n;
+            int depth;
+            int idx;
+        } s[ART_BATCH_WINDOW];
+        int next = 0, active = 0, found = 0;
+        int i, prefix_len;
+        int optimistic = t.flags & ART_OPTIMISTIC_PREFIX;
+
+        if (!t.root) {
+            for (i=0;i<n;i++) values[i] = V();
+            return 0;
+        }
+
+        for (i=0; i < ART_BATCH_WINDOW; i++) {
+            if (next < n) {
+                s[i].n = t.root;
+                s[i].depth = 0;
+                s[i].idx = next++;
+                active++;
+            } else {
+                s[i].idx = -1;
+            }
+        }
+        prefetch_node(t.root);
+
+        while (active) {
+            for (i=0; i < ART_BATCH_WINDOW; i++) {
+                if (s[i].idx < 0) continue;
+
+                const unsigned char *key = keys[s[i].idx];
+                int key_len = key_lens[s[i].idx];
+                art_node *node = s[i].n;
+                V value = V();
+
+                // Advance this lookup by one node
+                if (IS_LEAF(node)) {
+                    art_leaf *l = LEAF_RAW(node);
+                    if (!leaf_matches(l, key, key_len, s[i].depth)) {
+                        value = l->value;
+                        found++;
+                    }
+                } else {
+                    int depth = s[i].depth;
+                    bool match = true;
+                    if (node->partial_len) {
+                        if (!optimistic) {
+                            prefix_len = check_prefix(node, key, key_len, depth);
+                            match = prefix_len == min(PrefixLen, node->partial_len);
+                        }
+                        depth = depth + node->partial_len;
+                    }
+                    if (match && depth <= key_len) {
+                        art_node **child = find_child(node, key_at(key, key_len, depth));
+                        if (child && *child) {
+                            s[i].n = *child;
+                            s[i].depth = depth + 1;
+                            prefetch_node(s[i].n);
+                            continue;
+                        }
+                    }
+                }
+
+                // Done with this key, start the next one in its slot
+                values[s[i].idx] = value;
+                if (next < n) {
+                    s[i].n = t.root;
+                    s[i].depth = 0;
+                    s[i].idx = next++;
+                } else {
+                    s[i].idx = -1;
+                    active--;
+                }
+            }
+        }
+        return found;
+    }
+    // Returns the length of the leaf key if it is a prefix of
+    // key, or -1 if it is not
+    int leaf_prefix_of(const art_leaf *l, const unsigned char *key, int key_len) {
+        if (l->key_len > (uint32_t)key_len || memcmp(l->key, key, l->key_len))
+            return -1;
+        return l->key_len;
+    }
+    // Finds the longest stored key that is a prefix of key, or
+    // the key itself, in one walk down its path. A key that
+    // ends at an inner node sits under its 0 byte, which inserts
+    // keep free for it, see ART_KEY_CONFLICT. Sets match_len, if
+    // given, to the length of the match.
+    V art_longest_prefix_match(const unsigned char *key, int key_len, int *match_len = NULL) {
+        art_node **child;
+        art_node *n = t.root;
+        art_leaf *best = NULL;
+        int prefix_len, len, best_len = -1, depth = 0;
+        int optimistic = t.flags & ART_OPTIMISTIC_PREFIX;
+        while (n) {
+            if (IS_LEAF(n)) {
+                len = leaf_prefix_of(LEAF_RAW(n), key, key_len);
+                if (len > best_len) {
+                    best = LEAF_RAW(n);
+                    best_len = len;
+                }
+                break;
+            }
+
+            // Nothing below a mismatched prefix is a prefix of
+            // the key, optimistic nodes leave it to the leaves
+            if (n->partial_len) {
+                if (!optimistic) {
+                    prefix_len = check_prefix(n, key, key_len, depth);
+                    if (prefix_len != min(PrefixLen, n->partial_len))
+                        break;
+                }
+                depth = depth + n->partial_len;
+            }
+            if (depth > key_len)
+                break;
+
+            // A key ending at this depth
+            child = find_child(n, 0);
+            if (child && IS_LEAF(*child)) {
+                len = leaf_prefix_of(LEAF_RAW(*child), key, key_len);
+                if (len > best_len) {
+                    best = LEAF_RAW(*child);
+                    best_len = len;
+                }
+            }
+            if (depth == key_len)
+                break;
+
+            child = find_child(n, key[depth]);
+            n = (child) ? *child : NULL;
+            depth++;
+        }
+        if (!best)
+            return V();
+        if (match_len)
+            *match_len = best_len;
+        return best->value;
+    }
+    art_leaf* art_minimum() {
+        return minimum((art_node*)t.root);
+    }
+    art_leaf* art_maximum() {
+        return maximum((art_node*)t.root);
+    }
+    int art_iter(art_callback cb, void *data) {
+        return recursive_iter(t.root, cb, data);
+    }
+    // Finds the node or leaf whose keys are exactly those that
+    // start with a prefix, or NULL if there are none
+    art_node* prefix_root(const unsigned char *key, int key_len) {
+        art_node **child;
+        art_node *n = t.root;
+        int prefix_len, depth = 0;
+        while (n) {
+            // Might be a leaf
+            if (IS_LEAF(n)) {
+                // Check if the expanded path matches
+                if (!leaf_prefix_matches(LEAF_RAW(n), key, key_len))
+                    return n;
+                return NULL;
             }
 
             // If the depth matches the prefix, we need to handle this node
             if (depth == key_len) {
                 art_leaf *l = minimum(n);
                 if (!leaf_prefix_matches(l, key, key_len))
-                return recursive_iter(n, cb, data);
-                return 0;
+                    return n;
+                return NULL;
             }
 
             // Bail if the prefix does not match
             if (n->partial_len) {
                 prefix_len = prefix_mismatch(n, key, key_len, depth);
 
-                // Guard if the mis-match is longer than the MAX_PREFIX_LEN
+                // Guard if the mis-match is longer than the PrefixLen
                 if ((uint32_t)prefix_len > n->partial_len) {
                     prefix_len = n->partial_len;
                 }
 
                 // If there is no match, search is terminated
                 if (!prefix_len) {
-                    return 0;
+                    return NULL;
 
                 // If we've matched the prefix, iterate on this node
                 } else if (depth + prefix_len == key_len) {
-                    return recursive_iter(n, cb, data);
+                    return n;
                 }
 
+                // A mismatch inside the prefix ends the search
+                if ((uint32_t)prefix_len < n->partial_len)
+                    return NULL;
+
                 // if there is a full match, go deeper
                 depth = depth + n->partial_len;
             }
@@ -1011,8 +3029,353 @@ class art_trie {
             n = (child) ? *child : NULL;
             depth++;
         }
+        return NULL;
+    }
+    int art_iter_prefix(const unsigned char *key, int key_len, art_callback cb, void *data) {
+        art_node *n = prefix_root(key, key_len);
+        return n ? recursive_iter(n, cb, data) : 0;
+    }
+    // Iterators over the whole trie in key order
+    iterator begin() {
+        iterator it(this);
+        it.first();
+        return it;
+    }
+    iterator end() {
+        return iterator(this);
+    }
+    // Iterator at the first key >= the given key
+    iterator lower_bound(const unsigned char *key, int key_len) {
+        iterator it(this);
+        it.seek(key, key_len);
+        return it;
+    }
+    // Iterator at the first key > the given key
+    iterator upper_bound(const unsigned char *key, int key_len) {
+        iterator it(this);
+        art_leaf *l = it.seek(key, key_len);
+        if (l && !key_cmp(l->key, l->key_len, key, key_len))
+            it.next();
+        return it;
+    }
+    // Returns the first leaf with a key >= the given key, or NULL
+    art_leaf* art_lower_bound(const unsigned char *key, int key_len) {
+        return recursive_bound(t.root, key, key_len, 0, 0);
+    }
+    // Returns the first leaf with a key > the given key, or NULL
+    art_leaf* art_upper_bound(const unsigned char *key, int key_len) {
+        return recursive_bound(t.root, key, key_len, 0, 1);
+    }
+    // Invokes cb on each entry with a key in [start, end), in
+    // key order, pruning subtrees outside the bounds.
+    // start_len may be 0 and end NULL for an open bound.
+    int art_iter_range(const unsigned char *start, int start_len,
+            const unsigned char *end, int end_len, art_callback cb, void *data) {
+        return recursive_iter_range(t.root, start, start_len, end, end_len, 0,
+                start && start_len > 0, end != NULL, cb, data);
+    }
+    // Returns the number of keys smaller than the given key,
+    // which need not be in the trie. Without ART_SUBTREE_COUNT
+    // the subtrees passed over are counted leaf by leaf.
+    uint64_t art_rank(const unsigned char *key, int key_len) {
+        const art_node *n = t.root;
+        uint64_t rank = 0;
+        int idx, depth = 0;
+        while (n) {
+            if (IS_LEAF(n)) {
+                art_leaf *l = LEAF_RAW(n);
+                return rank + (key_cmp(l->key, l->key_len, key, key_len) < 0);
+            }
+
+            // Compare the prefix, the subtree is either
+            // wholly below the key, wholly above, or undecided
+            if (n->partial_len) {
+                art_leaf *l = n->partial_len > PrefixLen ? minimum(n) : NULL;
+                for (int i=0; i < (int)n->partial_len; i++) {
+                    if (depth + i >= key_len)
+                        return rank;
+                    unsigned char p = i < PrefixLen ? n->partial[i] : l->key[depth+i];
+                    if (p > key[depth+i])
+                        return rank;
+                    if (p < key[depth+i])
+                        return rank + subtree_count(n);
+                }
+                depth = depth + n->partial_len;
+            }
+            if (depth >= key_len)
+                return rank;
+
+            // Take in the children below the key byte,
+            // then go down the matching one
+            for (idx = next_child(n, -1); idx >= 0 && child_key(n, idx) < key[depth]; idx = next_child(n, idx))
+                rank += subtree_count(child_at(n, idx));
+            if (idx < 0 || child_key(n, idx) != key[depth])
+                return rank;
+            n = child_at(n, idx);
+            depth++;
+        }
+        return rank;
+    }
+    // Returns the number of keys in [start, end) without
+    // visiting them. start_len may be 0 and end NULL for an
+    // open bound.
+    uint64_t art_count_range(const unsigned char *start, int start_len,
+            const unsigned char *end, int end_len) {
+        uint64_t lo = start && start_len > 0 ? art_rank(start, start_len) : 0;
+        uint64_t hi = end ? art_rank(end, end_len) : t.size;
+        return hi > lo ? hi - lo : 0;
+    }
+    // Returns the leaf with the i-th smallest key, counting
+    // from 0, or NULL if i is not below the size of the trie
+    art_leaf* art_select(uint64_t i) {
+        const art_node *n = t.root;
+        if (i >= t.size) return NULL;
+        while (n && !IS_LEAF(n)) {
+            // Skip whole children until the one holding it
+            const art_node *child = NULL;
+            for (int idx = next_child(n, -1); idx >= 0; idx = next_child(n, idx)) {
+                child = child_at(n, idx);
+                uint64_t count = subtree_count(child);
+                if (i < count) break;
+                i -= count;
+                child = NULL;
+            }
+            n = child;
+        }
+        return n ? LEAF_RAW(n) : NULL;
+    }
+    // Returns the highest score under a child, kept in the node
+    // with ART_MAX_SCORE and found by a scan otherwise
+    uint64_t subtree_score(const art_node *n) {
+        if (IS_LEAF(n)) return value_score(LEAF_RAW(n)->value);
+        if (t.flags & ART_MAX_SCORE) return node_score(n);
+        uint64_t score = 0;
+        for (int idx = next_child(n, -1); idx >= 0; idx = next_child(n, idx))
+            score = max_score(score, subtree_score(child_at(n, idx)));
+        return score;
+    }
+    // Invokes cb on the k entries with the highest scores among
+    // those that start with prefix, highest first. Subtrees are
+    // opened best first from a heap, so with ART_MAX_SCORE only
+    // the paths to those entries and their siblings are read.
+    // Returns 0, or the return of the callback.
+    int art_topk_prefix(const unsigned char *prefix, int prefix_len, int k, art_callback cb, void *data) {
+        art_node *n = prefix_root(prefix, prefix_len);
+        if (!n || k <= 0) return 0;
+
+        // A leaf comes off the heap only once nothing left can
+        // beat it, so leaves come off in score order
+        typedef std::pair<uint64_t, art_node*> entry;
+        auto lower = [](const entry &a, const entry &b) { return a.first < b.first; };
+        std::vector<entry> heap;
+        heap.push_back(entry(subtree_score(n), n));
+        while (!heap.empty() && k) {
+            std::pop_heap(heap.begin(), heap.end(), lower);
+            n = heap.back().second;
+            heap.pop_back();
+            if (IS_LEAF(n)) {
+                art_leaf *l = LEAF_RAW(n);
+                int res = cb(data, (const unsigned char*)l->key, l->key_len, l->value);
+                if (res) return res;
+                k--;
+                continue;
+            }
+            for (int idx = next_child(n, -1); idx >= 0; idx = next_child(n, idx)) {
+                art_node *child = child_at(n, idx);
+                heap.push_back(entry(subtree_score(child), child));
+                std::push_heap(heap.begin(), heap.end(), lower);
+            }
+        }
         return 0;
     }
+    // State of one art_fuzzy_search. rows holds one edit distance
+    // row per key byte on the current path, each query_len + 1
+    // wide, so going back up a level needs no undo.
+    struct fuzzy_search {
+        const unsigned char *query;
+        int query_len;
+        int max_edits;
+        std::vector<int> rows;
+        art_callback cb;
+        void *data;
+    };
+    // Fills in the row for one more key byte after depth bytes
+    // and returns its smallest entry
+    int fuzzy_step(fuzzy_search &s, int depth, unsigned char c) {
+        size_t w = s.query_len + 1;
+        if ((depth + 2) * w > s.rows.size())
+            s.rows.resize(s.rows.size() * 2);
+        const int *prev = &s.rows[depth * w];
+        int *row = &s.rows[(depth + 1) * w];
+        int best = row[0] = prev[0] + 1;
+        for (size_t j = 1; j < w; j++) {
+            int d = prev[j-1] + (s.query[j-1] != c);
+            if (prev[j] + 1 < d) d = prev[j] + 1;
+            if (row[j-1] + 1 < d) d = row[j-1] + 1;
+            row[j] = d;
+            if (d < best) best = d;
+        }
+        return best;
+    }
+    // Walks a subtree entered after depth key bytes, pruning it
+    // once no key below can come within max_edits of the query
+    int fuzzy_recurse(fuzzy_search &s, const art_node *n, int depth) {
+        if (IS_LEAF(n)) {
+            // Finish the key from where the path left off
+            art_leaf *l = LEAF_RAW(n);
+            for (; depth < (int)l->key_len; depth++) {
+                if (fuzzy_step(s, depth, l->key[depth]) > s.max_edits)
+                    return 0;
+            }
+            if (s.rows[depth * (s.query_len + 1) + s.query_len] > s.max_edits)
+                return 0;
+            return s.cb(s.data, (const unsigned char*)l->key, l->key_len, l->value);
+        }
+
+        // Take in the whole prefix, reading the bytes past the
+        // stored part from a leaf below
+        if (n->partial_len) {
+            const unsigned char *prefix = n->partial;
+            if (n->partial_len > PrefixLen)
+                prefix = minimum(n)->key + depth;
+            for (uint32_t i = 0; i < n->partial_len; i++) {
+                if (fuzzy_step(s, depth + i, prefix[i]) > s.max_edits)
+                    return 0;
+            }
+            depth = depth + n->partial_len;
+        }
+
+        // A leaf child starts over from this depth, as its key
+        // may end here and have no byte for its edge
+        for (int idx = next_child(n, -1); idx >= 0; idx = next_child(n, idx)) {
+            const art_node *child = child_at(n, idx);
+            int res = 0;
+            if (IS_LEAF(child))
+                res = fuzzy_recurse(s, child, depth);
+            else if (fuzzy_step(s, depth, child_key(n, idx)) <= s.max_edits)
+                res = fuzzy_recurse(s, child, depth + 1);
+            if (res) return res;
+        }
+        return 0;
+    }
+    // Invokes cb on every key within max_edits insertions,
+    // deletions or substitutions of the query, in key order.
+    // Subtrees are left as soon as every entry of the edit
+    // distance row is over max_edits. Returns 0, or the
+    // return of the callback.
+    int art_fuzzy_search(const unsigned char *query, int query_len, int max_edits,
+            art_callback cb, void *data) {
+        if (!t.root || max_edits < 0) return 0;
+        fuzzy_search s;
+        s.query = query;
+        s.query_len = query_len;
+        s.max_edits = max_edits;
+        s.rows.resize(64 * (query_len + 1));
+        s.cb = cb;
+        s.data = data;
+
+        // Matching no key bytes costs one edit per query byte
+        for (int j = 0; j <= query_len; j++)
+            s.rows[j] = j;
+        return fuzzy_recurse(s, t.root, 0);
+    }
+    // Walks a subtree entered after depth key bytes with the
+    // DFA in state, leaving it once the state is dead
+    int pattern_recurse(const art_dfa *d, art_node *n, int depth, int state,
+            art_callback cb, void *data) {
+        if (IS_LEAF(n)) {
+            art_leaf *l = LEAF_RAW(n);
+            for (; depth < (int)l->key_len && state; depth++)
+                state = art_dfa_step(d, state, l->key[depth]);
+            if (!d->accept[state]) return 0;
+            return cb(data, (const unsigned char*)l->key, l->key_len, l->value);
+        }
+        if (d->is_all[state]) return recursive_iter(n, cb, data);
+
+        // Step over the whole prefix, reading the bytes past
+        // the stored part from a leaf below
+        if (n->partial_len) {
+            const unsigned char *prefix = n->partial;
+            if (n->partial_len > PrefixLen)
+                prefix = minimum(n)->key + depth;
+            for (uint32_t i = 0; i < n->partial_len; i++) {
+                state = art_dfa_step(d, state, prefix[i]);
+                if (!state) return 0;
+            }
+            depth = depth + n->partial_len;
+            if (d->is_all[state]) return recursive_iter(n, cb, data);
+        }
+
+        // A leaf child goes on from this depth, as its key
+        // may end here and have no byte for its edge
+        for (int idx = next_child(n, -1); idx >= 0; idx = next_child(n, idx)) {
+            art_node *child = child_at(n, idx);
+            int res = 0;
+            if (IS_LEAF(child)) {
+                res = pattern_recurse(d, child, depth, state, cb, data);
+            } else {
+                int next = art_dfa_step(d, state, child_key(n, idx));
+                if (next) res = pattern_recurse(d, child, depth + 1, next, cb, data);
+            }
+            if (res) return res;
+        }
+        return 0;
+    }
+    // Invokes cb on every key the pattern accepts, in key
+    // order. The DFA, from art_dfa_compile_glob, is stepped
+    // along edges and prefixes, so subtrees are left as soon
+    // as it dies. Returns 0, or the return of the callback.
+    int art_iter_pattern(const art_dfa *dfa, art_callback cb, void *data) {
+        if (!t.root || !dfa->start) return 0;
+        return pattern_recurse(dfa, t.root, 0, dfa->start, cb, data);
+    }
+    // Typed keys: integers, floats, doubles or an art_key_buf,
+    // encoded on the stack so that iteration follows their
+    // value order. Keep to one key type per trie.
+    template <typename K>
+    V art_insert(const K &key, V value) {
+        art_key_ref k(key);
+        return k.key ? art_insert(k.key, k.len, value) : V();
+    }
+    template <typename K>
+    V art_search(const K &key) {
+        art_key_ref k(key);
+        return k.key ? art_search(k.key, k.len) : V();
+    }
+    template <typename K>
+    V art_delete(const K &key) {
+        art_key_ref k(key);
+        return k.key ? art_delete(k.key, k.len) : V();
+    }
+    template <typename K>
+    art_leaf* art_lower_bound(const K &key) {
+        art_key_ref k(key);
+        return k.key ? art_lower_bound(k.key, k.len) : NULL;
+    }
+    template <typename K>
+    art_leaf* art_upper_bound(const K &key) {
+        art_key_ref k(key);
+        return k.key ? art_upper_bound(k.key, k.len) : NULL;
+    }
+    // Invokes cb on each entry with a typed key in [start, end)
+    template <typename K>
+    int art_iter_range(const K &start, const K &end, art_callback cb, void *data) {
+        art_key_ref lo(start), hi(end);
+        if (!lo.key || !hi.key) return 0;
+        return art_iter_range(lo.key, lo.len, hi.key, hi.len, cb, data);
+    }
+    template <typename K>
+    uint64_t art_rank(const K &key) {
+        art_key_ref k(key);
+        return k.key ? art_rank(k.key, k.len) : 0;
+    }
+    // Returns the number of typed keys in [start, end)
+    template <typename K>
+    uint64_t art_count_range(const K &start, const K &end) {
+        art_key_ref lo(start), hi(end);
+        if (!lo.key || !hi.key) return 0;
+        return art_count_range(lo.key, lo.len, hi.key, hi.len);
+    }
     size_t art_size_in_bytes() {
         size_t size = sizeof(art_tree);
         if (t.root != NULL) {
@@ -1020,9 +3383,365 @@ class art_trie {
         }
         return size;
     }
+    // Walks the whole trie and reports how many nodes of each
+    // type it has, how full they are, how long their prefixes
+    // are, how deep the leaves sit and how much memory it all
+    // takes, to size a dataset before loading it for real
+    art_analysis art_analyze() {
+        art_analysis a = art_analysis();
+        a.partial_len.resize(PrefixLen + 2);
+        if (t.root) analyze_node(t.root, 0, a);
+
+        // Pooled nodes and arena leaves hold whole slabs and chunks
+        if (t.pools) {
+            for (int i = 0; i < ART_NODE_TYPES; i++) {
+                for (art_slab *s = t.pools[i].slabs; s; s = s->next)
+                    a.node_usable[i] += art_usable_size(s, ART_SLAB_SIZE);
+            }
+        }
+        if (t.arena) {
+            for (art_slab *s = t.arena->chunks; s; s = s->next)
+                a.leaf_usable += art_usable_size(s, ART_ARENA_CHUNK_SIZE);
+        }
+
+        a.bytes = sizeof(art_tree) + a.leaf_bytes;
+        a.usable = sizeof(art_tree) + a.leaf_usable;
+        for (int i = 0; i < ART_NODE_TYPES; i++) {
+            a.bytes += a.node_bytes[i];
+            a.usable += a.node_usable[i];
+        }
+        return a;
+    }
+    // Writes the trie to a file that art_map can map.
+    // Values are stored as their raw bits, so only values
+    // that are not pointers survive a reload.
+    // Returns 0 on success, -1 on I/O error.
+    int art_save(const char *path) {
+        map_header h;
+        uint64_t off = 0;
+        int err = 0;
+        memset(&h, 0, sizeof(h));
+        FILE *f = fopen(path, "wb");
+        if (!f) return -1;
+
+        // Reserve the header, it is filled in last
+        map_write(f, off, err, &h, sizeof(h));
+        h.root = map_save_node(f, off, err, t.root);
+        memcpy(h.magic, ART_MAP_MAGIC, sizeof(h.magic));
+        h.version = ART_MAP_VERSION;
+        h.byte_order = ART_MAP_BYTE_ORDER;
+        h.max_prefix_len = PrefixLen;
+        h.size = t.size;
+        h.file_len = off;
+        if (fseek(f, 0, SEEK_SET) || fwrite(&h, sizeof(h), 1, f) != 1)
+            err = 1;
+        if (fclose(f) || err) {
+            unlink(path);
+            return -1;
+        }
+        return 0;
+    }
 
 };
 
+/**
+ * A trie saved by basic_art_trie::art_save, mapped read-only
+ * into memory and used in place. Nothing is read up front,
+ * pages come in from the shared page cache as lookups
+ * touch them, so many processes can serve the same file.
+ */
+template <int PrefixLen = MAX_PREFIX_LEN, typename V = void*>
+class basic_art_map {
+  public:
+    typedef int(*art_callback)(void *data, const unsigned char *key, uint32_t key_len, V value);
+
+  private:
+    typedef basic_map_node<PrefixLen> map_node;
+    typedef basic_map_node4<PrefixLen> map_node4;
+    typedef basic_map_node16<PrefixLen> map_node16;
+    typedef basic_map_node32<PrefixLen> map_node32;
+    typedef basic_map_node48<PrefixLen> map_node48;
+    typedef basic_map_node256<PrefixLen> map_node256;
+
+    const unsigned char *base;
+    size_t len;
+    uint64_t root;
+    uint64_t size;
+
+    bool is_leaf(uint64_t r) const {
+        return r & 1;
+    }
+    const map_node* node_at(uint64_t r) const {
+        return (const map_node*)(base + r);
+    }
+    const map_leaf* leaf_at(uint64_t r) const {
+        return (const map_leaf*)(base + (r & ~(uint64_t)1));
+    }
+    uint64_t find_child(const map_node *n, unsigned char c) const {
+        int i;
+        switch (n->type) {
+            case NODE4: {
+                const map_node4 *p = (const map_node4*)n;
+                for (i=0; i < n->num_children; i++) {
+                    if (p->keys[i] == c)
+                        return p->children[i];
+                }
+                break;
+            }
+            case NODE16: {
+                const map_node16 *p = (const map_node16*)n;
+                for (i=0; i < n->num_children; i++) {
+                    if (p->keys[i] == c)
+                        return p->children[i];
+                }
+                break;
+            }
+            case NODE32: {
+                const map_node32 *p = (const map_node32*)n;
+                for (i=0; i < n->num_children; i++) {
+                    if (p->keys[i] == c)
+                        return p->children[i];
+                }
+                break;
+            }
+            case NODE48: {
+                const map_node48 *p = (const map_node48*)n;
+                i = p->keys[c];
+                if (i)
+                    return p->children[i-1];
+                break;
+            }
+            case NODE256:
+                return ((const map_node256*)n)->children[c];
+            default:
+                abort();
+        }
+        return 0;
+    }
+    // Find the minimum leaf under a node
+    const map_leaf* minimum(uint64_t r) const {
+        while (r && !is_leaf(r)) {
+            const map_node *n = node_at(r);
+            int idx = 0;
+            switch (n->type) {
+                case NODE4:
+                    r = ((const map_node4*)n)->children[0];
+                    break;
+                case NODE16:
+                    r = ((const map_node16*)n)->children[0];
+                    break;
+                case NODE32:
+                    r = ((const map_node32*)n)->children[0];
+                    break;
+                case NODE48:
+                    while (!((const map_node48*)n)->keys[idx]) idx++;
+                    r = ((const map_node48*)n)->children[((const map_node48*)n)->keys[idx] - 1];
+                    break;
+                case NODE256:
+                    while (!((const map_node256*)n)->children[idx]) idx++;
+                    r = ((const map_node256*)n)->children[idx];
+                    break;
+                default:
+                    abort();
+            }
+        }
+        return r ? leaf_at(r) : NULL;
+    }
+    int recursive_iter(uint64_t r, art_callback cb, void *data) const {
+        // Handle base cases
+        if (!r) return 0;
+        if (is_leaf(r)) {
+            const map_leaf *l = leaf_at(r);
+            return cb(data, l->key, l->key_len, art_value_from_bits<V>(l->value));
+        }
+
+        const map_node *n = node_at(r);
+        int i, idx, res;
+        switch (n->type) {
+            case NODE4:
+                for (i=0; i < n->num_children; i++) {
+                    res = recursive_iter(((const map_node4*)n)->children[i], cb, data);
+                    if (res) return res;
+                }
+                break;
+            case NODE16:
+                for (i=0; i < n->num_children; i++) {
+                    res = recursive_iter(((const map_node16*)n)->children[i], cb, data);
+                    if (res) return res;
+                }
+                break;
+            case NODE32:
+                for (i=0; i < n->num_children; i++) {
+                    res = recursive_iter(((const map_node32*)n)->children[i], cb, data);
+                    if (res) return res;
+                }
+                break;
+            case NODE48:
+                for (i=0; i < 256; i++) {
+                    idx = ((const map_node48*)n)->keys[i];
+                    if (!idx) continue;
+                    res = recursive_iter(((const map_node48*)n)->children[idx-1], cb, data);
+                    if (res) return res;
+                }
+                break;
+            case NODE256:
+                for (i=0; i < 256; i++) {
+                    if (!((const map_node256*)n)->children[i]) continue;
+                    res = recursive_iter(((const map_node256*)n)->children[i], cb, data);
+                    if (res) return res;
+                }
+                break;
+            default:
+                abort();
+        }
+        return 0;
+    }
+
+  public:
+    basic_art_map() : base(NULL), len(0), root(0), size(0) {}
+    ~basic_art_map() {
+        art_close();
+    }
+    // Maps a file written by art_save. Returns 0 on success,
+    // -1 if the file cannot be mapped or was written with a
+    // different layout.
+    int art_open(const char *path) {
+        struct stat st;
+        art_close();
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return -1;
+        if (fstat(fd, &st) || (size_t)st.st_size < sizeof(map_header)) {
+            close(fd);
+            return -1;
+        }
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) return -1;
+
+        const map_header *h = (const map_header*)p;
+        if (memcmp(h->magic, ART_MAP_MAGIC, sizeof(h->magic)) ||
+                h->version < 1 || h->version > ART_MAP_VERSION ||
+                h->byte_order != ART_MAP_BYTE_ORDER ||
+                h->max_prefix_len != PrefixLen ||
+                h->file_len != (uint64_t)st.st_size) {
+            munmap(p, st.st_size);
+            return -1;
+        }
+        base = (const unsigned char*)p;
+        len = st.st_size;
+        root = h->root;
+        size = h->size;
+        return 0;
+    }
+    int art_close() {
+        int res = base ? munmap((void*)base, len) : 0;
+        base = NULL;
+        len = 0;
+        root = 0;
+        size = 0;
+        return res;
+    }
+    uint64_t art_size() const {
+        return size;
+    }
+    V art_search(const unsigned char *key, int key_len) const {
+        uint64_t r = root;
+        int i, depth = 0;
+        while (r) {
+            // Might be a leaf
+            if (is_leaf(r)) {
+                const map_leaf *l = leaf_at(r);
+                if (l->key_len == (uint32_t)key_len && !memcmp(l->key, key, key_len))
+                    return art_value_from_bits<V>(l->value);
+                return V();
+            }
+
+            // Bail if the prefix does not match
+            const map_node *n = node_at(r);
+            if (n->partial_len) {
+                int max_cmp = std::min(std::min((int)n->partial_len, PrefixLen), key_len - depth);
+                for (i=0; i < max_cmp; i++) {
+                    if (n->partial[i] != key[depth+i])
+                        return V();
+                }
+                if (i != std::min(PrefixLen, (int)n->partial_len))
+                    return V();
+                depth = depth + n->partial_len;
+            }
+            if (depth > key_len) return V();
+
+            r = find_child(n, key_at(key, key_len, depth));
+            depth++;
+        }
+        return V();
+    }
+    // Invokes cb on every entry in key order. Keys passed
+    // to the callback point into the mapping.
+    int art_iter(art_callback cb, void *data) const {
+        return recursive_iter(root, cb, data);
+    }
+    // Invokes cb on every entry that starts with the prefix
+    int art_iter_prefix(const unsigned char *key, int key_len, art_callback cb, void *data) const {
+        uint64_t r = root;
+        int i, prefix_len, depth = 0;
+        while (r) {
+            // Might be a leaf
+            if (is_leaf(r)) {
+                const map_leaf *l = leaf_at(r);
+                if (l->key_len >= (uint32_t)key_len && !memcmp(l->key, key, key_len))
+                    return cb(data, l->key, l->key_len, art_value_from_bits<V>(l->value));
+                return 0;
+            }
+
+            // If the depth matches the prefix, we need to handle this node
+            if (depth == key_len) {
+                const map_leaf *l = minimum(r);
+                if (l->key_len >= (uint32_t)key_len && !memcmp(l->key, key, key_len))
+                    return recursive_iter(r, cb, data);
+                return 0;
+            }
+
+            // Bail if the prefix does not match, reading
+            // bytes past PrefixLen from a leaf
+            const map_node *n = node_at(r);
+            if (n->partial_len) {
+                const map_leaf *l = n->partial_len > PrefixLen ? minimum(r) : NULL;
+                int max_cmp = std::min((int)n->partial_len, key_len - depth);
+                for (i=0; i < max_cmp; i++) {
+                    unsigned char p = i < PrefixLen ? n->partial[i] : l->key[depth+i];
+                    if (p != key[depth+i]) break;
+                }
+                prefix_len = i;
+
+                // If there is no match, search is terminated
+                if (!prefix_len) {
+                    return 0;
+
+                // If we've matched the prefix, iterate on this node
+                } else if (depth + prefix_len == key_len) {
+                    return recursive_iter(r, cb, data);
+                }
+
+                // Partial matches end the search too
+                if ((uint32_t)prefix_len < n->partial_len)
+                    return 0;
+                depth = depth + n->partial_len;
+            }
+
+            r = find_child(n, key[depth]);
+            depth++;
+        }
+        return 0;
+    }
+};
+
+/**
+ * The trie and map with the default prefix length and
+ * untyped values, as used by the C library.
+ */
+typedef basic_art_trie<> art_trie;
+typedef basic_art_map<> art_map;
+
 } // namespace art
 
 #endif // ifdef art
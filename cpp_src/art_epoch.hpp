@@ -0,0 +1,226 @@
+#ifndef ART_EPOCH_H
+#define ART_EPOCH_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace art {
+
+/**
+ * Number of pointers a thread retires before
+ * it tries to free the ones no reader can see.
+ */
+#ifndef ART_EPOCH_BATCH
+#define ART_EPOCH_BATCH 64
+#endif
+
+/**
+ * Decides when memory unlinked from a concurrent trie
+ * can be given back. Readers and writers bracket every
+ * operation with enter() and exit(), and unlinked nodes
+ * and leaves are handed to retire() instead of free().
+ * Retired pointers must have come from malloc.
+ */
+class art_reclaimer {
+  public:
+    virtual ~art_reclaimer() {}
+    virtual void enter() = 0;
+    virtual void exit() = 0;
+    virtual void retire(void *p) = 0;
+};
+
+// Brackets a scope with enter() and exit()
+class art_reclaim_guard {
+  private:
+    art_reclaimer *r;
+  public:
+    explicit art_reclaim_guard(art_reclaimer *r) : r(r) {
+        r->enter();
+    }
+    ~art_reclaim_guard() {
+        r->exit();
+    }
+};
+
+/**
+ * Keeps everything retired until it is destroyed.
+ * Costs nothing per operation, but memory only grows.
+ */
+class art_deferred_reclaimer : public art_reclaimer {
+  private:
+    std::mutex lock;
+    std::vector<void*> retired;
+  public:
+    ~art_deferred_reclaimer() {
+        for (size_t i = 0; i < retired.size(); i++)
+            free(retired[i]);
+    }
+    void enter() {}
+    void exit() {}
+    void retire(void *p) {
+        std::lock_guard<std::mutex> guard(lock);
+        retired.push_back(p);
+    }
+};
+
+/**
+ * Epoch based reclamation. Each thread announces the
+ * global epoch it entered at and tags what it retires with
+ * the epoch current at that time. A pointer retired at
+ * epoch e is freed once every thread inside an operation
+ * entered after e, as none of them can still reach it.
+ *
+ * Threads register on their first enter(). Whatever a
+ * thread still holds when it exits is handed back and
+ * freed with the reclaimer. No thread may be inside an
+ * operation when the reclaimer is destroyed.
+ */
+class art_epoch_reclaimer : public art_reclaimer {
+  private:
+    struct retired_ptr {
+        void *p;
+        uint64_t epoch;
+    };
+    struct thread_rec {
+        std::atomic<uint64_t> active;   // Epoch entered at, 0 when outside
+        int depth;
+        std::vector<retired_ptr> retired;
+        size_t next_scan;               // Retired count that triggers a scan
+        thread_rec() : active(0), depth(0), next_scan(ART_EPOCH_BATCH) {}
+    };
+    // Shared with the registered threads, which may outlive us
+    struct domain {
+        std::atomic<uint64_t> epoch;
+        std::mutex lock;
+        std::vector<thread_rec*> threads;
+        std::vector<retired_ptr> orphans;
+        bool closed;
+        domain() : epoch(1), closed(false) {}
+    };
+    typedef std::vector<std::pair<std::shared_ptr<domain>, thread_rec*> > thread_list;
+
+    // Per thread registrations, released when the thread exits
+    struct thread_regs {
+        thread_list regs;
+        ~thread_regs() {
+            for (size_t i = 0; i < regs.size(); i++)
+                unregister(regs[i].first.get(), regs[i].second);
+        }
+    };
+
+    std::shared_ptr<domain> d;
+
+    static void unregister(domain *dom, thread_rec *rec) {
+        std::lock_guard<std::mutex> guard(dom->lock);
+        if (!dom->closed) {
+            dom->orphans.insert(dom->orphans.end(), rec->retired.begin(), rec->retired.end());
+            for (size_t i = 0; i < dom->threads.size(); i++) {
+                if (dom->threads[i] == rec) {
+                    dom->threads[i] = dom->threads.back();
+                    dom->threads.pop_back();
+                    break;
+                }
+            }
+        }
+        delete rec;
+    }
+
+    thread_rec* local() {
+        static thread_local thread_regs tl;
+        thread_list &regs = tl.regs;
+        for (size_t i = 0; i < regs.size(); i++) {
+            if (regs[i].first == d)
+                return regs[i].second;
+        }
+        // Drop registrations of reclaimers that are gone
+        for (size_t i = 0; i < regs.size(); ) {
+            bool closed;
+            {
+                std::lock_guard<std::mutex> guard(regs[i].first->lock);
+                closed = regs[i].first->closed;
+            }
+            if (closed) {
+                unregister(regs[i].first.get(), regs[i].second);
+                regs[i] = regs.back();
+                regs.pop_back();
+            } else
+                i++;
+        }
+        thread_rec *rec = new thread_rec();
+        {
+            std::lock_guard<std::mutex> guard(d->lock);
+            d->threads.push_back(rec);
+        }
+        regs.push_back(std::make_pair(d, rec));
+        return rec;
+    }
+
+    // Oldest epoch a thread inside an operation entered at
+    uint64_t min_active() {
+        uint64_t min = d->epoch.fetch_add(1) + 1;
+        std::lock_guard<std::mutex> guard(d->lock);
+        for (size_t i = 0; i < d->threads.size(); i++) {
+            uint64_t e = d->threads[i]->active.load();
+            if (e && e < min)
+                min = e;
+        }
+        return min;
+    }
+
+    static void free_before(std::vector<retired_ptr> &list, uint64_t epoch) {
+        size_t kept = 0;
+        for (size_t i = 0; i < list.size(); i++) {
+            if (list[i].epoch < epoch)
+                free(list[i].p);
+            else
+                list[kept++] = list[i];
+        }
+        list.resize(kept);
+    }
+
+  public:
+    art_epoch_reclaimer() : d(std::make_shared<domain>()) {}
+    ~art_epoch_reclaimer() {
+        std::lock_guard<std::mutex> guard(d->lock);
+        d->closed = true;
+        for (size_t i = 0; i < d->threads.size(); i++) {
+            free_before(d->threads[i]->retired, UINT64_MAX);
+        }
+        free_before(d->orphans, UINT64_MAX);
+    }
+
+    void enter() {
+        thread_rec *rec = local();
+        if (rec->depth++ == 0)
+            rec->active.store(d->epoch.load());
+    }
+    void exit() {
+        thread_rec *rec = local();
+        if (--rec->depth == 0)
+            rec->active.store(0, std::memory_order_release);
+    }
+    void retire(void *p) {
+        thread_rec *rec = local();
+        retired_ptr r = {p, d->epoch.load()};
+        rec->retired.push_back(r);
+        if (rec->retired.size() >= rec->next_scan) {
+            uint64_t epoch = min_active();
+            free_before(rec->retired, epoch);
+            // Back off while a stalled reader pins what we hold
+            rec->next_scan = rec->retired.size() * 2;
+            if (rec->next_scan < ART_EPOCH_BATCH)
+                rec->next_scan = ART_EPOCH_BATCH;
+            std::lock_guard<std::mutex> guard(d->lock);
+            free_before(d->orphans, epoch);
+        }
+    }
+};
+
+} // namespace art
+
+#endif // ifdef ART_EPOCH_H
@@ -0,0 +1,865 @@
+#ifndef ART_OLC_H
+#define ART_OLC_H
+
+#include <atomic>
+
+#include "art.hpp"
+#include "art_epoch.hpp"
+
+#if defined(__i386__) || defined(__amd64__)
+    #include <immintrin.h>
+    #define ART_CPU_RELAX() _mm_pause()
+#else
+    #define ART_CPU_RELAX() ((void)0)
+#endif
+
+namespace art {
+
+/**
+ * Concurrent variant of art_trie using optimistic lock
+ * coupling, as in "The ART of Practical Synchronization"
+ * (Leis et al., DaMoN 2016).
+ *
+ * Every node is preceded by a version word, which art_trie
+ * nodes do without. Readers never write shared memory: they
+ * remember the version of each node on the way down and
+ * restart from the root if it moved before they were done
+ * with the node.
+ * Writers lock only the node they change in place, plus its
+ * parent when the node has to be replaced by a bigger or
+ * smaller one. The root is a fixed art_node256 so it never
+ * needs replacing itself.
+ *
+ * Replaced nodes and deleted leaves may still be in use by
+ * readers, so they are handed to an art_reclaimer instead of
+ * being freed. By default each trie owns an
+ * art_epoch_reclaimer.
+ */
+class art_trie_olc {
+  private:
+    art_node *root;
+    std::atomic<uint64_t> size;
+    art_reclaimer *reclaimer;
+    bool owns_reclaimer;
+
+    // The version word in front of a node: bit 1 is set while a
+    // writer holds the node, bit 0 once it has been replaced, and
+    // every unlock moves it on so readers can tell it changed
+    static inline uint64_t* version(art_node *n) {
+        return (uint64_t*)n - 1;
+    }
+
+    // Waits out a writer and returns the version to validate
+    // against. Fails if the node has been replaced.
+    static inline bool read_lock(art_node *n, uint64_t &v) {
+        v = __atomic_load_n(version(n), __ATOMIC_ACQUIRE);
+        while (v & 2) {
+            ART_CPU_RELAX();
+            v = __atomic_load_n(version(n), __ATOMIC_ACQUIRE);
+        }
+        return !(v & 1);
+    }
+    // True if the node is unchanged since read_lock
+    static inline bool check(art_node *n, uint64_t v) {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return __atomic_load_n(version(n), __ATOMIC_RELAXED) == v;
+    }
+    // Turns a read of version v into the write lock
+    static inline bool upgrade(art_node *n, uint64_t v) {
+        return __atomic_compare_exchange_n(version(n), &v, v + 2, false,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    }
+    // Spins for the write lock, fails if the node is replaced
+    static inline bool write_lock(art_node *n) {
+        uint64_t v;
+        do {
+            if (!read_lock(n, v)) return false;
+        } while (!upgrade(n, v));
+        return true;
+    }
+    static inline void write_unlock(art_node *n) {
+        __atomic_fetch_add(version(n), 2, __ATOMIC_RELEASE);
+    }
+    static inline void write_unlock_obsolete(art_node *n) {
+        __atomic_fetch_add(version(n), 3, __ATOMIC_RELEASE);
+    }
+
+    // Readers look at nodes while a writer may be changing them
+    // and only trust what they saw once the version checks out.
+    // Such racy reads, and the writes they can overlap, go
+    // through these relaxed atomics: plain moves on x86, but
+    // defined behaviour for the compiler and quiet under TSan.
+    template <typename T>
+    static inline T racy_load(const T &x) {
+        return __atomic_load_n(&x, __ATOMIC_RELAXED);
+    }
+    template <typename T, typename U>
+    static inline void racy_store(T &x, U v) {
+        __atomic_store_n(&x, (T)v, __ATOMIC_RELAXED);
+    }
+    // Child pointers also publish what they point to, so a reader
+    // that finds a new node or leaf sees it fully built
+    static inline art_node* load_child(art_node *const &slot) {
+        return __atomic_load_n(&slot, __ATOMIC_ACQUIRE);
+    }
+    static inline void store_child(art_node *&slot, art_node *child) {
+        __atomic_store_n(&slot, child, __ATOMIC_RELEASE);
+    }
+    // Returns a bitmask of the 16 keys at keys that equal c.
+    // The SIMD compare works on words loaded one at a time,
+    // keys start at a multiple of 4 in every node type.
+    typedef uint32_t __attribute__((__may_alias__)) racy_word;
+    static inline unsigned racy_match16(const unsigned char *keys, unsigned char c) {
+        #if defined(__i386__) || defined(__amd64__)
+            const racy_word *w = (const racy_word*)keys;
+            __m128i v = _mm_set_epi32(racy_load(w[3]), racy_load(w[2]),
+                    racy_load(w[1]), racy_load(w[0]));
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(c), v));
+        #else
+            unsigned bitfield = 0;
+            for (int i = 0; i < 16; ++i) {
+                if (racy_load(keys[i]) == c)
+                    bitfield |= (1u << i);
+            }
+            return bitfield;
+        #endif
+    }
+
+    static inline int min(int a, int b) {
+        return (a < b) ? a : b;
+    }
+
+    static art_node* alloc_node(uint8_t type) {
+        size_t size;
+        switch (type) {
+            case NODE4:
+                size = sizeof(art_node4);
+                break;
+            case NODE16:
+                size = sizeof(art_node16);
+                break;
+            case NODE32:
+                size = sizeof(art_node32);
+                break;
+            case NODE48:
+                size = sizeof(art_node48);
+                break;
+            case NODE256:
+                size = sizeof(art_node256);
+                break;
+            default:
+                abort();
+        }
+        uint64_t *p = (uint64_t*)calloc(1, sizeof(uint64_t) + size);
+        art_node *n = (art_node*)(p + 1);
+        n->type = type;
+        ART_STAT(node_allocs[type-1]);
+        return n;
+    }
+
+    static art_leaf* make_leaf(const unsigned char *key, int key_len, void *value) {
+        art_leaf *l = (art_leaf*)calloc(1, sizeof(art_leaf)+key_len);
+        ART_STAT(leaf_allocs);
+        l->value = value;
+        l->key_len = key_len;
+        memcpy(l->key, key, key_len);
+        return l;
+    }
+
+    // Recursively destroys the tree
+    static void destroy_node(art_node *n) {
+        if (!n) return;
+        if (IS_LEAF(n)) {
+            free(LEAF_RAW(n));
+            return;
+        }
+        int i, idx;
+        switch (n->type) {
+            case NODE4:
+                for (i=0;i<n->num_children;i++)
+                    destroy_node(((art_node4*)n)->children[i]);
+                break;
+            case NODE16:
+                for (i=0;i<n->num_children;i++)
+                    destroy_node(((art_node16*)n)->children[i]);
+                break;
+            case NODE32:
+                for (i=0;i<n->num_children;i++)
+                    destroy_node(((art_node32*)n)->children[i]);
+                break;
+            case NODE48:
+                for (i=0;i<256;i++) {
+                    idx = ((art_node48*)n)->keys[i];
+                    if (idx) destroy_node(((art_node48*)n)->children[idx-1]);
+                }
+                break;
+            case NODE256:
+                for (i=0;i<256;i++)
+                    destroy_node(((art_node256*)n)->children[i]);
+                break;
+            default:
+                abort();
+        }
+        free(version(n));
+    }
+
+    // Finds the child slot for c. Safe on a node that is being
+    // changed under us, the caller validates before using it.
+    static art_node** find_child(art_node *n, unsigned char c) {
+        int i, num = racy_load(n->num_children);
+        switch (n->type) {
+            case NODE4: {
+                art_node4 *p = (art_node4*)n;
+                for (i=0; i < num && i < 4; i++) {
+                    if (racy_load(p->keys[i]) == c)
+                        return &p->children[i];
+                }
+                break;
+            }
+            case NODE16: {
+                art_node16 *p = (art_node16*)n;
+                if (num > 16) num = 16;
+                unsigned bitfield = racy_match16(p->keys, c) & ((1u << num) - 1);
+                if (bitfield)
+                    return &p->children[__builtin_ctz(bitfield)];
+                break;
+            }
+            case NODE32: {
+                art_node32 *p = (art_node32*)n;
+                unsigned matches = racy_match16(p->keys, c) |
+                        racy_match16(p->keys+16, c) << 16;
+                if (num < 32)
+                    matches &= (1u << num) - 1;
+                if (matches)
+                    return &p->children[__builtin_ctz(matches)];
+                break;
+            }
+            case NODE48: {
+                art_node48 *p = (art_node48*)n;
+                i = racy_load(p->keys[c]);
+                if (i && i <= 48)
+                    return &p->children[i-1];
+                break;
+            }
+            case NODE256: {
+                art_node256 *p = (art_node256*)n;
+                if (load_child(p->children[c]))
+                    return &p->children[c];
+                break;
+            }
+        }
+        return NULL;
+    }
+
+    // Any child of n, or NULL if it looks empty right now
+    static art_node* first_child(art_node *n) {
+        int i, num = racy_load(n->num_children);
+        switch (n->type) {
+            case NODE4:
+                return (num && num <= 4) ? load_child(((art_node4*)n)->children[0]) : NULL;
+            case NODE16:
+                return (num && num <= 16) ? load_child(((art_node16*)n)->children[0]) : NULL;
+            case NODE32:
+                return (num && num <= 32) ? load_child(((art_node32*)n)->children[0]) : NULL;
+            case NODE48:
+                for (i=0;i<256;i++) {
+                    int idx = racy_load(((art_node48*)n)->keys[i]);
+                    if (idx && idx <= 48)
+                        return load_child(((art_node48*)n)->children[idx-1]);
+                }
+                return NULL;
+            case NODE256:
+                for (i=0;i<256;i++) {
+                    art_node *child = load_child(((art_node256*)n)->children[i]);
+                    if (child) return child;
+                }
+                return NULL;
+        }
+        return NULL;
+    }
+
+    static bool is_full(const art_node *n) {
+        return n->type != NODE256 && racy_load(n->num_children) == art_node_capacity(n->type);
+    }
+
+    // True if removing one child should shrink the node, using
+    // the same thresholds as art_trie
+    static bool is_underfull(const art_node *n) {
+        int num = racy_load(n->num_children);
+        switch (n->type) {
+            case NODE16: return num == 4;
+            case NODE32: return num == 13;
+            case NODE48: return num == 25;
+            case NODE256: return num == 38;
+            default: return false;
+        }
+    }
+
+    // Removes the entry at pos from a sorted node of num children
+    static void remove_at(unsigned char *keys, art_node **children, int num, int pos) {
+        for (int i = pos; i < num - 1; i++) {
+            racy_store(keys[i], keys[i+1]);
+            store_child(children[i], children[i+1]);
+        }
+    }
+
+    // Adds a child to a locked node4, node16 or node32 that has
+    // room for it, keeping the keys sorted
+    static void add_child_sorted(art_node *n, unsigned char *keys, art_node **children,
+            unsigned char c, art_node *child) {
+        int idx, num = n->num_children;
+        for (idx=0; idx < num; idx++) {
+            if (c < keys[idx]) break;
+        }
+        for (int i = num; i > idx; i--) {
+            racy_store(keys[i], keys[i-1]);
+            store_child(children[i], children[i-1]);
+        }
+        racy_store(keys[idx], c);
+        store_child(children[idx], child);
+        racy_store(n->num_children, num + 1);
+    }
+    static void add_child4(art_node4 *n, unsigned char c, art_node *child) {
+        add_child_sorted(&n->n, n->keys, n->children, c, child);
+    }
+    static void add_child16(art_node16 *n, unsigned char c, art_node *child) {
+        add_child_sorted(&n->n, n->keys, n->children, c, child);
+    }
+    static void add_child32(art_node32 *n, unsigned char c, art_node *child) {
+        add_child_sorted(&n->n, n->keys, n->children, c, child);
+    }
+    static void add_child48(art_node48 *n, unsigned char c, art_node *child) {
+        int pos = 0;
+        while (n->children[pos]) pos++;
+        store_child(n->children[pos], child);
+        racy_store(n->keys[c], pos + 1);
+        racy_store(n->n.num_children, n->n.num_children + 1);
+    }
+    static void add_child256(art_node256 *n, unsigned char c, art_node *child) {
+        store_child(n->children[c], child);
+        racy_store(n->n.num_children, n->n.num_children + 1);
+    }
+
+    // Adds a child to a locked node that has room for it. Kept
+    // out of line so the type switch is never inlined next to
+    // an allocation of one known type.
+    __attribute__((noinline))
+    static void add_child(art_node *n, unsigned char c, art_node *child) {
+        switch (n->type) {
+            case NODE4:
+                add_child4((art_node4*)n, c, child);
+                break;
+            case NODE16:
+                add_child16((art_node16*)n, c, child);
+                break;
+            case NODE32:
+                add_child32((art_node32*)n, c, child);
+                break;
+            case NODE48:
+                add_child48((art_node48*)n, c, child);
+                break;
+            case NODE256:
+                add_child256((art_node256*)n, c, child);
+                break;
+            default:
+                abort();
+        }
+    }
+
+    // Removes the child for c from a locked node
+    static void remove_child(art_node *n, unsigned char c) {
+        int pos, num = n->num_children;
+        switch (n->type) {
+            case NODE4: {
+                art_node4 *p = (art_node4*)n;
+                for (pos=0; pos < num && p->keys[pos] != c; pos++);
+                remove_at(p->keys, p->children, num, pos);
+                break;
+            }
+            case NODE16: {
+                art_node16 *p = (art_node16*)n;
+                for (pos=0; pos < num && p->keys[pos] != c; pos++);
+                remove_at(p->keys, p->children, num, pos);
+                break;
+            }
+            case NODE32: {
+                art_node32 *p = (art_node32*)n;
+                for (pos=0; pos < num && p->keys[pos] != c; pos++);
+                remove_at(p->keys, p->children, num, pos);
+                break;
+            }
+            case NODE48: {
+                art_node48 *p = (art_node48*)n;
+                pos = p->keys[c];
+                racy_store(p->keys[c], 0);
+                store_child(p->children[pos-1], NULL);
+                break;
+            }
+            case NODE256:
+                store_child(((art_node256*)n)->children[c], NULL);
+                break;
+            default:
+                abort();
+        }
+        racy_store(n->num_children, num - 1);
+    }
+
+    // Builds a copy of a locked node as the given type,
+    // leaving out the child for skip if it is >= 0
+    static art_node* copy_node(art_node *n, uint8_t type, int skip) {
+        art_node *copy = alloc_node(type);
+        copy->partial_len = n->partial_len;
+        memcpy(copy->partial, n->partial, min(MAX_PREFIX_LEN, n->partial_len));
+        int i, idx;
+        switch (n->type) {
+            case NODE4:
+                for (i=0;i<n->num_children;i++) {
+                    if (((art_node4*)n)->keys[i] != skip)
+                        add_child(copy, ((art_node4*)n)->keys[i], ((art_node4*)n)->children[i]);
+                }
+                break;
+            case NODE16:
+                for (i=0;i<n->num_children;i++) {
+                    if (((art_node16*)n)->keys[i] != skip)
+                        add_child(copy, ((art_node16*)n)->keys[i], ((art_node16*)n)->children[i]);
+                }
+                break;
+            case NODE32:
+                for (i=0;i<n->num_children;i++) {
+                    if (((art_node32*)n)->keys[i] != skip)
+                        add_child(copy, ((art_node32*)n)->keys[i], ((art_node32*)n)->children[i]);
+                }
+                break;
+            case NODE48:
+                for (i=0;i<256;i++) {
+                    idx = ((art_node48*)n)->keys[i];
+                    if (idx && i != skip)
+                        add_child(copy, i, ((art_node48*)n)->children[idx-1]);
+                }
+                break;
+            case NODE256:
+                for (i=0;i<256;i++) {
+                    if (((art_node256*)n)->children[i] && i != skip)
+                        add_child(copy, i, ((art_node256*)n)->children[i]);
+                }
+                break;
+            default:
+                abort();
+        }
+        return copy;
+    }
+
+    static int check_prefix(const art_node *n, int partial_len, const unsigned char *key, int key_len, int depth) {
+        int max_cmp = min(min(partial_len, MAX_PREFIX_LEN), key_len - depth);
+        int idx;
+        for (idx=0; idx < max_cmp; idx++) {
+            if (racy_load(n->partial[idx]) != key[depth+idx])
+                return idx;
+        }
+        return idx;
+    }
+
+    static int leaf_matches(const art_leaf *n, const unsigned char *key, int key_len) {
+        if (n->key_len != (uint32_t)key_len) return 1;
+        return memcmp(n->key, key, key_len);
+    }
+
+    // Finds some leaf under n, validating every hop.
+    // Returns NULL if the caller has to restart.
+    static art_leaf* any_leaf(art_node *n) {
+        while (!IS_LEAF(n)) {
+            uint64_t v;
+            if (!read_lock(n, v)) return NULL;
+            art_node *child = first_child(n);
+            if (!check(n, v) || !child) return NULL;
+            n = child;
+        }
+        return LEAF_RAW(n);
+    }
+
+    // Calculates the index at which the prefixes mismatch, reading
+    // the full prefix from a leaf if it is longer than MAX_PREFIX_LEN.
+    // Returns false if the caller has to restart.
+    static bool prefix_mismatch(art_node *n, int partial_len, const unsigned char *key, int key_len,
+            int depth, int &diff, art_leaf *&l) {
+        int max_cmp = min(min(MAX_PREFIX_LEN, partial_len), key_len - depth);
+        int idx;
+        for (idx=0; idx < max_cmp; idx++) {
+            if (racy_load(n->partial[idx]) != key[depth+idx]) {
+                diff = idx;
+                return true;
+            }
+        }
+        if (partial_len > MAX_PREFIX_LEN) {
+            ART_STAT(prefix_leaf_reads);
+            l = any_leaf(n);
+            if (!l) return false;
+            max_cmp = min(l->key_len, key_len) - depth;
+            for (; idx < max_cmp; idx++) {
+                if (l->key[idx+depth] != key[depth+idx])
+                    break;
+            }
+        }
+        diff = idx;
+        return true;
+    }
+
+    void* insert(const unsigned char *key, int key_len, void *value, bool replace, int *status) {
+        art_reclaim_guard guard(reclaimer);
+        art_leaf *leaf = NULL;
+        int added = ART_KEY_ADDED;
+        if (!status) status = &added;
+        *status = ART_KEY_ADDED;
+    restart:
+        art_node *parent = NULL, *node = root;
+        uint64_t parent_v = 0, v;
+        unsigned char parent_key = 0;
+        int depth = 0;
+        if (!read_lock(node, v)) goto restart;
+
+        while (true) {
+            // Check if given node has a prefix
+            int partial_len = racy_load(node->partial_len);
+            if (partial_len) {
+                int prefix_diff;
+                art_leaf *l = NULL;
+                if (!prefix_mismatch(node, partial_len, key, key_len, depth, prefix_diff, l))
+                    goto restart;
+                if (prefix_diff < partial_len) {
+                    if (partial_len > MAX_PREFIX_LEN && !l && !(l = any_leaf(node)))
+                        goto restart;
+                    if (!upgrade(parent, parent_v)) goto restart;
+                    if (!upgrade(node, v)) {
+                        write_unlock(parent);
+                        goto restart;
+                    }
+
+                    // A key ending here would go under 0 next to the
+                    // keys under node, which go on with byte c
+                    bool short_prefix = partial_len <= MAX_PREFIX_LEN;
+                    unsigned char c = short_prefix ? node->partial[prefix_diff] : l->key[depth+prefix_diff];
+                    if (depth + prefix_diff == key_len && !c) {
+                        write_unlock(node);
+                        write_unlock(parent);
+                        free(leaf);
+                        *status = ART_KEY_CONFLICT;
+                        return NULL;
+                    }
+
+                    // Put a new node4 above us holding the shared part
+                    art_node4 *new_node = (art_node4*)alloc_node(NODE4);
+                    new_node->n.partial_len = prefix_diff;
+                    memcpy(new_node->n.partial, node->partial, min(MAX_PREFIX_LEN, prefix_diff));
+
+                    // Adjust the prefix of the old node
+                    add_child4(new_node, c, node);
+                    partial_len -= prefix_diff+1;
+                    racy_store(node->partial_len, partial_len);
+                    for (int i = 0; i < min(MAX_PREFIX_LEN, partial_len); i++) {
+                        racy_store(node->partial[i], short_prefix ?
+                                node->partial[i+prefix_diff+1] : l->key[depth+prefix_diff+1+i]);
+                    }
+
+                    if (!leaf) leaf = make_leaf(key, key_len, value);
+                    add_child4(new_node, key_at(key, key_len, depth+prefix_diff), (art_node*)SET_LEAF(leaf));
+                    store_child(*find_child(parent, parent_key), &new_node->n);
+                    write_unlock(node);
+                    write_unlock(parent);
+                    size++;
+                    return NULL;
+                }
+                depth += partial_len;
+            }
+            if (depth > key_len && !check(node, v)) goto restart;
+
+            unsigned char c = key_at(key, key_len, depth);
+            art_node **child = find_child(node, c);
+            art_node *next = child ? load_child(*child) : NULL;
+            if (!check(node, v)) goto restart;
+
+            // No child, the leaf goes within this node
+            if (!next) {
+                if (!leaf) leaf = make_leaf(key, key_len, value);
+                if (!is_full(node)) {
+                    if (!upgrade(node, v)) goto restart;
+                    if (parent && !check(parent, parent_v)) {
+                        write_unlock(node);
+                        goto restart;
+                    }
+                    add_child(node, c, (art_node*)SET_LEAF(leaf));
+                    write_unlock(node);
+                } else {
+                    if (!upgrade(parent, parent_v)) goto restart;
+                    if (!upgrade(node, v)) {
+                        write_unlock(parent);
+                        goto restart;
+                    }
+                    art_node *bigger = copy_node(node, art_grown_type(node->type), -1);
+                    add_child(bigger, c, (art_node*)SET_LEAF(leaf));
+                    store_child(*find_child(parent, parent_key), bigger);
+                    write_unlock(parent);
+                    write_unlock_obsolete(node);
+                    ART_STAT(grows[node->type-1]);
+                    ART_STAT(node_frees[node->type-1]);
+                    reclaimer->retire(version(node));
+                }
+                size++;
+                return NULL;
+            }
+
+            if (parent && !check(parent, parent_v)) goto restart;
+
+            // Past the end of the key only its own leaf may follow
+            if (depth == key_len && !IS_LEAF(next)) {
+                free(leaf);
+                *status = ART_KEY_CONFLICT;
+                return NULL;
+            }
+
+            // If we are at a leaf, we need to replace it with a node
+            if (IS_LEAF(next)) {
+                // Leaves never change their key
+                art_leaf *l = LEAF_RAW(next);
+                if (keys_conflict(l->key, l->key_len, key, key_len)) {
+                    free(leaf);
+                    *status = ART_KEY_CONFLICT;
+                    return NULL;
+                }
+                if (!upgrade(node, v)) goto restart;
+
+                // Check if we are updating an existing value
+                if (!leaf_matches(l, key, key_len)) {
+                    void *old_val = __atomic_load_n(&l->value, __ATOMIC_RELAXED);
+                    if (replace) __atomic_store_n(&l->value, value, __ATOMIC_RELEASE);
+                    write_unlock(node);
+                    free(leaf);
+                    *status = ART_KEY_FOUND;
+                    return old_val;
+                }
+
+                // New value, we must split the leaf into a node4
+                if (!leaf) leaf = make_leaf(key, key_len, value);
+                art_node4 *new_node = (art_node4*)alloc_node(NODE4);
+                int longest_prefix = art_common_prefix(l->key, l->key_len, leaf->key, leaf->key_len, depth+1);
+                new_node->n.partial_len = longest_prefix;
+                memcpy(new_node->n.partial, key+depth+1, min(MAX_PREFIX_LEN, longest_prefix));
+                add_child4(new_node, key_at(l->key, l->key_len, depth+1+longest_prefix), next);
+                add_child4(new_node, key_at(key, key_len, depth+1+longest_prefix), (art_node*)SET_LEAF(leaf));
+                store_child(*child, &new_node->n);
+                write_unlock(node);
+                size++;
+                return NULL;
+            }
+
+            depth++;
+            parent = node;
+            parent_v = v;
+            parent_key = c;
+            node = next;
+            if (!read_lock(node, v)) goto restart;
+        }
+    }
+
+  public:
+    // Uses the given reclaimer, which must outlive the trie,
+    // or its own art_epoch_reclaimer if r is NULL
+    explicit art_trie_olc(art_reclaimer *r = NULL) : size(0) {
+        root = alloc_node(NODE256);
+        owns_reclaimer = (r == NULL);
+        reclaimer = r ? r : new art_epoch_reclaimer();
+    }
+    ~art_trie_olc() {
+        destroy_node(root);
+        if (owns_reclaimer)
+            delete reclaimer;
+    }
+
+    inline uint64_t art_size() {
+        return size.load(std::memory_order_relaxed);
+    }
+
+    // Same contract as art_trie::art_insert, status included,
+    // safe to call from any number of threads
+    void* art_insert(const unsigned char *key, int key_len, void *value, int *status = NULL) {
+        return insert(key, key_len, value, true, status);
+    }
+    void* art_insert_no_replace(const unsigned char *key, int key_len, void *value, int *status = NULL) {
+        return insert(key, key_len, value, false, status);
+    }
+
+    void* art_search(const unsigned char *key, int key_len) {
+        art_reclaim_guard guard(reclaimer);
+        ART_STAT(searches);
+    restart:
+        art_node *node = root;
+        uint64_t v;
+        int depth = 0, levels = 0;
+        if (!read_lock(node, v)) goto restart;
+
+        while (true) {
+            ART_STAT(search_depth);
+            ART_STAT_MAX(max_search_depth, ++levels);
+            // Bail if the prefix does not match
+            int partial_len = racy_load(node->partial_len);
+            if (partial_len) {
+                int prefix_len = check_prefix(node, partial_len, key, key_len, depth);
+                if (prefix_len != min(MAX_PREFIX_LEN, partial_len)) {
+                    if (!check(node, v)) goto restart;
+                    return NULL;
+                }
+                depth = depth + partial_len;
+            }
+            if (depth > key_len) {
+                if (!check(node, v)) goto restart;
+                return NULL;
+            }
+
+            art_node **child = find_child(node, key_at(key, key_len, depth));
+            art_node *next = child ? load_child(*child) : NULL;
+            if (!check(node, v)) goto restart;
+            if (!next) return NULL;
+
+            // Leaves never change their key, only the value
+            if (IS_LEAF(next)) {
+                art_leaf *l = LEAF_RAW(next);
+                if (!leaf_matches(l, key, key_len))
+                    return __atomic_load_n(&l->value, __ATOMIC_ACQUIRE);
+                ART_STAT(leaf_mismatches);
+                return NULL;
+            }
+
+            uint64_t next_v;
+            if (!read_lock(next, next_v)) goto restart;
+            if (!check(node, v)) goto restart;
+            node = next;
+            v = next_v;
+            depth++;
+        }
+    }
+
+    void* art_delete(const unsigned char *key, int key_len) {
+        art_reclaim_guard guard(reclaimer);
+    restart:
+        art_node *parent = NULL, *node = root;
+        uint64_t parent_v = 0, v;
+        unsigned char parent_key = 0;
+        int depth = 0;
+        if (!read_lock(node, v)) goto restart;
+
+        while (true) {
+            // Bail if the prefix does not match
+            int partial_len = racy_load(node->partial_len);
+            if (partial_len) {
+                int prefix_len = check_prefix(node, partial_len, key, key_len, depth);
+                if (prefix_len != min(MAX_PREFIX_LEN, partial_len)) {
+                    if (!check(node, v)) goto restart;
+                    return NULL;
+                }
+                depth = depth + partial_len;
+            }
+            if (depth > key_len) {
+                if (!check(node, v)) goto restart;
+                return NULL;
+            }
+
+            unsigned char c = key_at(key, key_len, depth);
+            art_node **child = find_child(node, c);
+            art_node *next = child ? load_child(*child) : NULL;
+            if (!check(node, v)) goto restart;
+            if (!next) return NULL;
+
+            if (IS_LEAF(next)) {
+                art_leaf *l = LEAF_RAW(next);
+                if (leaf_matches(l, key, key_len)) return NULL;
+
+                if (node->type == NODE4 && racy_load(node->num_children) == 2 && parent) {
+                    // Remove nodes with only a single child left
+                    if (!upgrade(parent, parent_v)) goto restart;
+                    if (!upgrade(node, v)) {
+                        write_unlock(parent);
+                        goto restart;
+                    }
+                    art_node4 *n4 = (art_node4*)node;
+                    int other = n4->keys[0] == c ? 1 : 0;
+                    art_node *second = n4->children[other];
+                    if (IS_LEAF(second)) {
+                        store_child(*find_child(parent, parent_key), second);
+                        write_unlock(parent);
+                    } else {
+                        if (!write_lock(second)) {
+                            write_unlock(node);
+                            write_unlock(parent);
+                            goto restart;
+                        }
+                        store_child(*find_child(parent, parent_key), second);
+                        write_unlock(parent);
+
+                        // Concatenate the prefixes
+                        unsigned char partial[MAX_PREFIX_LEN];
+                        int prefix = node->partial_len;
+                        memcpy(partial, node->partial, min(prefix, MAX_PREFIX_LEN));
+                        if (prefix < MAX_PREFIX_LEN) {
+                            partial[prefix] = n4->keys[other];
+                            prefix++;
+                        }
+                        if (prefix < MAX_PREFIX_LEN) {
+                            int sub_prefix = min(second->partial_len, MAX_PREFIX_LEN - prefix);
+                            memcpy(partial+prefix, second->partial, sub_prefix);
+                            prefix += sub_prefix;
+                        }
+                        for (int i = 0; i < min(prefix, MAX_PREFIX_LEN); i++)
+                            racy_store(second->partial[i], partial[i]);
+                        racy_store(second->partial_len, second->partial_len + node->partial_len + 1);
+                        write_unlock(second);
+                    }
+                    write_unlock_obsolete(node);
+                    ART_STAT(shrinks[NODE4-1]);
+                    ART_STAT(node_frees[NODE4-1]);
+                    reclaimer->retire(version(node));
+                } else if (is_underfull(node) && parent) {
+                    // Shrink into the next smaller node type
+                    if (!upgrade(parent, parent_v)) goto restart;
+                    if (!upgrade(node, v)) {
+                        write_unlock(parent);
+                        goto restart;
+                    }
+                    art_node *smaller = copy_node(node, art_shrunk_type(node->type), c);
+                    store_child(*find_child(parent, parent_key), smaller);
+                    write_unlock(parent);
+                    write_unlock_obsolete(node);
+                    ART_STAT(shrinks[node->type-1]);
+                    ART_STAT(node_frees[node->type-1]);
+                    reclaimer->retire(version(node));
+                } else {
+                    if (!upgrade(node, v)) goto restart;
+                    if (parent && !check(parent, parent_v)) {
+                        write_unlock(node);
+                        goto restart;
+                    }
+                    remove_child(node, c);
+                    write_unlock(node);
+                }
+
+                void *old = __atomic_load_n(&l->value, __ATOMIC_ACQUIRE);
+                ART_STAT(leaf_frees);
+                reclaimer->retire(l);
+                size--;
+                return old;
+            }
+
+            uint64_t next_v;
+            if (!read_lock(next, next_v)) goto restart;
+            if (!check(node, v)) goto restart;
+            depth++;
+            parent = node;
+            parent_v = v;
+            parent_key = c;
+            node = next;
+            v = next_v;
+        }
+    }
+};
+
+} // namespace art
+
+#endif // ifdef ART_OLC_H
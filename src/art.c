@@ -2,8 +2,20 @@
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "art.h"
+#include "art_pattern.h"
+
+#if defined(__APPLE__)
+    #include <malloc/malloc.h>
+#elif defined(__GLIBC__)
+    #include <malloc.h>
+#endif
 
 #ifdef __i386__
     #include <emmintrin.h>
@@ -13,57 +25,322 @@
 #endif
 #endif
 
+/**
+ * Wider compares are built for their own target and
+ * picked when the library loads, so one binary runs
+ * on any x86 and uses what the CPU has.
+ */
+#if (defined(__i386__) || defined(__amd64__)) && defined(__GNUC__)
+    #include <immintrin.h>
+    #define ART_SIMD_DISPATCH
+#endif
+
 /**
  * Macros to manipulate pointer tags
  */
 #define IS_LEAF(x) (((uintptr_t)x & 1))
 #define SET_LEAF(x) ((void*)((uintptr_t)x | 1))
 #define LEAF_RAW(x) ((art_leaf*)((void*)((uintptr_t)x & ~1)))
+#define SET_INLINE(v) ((art_node*)(((uintptr_t)(v) << 1) | 1))
+#define INLINE_VALUE(x) ((void*)((uintptr_t)(x) >> 1))
+
+/**
+ * Hot path counters, one set per thread, compiled
+ * out unless ART_STATS is defined
+ */
+#ifdef ART_STATS
+static __thread art_stats thread_stats;
+#define STAT(field) (thread_stats.field++)
+#define STAT_MAX(field, v) (thread_stats.field < (uint64_t)(v) ? \
+        (void)(thread_stats.field = (v)) : (void)0)
+#else
+#define STAT(field) ((void)0)
+#define STAT_MAX(field, v) ((void)(v))
+#endif
+
+/**
+ * Header of a slab. The node slots follow it.
+ */
+struct art_slab {
+    art_slab *next;
+};
+
+static const size_t node_sizes[] = {
+    0,
+    sizeof(art_node4),
+    sizeof(art_node16),
+    sizeof(art_node48),
+    sizeof(art_node256),
+    sizeof(art_node32)
+};
+
+/**
+ * Takes a slot from the pool, reusing freed
+ * nodes before carving a new one out of the slab.
+ */
+static void* pool_alloc(art_node_pool *p, size_t size) {
+    void *slot = p->free_list;
+    if (slot) {
+        p->free_list = *(void**)slot;
+        return slot;
+    }
+
+    if ((size_t)(p->end - p->bump) < size) {
+        size_t header = (sizeof(art_slab) + 15) & ~(size_t)15;
+        size_t slab_size = ART_SLAB_SIZE;
+        if (slab_size < header + size) slab_size = header + size;
+        art_slab *s = (art_slab*)malloc(slab_size);
+        if (!s) return NULL;
+        s->next = p->slabs;
+        p->slabs = s;
+        p->bump = (char*)s + header;
+        p->end = (char*)s + slab_size;
+    }
+    slot = p->bump;
+    p->bump += size;
+    return slot;
+}
+
+static void pool_free(art_node_pool *p, void *slot) {
+    *(void**)slot = p->free_list;
+    p->free_list = slot;
+}
+
+static void pool_release(art_node_pool *p) {
+    art_slab *s = p->slabs;
+    while (s) {
+        art_slab *next = s->next;
+        free(s);
+        s = next;
+    }
+    memset(p, 0, sizeof(art_node_pool));
+}
+
+/**
+ * Rounds a leaf allocation up to its size class.
+ */
+static size_t leaf_alloc_size(uint32_t key_len) {
+    return (sizeof(art_leaf) + key_len + 7) & ~(size_t)7;
+}
+
+/**
+ * Takes space for a leaf from the arena, reusing
+ * deleted leaves of the same size first.
+ */
+static void* arena_alloc(art_leaf_arena *a, size_t size) {
+    void **head;
+    size_t cls = size / 8 - 1;
+    if (cls < ART_ARENA_CLASSES) {
+        head = &a->free_lists[cls];
+    } else {
+        // Oversized leaves are reused only on an exact size match
+        head = &a->large_free;
+        while (*head && ((size_t*)*head)[1] != size)
+            head = (void**)*head;
+    }
+    void *slot = *head;
+    if (slot) {
+        *head = *(void**)slot;
+        return slot;
+    }
+
+    if ((size_t)(a->end - a->bump) < size) {
+        size_t header = (sizeof(art_slab) + 15) & ~(size_t)15;
+        size_t chunk_size = ART_ARENA_CHUNK_SIZE;
+        art_slab *s;
+        if (chunk_size < header + size) {
+            // Give a huge leaf a chunk of its own and keep
+            // bumping through the current one
+            s = (art_slab*)malloc(header + size);
+            if (!s) return NULL;
+            if (a->chunks) {
+                s->next = a->chunks->next;
+                a->chunks->next = s;
+            } else {
+                s->next = NULL;
+                a->chunks = s;
+            }
+            return (char*)s + header;
+        }
+        s = (art_slab*)malloc(chunk_size);
+        if (!s) return NULL;
+        s->next = a->chunks;
+        a->chunks = s;
+        a->bump = (char*)s + header;
+        a->end = (char*)s + chunk_size;
+    }
+    slot = a->bump;
+    a->bump += size;
+    return slot;
+}
+
+static void arena_free(art_leaf_arena *a, void *slot, size_t size) {
+    size_t cls = size / 8 - 1;
+    if (cls < ART_ARENA_CLASSES) {
+        *(void**)slot = a->free_lists[cls];
+        a->free_lists[cls] = slot;
+    } else {
+        ((size_t*)slot)[1] = size;
+        *(void**)slot = a->large_free;
+        a->large_free = slot;
+    }
+}
+
+static void arena_release(art_leaf_arena *a) {
+    art_slab *s = a->chunks;
+    while (s) {
+        art_slab *next = s->next;
+        free(s);
+        s = next;
+    }
+    memset(a, 0, sizeof(art_leaf_arena));
+}
+
+/**
+ * With ART_SUBTREE_COUNT every inner node is preceded
+ * by the number of leaves below it.
+ */
+#define NODE_COUNT(n) (((uint64_t*)(n))[-1])
+
+/**
+ * With ART_MAX_SCORE it is also preceded by the highest
+ * score below it, in front of the count if there is one.
+ */
+#define NODE_SCORE(t, n) (((uint64_t*)(n))[((t)->flags & ART_SUBTREE_COUNT) ? -2 : -1])
+
+/**
+ * Returns the size of the words in front of each node.
+ */
+static inline size_t node_header(const art_tree *t) {
+    return sizeof(uint64_t) * (((t->flags & ART_SUBTREE_COUNT) ? 1 : 0) +
+            ((t->flags & ART_MAX_SCORE) ? 1 : 0));
+}
+
+/**
+ * Returns the start of the allocation holding a node.
+ */
+static inline void* node_base(const art_tree *t, art_node *n) {
+    return (char*)n - node_header(t);
+}
 
 /**
  * Allocates a node of the given type,
  * initializes to zero and sets the type.
  */
-static art_node* alloc_node(uint8_t type) {
-    art_node* n;
-    switch (type) {
-        case NODE4:
-            n = (art_node*)calloc(1, sizeof(art_node4));
-            break;
-        case NODE16:
-            n = (art_node*)calloc(1, sizeof(art_node16));
-            break;
-        case NODE48:
-            n = (art_node*)calloc(1, sizeof(art_node48));
-            break;
-        case NODE256:
-            n = (art_node*)calloc(1, sizeof(art_node256));
-            break;
-        default:
-            abort();
+static art_node* alloc_node(art_tree *t, uint8_t type) {
+    char *p;
+    if (type < NODE4 || type > ART_NODE_TYPES) abort();
+    size_t header = node_header(t);
+    size_t size = header + node_sizes[type];
+    if (t->pools) {
+        p = (char*)pool_alloc(&t->pools[type-1], size);
+        if (p) memset(p, 0, size);
+    } else {
+        p = (char*)calloc(1, size);
     }
+    art_node *n = (art_node*)(p + header);
     n->type = type;
+    STAT(node_allocs[type-1]);
     return n;
 }
 
+/**
+ * Returns a node to its pool or to malloc.
+ */
+static void free_node(art_tree *t, art_node *n) {
+    STAT(node_frees[n->type-1]);
+    if (t->pools)
+        pool_free(&t->pools[n->type-1], node_base(t, n));
+    else
+        free(node_base(t, n));
+}
+
+/**
+ * Returns a leaf to the arena or to malloc.
+ */
+static void free_leaf(art_tree *t, art_leaf *l) {
+    STAT(leaf_frees);
+    if (t->arena)
+        arena_free(t->arena, l, leaf_alloc_size(l->key_len));
+    else
+        free(l);
+}
+
 /**
  * Initializes an ART tree
  * @return 0 on success.
  */
 int art_tree_init(art_tree *t) {
+    return art_tree_init_flags(t, 0);
+}
+
+/**
+ * Initializes an ART tree with optional behaviour.
+ * @return 0 on success.
+ */
+int art_tree_init_flags(art_tree *t, int flags) {
     t->root = NULL;
     t->size = 0;
+    t->flags = flags;
+    t->pools = NULL;
+    t->arena = NULL;
+    t->loader = NULL;
+    t->loader_data = NULL;
+    t->scorer = NULL;
+    t->scorer_data = NULL;
+    t->mods = 0;
+    if (flags & ART_NODE_POOL) {
+        t->pools = (art_node_pool*)calloc(ART_NODE_TYPES, sizeof(art_node_pool));
+        if (!t->pools) return -1;
+    }
+    if (flags & ART_LEAF_ARENA) {
+        t->arena = (art_leaf_arena*)calloc(1, sizeof(art_leaf_arena));
+        if (!t->arena) {
+            free(t->pools);
+            t->pools = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Initializes an ART tree that keeps values inline.
+ * @return 0 on success.
+ */
+int art_tree_init_inline(art_tree *t, int flags, art_key_loader loader, void *data) {
+    if (!loader) return -1;
+
+    // There are no leaves to put in an arena
+    int res = art_tree_init_flags(t, (flags | ART_INLINE_VALUES) & ~ART_LEAF_ARENA);
+    if (res) return res;
+    t->loader = loader;
+    t->loader_data = data;
+    return 0;
+}
+
+/**
+ * Initializes an ART tree that scores values with a callback.
+ * @return 0 on success.
+ */
+int art_tree_init_scored(art_tree *t, int flags, art_scorer scorer, void *data) {
+    if (!scorer) return -1;
+    int res = art_tree_init_flags(t, flags | ART_MAX_SCORE);
+    if (res) return res;
+    t->scorer = scorer;
+    t->scorer_data = data;
     return 0;
 }
 
 // Recursively destroys the tree
-static void destroy_node(art_node *n) {
+static void destroy_node(art_tree *t, art_node *n) {
     // Break if null
     if (!n) return;
 
-    // Special case leafs
+    // Special case leafs, arena leaves go away
+    // with their chunks and inline ones have none
     if (IS_LEAF(n)) {
-        free(LEAF_RAW(n));
+        if (!t->arena && !(t->flags & ART_INLINE_VALUES)) free(LEAF_RAW(n));
         return;
     }
 
@@ -74,19 +351,27 @@ static void destroy_node(art_node *n) {
         art_node16 *p2;
         art_node48 *p3;
         art_node256 *p4;
+        art_node32 *p5;
     } p;
     switch (n->type) {
         case NODE4:
             p.p1 = (art_node4*)n;
             for (i=0;i<n->num_children;i++) {
-                destroy_node(p.p1->children[i]);
+                destroy_node(t, p.p1->children[i]);
             }
             break;
 
         case NODE16:
             p.p2 = (art_node16*)n;
             for (i=0;i<n->num_children;i++) {
-                destroy_node(p.p2->children[i]);
+                destroy_node(t, p.p2->children[i]);
+            }
+            break;
+
+        case NODE32:
+            p.p5 = (art_node32*)n;
+            for (i=0;i<n->num_children;i++) {
+                destroy_node(t, p.p5->children[i]);
             }
             break;
 
@@ -95,7 +380,7 @@ static void destroy_node(art_node *n) {
             for (i=0;i<256;i++) {
                 idx = ((art_node48*)n)->keys[i]; 
                 if (!idx) continue; 
-                destroy_node(p.p3->children[idx-1]);
+                destroy_node(t, p.p3->children[idx-1]);
             }
             break;
 
@@ -103,7 +388,7 @@ static void destroy_node(art_node *n) {
             p.p4 = (art_node256*)n;
             for (i=0;i<256;i++) {
                 if (p.p4->children[i])
-                    destroy_node(p.p4->children[i]);
+                    destroy_node(t, p.p4->children[i]);
             }
             break;
 
@@ -111,8 +396,9 @@ static void destroy_node(art_node *n) {
             abort();
     }
 
-    // Free ourself on the way up
-    free(n);
+    // Free ourself on the way up, pooled
+    // nodes go away with their slabs
+    if (!t->pools) free(node_base(t, n));
 }
 
 /**
@@ -120,7 +406,21 @@ static void destroy_node(art_node *n) {
  * @return 0 on success.
  */
 int art_tree_destroy(art_tree *t) {
-    destroy_node(t->root);
+    // Nothing to walk if every node lives in a pool
+    // and every leaf in the arena, or inline
+    if (!t->pools || !(t->arena || (t->flags & ART_INLINE_VALUES)))
+        destroy_node(t, t->root);
+    if (t->pools) {
+        for (int i=0;i<ART_NODE_TYPES;i++)
+            pool_release(&t->pools[i]);
+        free(t->pools);
+        t->pools = NULL;
+    }
+    if (t->arena) {
+        arena_release(t->arena);
+        free(t->arena);
+        t->arena = NULL;
+    }
     return 0;
 }
 
@@ -132,6 +432,54 @@ int art_tree_destroy(art_tree *t) {
 extern inline uint64_t art_size(art_tree *t);
 #endif
 
+/**
+ * Returns a bitmask of the keys of an
+ * art_node32 that are equal to c.
+ */
+static unsigned match32_base(const unsigned char *keys, unsigned char c) {
+#if defined(__i386__) || defined(__amd64__)
+    // Two 16 byte compares
+    __m128i key = _mm_set1_epi8(c);
+    unsigned lo = _mm_movemask_epi8(_mm_cmpeq_epi8(key,
+                _mm_loadu_si128((const __m128i*)keys)));
+    unsigned hi = _mm_movemask_epi8(_mm_cmpeq_epi8(key,
+                _mm_loadu_si128((const __m128i*)(keys + 16))));
+    return lo | hi << 16;
+#else
+    unsigned bitfield = 0;
+    for (int i = 0; i < 32; ++i) {
+        if (keys[i] == c)
+            bitfield |= (1u << i);
+    }
+    return bitfield;
+#endif
+}
+
+#ifdef ART_SIMD_DISPATCH
+// One 32 byte compare
+__attribute__((target("avx2")))
+static unsigned match32_avx2(const unsigned char *keys, unsigned char c) {
+    __m256i cmp = _mm256_cmpeq_epi8(_mm256_set1_epi8(c),
+            _mm256_loadu_si256((const __m256i*)keys));
+    return _mm256_movemask_epi8(cmp);
+}
+#endif
+
+/**
+ * The art_node32 compare in use, picked once when the
+ * library loads so lookups make a plain indirect call.
+ */
+static unsigned (*match32)(const unsigned char *keys, unsigned char c) = match32_base;
+
+#ifdef ART_SIMD_DISPATCH
+__attribute__((constructor))
+static void detect_simd(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        match32 = match32_avx2;
+}
+#endif
+
 static art_node** find_child(art_node *n, unsigned char c) {
     int i, mask, bitfield;
     union {
@@ -139,10 +487,23 @@ static art_node** find_child(art_node *n, unsigned char c) {
         art_node16 *p2;
         art_node48 *p3;
         art_node256 *p4;
+        art_node32 *p5;
     } p;
     switch (n->type) {
         case NODE4:
             p.p1 = (art_node4*)n;
+            #if defined(__i386__) || defined(__amd64__)
+            {
+                // Compare the key to all 4 stored keys at once
+                uint32_t keys;
+                memcpy(&keys, p.p1->keys, 4);
+                bitfield = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(c),
+                            _mm_cvtsi32_si128(keys)));
+                bitfield &= (1 << n->num_children) - 1;
+                if (bitfield)
+                    return &p.p1->children[__builtin_ctz(bitfield)];
+            }
+            #else
             for (i=0 ; i < n->num_children; i++) {
 		/* this cast works around a bug in gcc 5.1 when unrolling loops
 		 * https://gcc.gnu.org/bugzilla/show_bug.cgi?id=59124
@@ -150,6 +511,7 @@ static art_node** find_child(art_node *n, unsigned char c) {
                 if (((unsigned char*)p.p1->keys)[i] == c)
                     return &p.p1->children[i];
             }
+            #endif
             break;
 
         {
@@ -200,6 +562,18 @@ static art_node** find_child(art_node *n, unsigned char c) {
             break;
         }
 
+        case NODE32: {
+            p.p5 = (art_node32*)n;
+            unsigned matches = match32(p.p5->keys, c);
+
+            // Use a mask to ignore children that don't exist
+            if (n->num_children < 32)
+                matches &= (1u << n->num_children) - 1;
+            if (matches)
+                return &p.p5->children[__builtin_ctz(matches)];
+            break;
+        }
+
         case NODE48:
             p.p3 = (art_node48*)n;
             i = p.p3->keys[c];
@@ -238,17 +612,49 @@ static int check_prefix(const art_node *n, const unsigned char *key, int key_len
     return idx;
 }
 
+/**
+ * Returns the key of a leaf child, read from the
+ * leaf or, for inline values, from the loader.
+ */
+static inline const unsigned char* leaf_key(const art_tree *t, const art_node *n, uint32_t *key_len) {
+    if (t->flags & ART_INLINE_VALUES)
+        return t->loader(t->loader_data, INLINE_VALUE(n), key_len);
+    *key_len = LEAF_RAW(n)->key_len;
+    return LEAF_RAW(n)->key;
+}
+
+/**
+ * Returns the byte of a key at depth. A key reads as if it
+ * ended in a 0 byte, so one key may be a prefix of another
+ * without reading past either. Inserts refuse a key that
+ * is another one followed by a 0 byte, see keys_conflict.
+ */
+static inline unsigned char key_at(const unsigned char *key, int key_len, int depth) {
+    return depth < key_len ? key[depth] : 0;
+}
+
+/**
+ * Returns the value of a leaf child.
+ */
+static inline void* leaf_value(const art_tree *t, const art_node *n) {
+    if (t->flags & ART_INLINE_VALUES)
+        return INLINE_VALUE(n);
+    return LEAF_RAW(n)->value;
+}
+
 /**
  * Checks if a leaf matches
  * @return 0 on success.
  */
-static int leaf_matches(const art_leaf *n, const unsigned char *key, int key_len, int depth) {
-    (void)depth;
+static int leaf_matches(const art_tree *t, const art_node *n, const unsigned char *key, int key_len) {
+    uint32_t n_len;
+    const unsigned char *n_key = leaf_key(t, n, &n_len);
+
     // Fail if the key lengths are different
-    if (n->key_len != (uint32_t)key_len) return 1;
+    if (n_len != (uint32_t)key_len) return 1;
 
-    // Compare the keys starting at the depth
-    return memcmp(n->key, key, key_len);
+    // Compare the keys
+    return memcmp(n_key, key, key_len);
 }
 
 /**
@@ -262,60 +668,249 @@ static int leaf_matches(const art_leaf *n, const unsigned char *key, int key_len
 void* art_search(const art_tree *t, const unsigned char *key, int key_len) {
     art_node **child;
     art_node *n = t->root;
-    int prefix_len, depth = 0;
+    int prefix_len, depth = 0, levels = 0;
+    int optimistic = t->flags & ART_OPTIMISTIC_PREFIX;
+    STAT(searches);
     while (n) {
         // Might be a leaf
         if (IS_LEAF(n)) {
-            n = (art_node*)LEAF_RAW(n);
             // Check if the expanded path matches
-            if (!leaf_matches((art_leaf*)n, key, key_len, depth)) {
-                return ((art_leaf*)n)->value;
+            if (!leaf_matches(t, n, key, key_len)) {
+                return leaf_value(t, n);
             }
+            STAT(leaf_mismatches);
             return NULL;
         }
+        STAT(search_depth);
+        STAT_MAX(max_search_depth, ++levels);
 
-        // Bail if the prefix does not match
+        // Bail if the prefix does not match, unless the
+        // leaf is left to catch it
         if (n->partial_len) {
-            prefix_len = check_prefix(n, key, key_len, depth);
-            if (prefix_len != min(MAX_PREFIX_LEN, n->partial_len))
-                return NULL;
+            if (!optimistic) {
+                prefix_len = check_prefix(n, key, key_len, depth);
+                if (prefix_len != min(MAX_PREFIX_LEN, n->partial_len))
+                    return NULL;
+            }
             depth = depth + n->partial_len;
         }
 
+        // The key may end inside a prefix longer than the stored part
+        if (depth > key_len)
+            return NULL;
+
         // Recursively search
-        child = find_child(n, key[depth]);
+        child = find_child(n, key_at(key, key_len, depth));
         n = (child) ? *child : NULL;
         depth++;
     }
     return NULL;
 }
 
-// Find the minimum leaf under a node
-static art_leaf* minimum(const art_node *n) {
+/**
+ * State of one lookup in art_search_batch
+ */
+typedef struct {
+    const art_node *n;
+    int depth;
+    int idx;
+} batch_state;
+
+static inline void prefetch_node(const art_node *n) {
+    if (IS_LEAF(n)) {
+        __builtin_prefetch(LEAF_RAW(n));
+    } else {
+        __builtin_prefetch(n);
+        __builtin_prefetch((const char*)n + 64);
+    }
+}
+
+/**
+ * Searches for many keys at once, keeping up to
+ * ART_BATCH_WINDOW lookups in flight. Each pass moves every
+ * lookup down one level and prefetches the node it lands on,
+ * so by the time we come back to it the node is in cache.
+ * @return The number of keys found.
+ */
+int art_search_batch(const art_tree *t, const unsigned char **keys, const int *key_lens, int n, void **values) {
+    batch_state s[ART_BATCH_WINDOW];
+    int next = 0, active = 0, found = 0;
+    int i, prefix_len;
+    int optimistic = t->flags & ART_OPTIMISTIC_PREFIX;
+
+    if (!t->root) {
+        for (i=0;i<n;i++) values[i] = NULL;
+        return 0;
+    }
+
+    for (i=0; i < ART_BATCH_WINDOW; i++) {
+        if (next < n) {
+            s[i].n = t->root;
+            s[i].depth = 0;
+            s[i].idx = next++;
+            active++;
+        } else {
+            s[i].idx = -1;
+        }
+    }
+    prefetch_node(t->root);
+
+    while (active) {
+        for (i=0; i < ART_BATCH_WINDOW; i++) {
+            batch_state *b = &s[i];
+            if (b->idx < 0) continue;
+
+            const unsigned char *key = keys[b->idx];
+            int key_len = key_lens[b->idx];
+            const art_node *node = b->n;
+            void *value = NULL;
+
+            // Advance this lookup by one node
+            if (IS_LEAF(node)) {
+                if (!leaf_matches(t, node, key, key_len)) {
+                    value = leaf_value(t, node);
+                    found++;
+                }
+            } else {
+                int depth = b->depth;
+                int match = 1;
+                if (node->partial_len) {
+                    if (!optimistic) {
+                        prefix_len = check_prefix(node, key, key_len, depth);
+                        match = prefix_len == min(MAX_PREFIX_LEN, node->partial_len);
+                    }
+                    depth = depth + node->partial_len;
+                }
+                if (match && depth <= key_len) {
+                    art_node **child = find_child((art_node*)node, key_at(key, key_len, depth));
+                    if (child && *child) {
+                        b->n = *child;
+                        b->depth = depth + 1;
+                        prefetch_node(b->n);
+                        continue;
+                    }
+                }
+            }
+
+            // Done with this key, start the next one in its slot
+            values[b->idx] = value;
+            if (next < n) {
+                b->n = t->root;
+                b->depth = 0;
+                b->idx = next++;
+            } else {
+                b->idx = -1;
+                active--;
+            }
+        }
+    }
+    return found;
+}
+
+/**
+ * Checks if the key of a leaf is a prefix of key
+ * @return The length of the leaf key, or -1 if it is not.
+ */
+static int leaf_prefix_of(const art_tree *t, const art_node *n, const unsigned char *key, int key_len) {
+    uint32_t n_len;
+    const unsigned char *n_key = leaf_key(t, n, &n_len);
+    if (n_len > (uint32_t)key_len || memcmp(n_key, key, n_len))
+        return -1;
+    return n_len;
+}
+
+/**
+ * Finds the longest stored key that is a prefix of key.
+ * A key that ends at an inner node sits under its 0 byte,
+ * so each node on the path of key is a chance to pick up
+ * a shorter match on the way down.
+ */
+void* art_longest_prefix_match(const art_tree *t, const unsigned char *key, int key_len, int *match_len) {
+    art_node **child;
+    art_node *n = t->root;
+    const art_node *best = NULL;
+    int prefix_len, len, best_len = -1, depth = 0;
+    int optimistic = t->flags & ART_OPTIMISTIC_PREFIX;
+    while (n) {
+        if (IS_LEAF(n)) {
+            len = leaf_prefix_of(t, n, key, key_len);
+            if (len > best_len) {
+                best = n;
+                best_len = len;
+            }
+            break;
+        }
+
+        // Nothing below a mismatched prefix is a prefix of the
+        // key. Optimistic nodes are skipped, as every candidate
+        // is checked against the key anyway.
+        if (n->partial_len) {
+            if (!optimistic) {
+                prefix_len = check_prefix(n, key, key_len, depth);
+                if (prefix_len != min(MAX_PREFIX_LEN, n->partial_len))
+                    break;
+            }
+            depth = depth + n->partial_len;
+        }
+        if (depth > key_len)
+            break;
+
+        // A key ending at this depth
+        child = find_child(n, 0);
+        if (child && IS_LEAF(*child)) {
+            len = leaf_prefix_of(t, *child, key, key_len);
+            if (len > best_len) {
+                best = *child;
+                best_len = len;
+            }
+        }
+        if (depth == key_len)
+            break;
+
+        child = find_child(n, key[depth]);
+        n = (child) ? *child : NULL;
+        depth++;
+    }
+    if (!best)
+        return NULL;
+    if (match_len)
+        *match_len = best_len;
+    return leaf_value(t, best);
+}
+
+// Find the minimum leaf child under a node, still tagged
+static const art_node* min_child(const art_node *n) {
     // Handle base cases
     if (!n) return NULL;
-    if (IS_LEAF(n)) return LEAF_RAW(n);
+    if (IS_LEAF(n)) return n;
 
     int idx;
     switch (n->type) {
         case NODE4:
-            return minimum(((const art_node4*)n)->children[0]);
+            return min_child(((const art_node4*)n)->children[0]);
         case NODE16:
-            return minimum(((const art_node16*)n)->children[0]);
+            return min_child(((const art_node16*)n)->children[0]);
+        case NODE32:
+            return min_child(((const art_node32*)n)->children[0]);
         case NODE48:
             idx=0;
             while (!((const art_node48*)n)->keys[idx]) idx++;
             idx = ((const art_node48*)n)->keys[idx] - 1;
-            return minimum(((const art_node48*)n)->children[idx]);
+            return min_child(((const art_node48*)n)->children[idx]);
         case NODE256:
             idx=0;
             while (!((const art_node256*)n)->children[idx]) idx++;
-            return minimum(((const art_node256*)n)->children[idx]);
+            return min_child(((const art_node256*)n)->children[idx]);
         default:
             abort();
     }
 }
 
+// Find the minimum leaf under a node
+static art_leaf* minimum(const art_node *n) {
+    return LEAF_RAW(min_child(n));
+}
+
 // Find the maximum leaf under a node
 static art_leaf* maximum(const art_node *n) {
     // Handle base cases
@@ -328,6 +923,8 @@ static art_leaf* maximum(const art_node *n) {
             return maximum(((const art_node4*)n)->children[n->num_children-1]);
         case NODE16:
             return maximum(((const art_node16*)n)->children[n->num_children-1]);
+        case NODE32:
+            return maximum(((const art_node32*)n)->children[n->num_children-1]);
         case NODE48:
             idx=255;
             while (!((const art_node48*)n)->keys[idx]) idx--;
@@ -346,6 +943,7 @@ static art_leaf* maximum(const art_node *n) {
  * Returns the minimum valued leaf
  */
 art_leaf* art_minimum(art_tree *t) {
+    if (t->flags & ART_INLINE_VALUES) return NULL;
     return minimum((art_node*)t->root);
 }
 
@@ -353,40 +951,62 @@ art_leaf* art_minimum(art_tree *t) {
  * Returns the maximum valued leaf
  */
 art_leaf* art_maximum(art_tree *t) {
+    if (t->flags & ART_INLINE_VALUES) return NULL;
     return maximum((art_node*)t->root);
 }
 
-static art_leaf* make_leaf(const unsigned char *key, int key_len, void *value) {
-    art_leaf *l = (art_leaf*)calloc(1, sizeof(art_leaf)+key_len);
+static art_leaf* make_leaf(art_tree *t, const unsigned char *key, int key_len, void *value) {
+    art_leaf *l;
+    if (t->arena)
+        l = (art_leaf*)arena_alloc(t->arena, leaf_alloc_size(key_len));
+    else
+        l = (art_leaf*)calloc(1, sizeof(art_leaf)+key_len);
+    STAT(leaf_allocs);
     l->value = value;
     l->key_len = key_len;
     memcpy(l->key, key, key_len);
     return l;
 }
 
-static int longest_common_prefix(art_leaf *l1, art_leaf *l2, int depth) {
-    int max_cmp = min(l1->key_len, l2->key_len) - depth;
+/**
+ * Makes the child for a new key: a tagged leaf,
+ * or the tagged value itself in an inline tree.
+ */
+static art_node* new_leaf(art_tree *t, const unsigned char *key, int key_len, void *value) {
+    if (t->flags & ART_INLINE_VALUES)
+        return SET_INLINE(value);
+    return (art_node*)SET_LEAF(make_leaf(t, key, key_len, value));
+}
+
+static int longest_common_prefix(const unsigned char *k1, int k1_len,
+        const unsigned char *k2, int k2_len, int depth) {
+    int max_cmp = min(k1_len, k2_len) - depth;
     int idx;
     for (idx=0; idx < max_cmp; idx++) {
-        if (l1->key[depth+idx] != l2->key[depth+idx])
+        if (k1[depth+idx] != k2[depth+idx])
             return idx;
     }
     return idx;
 }
 
-static void copy_header(art_node *dest, art_node *src) {
+static void copy_header(const art_tree *t, art_node *dest, art_node *src) {
+    if (t->flags & ART_SUBTREE_COUNT)
+        NODE_COUNT(dest) = NODE_COUNT(src);
+    if (t->flags & ART_MAX_SCORE)
+        NODE_SCORE(t, dest) = NODE_SCORE(t, src);
     dest->num_children = src->num_children;
     dest->partial_len = src->partial_len;
     memcpy(dest->partial, src->partial, min(MAX_PREFIX_LEN, src->partial_len));
 }
 
-static void add_child256(art_node256 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child256(art_tree *t, art_node256 *n, art_node **ref, unsigned char c, void *child) {
+    (void)t;
     (void)ref;
     n->n.num_children++;
     n->children[c] = (art_node*)child;
 }
 
-static void add_child48(art_node48 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child48(art_tree *t, art_node48 *n, art_node **ref, unsigned char c, void *child) {
     if (n->n.num_children < 48) {
         int pos = 0;
         while (n->children[pos]) pos++;
@@ -394,20 +1014,55 @@ static void add_child48(art_node48 *n, art_node **ref, unsigned char c, void *ch
         n->keys[c] = pos + 1;
         n->n.num_children++;
     } else {
-        art_node256 *new_node = (art_node256*)alloc_node(NODE256);
+        STAT(grows[NODE48-1]);
+        art_node256 *new_node = (art_node256*)alloc_node(t, NODE256);
         for (int i=0;i<256;i++) {
             if (n->keys[i]) {
                 new_node->children[i] = n->children[n->keys[i] - 1];
             }
         }
-        copy_header((art_node*)new_node, (art_node*)n);
+        copy_header(t, (art_node*)new_node, (art_node*)n);
+        *ref = (art_node*)new_node;
+        free_node(t, (art_node*)n);
+        add_child256(t, new_node, ref, c, child);
+    }
+}
+
+static void add_child32(art_tree *t, art_node32 *n, art_node **ref, unsigned char c, void *child) {
+    if (n->n.num_children < 32) {
+        int idx;
+        for (idx=0; idx < n->n.num_children; idx++) {
+            if (c < n->keys[idx]) break;
+        }
+
+        // Shift to make room
+        memmove(n->keys+idx+1, n->keys+idx, n->n.num_children - idx);
+        memmove(n->children+idx+1, n->children+idx,
+                (n->n.num_children - idx)*sizeof(void*));
+
+        // Insert element
+        n->keys[idx] = c;
+        n->children[idx] = (art_node*)child;
+        n->n.num_children++;
+
+    } else {
+        STAT(grows[NODE32-1]);
+        art_node48 *new_node = (art_node48*)alloc_node(t, NODE48);
+
+        // Copy the child pointers and populate the key map
+        memcpy(new_node->children, n->children,
+                sizeof(void*)*n->n.num_children);
+        for (int i=0;i<n->n.num_children;i++) {
+            new_node->keys[n->keys[i]] = i + 1;
+        }
+        copy_header(t, (art_node*)new_node, (art_node*)n);
         *ref = (art_node*)new_node;
-        free(n);
-        add_child256(new_node, ref, c, child);
+        free_node(t, (art_node*)n);
+        add_child48(t, new_node, ref, c, child);
     }
 }
 
-static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child16(art_tree *t, art_node16 *n, art_node **ref, unsigned char c, void *child) {
     if (n->n.num_children < 16) {
         unsigned mask = (1 << n->n.num_children) - 1;
         
@@ -415,9 +1070,10 @@ static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *ch
         #ifdef __i386__
             __m128i cmp;
 
-            // Compare the key to all 16 stored keys
-            cmp = _mm_cmplt_epi8(_mm_set1_epi8(c),
-                    _mm_loadu_si128((__m128i*)n->keys));
+            // Compare the key to all 16 stored keys, flipping the
+            // sign bits so the signed compare orders bytes unsigned
+            cmp = _mm_cmplt_epi8(_mm_set1_epi8(c ^ 0x80),
+                    _mm_xor_si128(_mm_loadu_si128((__m128i*)n->keys), _mm_set1_epi8((char)0x80)));
 
             // Use a mask to ignore children that don't exist
             unsigned bitfield = _mm_movemask_epi8(cmp) & mask;
@@ -425,9 +1081,10 @@ static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *ch
         #ifdef __amd64__
             __m128i cmp;
 
-            // Compare the key to all 16 stored keys
-            cmp = _mm_cmplt_epi8(_mm_set1_epi8(c),
-                    _mm_loadu_si128((__m128i*)n->keys));
+            // Compare the key to all 16 stored keys, flipping the
+            // sign bits so the signed compare orders bytes unsigned
+            cmp = _mm_cmplt_epi8(_mm_set1_epi8(c ^ 0x80),
+                    _mm_xor_si128(_mm_loadu_si128((__m128i*)n->keys), _mm_set1_epi8((char)0x80)));
 
             // Use a mask to ignore children that don't exist
             unsigned bitfield = _mm_movemask_epi8(cmp) & mask;
@@ -460,22 +1117,22 @@ static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *ch
         n->n.num_children++;
 
     } else {
-        art_node48 *new_node = (art_node48*)alloc_node(NODE48);
+        STAT(grows[NODE16-1]);
+        art_node32 *new_node = (art_node32*)alloc_node(t, NODE32);
 
-        // Copy the child pointers and populate the key map
+        // Copy the child pointers and the key map
         memcpy(new_node->children, n->children,
                 sizeof(void*)*n->n.num_children);
-        for (int i=0;i<n->n.num_children;i++) {
-            new_node->keys[n->keys[i]] = i + 1;
-        }
-        copy_header((art_node*)new_node, (art_node*)n);
-        *ref = (art_node*)new_node;
-        free(n);
-        add_child48(new_node, ref, c, child);
+        memcpy(new_node->keys, n->keys,
+                sizeof(unsigned char)*n->n.num_children);
+        copy_header(t, (art_node*)new_node, (art_node*)n);
+        *ref = (art_node*)new_node;
+        free_node(t, (art_node*)n);
+        add_child32(t, new_node, ref, c, child);
     }
 }
 
-static void add_child4(art_node4 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child4(art_tree *t, art_node4 *n, art_node **ref, unsigned char c, void *child) {
     if (n->n.num_children < 4) {
         int idx;
         for (idx=0; idx < n->n.num_children; idx++) {
@@ -493,30 +1150,33 @@ static void add_child4(art_node4 *n, art_node **ref, unsigned char c, void *chil
         n->n.num_children++;
 
     } else {
-        art_node16 *new_node = (art_node16*)alloc_node(NODE16);
+        STAT(grows[NODE4-1]);
+        art_node16 *new_node = (art_node16*)alloc_node(t, NODE16);
 
         // Copy the child pointers and the key map
         memcpy(new_node->children, n->children,
                 sizeof(void*)*n->n.num_children);
         memcpy(new_node->keys, n->keys,
                 sizeof(unsigned char)*n->n.num_children);
-        copy_header((art_node*)new_node, (art_node*)n);
+        copy_header(t, (art_node*)new_node, (art_node*)n);
         *ref = (art_node*)new_node;
-        free(n);
-        add_child16(new_node, ref, c, child);
+        free_node(t, (art_node*)n);
+        add_child16(t, new_node, ref, c, child);
     }
 }
 
-static void add_child(art_node *n, art_node **ref, unsigned char c, void *child) {
+static void add_child(art_tree *t, art_node *n, art_node **ref, unsigned char c, void *child) {
     switch (n->type) {
         case NODE4:
-            return add_child4((art_node4*)n, ref, c, child);
+            return add_child4(t, (art_node4*)n, ref, c, child);
         case NODE16:
-            return add_child16((art_node16*)n, ref, c, child);
+            return add_child16(t, (art_node16*)n, ref, c, child);
+        case NODE32:
+            return add_child32(t, (art_node32*)n, ref, c, child);
         case NODE48:
-            return add_child48((art_node48*)n, ref, c, child);
+            return add_child48(t, (art_node48*)n, ref, c, child);
         case NODE256:
-            return add_child256((art_node256*)n, ref, c, child);
+            return add_child256(t, (art_node256*)n, ref, c, child);
         default:
             abort();
     }
@@ -525,7 +1185,7 @@ static void add_child(art_node *n, art_node **ref, unsigned char c, void *child)
 /**
  * Calculates the index at which the prefixes mismatch
  */
-static int prefix_mismatch(const art_node *n, const unsigned char *key, int key_len, int depth) {
+static int prefix_mismatch(const art_tree *t, const art_node *n, const unsigned char *key, int key_len, int depth) {
     int max_cmp = min(min(MAX_PREFIX_LEN, n->partial_len), key_len - depth);
     int idx;
     for (idx=0; idx < max_cmp; idx++) {
@@ -536,99 +1196,259 @@ static int prefix_mismatch(const art_node *n, const unsigned char *key, int key_
     // If the prefix is short we can avoid finding a leaf
     if (n->partial_len > MAX_PREFIX_LEN) {
         // Prefix is longer than what we've checked, find a leaf
-        art_leaf *l = minimum(n);
-        max_cmp = min(l->key_len, key_len)- depth;
+        STAT(prefix_leaf_reads);
+        uint32_t l_len;
+        const unsigned char *l_key = leaf_key(t, min_child(n), &l_len);
+        max_cmp = min(l_len, key_len)- depth;
         for (; idx < max_cmp; idx++) {
-            if (l->key[idx+depth] != key[depth+idx])
+            if (l_key[idx+depth] != key[depth+idx])
                 return idx;
         }
     }
     return idx;
 }
 
-static void* recursive_insert(art_node *n, art_node **ref, const unsigned char *key, int key_len, void *value, int depth, int *old, int replace) {
-    // If we are at a NULL node, inject a leaf
-    if (!n) {
-        *ref = (art_node*)SET_LEAF(make_leaf(key, key_len, value));
-        return NULL;
+// Adds delta to the count of each inner node on the path of a
+// key, from the one in ref down to stop or to where the path
+// ends. The path only depends on the key bytes past each
+// prefix, so the prefixes themselves are not compared.
+static void count_path(art_node **ref, int depth, const unsigned char *key, int key_len,
+        const art_node *stop, int delta) {
+    art_node *n = *ref;
+    while (n && !IS_LEAF(n)) {
+        NODE_COUNT(n) += delta;
+        if (n == stop) return;
+        depth = depth + n->partial_len;
+        if (depth > key_len) return;
+        art_node **child = find_child(n, key_at(key, key_len, depth));
+        n = (child) ? *child : NULL;
+        depth++;
     }
+}
 
-    // If we are at a leaf, we need to replace it with a node
-    if (IS_LEAF(n)) {
-        art_leaf *l = LEAF_RAW(n);
+static inline uint64_t max_score(uint64_t a, uint64_t b) {
+    return (a > b) ? a : b;
+}
 
-        // Check if we are updating an existing value
-        if (!leaf_matches(l, key, key_len, depth)) {
-            *old = 1;
-            void *old_val = l->value;
-            if(replace) l->value = value;
-            return old_val;
-        }
+// Returns the score of a value, the value itself
+// unless the tree has a scorer
+static inline uint64_t value_score(const art_tree *t, void *value) {
+    return t->scorer ? t->scorer(t->scorer_data, value) : (uint64_t)(uintptr_t)value;
+}
 
-        // New value, we must split the leaf into a node4
-        art_node4 *new_node = (art_node4*)alloc_node(NODE4);
+// Returns the highest score under a child with ART_MAX_SCORE
+static inline uint64_t child_score(const art_tree *t, const art_node *n) {
+    return IS_LEAF(n) ? value_score(t, leaf_value(t, n)) : NODE_SCORE(t, n);
+}
 
-        // Create a new leaf
-        art_leaf *l2 = make_leaf(key, key_len, value);
+// Recomputes the score of an inner node from its children
+static void rescore_node(const art_tree *t, art_node *n) {
+    art_node **children;
+    int i, slots;
+    switch (n->type) {
+        case NODE4:
+            children = ((art_node4*)n)->children;
+            slots = n->num_children;
+            break;
+        case NODE16:
+            children = ((art_node16*)n)->children;
+            slots = n->num_children;
+            break;
+        case NODE32:
+            children = ((art_node32*)n)->children;
+            slots = n->num_children;
+            break;
+        case NODE48:
+            children = ((art_node48*)n)->children;
+            slots = 48;
+            break;
+        case NODE256:
+            children = ((art_node256*)n)->children;
+            slots = 256;
+            break;
+        default:
+            abort();
+    }
+    uint64_t score = 0;
+    for (i=0; i < slots; i++) {
+        if (children[i])
+            score = max_score(score, child_score(t, children[i]));
+    }
+    NODE_SCORE(t, n) = score;
+}
 
-        // Determine longest prefix
-        int longest_prefix = longest_common_prefix(l, l2, depth);
-        new_node->n.partial_len = longest_prefix;
-        memcpy(new_node->n.partial, key+depth, min(MAX_PREFIX_LEN, longest_prefix));
-        // Add the leafs to the new node4
-        *ref = (art_node*)new_node;
-        add_child4(new_node, ref, l->key[depth+longest_prefix], SET_LEAF(l));
-        add_child4(new_node, ref, l2->key[depth+longest_prefix], SET_LEAF(l2));
-        return NULL;
+// Recomputes the scores on the path of a key bottom up, once
+// a value on it went away or lost score. Raising a score never
+// needs this, the walk down raises each node it passes.
+static void score_path(const art_tree *t, art_node *n, int depth, const unsigned char *key, int key_len) {
+    if (!n || IS_LEAF(n)) return;
+    depth = depth + n->partial_len;
+    if (depth <= key_len) {
+        art_node **child = find_child(n, key_at(key, key_len, depth));
+        if (child) score_path(t, *child, depth + 1, key, key_len);
     }
+    rescore_node(t, n);
+}
 
-    // Check if given node has a prefix
-    if (n->partial_len) {
-        // Determine if the prefixes differ, since we need to split
-        int prefix_diff = prefix_mismatch(n, key, key_len, depth);
-        if ((uint32_t)prefix_diff >= n->partial_len) {
-            depth += n->partial_len;
-            goto RECURSE_SEARCH;
+// Returns 1 if one key is the other followed by a 0 byte and
+// maybe more. The shorter one reads as ending in a 0 byte, so
+// both would need the same slot and neither could be found.
+static int keys_conflict(const unsigned char *k1, int k1_len, const unsigned char *k2, int k2_len) {
+    if (k1_len > k2_len)
+        return keys_conflict(k2, k2_len, k1, k1_len);
+    return k1_len < k2_len && !k2[k1_len] && !memcmp(k1, k2, k1_len);
+}
+
+// Takes back what the walk down did for a key that conflicts,
+// counts from start down to stop and the raised scores
+static void* refuse_key(art_tree *t, art_node **start, int start_depth, const unsigned char *key, int key_len,
+        const art_node *stop, int *old) {
+    if (t->flags & ART_SUBTREE_COUNT)
+        count_path(start, start_depth, key, key_len, stop, -1);
+    if (t->flags & ART_MAX_SCORE)
+        score_path(t, t->root, 0, key, key_len);
+    *old = ART_KEY_CONFLICT;
+    return NULL;
+}
+
+// Walks down from the slot ref, whose keys share their first
+// depth bytes, to the slot the key belongs in. Splices only
+// ever touch the slot pointing at the current node, so that
+// is all the walk keeps, apart from the path left in a hint.
+static void* insert_key(art_tree *t, art_node **ref, int depth, const unsigned char *key, int key_len,
+        void *value, int *old, int replace, art_hint *hint) {
+    art_node **start = ref;
+    int start_depth = depth;
+    int counted = t->flags & ART_SUBTREE_COUNT;
+    int scored = t->flags & ART_MAX_SCORE;
+    uint64_t score = scored ? value_score(t, value) : 0;
+    for (;;) {
+        art_node *n = *ref;
+
+        // Remember the slot while the hint can still check it
+        if (hint && hint->levels < ART_HINT_DEPTH && depth <= ART_HINT_KEY_LEN) {
+            hint->refs[hint->levels] = ref;
+            hint->depths[hint->levels++] = depth;
         }
 
-        // Create a new node
-        art_node4 *new_node = (art_node4*)alloc_node(NODE4);
-        *ref = (art_node*)new_node;
-        new_node->n.partial_len = prefix_diff;
-        memcpy(new_node->n.partial, n->partial, min(MAX_PREFIX_LEN, prefix_diff));
-
-        // Adjust the prefix of the old node
-        if (n->partial_len <= MAX_PREFIX_LEN) {
-            add_child4(new_node, ref, n->partial[prefix_diff], n);
-            n->partial_len -= (prefix_diff+1);
-            memmove(n->partial, n->partial+prefix_diff+1,
-                    min(MAX_PREFIX_LEN, n->partial_len));
-        } else {
-            n->partial_len -= (prefix_diff+1);
-            art_leaf *l = minimum(n);
-            add_child4(new_node, ref, l->key[depth+prefix_diff], n);
-            memcpy(n->partial, l->key+depth+prefix_diff+1,
-                    min(MAX_PREFIX_LEN, n->partial_len));
+        // If we are at a NULL node, inject a leaf
+        if (!n) {
+            *ref = new_leaf(t, key, key_len, value);
+            return NULL;
         }
 
-        // Insert the new leaf
-        art_leaf *l = make_leaf(key, key_len, value);
-        add_child4(new_node, ref, key[depth+prefix_diff], SET_LEAF(l));
-        return NULL;
-    }
+        // If we are at a leaf, we need to replace it with a node
+        if (IS_LEAF(n)) {
+            // Check if we are updating an existing value
+            if (!leaf_matches(t, n, key, key_len)) {
+                // Nodes were counted on the way down
+                // as if the key were new
+                if (counted) count_path(start, start_depth, key, key_len, NULL, -1);
+                *old = ART_KEY_FOUND;
+                void *old_val = leaf_value(t, n);
+                if (replace) {
+                    if (t->flags & ART_INLINE_VALUES)
+                        *ref = SET_INLINE(value);
+                    else
+                        LEAF_RAW(n)->value = value;
+                }
+                // Scores were raised on the way down to one that
+                // may not be there, redo them if it differs
+                if (scored && value_score(t, old_val) != score)
+                    score_path(t, t->root, 0, key, key_len);
+                return old_val;
+            }
 
-RECURSE_SEARCH:;
+            uint32_t l_len;
+            const unsigned char *l_key = leaf_key(t, n, &l_len);
+            if (keys_conflict(l_key, l_len, key, key_len))
+                return refuse_key(t, start, start_depth, key, key_len, NULL, old);
+
+            // New value, we must split the leaf into a node4
+            art_node4 *new_node = (art_node4*)alloc_node(t, NODE4);
+            if (counted) NODE_COUNT(new_node) = 2;
+            if (scored) NODE_SCORE(t, new_node) = max_score(child_score(t, n), score);
+
+            // Determine longest prefix
+            int longest_prefix = longest_common_prefix(l_key, l_len, key, key_len, depth);
+            new_node->n.partial_len = longest_prefix;
+            memcpy(new_node->n.partial, key+depth, min(MAX_PREFIX_LEN, longest_prefix));
+            // Add the leafs to the new node4
+            *ref = (art_node*)new_node;
+            add_child4(t, new_node, ref, key_at(l_key, l_len, depth+longest_prefix), n);
+            add_child4(t, new_node, ref, key_at(key, key_len, depth+longest_prefix),
+                    new_leaf(t, key, key_len, value));
+            return NULL;
+        }
 
-    // Find a child to recurse to
-    art_node **child = find_child(n, key[depth]);
-    if (child) {
-        return recursive_insert(*child, child, key, key_len, value, depth+1, old, replace);
-    }
+        // Check if given node has a prefix
+        if (n->partial_len) {
+            // Determine if the prefixes differ, since we need to split
+            int prefix_diff = prefix_mismatch(t, n, key, key_len, depth);
+            if ((uint32_t)prefix_diff < n->partial_len) {
+                // The byte the keys under n go on with
+                const unsigned char *l_key = NULL;
+                unsigned char c;
+                if (n->partial_len <= MAX_PREFIX_LEN) {
+                    c = n->partial[prefix_diff];
+                } else {
+                    uint32_t l_len;
+                    l_key = leaf_key(t, min_child(n), &l_len);
+                    c = l_key[depth+prefix_diff];
+                }
 
-    // No child, node goes within us
-    art_leaf *l = make_leaf(key, key_len, value);
-    add_child(n, ref, key[depth], SET_LEAF(l));
-    return NULL;
+                // A key ending here would go under 0 next to them
+                if (depth + prefix_diff == key_len && !c) {
+                    // n itself was not counted yet
+                    if (counted) NODE_COUNT(n)++;
+                    return refuse_key(t, start, start_depth, key, key_len, n, old);
+                }
+
+                // Create a new node
+                art_node4 *new_node = (art_node4*)alloc_node(t, NODE4);
+                if (counted) NODE_COUNT(new_node) = NODE_COUNT(n) + 1;
+                if (scored) NODE_SCORE(t, new_node) = max_score(NODE_SCORE(t, n), score);
+                *ref = (art_node*)new_node;
+                new_node->n.partial_len = prefix_diff;
+                memcpy(new_node->n.partial, n->partial, min(MAX_PREFIX_LEN, prefix_diff));
+
+                // Adjust the prefix of the old node
+                add_child4(t, new_node, ref, c, n);
+                n->partial_len -= (prefix_diff+1);
+                if (!l_key) {
+                    memmove(n->partial, n->partial+prefix_diff+1,
+                            min(MAX_PREFIX_LEN, n->partial_len));
+                } else {
+                    memcpy(n->partial, l_key+depth+prefix_diff+1,
+                            min(MAX_PREFIX_LEN, n->partial_len));
+                }
+
+                // Insert the new leaf
+                add_child4(t, new_node, ref, key_at(key, key_len, depth+prefix_diff),
+                        new_leaf(t, key, key_len, value));
+                return NULL;
+            }
+            depth += n->partial_len;
+        }
+
+        // The key goes somewhere below n
+        if (counted) NODE_COUNT(n)++;
+        if (scored && NODE_SCORE(t, n) < score) NODE_SCORE(t, n) = score;
+
+        // Find a child to descend to
+        art_node **child = find_child(n, key_at(key, key_len, depth));
+        if (!child) {
+            // No child, node goes within us
+            add_child(t, n, ref, key_at(key, key_len, depth), new_leaf(t, key, key_len, value));
+            return NULL;
+        }
+
+        // Past the end of the key only its own leaf may follow
+        if (depth == key_len && !IS_LEAF(*child))
+            return refuse_key(t, start, start_depth, key, key_len, n, old);
+        ref = child;
+        depth++;
+    }
 }
 
 /**
@@ -641,10 +1461,7 @@ RECURSE_SEARCH:;
  * the old value pointer is returned.
  */
 void* art_insert(art_tree *t, const unsigned char *key, int key_len, void *value) {
-    int old_val = 0;
-    void *old = recursive_insert(t->root, &t->root, key, key_len, value, 0, &old_val, 1);
-    if (!old_val) t->size++;
-    return old;
+    return art_insert_status(t, key, key_len, value, 1, NULL);
 }
 
 /**
@@ -657,22 +1474,187 @@ void* art_insert(art_tree *t, const unsigned char *key, int key_len, void *value
  * the old value pointer is returned.
  */
 void* art_insert_no_replace(art_tree *t, const unsigned char *key, int key_len, void *value) {
+    return art_insert_status(t, key, key_len, value, 0, NULL);
+}
+
+/**
+ * Inserts a value and sets status to ART_KEY_ADDED,
+ * ART_KEY_FOUND or ART_KEY_CONFLICT.
+ */
+void* art_insert_status(art_tree *t, const unsigned char *key, int key_len, void *value,
+        int replace, int *status) {
+    int old_val = 0;
+    void *old = insert_key(t, &t->root, 0, key, key_len, value, &old_val, replace, NULL);
+    if (!old_val) {
+        t->size++;
+        t->mods++;
+    }
+    if (status) *status = old_val;
+    return old;
+}
+
+/**
+ * Clears a hint so that its next insert starts at the root.
+ */
+void art_hint_init(art_hint *h) {
+    h->t = NULL;
+    h->mods = 0;
+    h->levels = 0;
+    h->key_len = 0;
+}
+
+/**
+ * Inserts a value, resuming from the path of the previous
+ * insert with the same hint.
+ */
+void* art_insert_hint(art_tree *t, art_hint *h, const unsigned char *key, int key_len, void *value) {
+    return art_insert_hint_status(t, h, key, key_len, value, NULL);
+}
+
+/**
+ * Inserts a value from the path of the previous insert and
+ * sets status like art_insert_status.
+ */
+void* art_insert_hint_status(art_tree *t, art_hint *h, const unsigned char *key, int key_len,
+        void *value, int *status) {
+    // A path is only good while nothing else reshaped the tree
+    if (h->t != t || h->mods != t->mods) {
+        h->t = t;
+        h->levels = 0;
+        h->key_len = 0;
+    }
+
+    // Resume below the deepest node entered with bytes this
+    // key shares with the previous one
+    uint32_t common = 0, max_cmp = min(h->key_len, key_len);
+    while (common < max_cmp && h->key[common] == key[common])
+        common++;
+    int level = h->levels - 1;
+    while (level > 0 && h->depths[level] > common)
+        level--;
+    art_node **ref = level > 0 ? h->refs[level] : &t->root;
+    int depth = level > 0 ? h->depths[level] : 0;
+    h->levels = level > 0 ? level : 0;
+
     int old_val = 0;
-    void *old = recursive_insert(t->root, &t->root, key, key_len, value, 0, &old_val, 0);
-    if (!old_val) t->size++;
+    void *old = insert_key(t, ref, depth, key, key_len, value, &old_val, 1, h);
+    if (!old_val) {
+        t->size++;
+        t->mods++;
+
+        // The walk only counted from where it resumed
+        if (t->flags & ART_SUBTREE_COUNT) {
+            for (int i=0; i < level; i++)
+                NODE_COUNT(*h->refs[i])++;
+        }
+    }
+
+    // Likewise for scores, a replaced or refused value was
+    // rescored from the root already if it changed
+    if ((t->flags & ART_MAX_SCORE) && level > 0 && old_val != ART_KEY_CONFLICT) {
+        uint64_t score = value_score(t, value);
+        for (int i=0; i < level; i++)
+            NODE_SCORE(t, *h->refs[i]) = max_score(NODE_SCORE(t, *h->refs[i]), score);
+    }
+    h->mods = t->mods;
+    h->key_len = min(key_len, ART_HINT_KEY_LEN);
+    memcpy(h->key, key, h->key_len);
+    if (status) *status = old_val;
     return old;
 }
 
-static void remove_child256(art_node256 *n, art_node **ref, unsigned char c) {
+// Builds the subtree holding keys [lo, hi), which share their
+// first depth bytes, with every node at its final type
+static art_node* bulk_build(art_tree *t, const unsigned char **keys, const int *key_lens,
+        void **values, int lo, int hi, int depth) {
+    if (hi - lo == 1)
+        return new_leaf(t, keys[lo], key_lens[lo], values[lo]);
+
+    // Keys are sorted, so the first and last share
+    // the prefix common to the whole range
+    const unsigned char *first = keys[lo], *last = keys[hi-1];
+    int max_cmp = min(key_lens[lo], key_lens[hi-1]);
+    int prefix_len = 0;
+    while (depth + prefix_len < max_cmp && first[depth+prefix_len] == last[depth+prefix_len])
+        prefix_len++;
+    int d = depth + prefix_len;
+
+    // Count the children to pick the node type
+    int i, start, children = 1;
+    for (i=lo+1; i < hi; i++) {
+        if (keys[i][d] != keys[i-1][d]) children++;
+    }
+    uint8_t type = children <= 4 ? NODE4 : children <= 16 ? NODE16 :
+        children <= 32 ? NODE32 : children <= 48 ? NODE48 : NODE256;
+    art_node *n = alloc_node(t, type);
+    n->partial_len = prefix_len;
+    memcpy(n->partial, first+depth, min(MAX_PREFIX_LEN, prefix_len));
+    if (t->flags & ART_SUBTREE_COUNT)
+        NODE_COUNT(n) = hi - lo;
+
+    // Children arrive in key order, so they are appended
+    for (start=lo, i=lo+1; i <= hi; i++) {
+        if (i < hi && keys[i][d] == keys[start][d]) continue;
+        unsigned char c = keys[start][d];
+        art_node *child = bulk_build(t, keys, key_lens, values, start, i, d+1);
+        switch (type) {
+            case NODE4:
+                ((art_node4*)n)->keys[n->num_children] = c;
+                ((art_node4*)n)->children[n->num_children] = child;
+                break;
+            case NODE16:
+                ((art_node16*)n)->keys[n->num_children] = c;
+                ((art_node16*)n)->children[n->num_children] = child;
+                break;
+            case NODE32:
+                ((art_node32*)n)->keys[n->num_children] = c;
+                ((art_node32*)n)->children[n->num_children] = child;
+                break;
+            case NODE48:
+                ((art_node48*)n)->keys[c] = n->num_children + 1;
+                ((art_node48*)n)->children[n->num_children] = child;
+                break;
+            case NODE256:
+                ((art_node256*)n)->children[c] = child;
+                break;
+        }
+        n->num_children++;
+        start = i;
+    }
+    if (t->flags & ART_MAX_SCORE)
+        rescore_node(t, n);
+    return n;
+}
+
+/**
+ * Builds the tree from sorted keys in a single pass.
+ */
+int art_bulk_load(art_tree *t, const unsigned char **keys, const int *key_lens, int n, void **values) {
+    if (t->root || n < 0) return -1;
+
+    // Keys must be strictly ascending and none may be a prefix
+    // of the next one, which rules out a prefix of any later key
+    for (int i=1; i < n; i++) {
+        if (memcmp(keys[i-1], keys[i], min(key_lens[i-1], key_lens[i])) >= 0)
+            return -1;
+    }
+    if (n) t->root = bulk_build(t, keys, key_lens, values, 0, n, 0);
+    t->size = n;
+    t->mods++;
+    return 0;
+}
+
+static void remove_child256(art_tree *t, art_node256 *n, art_node **ref, unsigned char c) {
     n->children[c] = NULL;
     n->n.num_children--;
 
     // Resize to a node48 on underflow, not immediately to prevent
     // trashing if we sit on the 48/49 boundary
     if (n->n.num_children == 37) {
-        art_node48 *new_node = (art_node48*)alloc_node(NODE48);
+        STAT(shrinks[NODE256-1]);
+        art_node48 *new_node = (art_node48*)alloc_node(t, NODE48);
         *ref = (art_node*)new_node;
-        copy_header((art_node*)new_node, (art_node*)n);
+        copy_header(t, (art_node*)new_node, (art_node*)n);
 
         int pos = 0;
         for (int i=0;i<256;i++) {
@@ -682,20 +1664,21 @@ static void remove_child256(art_node256 *n, art_node **ref, unsigned char c) {
                 pos++;
             }
         }
-        free(n);
+        free_node(t, (art_node*)n);
     }
 }
 
-static void remove_child48(art_node48 *n, art_node **ref, unsigned char c) {
+static void remove_child48(art_tree *t, art_node48 *n, art_node **ref, unsigned char c) {
     int pos = n->keys[c];
     n->keys[c] = 0;
     n->children[pos-1] = NULL;
     n->n.num_children--;
 
-    if (n->n.num_children == 12) {
-        art_node16 *new_node = (art_node16*)alloc_node(NODE16);
+    if (n->n.num_children == 24) {
+        STAT(shrinks[NODE48-1]);
+        art_node32 *new_node = (art_node32*)alloc_node(t, NODE32);
         *ref = (art_node*)new_node;
-        copy_header((art_node*)new_node, (art_node*)n);
+        copy_header(t, (art_node*)new_node, (art_node*)n);
 
         int child = 0;
         for (int i=0;i<256;i++) {
@@ -706,27 +1689,45 @@ static void remove_child48(art_node48 *n, art_node **ref, unsigned char c) {
                 child++;
             }
         }
-        free(n);
+        free_node(t, (art_node*)n);
+    }
+}
+
+static void remove_child32(art_tree *t, art_node32 *n, art_node **ref, art_node **l) {
+    int pos = l - n->children;
+    memmove(n->keys+pos, n->keys+pos+1, n->n.num_children - 1 - pos);
+    memmove(n->children+pos, n->children+pos+1, (n->n.num_children - 1 - pos)*sizeof(void*));
+    n->n.num_children--;
+
+    if (n->n.num_children == 12) {
+        STAT(shrinks[NODE32-1]);
+        art_node16 *new_node = (art_node16*)alloc_node(t, NODE16);
+        *ref = (art_node*)new_node;
+        copy_header(t, (art_node*)new_node, (art_node*)n);
+        memcpy(new_node->keys, n->keys, 12);
+        memcpy(new_node->children, n->children, 12*sizeof(void*));
+        free_node(t, (art_node*)n);
     }
 }
 
-static void remove_child16(art_node16 *n, art_node **ref, art_node **l) {
+static void remove_child16(art_tree *t, art_node16 *n, art_node **ref, art_node **l) {
     int pos = l - n->children;
     memmove(n->keys+pos, n->keys+pos+1, n->n.num_children - 1 - pos);
     memmove(n->children+pos, n->children+pos+1, (n->n.num_children - 1 - pos)*sizeof(void*));
     n->n.num_children--;
 
     if (n->n.num_children == 3) {
-        art_node4 *new_node = (art_node4*)alloc_node(NODE4);
+        STAT(shrinks[NODE16-1]);
+        art_node4 *new_node = (art_node4*)alloc_node(t, NODE4);
         *ref = (art_node*)new_node;
-        copy_header((art_node*)new_node, (art_node*)n);
+        copy_header(t, (art_node*)new_node, (art_node*)n);
         memcpy(new_node->keys, n->keys, 4);
         memcpy(new_node->children, n->children, 4*sizeof(void*));
-        free(n);
+        free_node(t, (art_node*)n);
     }
 }
 
-static void remove_child4(art_node4 *n, art_node **ref, art_node **l) {
+static void remove_child4(art_tree *t, art_node4 *n, art_node **ref, art_node **l) {
     int pos = l - n->children;
     memmove(n->keys+pos, n->keys+pos+1, n->n.num_children - 1 - pos);
     memmove(n->children+pos, n->children+pos+1, (n->n.num_children - 1 - pos)*sizeof(void*));
@@ -734,6 +1735,7 @@ static void remove_child4(art_node4 *n, art_node **ref, art_node **l) {
 
     // Remove nodes with only a single child
     if (n->n.num_children == 1) {
+        STAT(shrinks[NODE4-1]);
         art_node *child = n->children[0];
         if (!IS_LEAF(child)) {
             // Concatenate the prefixes
@@ -753,64 +1755,88 @@ static void remove_child4(art_node4 *n, art_node **ref, art_node **l) {
             child->partial_len += n->n.partial_len + 1;
         }
         *ref = child;
-        free(n);
+        free_node(t, (art_node*)n);
     }
 }
 
-static void remove_child(art_node *n, art_node **ref, unsigned char c, art_node **l) {
+static void remove_child(art_tree *t, art_node *n, art_node **ref, unsigned char c, art_node **l) {
     switch (n->type) {
         case NODE4:
-            return remove_child4((art_node4*)n, ref, l);
+            return remove_child4(t, (art_node4*)n, ref, l);
         case NODE16:
-            return remove_child16((art_node16*)n, ref, l);
+            return remove_child16(t, (art_node16*)n, ref, l);
+        case NODE32:
+            return remove_child32(t, (art_node32*)n, ref, l);
         case NODE48:
-            return remove_child48((art_node48*)n, ref, c);
+            return remove_child48(t, (art_node48*)n, ref, c);
         case NODE256:
-            return remove_child256((art_node256*)n, ref, c);
+            return remove_child256(t, (art_node256*)n, ref, c);
         default:
             abort();
     }
 }
 
-static art_leaf* recursive_delete(art_node *n, art_node **ref, const unsigned char *key, int key_len, int depth) {
+// Unlinks the matching leaf child and returns it, still tagged.
+// Like insert_key it only keeps the slot of the current node,
+// which remove_child needs when the node shrinks.
+static art_node* delete_key(art_tree *t, const unsigned char *key, int key_len) {
+    art_node **ref = &t->root;
+    art_node *n = *ref;
+    int depth = 0;
+
     // Search terminated
     if (!n) return NULL;
 
-    // Handle hitting a leaf node
+    // Handle a leaf at the root
     if (IS_LEAF(n)) {
-        art_leaf *l = LEAF_RAW(n);
-        if (!leaf_matches(l, key, key_len, depth)) {
+        if (!leaf_matches(t, n, key, key_len)) {
             *ref = NULL;
-            return l;
+            return n;
         }
         return NULL;
     }
 
-    // Bail if the prefix does not match
-    if (n->partial_len) {
-        int prefix_len = check_prefix(n, key, key_len, depth);
-        if (prefix_len != min(MAX_PREFIX_LEN, n->partial_len)) {
-            return NULL;
+    for (;;) {
+        // Bail if the prefix does not match
+        if (n->partial_len) {
+            if (!(t->flags & ART_OPTIMISTIC_PREFIX)) {
+                int prefix_len = check_prefix(n, key, key_len, depth);
+                if (prefix_len != min(MAX_PREFIX_LEN, n->partial_len)) {
+                    return NULL;
+                }
+            }
+            depth = depth + n->partial_len;
         }
-        depth = depth + n->partial_len;
-    }
 
-    // Find child node
-    art_node **child = find_child(n, key[depth]);
-    if (!child) return NULL;
+        if (depth > key_len)
+            return NULL;
 
-    // If the child is leaf, delete from this node
-    if (IS_LEAF(*child)) {
-        art_leaf *l = LEAF_RAW(*child);
-        if (!leaf_matches(l, key, key_len, depth)) {
-            remove_child(n, ref, key[depth], child);
-            return l;
+        // Find child node
+        art_node **child = find_child(n, key_at(key, key_len, depth));
+        if (!child) return NULL;
+
+        // If the child is leaf, delete from this node
+        if (IS_LEAF(*child)) {
+            art_node *l = *child;
+            if (!leaf_matches(t, l, key, key_len)) {
+                // Uncount the path while it is still intact
+                if (t->flags & ART_SUBTREE_COUNT)
+                    count_path(&t->root, 0, key, key_len, n, -1);
+
+                // Scores on the path only drop if this was the best
+                int rescore = (t->flags & ART_MAX_SCORE) && child_score(t, l) >= NODE_SCORE(t, n);
+                remove_child(t, n, ref, key_at(key, key_len, depth), child);
+                if (rescore)
+                    score_path(t, t->root, 0, key, key_len);
+                return l;
+            }
+            return NULL;
         }
-        return NULL;
 
-    // Recurse
-    } else {
-        return recursive_delete(*child, child, key, key_len, depth+1);
+        // Descend
+        ref = child;
+        n = *child;
+        depth++;
     }
 }
 
@@ -823,37 +1849,47 @@ static art_leaf* recursive_delete(art_node *n, art_node **ref, const unsigned ch
  * the value pointer is returned.
  */
 void* art_delete(art_tree *t, const unsigned char *key, int key_len) {
-    art_leaf *l = recursive_delete(t->root, &t->root, key, key_len, 0);
+    art_node *l = delete_key(t, key, key_len);
     if (l) {
         t->size--;
-        void *old = l->value;
-        free(l);
+        t->mods++;
+        void *old = leaf_value(t, l);
+        if (!(t->flags & ART_INLINE_VALUES))
+            free_leaf(t, LEAF_RAW(l));
         return old;
     }
     return NULL;
 }
 
 // Recursively iterates over the tree
-static int recursive_iter(art_node *n, art_callback cb, void *data) {
+static int recursive_iter(const art_tree *t, art_node *n, art_callback cb, void *data) {
     // Handle base cases
     if (!n) return 0;
     if (IS_LEAF(n)) {
-        art_leaf *l = LEAF_RAW(n);
-        return cb(data, (const unsigned char*)l->key, l->key_len, l->value);
+        uint32_t key_len;
+        const unsigned char *key = leaf_key(t, n, &key_len);
+        return cb(data, key, key_len, leaf_value(t, n));
     }
 
     int idx, res;
     switch (n->type) {
         case NODE4:
             for (int i=0; i < n->num_children; i++) {
-                res = recursive_iter(((art_node4*)n)->children[i], cb, data);
+                res = recursive_iter(t, ((art_node4*)n)->children[i], cb, data);
                 if (res) return res;
             }
             break;
 
         case NODE16:
             for (int i=0; i < n->num_children; i++) {
-                res = recursive_iter(((art_node16*)n)->children[i], cb, data);
+                res = recursive_iter(t, ((art_node16*)n)->children[i], cb, data);
+                if (res) return res;
+            }
+            break;
+
+        case NODE32:
+            for (int i=0; i < n->num_children; i++) {
+                res = recursive_iter(t, ((art_node32*)n)->children[i], cb, data);
                 if (res) return res;
             }
             break;
@@ -863,7 +1899,7 @@ static int recursive_iter(art_node *n, art_callback cb, void *data) {
                 idx = ((art_node48*)n)->keys[i];
                 if (!idx) continue;
 
-                res = recursive_iter(((art_node48*)n)->children[idx-1], cb, data);
+                res = recursive_iter(t, ((art_node48*)n)->children[idx-1], cb, data);
                 if (res) return res;
             }
             break;
@@ -871,7 +1907,7 @@ static int recursive_iter(art_node *n, art_callback cb, void *data) {
         case NODE256:
             for (int i=0; i < 256; i++) {
                 if (!((art_node256*)n)->children[i]) continue;
-                res = recursive_iter(((art_node256*)n)->children[i], cb, data);
+                res = recursive_iter(t, ((art_node256*)n)->children[i], cb, data);
                 if (res) return res;
             }
             break;
@@ -893,60 +1929,48 @@ static int recursive_iter(art_node *n, art_callback cb, void *data) {
  * @return 0 on success, or the return of the callback.
  */
 int art_iter(art_tree *t, art_callback cb, void *data) {
-    return recursive_iter(t->root, cb, data);
+    return recursive_iter(t, t->root, cb, data);
 }
 
 /**
  * Checks if a leaf prefix matches
  * @return 0 on success.
  */
-static int leaf_prefix_matches(const art_leaf *n, const unsigned char *prefix, int prefix_len) {
+static int leaf_prefix_matches(const art_tree *t, const art_node *n, const unsigned char *prefix, int prefix_len) {
     // Fail if the key length is too short
-    if (n->key_len < (uint32_t)prefix_len) return 1;
+    uint32_t n_len;
+    const unsigned char *n_key = leaf_key(t, n, &n_len);
+    if (n_len < (uint32_t)prefix_len) return 1;
 
     // Compare the keys
-    return memcmp(n->key, prefix, prefix_len);
+    return memcmp(n_key, prefix, prefix_len);
 }
 
-/**
- * Iterates through the entries pairs in the map,
- * invoking a callback for each that matches a given prefix.
- * The call back gets a key, value for each and returns an integer stop value.
- * If the callback returns non-zero, then the iteration stops.
- * @arg t The tree to iterate over
- * @arg prefix The prefix of keys to read
- * @arg prefix_len The length of the prefix
- * @arg cb The callback function to invoke
- * @arg data Opaque handle passed to the callback
- * @return 0 on success, or the return of the callback.
- */
-int art_iter_prefix(art_tree *t, const unsigned char *key, int key_len, art_callback cb, void *data) {
+// Finds the node or leaf whose keys are exactly those that
+// start with a prefix, or NULL if there are none
+static art_node* prefix_root(const art_tree *t, const unsigned char *key, int key_len) {
     art_node **child;
     art_node *n = t->root;
     int prefix_len, depth = 0;
     while (n) {
         // Might be a leaf
         if (IS_LEAF(n)) {
-            n = (art_node*)LEAF_RAW(n);
             // Check if the expanded path matches
-            if (!leaf_prefix_matches((art_leaf*)n, key, key_len)) {
-                art_leaf *l = (art_leaf*)n;
-                return cb(data, (const unsigned char*)l->key, l->key_len, l->value);
-            }
-            return 0;
+            if (!leaf_prefix_matches(t, n, key, key_len))
+                return n;
+            return NULL;
         }
 
         // If the depth matches the prefix, we need to handle this node
         if (depth == key_len) {
-            art_leaf *l = minimum(n);
-            if (!leaf_prefix_matches(l, key, key_len))
-               return recursive_iter(n, cb, data);
-            return 0;
+            if (!leaf_prefix_matches(t, min_child(n), key, key_len))
+               return n;
+            return NULL;
         }
 
         // Bail if the prefix does not match
         if (n->partial_len) {
-            prefix_len = prefix_mismatch(n, key, key_len, depth);
+            prefix_len = prefix_mismatch(t, n, key, key_len, depth);
 
             // Guard if the mis-match is longer than the MAX_PREFIX_LEN
             if ((uint32_t)prefix_len > n->partial_len) {
@@ -955,13 +1979,17 @@ int art_iter_prefix(art_tree *t, const unsigned char *key, int key_len, art_call
 
             // If there is no match, search is terminated
             if (!prefix_len) {
-                return 0;
+                return NULL;
 
             // If we've matched the prefix, iterate on this node
             } else if (depth + prefix_len == key_len) {
-                return recursive_iter(n, cb, data);
+                return n;
             }
 
+            // A mismatch inside the prefix ends the search
+            if ((uint32_t)prefix_len < n->partial_len)
+                return NULL;
+
             // if there is a full match, go deeper
             depth = depth + n->partial_len;
         }
@@ -971,5 +1999,1360 @@ int art_iter_prefix(art_tree *t, const unsigned char *key, int key_len, art_call
         n = (child) ? *child : NULL;
         depth++;
     }
+    return NULL;
+}
+
+/**
+ * Iterates through the entries pairs in the map,
+ * invoking a callback for each that matches a given prefix.
+ * The call back gets a key, value for each and returns an integer stop value.
+ * If the callback returns non-zero, then the iteration stops.
+ * @arg t The tree to iterate over
+ * @arg prefix The prefix of keys to read
+ * @arg prefix_len The length of the prefix
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_iter_prefix(art_tree *t, const unsigned char *key, int key_len, art_callback cb, void *data) {
+    art_node *n = prefix_root(t, key, key_len);
+    return n ? recursive_iter(t, n, cb, data) : 0;
+}
+
+/**
+ * Initializes an iterator over a tree.
+ */
+int art_iterator_init(art_iterator *it, const art_tree *t) {
+    it->t = t;
+    it->stack = NULL;
+    it->top = 0;
+    it->cap = 0;
+    it->leaf = NULL;
+    return 0;
+}
+
+/**
+ * Releases the memory held by an iterator.
+ */
+void art_iterator_destroy(art_iterator *it) {
+    free(it->stack);
+    it->stack = NULL;
+    it->top = 0;
+    it->cap = 0;
+    it->leaf = NULL;
+}
+
+// Returns the child at an iterator position, or NULL
+static art_node* child_at(const art_node *n, int idx) {
+    int pos;
+    switch (n->type) {
+        case NODE4:
+            return ((const art_node4*)n)->children[idx];
+        case NODE16:
+            return ((const art_node16*)n)->children[idx];
+        case NODE32:
+            return ((const art_node32*)n)->children[idx];
+        case NODE48:
+            pos = ((const art_node48*)n)->keys[idx];
+            return pos ? ((const art_node48*)n)->children[pos-1] : NULL;
+        case NODE256:
+            return ((const art_node256*)n)->children[idx];
+        default:
+            abort();
+    }
+}
+
+// Returns the key byte that leads to the child at a position
+static unsigned char child_key(const art_node *n, int idx) {
+    switch (n->type) {
+        case NODE4:
+            return ((const art_node4*)n)->keys[idx];
+        case NODE16:
+            return ((const art_node16*)n)->keys[idx];
+        case NODE32:
+            return ((const art_node32*)n)->keys[idx];
+        default:
+            return idx;
+    }
+}
+
+// Returns the first position after idx holding a child, or -1
+static int next_child(const art_node *n, int idx) {
+    switch (n->type) {
+        case NODE4:
+        case NODE16:
+        case NODE32:
+            return idx + 1 < n->num_children ? idx + 1 : -1;
+        case NODE48:
+            for (idx++; idx < 256; idx++) {
+                if (((const art_node48*)n)->keys[idx]) return idx;
+            }
+            return -1;
+        case NODE256:
+            for (idx++; idx < 256; idx++) {
+                if (((const art_node256*)n)->children[idx]) return idx;
+            }
+            return -1;
+        default:
+            abort();
+    }
+}
+
+// Returns the last position before idx holding a child, or -1
+static int prev_child(const art_node *n, int idx) {
+    switch (n->type) {
+        case NODE4:
+        case NODE16:
+        case NODE32:
+            if (idx > n->num_children) idx = n->num_children;
+            return idx - 1;
+        case NODE48:
+            for (idx--; idx >= 0; idx--) {
+                if (((const art_node48*)n)->keys[idx]) return idx;
+            }
+            return -1;
+        case NODE256:
+            for (idx--; idx >= 0; idx--) {
+                if (((const art_node256*)n)->children[idx]) return idx;
+            }
+            return -1;
+        default:
+            abort();
+    }
+}
+
+// Returns the first position whose key byte is >= c, or -1
+static int lower_child(const art_node *n, unsigned char c) {
+    int i;
+    switch (n->type) {
+        case NODE4:
+            for (i=0; i < n->num_children; i++) {
+                if (((const art_node4*)n)->keys[i] >= c) return i;
+            }
+            return -1;
+        case NODE16:
+            for (i=0; i < n->num_children; i++) {
+                if (((const art_node16*)n)->keys[i] >= c) return i;
+            }
+            return -1;
+        case NODE32:
+            for (i=0; i < n->num_children; i++) {
+                if (((const art_node32*)n)->keys[i] >= c) return i;
+            }
+            return -1;
+        default:
+            return child_at(n, c) ? c : next_child(n, c);
+    }
+}
+
+static int iter_push(art_iterator *it, art_node *n, int idx) {
+    if (it->top == it->cap) {
+        int cap = it->cap ? it->cap * 2 : 16;
+        art_iter_frame *stack = (art_iter_frame*)realloc(it->stack, cap * sizeof(art_iter_frame));
+        if (!stack) return -1;
+        it->stack = stack;
+        it->cap = cap;
+    }
+    it->stack[it->top].node = n;
+    it->stack[it->top].idx = idx;
+    it->top++;
     return 0;
 }
+
+// Walks down to the minimum leaf under n, recording the path
+static art_leaf* iter_descend_min(art_iterator *it, art_node *n) {
+    while (n && !IS_LEAF(n)) {
+        int idx = next_child(n, -1);
+        if (iter_push(it, n, idx)) {
+            n = NULL;
+            break;
+        }
+        n = child_at(n, idx);
+    }
+    it->leaf = n ? LEAF_RAW(n) : NULL;
+    return it->leaf;
+}
+
+// Walks down to the maximum leaf under n, recording the path
+static art_leaf* iter_descend_max(art_iterator *it, art_node *n) {
+    while (n && !IS_LEAF(n)) {
+        int idx = prev_child(n, 256);
+        if (iter_push(it, n, idx)) {
+            n = NULL;
+            break;
+        }
+        n = child_at(n, idx);
+    }
+    it->leaf = n ? LEAF_RAW(n) : NULL;
+    return it->leaf;
+}
+
+/**
+ * Positions the iterator on the minimum leaf.
+ */
+art_leaf* art_iterator_first(art_iterator *it) {
+    it->top = 0;
+    if (it->t->flags & ART_INLINE_VALUES) return NULL;
+    return iter_descend_min(it, it->t->root);
+}
+
+/**
+ * Positions the iterator on the maximum leaf.
+ */
+art_leaf* art_iterator_last(art_iterator *it) {
+    it->top = 0;
+    if (it->t->flags & ART_INLINE_VALUES) return NULL;
+    return iter_descend_max(it, it->t->root);
+}
+
+/**
+ * Moves the iterator to the next leaf in key order.
+ */
+art_leaf* art_iterator_next(art_iterator *it) {
+    if (!it->leaf) return NULL;
+    while (it->top) {
+        art_iter_frame *f = &it->stack[it->top-1];
+        int idx = next_child(f->node, f->idx);
+        if (idx >= 0) {
+            f->idx = idx;
+            return iter_descend_min(it, child_at(f->node, idx));
+        }
+        it->top--;
+    }
+    it->leaf = NULL;
+    return NULL;
+}
+
+/**
+ * Moves the iterator to the previous leaf in key order.
+ */
+art_leaf* art_iterator_prev(art_iterator *it) {
+    if (!it->leaf) return NULL;
+    while (it->top) {
+        art_iter_frame *f = &it->stack[it->top-1];
+        int idx = prev_child(f->node, f->idx);
+        if (idx >= 0) {
+            f->idx = idx;
+            return iter_descend_max(it, child_at(f->node, idx));
+        }
+        it->top--;
+    }
+    it->leaf = NULL;
+    return NULL;
+}
+
+// Positions the iterator past every leaf under n, which
+// are all smaller than the key being sought
+static art_leaf* iter_skip(art_iterator *it, art_node *n) {
+    if (!iter_descend_max(it, n)) return NULL;
+    return art_iterator_next(it);
+}
+
+/**
+ * Positions the iterator on the first leaf whose
+ * key is greater than or equal to the given key.
+ */
+art_leaf* art_iterator_seek(art_iterator *it, const unsigned char *key, int key_len) {
+    art_node *n = it->t->root;
+    art_leaf *l;
+    int depth = 0, idx, i, cmp;
+    it->top = 0;
+    it->leaf = NULL;
+    if (it->t->flags & ART_INLINE_VALUES) return NULL;
+    while (n && !IS_LEAF(n)) {
+        // Compare the prefix, taking bytes past
+        // MAX_PREFIX_LEN from any leaf below
+        if (n->partial_len) {
+            l = n->partial_len > MAX_PREFIX_LEN ? minimum(n) : NULL;
+            for (i=0; i < (int)n->partial_len; i++) {
+                if (depth + i >= key_len)
+                    return iter_descend_min(it, n);
+                unsigned char p = i < MAX_PREFIX_LEN ? n->partial[i] : l->key[depth+i];
+                if (p > key[depth+i])
+                    return iter_descend_min(it, n);
+                if (p < key[depth+i])
+                    return iter_skip(it, n);
+            }
+            depth = depth + n->partial_len;
+        }
+        if (depth >= key_len)
+            return iter_descend_min(it, n);
+
+        // Go down the matching child, or the
+        // smallest one above the key byte
+        idx = lower_child(n, key[depth]);
+        if (idx < 0)
+            return iter_skip(it, n);
+        if (iter_push(it, n, idx)) {
+            it->leaf = NULL;
+            return NULL;
+        }
+        if (child_key(n, idx) != key[depth])
+            return iter_descend_min(it, child_at(n, idx));
+        n = child_at(n, idx);
+        depth++;
+    }
+    if (!n) {
+        it->leaf = NULL;
+        return NULL;
+    }
+
+    // Compare the whole key at the leaf
+    l = LEAF_RAW(n);
+    it->leaf = l;
+    cmp = memcmp(l->key, key, min(l->key_len, key_len));
+    if (cmp > 0 || (cmp == 0 && l->key_len >= (uint32_t)key_len))
+        return l;
+    return art_iterator_next(it);
+}
+
+// Compares two keys byte-wise, a shorter key sorting first
+static int key_cmp(const unsigned char *a, int a_len, const unsigned char *b, int b_len) {
+    int res = memcmp(a, b, min(a_len, b_len));
+    return res ? res : a_len - b_len;
+}
+
+// Finds the first leaf under n above the key, or
+// equal to it unless strict is set
+static art_leaf* recursive_bound(art_node *n, const unsigned char *key, int key_len, int depth, int strict) {
+    if (!n) return NULL;
+    if (IS_LEAF(n)) {
+        art_leaf *l = LEAF_RAW(n);
+        int cmp = key_cmp(l->key, l->key_len, key, key_len);
+        return (cmp > 0 || (cmp == 0 && !strict)) ? l : NULL;
+    }
+
+    // Compare the prefix, the subtree is either
+    // wholly above the key, wholly below, or undecided
+    if (n->partial_len) {
+        art_leaf *l = n->partial_len > MAX_PREFIX_LEN ? minimum(n) : NULL;
+        for (int i=0; i < (int)n->partial_len; i++) {
+            if (depth + i >= key_len)
+                return minimum(n);
+            unsigned char p = i < MAX_PREFIX_LEN ? n->partial[i] : l->key[depth+i];
+            if (p > key[depth+i])
+                return minimum(n);
+            if (p < key[depth+i])
+                return NULL;
+        }
+        depth = depth + n->partial_len;
+    }
+    // Past its end the key reads as a 0 byte, which
+    // leads to its own leaf if it is stored
+    if (depth > key_len)
+        return minimum(n);
+    unsigned char c = key_at(key, key_len, depth);
+
+    // Try the matching child, then the next one up
+    int idx = lower_child(n, c);
+    if (idx < 0) return NULL;
+    if (child_key(n, idx) == c) {
+        art_leaf *l = recursive_bound(child_at(n, idx), key, key_len, depth+1, strict);
+        if (l) return l;
+        idx = next_child(n, idx);
+        if (idx < 0) return NULL;
+    }
+    return minimum(child_at(n, idx));
+}
+
+/**
+ * Returns the first leaf whose key is greater
+ * than or equal to the given key.
+ */
+art_leaf* art_lower_bound(const art_tree *t, const unsigned char *key, int key_len) {
+    if (t->flags & ART_INLINE_VALUES) return NULL;
+    return recursive_bound(t->root, key, key_len, 0, 0);
+}
+
+/**
+ * Returns the first leaf whose key is
+ * greater than the given key.
+ */
+art_leaf* art_upper_bound(const art_tree *t, const unsigned char *key, int key_len) {
+    if (t->flags & ART_INLINE_VALUES) return NULL;
+    return recursive_bound(t->root, key, key_len, 0, 1);
+}
+
+// Recursively iterates over the leaves under n that fall in
+// [start, end). lo and hi are set while the path to n still
+// equals a prefix of start or end, only then do the bounds
+// need comparing, and children outside them are skipped.
+static int recursive_iter_range(const art_tree *t, art_node *n, const unsigned char *start, int start_len,
+        const unsigned char *end, int end_len, int depth, int lo, int hi,
+        art_callback cb, void *data) {
+    // Handle base cases
+    if (!n) return 0;
+    if (!lo && !hi) return recursive_iter(t, n, cb, data);
+    if (IS_LEAF(n)) {
+        uint32_t l_len;
+        const unsigned char *l_key = leaf_key(t, n, &l_len);
+        if (lo && key_cmp(l_key, l_len, start, start_len) < 0) return 0;
+        if (hi && key_cmp(l_key, l_len, end, end_len) >= 0) return 0;
+        return cb(data, l_key, l_len, leaf_value(t, n));
+    }
+
+    // Compare the prefix against the bounds
+    if (n->partial_len) {
+        uint32_t l_len;
+        const unsigned char *l_key = n->partial_len > MAX_PREFIX_LEN ?
+            leaf_key(t, min_child(n), &l_len) : NULL;
+        for (int i=0; i < (int)n->partial_len && (lo || hi); i++) {
+            unsigned char p = i < MAX_PREFIX_LEN ? n->partial[i] : l_key[depth+i];
+            if (lo) {
+                if (depth + i >= start_len || p > start[depth+i]) lo = 0;
+                else if (p < start[depth+i]) return 0;
+            }
+            if (hi) {
+                if (depth + i >= end_len || p > end[depth+i]) return 0;
+                if (p < end[depth+i]) hi = 0;
+            }
+        }
+        if (!lo && !hi) return recursive_iter(t, n, cb, data);
+        depth = depth + n->partial_len;
+    }
+    if (lo && depth >= start_len) lo = 0;
+    if (hi && depth >= end_len) return 0;
+
+    // Visit only the children between the bounds
+    int res, idx = lo ? lower_child(n, start[depth]) : next_child(n, -1);
+    for (; idx >= 0; idx = next_child(n, idx)) {
+        unsigned char c = child_key(n, idx);
+        if (hi && c > end[depth]) break;
+        res = recursive_iter_range(t, child_at(n, idx), start, start_len, end, end_len, depth+1,
+                lo && c == start[depth], hi && c == end[depth], cb, data);
+        if (res) return res;
+    }
+    return 0;
+}
+
+/**
+ * Iterates through the entries whose keys fall in [start, end),
+ * in key order, invoking a callback for each.
+ */
+int art_iter_range(art_tree *t, const unsigned char *start, int start_len,
+        const unsigned char *end, int end_len, art_callback cb, void *data) {
+    return recursive_iter_range(t, t->root, start, start_len, end, end_len, 0,
+            start && start_len > 0, end != NULL, cb, data);
+}
+
+// Returns the number of leaves under a child, kept in the
+// node with ART_SUBTREE_COUNT and counted one by one otherwise
+static uint64_t subtree_count(const art_tree *t, const art_node *n) {
+    if (!n) return 0;
+    if (IS_LEAF(n)) return 1;
+    if (t->flags & ART_SUBTREE_COUNT) return NODE_COUNT(n);
+    uint64_t count = 0;
+    for (int idx = next_child(n, -1); idx >= 0; idx = next_child(n, idx))
+        count += subtree_count(t, child_at(n, idx));
+    return count;
+}
+
+/**
+ * Returns the number of keys smaller than the given key.
+ */
+uint64_t art_rank(const art_tree *t, const unsigned char *key, int key_len) {
+    const art_node *n = t->root;
+    uint64_t rank = 0;
+    int idx, depth = 0;
+    while (n) {
+        if (IS_LEAF(n)) {
+            uint32_t l_len;
+            const unsigned char *l_key = leaf_key(t, n, &l_len);
+            return rank + (key_cmp(l_key, l_len, key, key_len) < 0);
+        }
+
+        // Compare the prefix, the subtree is either
+        // wholly below the key, wholly above, or undecided
+        if (n->partial_len) {
+            uint32_t l_len;
+            const unsigned char *l_key = n->partial_len > MAX_PREFIX_LEN ?
+                leaf_key(t, min_child(n), &l_len) : NULL;
+            for (int i=0; i < (int)n->partial_len; i++) {
+                if (depth + i >= key_len)
+                    return rank;
+                unsigned char p = i < MAX_PREFIX_LEN ? n->partial[i] : l_key[depth+i];
+                if (p > key[depth+i])
+                    return rank;
+                if (p < key[depth+i])
+                    return rank + subtree_count(t, n);
+            }
+            depth = depth + n->partial_len;
+        }
+        if (depth >= key_len)
+            return rank;
+
+        // Take in the children below the key byte,
+        // then go down the matching one
+        for (idx = next_child(n, -1); idx >= 0 && child_key(n, idx) < key[depth]; idx = next_child(n, idx))
+            rank += subtree_count(t, child_at(n, idx));
+        if (idx < 0 || child_key(n, idx) != key[depth])
+            return rank;
+        n = child_at(n, idx);
+        depth++;
+    }
+    return rank;
+}
+
+/**
+ * Returns the number of keys in [start, end).
+ */
+uint64_t art_count_range(const art_tree *t, const unsigned char *start, int start_len,
+        const unsigned char *end, int end_len) {
+    uint64_t lo = start && start_len > 0 ? art_rank(t, start, start_len) : 0;
+    uint64_t hi = end ? art_rank(t, end, end_len) : t->size;
+    return hi > lo ? hi - lo : 0;
+}
+
+/**
+ * Returns the leaf with the i-th smallest key.
+ */
+art_leaf* art_select(const art_tree *t, uint64_t i) {
+    const art_node *n = t->root;
+    if ((t->flags & ART_INLINE_VALUES) || i >= t->size) return NULL;
+    while (n && !IS_LEAF(n)) {
+        // Skip whole children until the one holding it
+        const art_node *child = NULL;
+        for (int idx = next_child(n, -1); idx >= 0; idx = next_child(n, idx)) {
+            child = child_at(n, idx);
+            uint64_t count = subtree_count(t, child);
+            if (i < count) break;
+            i -= count;
+            child = NULL;
+        }
+        n = child;
+    }
+    return n ? LEAF_RAW(n) : NULL;
+}
+
+// Returns the highest score under a child, kept in the node
+// with ART_MAX_SCORE and found by a scan otherwise
+static uint64_t subtree_score(const art_tree *t, const art_node *n) {
+    if (IS_LEAF(n)) return value_score(t, leaf_value(t, n));
+    if (t->flags & ART_MAX_SCORE) return NODE_SCORE(t, n);
+    uint64_t score = 0;
+    for (int idx = next_child(n, -1); idx >= 0; idx = next_child(n, idx))
+        score = max_score(score, subtree_score(t, child_at(n, idx)));
+    return score;
+}
+
+/**
+ * A subtree waiting in the art_topk_prefix heap
+ */
+typedef struct {
+    uint64_t score;
+    art_node *n;
+} topk_entry;
+
+// Adds a subtree to the max-heap by its best score
+static int topk_push(topk_entry **heap, int *len, int *cap, uint64_t score, art_node *n) {
+    if (*len == *cap) {
+        int new_cap = *cap * 2;
+        topk_entry *h = (topk_entry*)realloc(*heap, new_cap * sizeof(topk_entry));
+        if (!h) return -1;
+        *heap = h;
+        *cap = new_cap;
+    }
+    topk_entry *h = *heap;
+    int i = (*len)++;
+    while (i > 0 && h[(i-1)/2].score < score) {
+        h[i] = h[(i-1)/2];
+        i = (i-1)/2;
+    }
+    h[i].score = score;
+    h[i].n = n;
+    return 0;
+}
+
+// Takes the subtree with the best score off the heap
+static art_node* topk_pop(topk_entry *h, int *len) {
+    art_node *top = h[0].n;
+    topk_entry last = h[--(*len)];
+    int i = 0;
+    for (;;) {
+        int c = 2*i + 1;
+        if (c >= *len) break;
+        if (c + 1 < *len && h[c+1].score > h[c].score) c++;
+        if (h[c].score <= last.score) break;
+        h[i] = h[c];
+        i = c;
+    }
+    h[i] = last;
+    return top;
+}
+
+/**
+ * Invokes the callback on the k best scored entries
+ * under a prefix, best first.
+ * @return 0 on success, -1 if the heap could not grow,
+ * or the return of the callback.
+ */
+int art_topk_prefix(const art_tree *t, const unsigned char *prefix, int prefix_len, int k,
+        art_callback cb, void *data) {
+    art_node *n = prefix_root(t, prefix, prefix_len);
+    if (!n || k <= 0) return 0;
+
+    // A leaf comes off the heap only once nothing left can
+    // beat it, so leaves come off in score order
+    int len = 0, cap = 64, res = 0;
+    topk_entry *heap = (topk_entry*)malloc(cap * sizeof(topk_entry));
+    if (!heap) return -1;
+    res = topk_push(&heap, &len, &cap, subtree_score(t, n), n);
+    while (!res && len && k) {
+        n = topk_pop(heap, &len);
+        if (IS_LEAF(n)) {
+            uint32_t key_len;
+            const unsigned char *key = leaf_key(t, n, &key_len);
+            res = cb(data, key, key_len, leaf_value(t, n));
+            k--;
+            continue;
+        }
+        for (int idx = next_child(n, -1); idx >= 0 && !res; idx = next_child(n, idx)) {
+            art_node *child = child_at(n, idx);
+            res = topk_push(&heap, &len, &cap, subtree_score(t, child), child);
+        }
+    }
+    free(heap);
+    return res;
+}
+
+/**
+ * State of one art_fuzzy_search. rows holds one edit distance
+ * row per key byte on the current path, each query_len + 1
+ * wide, so going back up a level needs no undo.
+ */
+typedef struct {
+    const art_tree *t;
+    const unsigned char *query;
+    int query_len;
+    int max_edits;
+    int *rows;
+    int depths;
+    art_callback cb;
+    void *data;
+} fuzzy_search;
+
+// Fills in the row for one more key byte after depth bytes
+// and returns its smallest entry, or -1 if it could not grow
+static int fuzzy_step(fuzzy_search *s, int depth, unsigned char c) {
+    int w = s->query_len + 1;
+    if (depth + 1 >= s->depths) {
+        int depths = s->depths * 2;
+        int *rows = (int*)realloc(s->rows, (size_t)depths * w * sizeof(int));
+        if (!rows) return -1;
+        s->rows = rows;
+        s->depths = depths;
+    }
+    const int *prev = s->rows + (size_t)depth * w;
+    int *row = s->rows + (size_t)(depth + 1) * w;
+    int best = row[0] = prev[0] + 1;
+    for (int j=1; j < w; j++) {
+        int d = prev[j-1] + (s->query[j-1] != c);
+        if (prev[j] + 1 < d) d = prev[j] + 1;
+        if (row[j-1] + 1 < d) d = row[j-1] + 1;
+        row[j] = d;
+        if (d < best) best = d;
+    }
+    return best;
+}
+
+// Walks a subtree entered after depth key bytes, pruning it once
+// no key below can come within max_edits of the query
+static int fuzzy_recurse(fuzzy_search *s, const art_node *n, int depth) {
+    int w = s->query_len + 1, best;
+    if (IS_LEAF(n)) {
+        // Finish the key from where the path left off
+        uint32_t key_len;
+        const unsigned char *key = leaf_key(s->t, n, &key_len);
+        for (; depth < (int)key_len; depth++) {
+            best = fuzzy_step(s, depth, key[depth]);
+            if (best < 0) return -1;
+            if (best > s->max_edits) return 0;
+        }
+        if (s->rows[(size_t)depth * w + s->query_len] > s->max_edits)
+            return 0;
+        return s->cb(s->data, key, key_len, leaf_value(s->t, n));
+    }
+
+    // Take in the whole prefix, reading the bytes past the
+    // stored part from a leaf below
+    if (n->partial_len) {
+        const unsigned char *prefix = n->partial;
+        if (n->partial_len > MAX_PREFIX_LEN) {
+            uint32_t key_len;
+            prefix = leaf_key(s->t, min_child(n), &key_len) + depth;
+        }
+        for (uint32_t i=0; i < n->partial_len; i++) {
+            best = fuzzy_step(s, depth + i, prefix[i]);
+            if (best < 0) return -1;
+            if (best > s->max_edits) return 0;
+        }
+        depth = depth + n->partial_len;
+    }
+
+    // A leaf child starts over from this depth, as its key may
+    // end here and have no byte for the edge it sits under
+    for (int idx = next_child(n, -1); idx >= 0; idx = next_child(n, idx)) {
+        const art_node *child = child_at(n, idx);
+        int res;
+        if (IS_LEAF(child)) {
+            res = fuzzy_recurse(s, child, depth);
+        } else {
+            best = fuzzy_step(s, depth, child_key(n, idx));
+            if (best < 0) return -1;
+            res = best > s->max_edits ? 0 : fuzzy_recurse(s, child, depth + 1);
+        }
+        if (res) return res;
+    }
+    return 0;
+}
+
+/**
+ * Invokes the callback on every key within max_edits
+ * edits of the query, in key order.
+ * @return 0 on success, -1 if the rows could not grow,
+ * or the return of the callback.
+ */
+int art_fuzzy_search(const art_tree *t, const unsigned char *query, int query_len, int max_edits,
+        art_callback cb, void *data) {
+    if (!t->root || max_edits < 0) return 0;
+    fuzzy_search s = {t, query, query_len, max_edits, NULL, 0, cb, data};
+    s.depths = 64;
+    s.rows = (int*)malloc((size_t)s.depths * (query_len + 1) * sizeof(int));
+    if (!s.rows) return -1;
+
+    // Matching no key bytes costs one edit per query byte
+    for (int j=0; j <= query_len; j++)
+        s.rows[j] = j;
+    int res = fuzzy_recurse(&s, t->root, 0);
+    free(s.rows);
+    return res;
+}
+
+// Walks a subtree entered after depth key bytes with the DFA
+// in state, leaving it once the state is dead
+static int pattern_recurse(const art_tree *t, const art_dfa *d, const art_node *n, int depth,
+        int state, art_callback cb, void *data) {
+    if (IS_LEAF(n)) {
+        uint32_t key_len;
+        const unsigned char *key = leaf_key(t, n, &key_len);
+        for (; depth < (int)key_len && state; depth++)
+            state = art_dfa_step(d, state, key[depth]);
+        if (!d->accept[state]) return 0;
+        return cb(data, key, key_len, leaf_value(t, n));
+    }
+    if (d->is_all[state])
+        return recursive_iter(t, (art_node*)n, cb, data);
+
+    // Step over the whole prefix, reading the bytes past the
+    // stored part from a leaf below
+    if (n->partial_len) {
+        const unsigned char *prefix = n->partial;
+        if (n->partial_len > MAX_PREFIX_LEN) {
+            uint32_t key_len;
+            prefix = leaf_key(t, min_child(n), &key_len) + depth;
+        }
+        for (uint32_t i=0; i < n->partial_len; i++) {
+            state = art_dfa_step(d, state, prefix[i]);
+            if (!state) return 0;
+        }
+        depth = depth + n->partial_len;
+        if (d->is_all[state])
+            return recursive_iter(t, (art_node*)n, cb, data);
+    }
+
+    // A leaf child goes on from this depth, as its key may
+    // end here and have no byte for the edge it sits under
+    for (int idx = next_child(n, -1); idx >= 0; idx = next_child(n, idx)) {
+        const art_node *child = child_at(n, idx);
+        int res;
+        if (IS_LEAF(child)) {
+            res = pattern_recurse(t, d, child, depth, state, cb, data);
+        } else {
+            int next = art_dfa_step(d, state, child_key(n, idx));
+            res = next ? pattern_recurse(t, d, child, depth + 1, next, cb, data) : 0;
+        }
+        if (res) return res;
+    }
+    return 0;
+}
+
+/**
+ * Invokes the callback on every key the pattern accepts,
+ * in key order.
+ * @return 0 on success, or the return of the callback.
+ */
+int art_iter_pattern(const art_tree *t, const struct art_dfa *dfa, art_callback cb, void *data) {
+    if (!t->root || !dfa->start) return 0;
+    return pattern_recurse(t, dfa, t->root, 0, dfa->start, cb, data);
+}
+
+/**
+ * Layout of a saved tree. Nodes mirror the in-memory ones,
+ * with children stored as offsets from the start of the file.
+ * Offset 0 is the header, so it doubles as NULL, and the low
+ * bit tags leaves as in memory.
+ */
+#define ART_MAP_MAGIC "ARTMAP\0\0"
+#define ART_MAP_VERSION 2   // Adds NODE32, version 1 files read the same
+#define ART_MAP_BYTE_ORDER 0x01020304
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t max_prefix_len;
+    uint32_t reserved;
+    uint64_t size;
+    uint64_t root;
+    uint64_t file_len;
+} map_header;
+
+typedef struct {
+    uint32_t partial_len;
+    uint8_t type;
+    uint8_t num_children;
+    unsigned char partial[MAX_PREFIX_LEN];
+} map_node;
+
+typedef struct {
+    map_node n;
+    unsigned char keys[4];
+    uint64_t children[4];
+} map_node4;
+
+typedef struct {
+    map_node n;
+    unsigned char keys[16];
+    uint64_t children[16];
+} map_node16;
+
+typedef struct {
+    map_node n;
+    unsigned char keys[32];
+    uint64_t children[32];
+} map_node32;
+
+typedef struct {
+    map_node n;
+    unsigned char keys[256];
+    uint64_t children[48];
+} map_node48;
+
+typedef struct {
+    map_node n;
+    uint64_t children[256];
+} map_node256;
+
+typedef struct {
+    uint64_t value;
+    uint32_t key_len;
+    unsigned char key[];
+} map_leaf;
+
+#define MAP_IS_LEAF(r) ((r) & 1)
+#define MAP_NODE(m, r) ((const map_node*)((m)->base + (r)))
+#define MAP_LEAF(m, r) ((const map_leaf*)((m)->base + ((r) & ~(uint64_t)1)))
+
+typedef struct {
+    FILE *f;
+    uint64_t off;
+    int err;
+} map_writer;
+
+// Appends to the file, padded to 8 bytes
+static uint64_t map_write(map_writer *w, const void *buf, size_t len) {
+    static const char pad[8];
+    uint64_t at = w->off;
+    size_t pad_len = ((len + 7) & ~(size_t)7) - len;
+    if (fwrite(buf, 1, len, w->f) != len || fwrite(pad, 1, pad_len, w->f) != pad_len)
+        w->err = 1;
+    w->off += len + pad_len;
+    return at;
+}
+
+// Writes the children before their parent, so
+// every offset is known by the time it is stored
+static uint64_t map_save_node(map_writer *w, const art_node *n) {
+    if (!n) return 0;
+    if (IS_LEAF(n)) {
+        art_leaf *l = LEAF_RAW(n);
+        size_t len = sizeof(map_leaf) + l->key_len;
+        map_leaf *ml = (map_leaf*)calloc(1, len);
+        if (!ml) {
+            w->err = 1;
+            return 0;
+        }
+        ml->value = (uintptr_t)l->value;
+        ml->key_len = l->key_len;
+        memcpy(ml->key, l->key, l->key_len);
+        uint64_t at = map_write(w, ml, offsetof(map_leaf, key) + l->key_len);
+        free(ml);
+        return at | 1;
+    }
+
+    union {
+        map_node n;
+        map_node4 n4;
+        map_node16 n16;
+        map_node32 n32;
+        map_node48 n48;
+        map_node256 n256;
+    } out;
+    size_t len;
+    int i;
+    memset(&out, 0, sizeof(out));
+    out.n.partial_len = n->partial_len;
+    out.n.type = n->type;
+    out.n.num_children = n->num_children;
+    memcpy(out.n.partial, n->partial, MAX_PREFIX_LEN);
+    switch (n->type) {
+        case NODE4:
+            memcpy(out.n4.keys, ((art_node4*)n)->keys, 4);
+            for (i=0; i < n->num_children; i++)
+                out.n4.children[i] = map_save_node(w, ((art_node4*)n)->children[i]);
+            len = sizeof(map_node4);
+            break;
+        case NODE16:
+            memcpy(out.n16.keys, ((art_node16*)n)->keys, 16);
+            for (i=0; i < n->num_children; i++)
+                out.n16.children[i] = map_save_node(w, ((art_node16*)n)->children[i]);
+            len = sizeof(map_node16);
+            break;
+        case NODE32:
+            memcpy(out.n32.keys, ((art_node32*)n)->keys, 32);
+            for (i=0; i < n->num_children; i++)
+                out.n32.children[i] = map_save_node(w, ((art_node32*)n)->children[i]);
+            len = sizeof(map_node32);
+            break;
+        case NODE48:
+            memcpy(out.n48.keys, ((art_node48*)n)->keys, 256);
+            for (i=0; i < 48; i++)
+                out.n48.children[i] = map_save_node(w, ((art_node48*)n)->children[i]);
+            len = sizeof(map_node48);
+            break;
+        case NODE256:
+            for (i=0; i < 256; i++)
+                out.n256.children[i] = map_save_node(w, ((art_node256*)n)->children[i]);
+            len = sizeof(map_node256);
+            break;
+        default:
+            abort();
+    }
+    return map_write(w, &out, len);
+}
+
+/**
+ * Writes the tree to a file that art_map_open can map.
+ */
+int art_tree_save(const art_tree *t, const char *path) {
+    map_header h;
+    map_writer w;
+    if (t->flags & ART_INLINE_VALUES) return -1;
+    memset(&h, 0, sizeof(h));
+    w.f = fopen(path, "wb");
+    if (!w.f) return -1;
+    w.off = 0;
+    w.err = 0;
+
+    // Reserve the header, it is filled in last
+    map_write(&w, &h, sizeof(h));
+    h.root = map_save_node(&w, t->root);
+    memcpy(h.magic, ART_MAP_MAGIC, sizeof(h.magic));
+    h.version = ART_MAP_VERSION;
+    h.byte_order = ART_MAP_BYTE_ORDER;
+    h.max_prefix_len = MAX_PREFIX_LEN;
+    h.size = t->size;
+    h.file_len = w.off;
+    if (fseek(w.f, 0, SEEK_SET) || fwrite(&h, sizeof(h), 1, w.f) != 1)
+        w.err = 1;
+    if (fclose(w.f) || w.err) {
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Maps a file written by art_tree_save.
+ */
+int art_map_open(art_map *m, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(map_header)) {
+        close(fd);
+        return -1;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return -1;
+
+    const map_header *h = (const map_header*)base;
+    if (memcmp(h->magic, ART_MAP_MAGIC, sizeof(h->magic)) ||
+            h->version < 1 || h->version > ART_MAP_VERSION ||
+            h->byte_order != ART_MAP_BYTE_ORDER ||
+            h->max_prefix_len != MAX_PREFIX_LEN ||
+            h->file_len != (uint64_t)st.st_size) {
+        munmap(base, st.st_size);
+        return -1;
+    }
+    m->base = (const unsigned char*)base;
+    m->len = st.st_size;
+    m->root = h->root;
+    m->size = h->size;
+    return 0;
+}
+
+/**
+ * Unmaps a file mapped by art_map_open.
+ */
+int art_map_close(art_map *m) {
+    int res = munmap((void*)m->base, m->len);
+    m->base = NULL;
+    m->len = 0;
+    m->root = 0;
+    m->size = 0;
+    return res;
+}
+
+static uint64_t map_find_child(const map_node *n, unsigned char c) {
+    int i;
+    switch (n->type) {
+        case NODE4: {
+            const map_node4 *p = (const map_node4*)n;
+            for (i=0; i < n->num_children; i++) {
+                if (p->keys[i] == c)
+                    return p->children[i];
+            }
+            break;
+        }
+        case NODE16: {
+            const map_node16 *p = (const map_node16*)n;
+            for (i=0; i < n->num_children; i++) {
+                if (p->keys[i] == c)
+                    return p->children[i];
+            }
+            break;
+        }
+        case NODE32: {
+            const map_node32 *p = (const map_node32*)n;
+            for (i=0; i < n->num_children; i++) {
+                if (p->keys[i] == c)
+                    return p->children[i];
+            }
+            break;
+        }
+        case NODE48: {
+            const map_node48 *p = (const map_node48*)n;
+            i = p->keys[c];
+            if (i)
+                return p->children[i-1];
+            break;
+        }
+        case NODE256:
+            return ((const map_node256*)n)->children[c];
+        default:
+            abort();
+    }
+    return 0;
+}
+
+static int map_check_prefix(const map_node *n, const unsigned char *key, int key_len, int depth) {
+    int max_cmp = min(min(n->partial_len, MAX_PREFIX_LEN), key_len - depth);
+    int idx;
+    for (idx=0; idx < max_cmp; idx++) {
+        if (n->partial[idx] != key[depth+idx])
+            return idx;
+    }
+    return idx;
+}
+
+/**
+ * Searches for a value in a mapped tree
+ */
+void* art_map_search(const art_map *m, const unsigned char *key, int key_len) {
+    uint64_t r = m->root;
+    int prefix_len, depth = 0;
+    while (r) {
+        // Might be a leaf
+        if (MAP_IS_LEAF(r)) {
+            const map_leaf *l = MAP_LEAF(m, r);
+            if (l->key_len == (uint32_t)key_len && !memcmp(l->key, key, key_len))
+                return (void*)(uintptr_t)l->value;
+            return NULL;
+        }
+
+        // Bail if the prefix does not match
+        const map_node *n = MAP_NODE(m, r);
+        if (n->partial_len) {
+            prefix_len = map_check_prefix(n, key, key_len, depth);
+            if (prefix_len != min(MAX_PREFIX_LEN, n->partial_len))
+                return NULL;
+            depth = depth + n->partial_len;
+        }
+        if (depth > key_len) return NULL;
+
+        r = map_find_child(n, key_at(key, key_len, depth));
+        depth++;
+    }
+    return NULL;
+}
+
+// Find the minimum leaf under a mapped node
+static const map_leaf* map_minimum(const art_map *m, uint64_t r) {
+    while (r && !MAP_IS_LEAF(r)) {
+        const map_node *n = MAP_NODE(m, r);
+        int idx = 0;
+        switch (n->type) {
+            case NODE4:
+                r = ((const map_node4*)n)->children[0];
+                break;
+            case NODE16:
+                r = ((const map_node16*)n)->children[0];
+                break;
+            case NODE32:
+                r = ((const map_node32*)n)->children[0];
+                break;
+            case NODE48:
+                while (!((const map_node48*)n)->keys[idx]) idx++;
+                r = ((const map_node48*)n)->children[((const map_node48*)n)->keys[idx] - 1];
+                break;
+            case NODE256:
+                while (!((const map_node256*)n)->children[idx]) idx++;
+                r = ((const map_node256*)n)->children[idx];
+                break;
+            default:
+                abort();
+        }
+    }
+    return r ? MAP_LEAF(m, r) : NULL;
+}
+
+// Recursively iterates over a mapped subtree
+static int map_recursive_iter(const art_map *m, uint64_t r, art_callback cb, void *data) {
+    // Handle base cases
+    if (!r) return 0;
+    if (MAP_IS_LEAF(r)) {
+        const map_leaf *l = MAP_LEAF(m, r);
+        return cb(data, l->key, l->key_len, (void*)(uintptr_t)l->value);
+    }
+
+    const map_node *n = MAP_NODE(m, r);
+    int i, idx, res;
+    switch (n->type) {
+        case NODE4:
+            for (i=0; i < n->num_children; i++) {
+                res = map_recursive_iter(m, ((const map_node4*)n)->children[i], cb, data);
+                if (res) return res;
+            }
+            break;
+        case NODE16:
+            for (i=0; i < n->num_children; i++) {
+                res = map_recursive_iter(m, ((const map_node16*)n)->children[i], cb, data);
+                if (res) return res;
+            }
+            break;
+        case NODE32:
+            for (i=0; i < n->num_children; i++) {
+                res = map_recursive_iter(m, ((const map_node32*)n)->children[i], cb, data);
+                if (res) return res;
+            }
+            break;
+        case NODE48:
+            for (i=0; i < 256; i++) {
+                idx = ((const map_node48*)n)->keys[i];
+                if (!idx) continue;
+                res = map_recursive_iter(m, ((const map_node48*)n)->children[idx-1], cb, data);
+                if (res) return res;
+            }
+            break;
+        case NODE256:
+            for (i=0; i < 256; i++) {
+                if (!((const map_node256*)n)->children[i]) continue;
+                res = map_recursive_iter(m, ((const map_node256*)n)->children[i], cb, data);
+                if (res) return res;
+            }
+            break;
+        default:
+            abort();
+    }
+    return 0;
+}
+
+/**
+ * Iterates through the entries of a mapped tree.
+ */
+int art_map_iter(const art_map *m, art_callback cb, void *data) {
+    return map_recursive_iter(m, m->root, cb, data);
+}
+
+/**
+ * Iterates through the entries of a mapped
+ * tree that match a given prefix.
+ */
+int art_map_iter_prefix(const art_map *m, const unsigned char *key, int key_len, art_callback cb, void *data) {
+    uint64_t r = m->root;
+    int i, prefix_len, depth = 0;
+    while (r) {
+        // Might be a leaf
+        if (MAP_IS_LEAF(r)) {
+            const map_leaf *l = MAP_LEAF(m, r);
+            if (l->key_len >= (uint32_t)key_len && !memcmp(l->key, key, key_len))
+                return cb(data, l->key, l->key_len, (void*)(uintptr_t)l->value);
+            return 0;
+        }
+
+        // If the depth matches the prefix, we need to handle this node
+        if (depth == key_len) {
+            const map_leaf *l = map_minimum(m, r);
+            if (l->key_len >= (uint32_t)key_len && !memcmp(l->key, key, key_len))
+                return map_recursive_iter(m, r, cb, data);
+            return 0;
+        }
+
+        // Bail if the prefix does not match, reading
+        // bytes past MAX_PREFIX_LEN from a leaf
+        const map_node *n = MAP_NODE(m, r);
+        if (n->partial_len) {
+            const map_leaf *l = n->partial_len > MAX_PREFIX_LEN ? map_minimum(m, r) : NULL;
+            int max_cmp = min(n->partial_len, key_len - depth);
+            for (i=0; i < max_cmp; i++) {
+                unsigned char p = i < MAX_PREFIX_LEN ? n->partial[i] : l->key[depth+i];
+                if (p != key[depth+i]) break;
+            }
+            prefix_len = i;
+
+            // If there is no match, search is terminated
+            if (!prefix_len) {
+                return 0;
+
+            // If we've matched the prefix, iterate on this node
+            } else if (depth + prefix_len == key_len) {
+                return map_recursive_iter(m, r, cb, data);
+            }
+
+            // Partial matches end the search too
+            if ((uint32_t)prefix_len < n->partial_len)
+                return 0;
+            depth = depth + n->partial_len;
+        }
+
+        r = map_find_child(n, key[depth]);
+        depth++;
+    }
+    return 0;
+}
+
+/**
+ * Copies the counters of the calling thread.
+ */
+void art_stats_get(art_stats *s) {
+#ifdef ART_STATS
+    *s = thread_stats;
+#else
+    memset(s, 0, sizeof(art_stats));
+#endif
+}
+
+/**
+ * Zeroes the counters of the calling thread.
+ */
+void art_stats_reset(void) {
+#ifdef ART_STATS
+    memset(&thread_stats, 0, sizeof(art_stats));
+#endif
+}
+
+/**
+ * Adds one snapshot into another.
+ */
+void art_stats_merge(art_stats *into, const art_stats *from) {
+    for (int i=0; i < ART_NODE_TYPES; i++) {
+        into->grows[i] += from->grows[i];
+        into->shrinks[i] += from->shrinks[i];
+        into->node_allocs[i] += from->node_allocs[i];
+        into->node_frees[i] += from->node_frees[i];
+    }
+    into->leaf_allocs += from->leaf_allocs;
+    into->leaf_frees += from->leaf_frees;
+    into->prefix_leaf_reads += from->prefix_leaf_reads;
+    into->searches += from->searches;
+    into->search_depth += from->search_depth;
+    if (into->max_search_depth < from->max_search_depth)
+        into->max_search_depth = from->max_search_depth;
+    into->leaf_mismatches += from->leaf_mismatches;
+}
+
+/**
+ * Returns the bytes malloc set aside for an allocation
+ * of the given size, where the platform can tell.
+ */
+static size_t usable_size(void *p, size_t size) {
+#if defined(__APPLE__)
+    return malloc_size(p);
+#elif defined(__GLIBC__)
+    (void)size;
+    return malloc_usable_size(p);
+#else
+    (void)p;
+    return size;
+#endif
+}
+
+static void analyze_node(const art_tree *t, art_node *n, uint32_t depth, art_analysis *a) {
+    static const int capacity[] = {4, 16, 48, 256, 32};
+    if (IS_LEAF(n)) {
+        uint32_t key_len;
+        leaf_key(t, n, &key_len);
+        a->leaves++;
+        a->key_bytes += key_len;
+        a->leaf_depth[min(depth, ART_DEPTH_BUCKETS - 1)]++;
+        if (depth > a->max_leaf_depth) a->max_leaf_depth = depth;
+        if (t->flags & ART_INLINE_VALUES) return;
+        size_t size = t->arena ? leaf_alloc_size(key_len) : sizeof(art_leaf) + key_len;
+        a->leaf_bytes += size;
+        if (!t->arena) a->leaf_usable += usable_size(LEAF_RAW(n), size);
+        return;
+    }
+
+    // A full node256 wraps num_children, so count them
+    int type = n->type - 1, children = 0;
+    for (int idx = next_child(n, -1); idx >= 0; idx = next_child(n, idx)) {
+        analyze_node(t, child_at(n, idx), depth + 1, a);
+        children++;
+    }
+    size_t size = node_header(t) + node_sizes[n->type];
+    a->nodes[type]++;
+    a->node_bytes[type] += size;
+    if (!t->pools) a->node_usable[type] += usable_size(node_base(t, n), size);
+    a->fill[type][min(children * ART_FILL_BUCKETS / capacity[type], ART_FILL_BUCKETS - 1)]++;
+    a->partial_len[min(n->partial_len, MAX_PREFIX_LEN + 1)]++;
+    if (n->partial_len > a->max_partial_len) a->max_partial_len = n->partial_len;
+}
+
+/**
+ * Walks the whole tree and reports its shape and memory use.
+ */
+void art_analyze(const art_tree *t, art_analysis *a) {
+    memset(a, 0, sizeof(art_analysis));
+    if (t->root) analyze_node(t, t->root, 0, a);
+
+    // Pooled nodes and arena leaves hold whole slabs and chunks
+    if (t->pools) {
+        for (int i=0; i < ART_NODE_TYPES; i++) {
+            for (art_slab *s = t->pools[i].slabs; s; s = s->next)
+                a->node_usable[i] += usable_size(s, ART_SLAB_SIZE);
+        }
+    }
+    if (t->arena) {
+        for (art_slab *s = t->arena->chunks; s; s = s->next)
+            a->leaf_usable += usable_size(s, ART_ARENA_CHUNK_SIZE);
+    }
+
+    a->bytes = sizeof(art_tree) + a->leaf_bytes;
+    a->usable = sizeof(art_tree) + a->leaf_usable;
+    for (int i=0; i < ART_NODE_TYPES; i++) {
+        a->bytes += a->node_bytes[i];
+        a->usable += a->node_usable[i];
+    }
+}
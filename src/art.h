@@ -10,8 +10,75 @@ extern "C" {
 #define NODE16  2
 #define NODE48  3
 #define NODE256 4
+#define NODE32  5   // Came after the others, which keep their codes
 
+/**
+ * Number of node types, which is also the highest type code
+ */
+#define ART_NODE_TYPES 5
+
+/**
+ * Prefix bytes kept inline in every inner node. Keys with
+ * long shared prefixes benefit from a larger value; the
+ * library and everything including this header must be
+ * built with the same one.
+ */
+#ifndef MAX_PREFIX_LEN
 #define MAX_PREFIX_LEN 10
+#endif
+
+/**
+ * Flags accepted by art_tree_init_flags
+ */
+#define ART_NODE_POOL 1     // Carve inner nodes out of per-type slabs
+#define ART_LEAF_ARENA 2    // Bump-allocate leaves out of large chunks
+#define ART_OPTIMISTIC_PREFIX 4 // Skip prefixes on lookup, verify at the leaf
+#define ART_INLINE_VALUES 8 // Set by art_tree_init_inline
+#define ART_SUBTREE_COUNT 16 // Keep the number of leaves under every inner node
+#define ART_MAX_SCORE 32    // Keep the highest value score under every inner node
+
+/**
+ * What an insert did, reported by art_insert_status and
+ * art_insert_hint_status. A key conflicts if it cannot be
+ * stored next to one already in the tree: keys read as if
+ * they ended in a 0 byte, so a key followed by a 0 byte and
+ * more would take the slot of the key itself. The tree is
+ * then left as it was.
+ */
+#define ART_KEY_ADDED 0         // The key was new
+#define ART_KEY_FOUND 1         // The key was there, its old value is returned
+#define ART_KEY_CONFLICT (-1)   // The key was refused
+
+/**
+ * Size of each slab requested from malloc
+ * when ART_NODE_POOL is set.
+ */
+#ifndef ART_SLAB_SIZE
+#define ART_SLAB_SIZE (64 * 1024)
+#endif
+
+/**
+ * Size of each chunk requested from malloc
+ * when ART_LEAF_ARENA is set.
+ */
+#ifndef ART_ARENA_CHUNK_SIZE
+#define ART_ARENA_CHUNK_SIZE (1024 * 1024)
+#endif
+
+/**
+ * Deleted arena leaves are kept on free lists
+ * in 8 byte size classes up to this many classes.
+ * Larger leaves share a single exact-size list.
+ */
+#define ART_ARENA_CLASSES 64
+
+/**
+ * Number of lookups art_search_batch keeps
+ * in flight at the same time.
+ */
+#ifndef ART_BATCH_WINDOW
+#define ART_BATCH_WINDOW 16
+#endif
 
 #if defined(__GNUC__) && !defined(__clang__)
 # if __STDC_VERSION__ >= 199901L && 402 == (__GNUC__ * 100 + __GNUC_MINOR__)
@@ -26,6 +93,18 @@ extern "C" {
 
 typedef int(*art_callback)(void *data, const unsigned char *key, uint32_t key_len, void *value);
 
+/**
+ * Returns the key stored under a value, and sets its
+ * length, for trees made by art_tree_init_inline.
+ */
+typedef const unsigned char*(*art_key_loader)(void *data, void *value, uint32_t *key_len);
+
+/**
+ * Returns the score of a value, for trees made by
+ * art_tree_init_scored. Higher scores come first.
+ */
+typedef uint64_t(*art_scorer)(void *data, void *value);
+
 /**
  * This struct is included as part
  * of all the various node sizes
@@ -55,6 +134,16 @@ typedef struct {
     art_node *children[16];
 } art_node16;
 
+/**
+ * Node with 32 children, searched with one
+ * AVX2 compare or two SSE2 ones.
+ */
+typedef struct {
+    art_node n;
+    unsigned char keys[32];
+    art_node *children[32];
+} art_node32;
+
 /**
  * Node with 48 children, but
  * a full 256 byte field.
@@ -83,20 +172,221 @@ typedef struct {
     unsigned char key[];
 } art_leaf;
 
+/**
+ * Free list and slab chain for one node size.
+ */
+typedef struct art_slab art_slab;
+typedef struct {
+    void *free_list;
+    art_slab *slabs;
+    char *bump;
+    char *end;
+} art_node_pool;
+
+/**
+ * Chunk chain and size-class free lists for leaves.
+ */
+typedef struct {
+    void *free_lists[ART_ARENA_CLASSES];
+    void *large_free;
+    art_slab *chunks;
+    char *bump;
+    char *end;
+} art_leaf_arena;
+
 /**
  * Main struct, points to root.
  */
 typedef struct {
     art_node *root;
     uint64_t size;
+    int flags;
+    art_node_pool *pools;
+    art_leaf_arena *arena;
+    art_key_loader loader;
+    void *loader_data;
+    art_scorer scorer;
+    void *scorer_data;
+    uint64_t mods;      // Bumped by every insert or delete that reshapes the tree
 } art_tree;
 
+/**
+ * Levels and leading key bytes an insert hint remembers
+ */
+#define ART_HINT_DEPTH 32
+#define ART_HINT_KEY_LEN 128
+
+/**
+ * The path taken by the last art_insert_hint, as the slot
+ * of each node from the root down and the key depth it was
+ * entered at. The next insert resumes from the deepest node
+ * whose leading bytes it shares with the previous key. Any
+ * other insert or delete that reshapes the tree sends it
+ * back to the root.
+ */
+typedef struct {
+    const art_tree *t;
+    uint64_t mods;
+    int levels;
+    uint32_t key_len;
+    art_node **refs[ART_HINT_DEPTH];
+    uint32_t depths[ART_HINT_DEPTH];
+    unsigned char key[ART_HINT_KEY_LEN];
+} art_hint;
+
+/**
+ * What the hot paths did, counted when the library is built
+ * with ART_STATS defined and always zero otherwise. Each thread
+ * counts into its own copy, so counting takes no locks and
+ * shares no cache lines. Per type arrays are indexed by node
+ * type - 1.
+ */
+typedef struct {
+    uint64_t grows[ART_NODE_TYPES];          // Nodes of each type full on add_child and replaced
+    uint64_t shrinks[ART_NODE_TYPES];        // Nodes of each type replaced on remove_child, a node4 by its child
+    uint64_t node_allocs[ART_NODE_TYPES];
+    uint64_t node_frees[ART_NODE_TYPES];     // Frees while the tree is in use, not by art_tree_destroy
+    uint64_t leaf_allocs;
+    uint64_t leaf_frees;
+    uint64_t prefix_leaf_reads; // Inserts comparing a prefix past MAX_PREFIX_LEN against a leaf
+    uint64_t searches;          // Calls to art_search
+    uint64_t search_depth;      // Inner nodes those searches went through
+    uint64_t max_search_depth;
+    uint64_t leaf_mismatches;   // Searches that ended on a leaf with another key
+} art_stats;
+
+/**
+ * Buckets of the histograms in art_analysis
+ */
+#define ART_FILL_BUCKETS 10
+#define ART_DEPTH_BUCKETS 64
+
+/**
+ * Shape and memory use of a tree, as filled in by art_analyze.
+ * Per type arrays are indexed by node type - 1. Bytes count
+ * what the tree asked for, usable bytes what the allocator set
+ * aside: malloc_usable_size of each node and leaf, or whole
+ * slabs and chunks with ART_NODE_POOL and ART_LEAF_ARENA.
+ */
+typedef struct {
+    uint64_t nodes[ART_NODE_TYPES];
+    uint64_t node_bytes[ART_NODE_TYPES];     // With the words kept in front of each node
+    uint64_t node_usable[ART_NODE_TYPES];
+    uint64_t fill[ART_NODE_TYPES][ART_FILL_BUCKETS]; // Nodes by children per tenth of capacity, full ones in the last
+    uint64_t partial_len[MAX_PREFIX_LEN + 2]; // Nodes by prefix length, longer than MAX_PREFIX_LEN in the last
+    uint32_t max_partial_len;
+    uint64_t leaves;
+    uint64_t key_bytes;
+    uint64_t leaf_bytes;        // None in trees made by art_tree_init_inline
+    uint64_t leaf_usable;
+    uint64_t leaf_depth[ART_DEPTH_BUCKETS]; // Leaves by inner nodes above them, deeper ones in the last
+    uint32_t max_leaf_depth;
+    uint64_t bytes;             // All of the above and the art_tree itself
+    uint64_t usable;
+} art_analysis;
+
+/**
+ * One level of an iterator's path: an inner node
+ * and the child the iterator went down into.
+ * For art_node4, art_node16 and art_node32 idx is a position in
+ * children, for the bigger nodes it is the key byte.
+ */
+typedef struct {
+    art_node *node;
+    int idx;
+} art_iter_frame;
+
+/**
+ * Pull-based cursor over the tree in key order.
+ * Any insert or delete on the tree invalidates it.
+ */
+typedef struct {
+    const art_tree *t;
+    art_iter_frame *stack;
+    int top;
+    int cap;
+    art_leaf *leaf;
+} art_iterator;
+
+/**
+ * A tree saved by art_tree_save, mapped read-only
+ * into memory. Nodes refer to each other by file
+ * offset, so it is used in place.
+ */
+typedef struct {
+    const unsigned char *base;
+    uint64_t len;
+    uint64_t root;
+    uint64_t size;
+} art_map;
+
 /**
  * Initializes an ART tree
  * @return 0 on success.
  */
 int art_tree_init(art_tree *t);
 
+/**
+ * Initializes an ART tree with optional behaviour.
+ * With ART_NODE_POOL inner nodes come from per-type slabs,
+ * freed nodes are reused on grow/shrink, and destroy
+ * releases the slabs in bulk.
+ * With ART_LEAF_ARENA leaves are bump-allocated out of large
+ * chunks and deleted leaves are reused by later inserts.
+ * When both are set art_tree_destroy frees the chunks
+ * without walking the tree.
+ * With ART_OPTIMISTIC_PREFIX search and delete step over
+ * node prefixes without comparing them, and the full key
+ * compare at the leaf catches any mismatch. Lookups then
+ * never read the stored prefix bytes, so a smaller
+ * MAX_PREFIX_LEN only costs inserts.
+ * With ART_SUBTREE_COUNT every inner node keeps the number
+ * of leaves below it, so art_rank, art_select and
+ * art_count_range take one walk down. Each node takes 8
+ * more bytes and inserts and deletes update the counts
+ * along their path.
+ * With ART_MAX_SCORE every inner node keeps the highest
+ * score of a value below it, so art_topk_prefix only opens
+ * the subtrees that can still hold one of the top keys.
+ * Values are their own score unless the tree was made by
+ * art_tree_init_scored. Each node takes 8 more bytes, and
+ * deletes and lowered scores rescan the nodes on their path.
+ * @arg t The tree
+ * @arg flags Bitwise OR of ART_* flags, or 0
+ * @return 0 on success.
+ */
+int art_tree_init_flags(art_tree *t, int flags);
+
+/**
+ * Initializes an ART tree without leaves. Each value is
+ * stored in its child slot, tagged the way leaf pointers
+ * are, so values must fit in the low 63 bits of a pointer.
+ * Keys are not copied: the loader returns the key of a
+ * value whenever one is needed to verify a lookup or to
+ * split a node, so they must outlive the tree.
+ * art_minimum, art_maximum, the bounds, art_select, the
+ * iterator and art_tree_save deal in art_leaf, and do not
+ * work on such a tree.
+ * @arg t The tree
+ * @arg flags Bitwise OR of ART_* flags, or 0
+ * @arg loader Returns the key of a value
+ * @arg data Opaque handle passed to the loader
+ * @return 0 on success.
+ */
+int art_tree_init_inline(art_tree *t, int flags, art_key_loader loader, void *data);
+
+/**
+ * Initializes an ART tree with ART_MAX_SCORE, taking the
+ * score of each value from a callback. The score of a
+ * stored value must not change while it is in the tree.
+ * @arg t The tree
+ * @arg flags Bitwise OR of ART_* flags, or 0
+ * @arg scorer Returns the score of a value
+ * @arg data Opaque handle passed to the scorer
+ * @return 0 on success.
+ */
+int art_tree_init_scored(art_tree *t, int flags, art_scorer scorer, void *data);
+
 /**
  * DEPRECATED
  * Initializes an ART tree
@@ -134,8 +424,8 @@ inline uint64_t art_size(art_tree *t) {
  * @arg key the key
  * @arg key_len the length of the key
  * @arg value opaque value.
- * @return null if the item was newly inserted, otherwise
- * the old value pointer is returned.
+ * @return null if the item was newly inserted or refused, see
+ * art_insert_status, otherwise the old value pointer is returned.
  */
 void* art_insert(art_tree *t, const unsigned char *key, int key_len, void *value);
 
@@ -145,11 +435,70 @@ void* art_insert(art_tree *t, const unsigned char *key, int key_len, void *value
  * @arg key the key
  * @arg key_len the length of the key
  * @arg value opaque value.
- * @return null if the item was newly inserted, otherwise
- * the old value pointer is returned.
+ * @return null if the item was newly inserted or refused, see
+ * art_insert_status, otherwise the old value pointer is returned.
  */
 void* art_insert_no_replace(art_tree *t, const unsigned char *key, int key_len, void *value);
 
+/**
+ * Inserts a value like art_insert or art_insert_no_replace and
+ * tells what happened, so a refused key is not mistaken for
+ * one whose old value was NULL.
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg value Opaque value.
+ * @arg replace Non-zero to replace the value of a key already there
+ * @arg status Set to ART_KEY_ADDED, ART_KEY_FOUND or ART_KEY_CONFLICT
+ * @return The old value pointer if the key was there, otherwise NULL
+ */
+void* art_insert_status(art_tree *t, const unsigned char *key, int key_len, void *value,
+        int replace, int *status);
+
+/**
+ * Clears a hint so that its next insert starts at the root.
+ * Hints must be cleared again after the tree is destroyed.
+ */
+void art_hint_init(art_hint *h);
+
+/**
+ * Inserts a value like art_insert, starting from where the
+ * previous insert with the same hint left off. Sorted or
+ * clustered keys then only walk the part of the path that
+ * differs from the previous key.
+ * @arg t The tree
+ * @arg h The hint, updated with the path of this insert
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg value Opaque value.
+ * @return NULL if the item was newly inserted or refused, see
+ * art_insert_hint_status, otherwise the old value pointer is returned.
+ */
+void* art_insert_hint(art_tree *t, art_hint *h, const unsigned char *key, int key_len, void *value);
+
+/**
+ * Inserts a value like art_insert_hint and tells what happened.
+ * @arg status Set to ART_KEY_ADDED, ART_KEY_FOUND or ART_KEY_CONFLICT
+ * @return The old value pointer if the key was there, otherwise NULL
+ */
+void* art_insert_hint_status(art_tree *t, art_hint *h, const unsigned char *key, int key_len,
+        void *value, int *status);
+
+/**
+ * Builds the tree from keys that are already sorted, creating
+ * every inner node at its final type in a single pass instead
+ * of growing it one insert at a time.
+ * @arg t The tree, which must be empty
+ * @arg keys The keys in strictly ascending order. No key may
+ * be a prefix of another.
+ * @arg key_lens The length of each key
+ * @arg n The number of keys
+ * @arg values The value of each key
+ * @return 0 on success, -1 if the tree is not empty or
+ * the keys are not sorted and prefix free.
+ */
+int art_bulk_load(art_tree *t, const unsigned char **keys, const int *key_lens, int n, void **values);
+
 /**
  * Deletes a value from the ART tree
  * @arg t The tree
@@ -170,6 +519,35 @@ void* art_delete(art_tree *t, const unsigned char *key, int key_len);
  */
 void* art_search(const art_tree *t, const unsigned char *key, int key_len);
 
+/**
+ * Searches for many keys at once. Lookups are interleaved
+ * and the next node of each one is prefetched before any
+ * of them is resolved, hiding the cache misses of a walk
+ * behind the work on the other keys.
+ * @arg t The tree
+ * @arg keys The keys to search for
+ * @arg key_lens The length of each key
+ * @arg n The number of keys
+ * @arg values Filled with the value of each key, or NULL
+ * if it was not found
+ * @return The number of keys found.
+ */
+int art_search_batch(const art_tree *t, const unsigned char **keys, const int *key_lens, int n, void **values);
+
+/**
+ * Finds the longest key in the tree that is a prefix of
+ * the given key, or the key itself, in one walk down its
+ * path, as for a route or URL prefix table. Keys are taken
+ * to end in a 0 byte, see ART_KEY_CONFLICT.
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg match_len Set to the length of the match, may be NULL
+ * @return NULL if no key is a prefix, otherwise the value
+ * of the longest one.
+ */
+void* art_longest_prefix_match(const art_tree *t, const unsigned char *key, int key_len, int *match_len);
+
 /**
  * Returns the minimum valued leaf
  * @return The minimum leaf or NULL
@@ -208,6 +586,256 @@ int art_iter(art_tree *t, art_callback cb, void *data);
  */
 int art_iter_prefix(art_tree *t, const unsigned char *prefix, int prefix_len, art_callback cb, void *data);
 
+/**
+ * Invokes a callback for the k entries with the highest
+ * scores among those that match a given prefix, highest
+ * first. Subtrees are opened best first from a heap, so
+ * with ART_MAX_SCORE only the paths to those entries and
+ * their siblings are read. Without it each subtree is
+ * scanned for its best score.
+ * @arg t The tree to search
+ * @arg prefix The prefix of keys to read
+ * @arg prefix_len The length of the prefix
+ * @arg k The most entries to report
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, -1 if the heap could not grow,
+ * or the return of the callback.
+ */
+int art_topk_prefix(const art_tree *t, const unsigned char *prefix, int prefix_len, int k,
+        art_callback cb, void *data);
+
+/**
+ * Invokes a callback for every key within max_edits
+ * insertions, deletions or substitutions of the query, in
+ * key order. The walk carries one row of the edit distance
+ * table per key byte and leaves a subtree as soon as every
+ * entry of the row is over max_edits, so only paths close
+ * to the query are read.
+ * @arg t The tree to search
+ * @arg query The key to match
+ * @arg query_len The length of the query
+ * @arg max_edits The most edits a match may take
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, -1 if the rows could not grow,
+ * or the return of the callback.
+ */
+int art_fuzzy_search(const art_tree *t, const unsigned char *query, int query_len, int max_edits,
+        art_callback cb, void *data);
+
+struct art_dfa;
+
+/**
+ * Invokes a callback for every key the pattern accepts, in
+ * key order. The pattern is a DFA over key bytes, as compiled
+ * from a glob by art_dfa_compile_glob in art_pattern.h. It is
+ * stepped along edges and prefixes as the walk goes down, so
+ * a subtree is left as soon as the DFA dies, and read whole
+ * once it reaches a state that accepts everything.
+ * If the callback returns non-zero, then the iteration stops.
+ * @arg t The tree to iterate over
+ * @arg dfa The compiled pattern
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_iter_pattern(const art_tree *t, const struct art_dfa *dfa, art_callback cb, void *data);
+
+/**
+ * Iterates through the entries whose keys fall in [start, end),
+ * in key order, invoking a callback for each. Subtrees outside
+ * the bounds are never visited.
+ * If the callback returns non-zero, then the iteration stops.
+ * @arg t The tree to iterate over
+ * @arg start The inclusive lower bound
+ * @arg start_len The length of the lower bound, 0 for none
+ * @arg end The exclusive upper bound, NULL for none
+ * @arg end_len The length of the upper bound
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_iter_range(art_tree *t, const unsigned char *start, int start_len,
+        const unsigned char *end, int end_len, art_callback cb, void *data);
+
+/**
+ * Returns the first leaf whose key is greater
+ * than or equal to the given key.
+ * @return The leaf, or NULL if all keys are smaller.
+ */
+art_leaf* art_lower_bound(const art_tree *t, const unsigned char *key, int key_len);
+
+/**
+ * Returns the first leaf whose key is
+ * greater than the given key.
+ * @return The leaf, or NULL if no key is greater.
+ */
+art_leaf* art_upper_bound(const art_tree *t, const unsigned char *key, int key_len);
+
+/**
+ * Returns the number of keys smaller than the given key.
+ * Without ART_SUBTREE_COUNT the subtrees passed over are
+ * counted leaf by leaf.
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return The rank of the key, which need not be in the tree.
+ */
+uint64_t art_rank(const art_tree *t, const unsigned char *key, int key_len);
+
+/**
+ * Returns the number of keys in [start, end), like
+ * art_iter_range without visiting them.
+ * @arg t The tree
+ * @arg start The inclusive lower bound
+ * @arg start_len The length of the lower bound, 0 for none
+ * @arg end The exclusive upper bound, NULL for none
+ * @arg end_len The length of the upper bound
+ * @return The number of keys between the bounds.
+ */
+uint64_t art_count_range(const art_tree *t, const unsigned char *start, int start_len,
+        const unsigned char *end, int end_len);
+
+/**
+ * Returns the leaf with the i-th smallest key, counting from
+ * 0, so art_select(t, art_rank(t, key, len)) is the lower
+ * bound of a key.
+ * @arg t The tree
+ * @arg i The position of the key in key order
+ * @return The leaf, or NULL if i is not below the size of
+ * the tree.
+ */
+art_leaf* art_select(const art_tree *t, uint64_t i);
+
+/**
+ * Initializes an iterator over a tree. It starts out
+ * exhausted until positioned with first, last or seek.
+ * @return 0 on success.
+ */
+int art_iterator_init(art_iterator *it, const art_tree *t);
+
+/**
+ * Releases the memory held by an iterator.
+ */
+void art_iterator_destroy(art_iterator *it);
+
+/**
+ * Positions the iterator on the minimum leaf.
+ * @return The leaf, or NULL if the tree is empty.
+ */
+art_leaf* art_iterator_first(art_iterator *it);
+
+/**
+ * Positions the iterator on the maximum leaf.
+ * @return The leaf, or NULL if the tree is empty.
+ */
+art_leaf* art_iterator_last(art_iterator *it);
+
+/**
+ * Positions the iterator on the first leaf whose
+ * key is greater than or equal to the given key.
+ * @arg it The iterator
+ * @arg key The key to seek to
+ * @arg key_len The length of the key
+ * @return The leaf, or NULL if all keys are smaller.
+ */
+art_leaf* art_iterator_seek(art_iterator *it, const unsigned char *key, int key_len);
+
+/**
+ * Moves the iterator to the next leaf in key order.
+ * @return The leaf, or NULL once past the maximum.
+ */
+art_leaf* art_iterator_next(art_iterator *it);
+
+/**
+ * Moves the iterator to the previous leaf in key order.
+ * @return The leaf, or NULL once past the minimum.
+ */
+art_leaf* art_iterator_prev(art_iterator *it);
+
+/**
+ * Writes the tree to a file that art_map_open can map.
+ * Node layout matches memory, with children stored as
+ * file offsets. Values are stored as their raw bits, so
+ * only values that are not pointers survive a reload.
+ * @arg t The tree to save
+ * @arg path The file to write
+ * @return 0 on success, -1 on I/O error.
+ */
+int art_tree_save(const art_tree *t, const char *path);
+
+/**
+ * Maps a file written by art_tree_save. Nothing is read
+ * up front, pages come in from the shared page cache as
+ * lookups touch them.
+ * @arg m The map to initialize
+ * @arg path The file to map
+ * @return 0 on success, -1 if the file cannot be mapped or
+ * was written with a different layout.
+ */
+int art_map_open(art_map *m, const char *path);
+
+/**
+ * Unmaps a file mapped by art_map_open.
+ * @return 0 on success.
+ */
+int art_map_close(art_map *m);
+
+/**
+ * Searches for a value in a mapped tree
+ * @arg m The map
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return NULL if the item was not found, otherwise
+ * the value is returned.
+ */
+void* art_map_search(const art_map *m, const unsigned char *key, int key_len);
+
+/**
+ * Iterates through the entries of a mapped tree in key
+ * order, invoking a callback for each. Keys passed to the
+ * callback point into the mapping.
+ * @return 0 on success, or the return of the callback.
+ */
+int art_map_iter(const art_map *m, art_callback cb, void *data);
+
+/**
+ * Iterates through the entries of a mapped tree
+ * that match a given prefix, like art_iter_prefix.
+ * @return 0 on success, or the return of the callback.
+ */
+int art_map_iter_prefix(const art_map *m, const unsigned char *prefix, int prefix_len, art_callback cb, void *data);
+
+/**
+ * Copies the counters of the calling thread, which cover every
+ * tree it used since it started or last reset them. Worker
+ * threads take their own snapshot and art_stats_merge them.
+ * @arg s Filled in with the counters
+ */
+void art_stats_get(art_stats *s);
+
+/**
+ * Zeroes the counters of the calling thread.
+ */
+void art_stats_reset(void);
+
+/**
+ * Adds the counters of one snapshot into another, keeping
+ * the deeper of the two max_search_depth.
+ */
+void art_stats_merge(art_stats *into, const art_stats *from);
+
+/**
+ * Walks the whole tree and reports how many nodes of each type
+ * it has, how full they are, how long their prefixes are, how
+ * deep the leaves sit and how much memory it all takes, to size
+ * a dataset before loading it for real.
+ * @arg t The tree to analyze
+ * @arg a Filled in with the report
+ */
+void art_analyze(const art_tree *t, art_analysis *a);
+
 #ifdef __cplusplus
 }
 #endif
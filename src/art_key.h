@@ -0,0 +1,308 @@
+#include <stdint.h>
+#include <string.h>
+#ifndef ART_KEY_H
+#define ART_KEY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Order-preserving key encodings. Encoded keys compare with
+ * memcmp in the same order as the values they encode, so
+ * art_iter and art_iter_range visit them in value order.
+ *
+ * Integers are big-endian with the sign bit flipped. Floats
+ * are their IEEE bits, flipped so negatives sort first; -0.0
+ * sorts before 0.0 and NaNs after infinity. Strings escape
+ * every 0x00 as 00 FF and end with 00 01, so no encoded string
+ * is a prefix of another. Tuples are their columns encoded one
+ * after the other, each column after the first behind a 01 byte.
+ * A tuple followed by more columns then never goes on with a 0
+ * byte, so tuples of any arity can share a tree (see
+ * ART_KEY_CONFLICT), and a shorter tuple sorts before the
+ * longer ones it starts and bounds a range or prefix scan of
+ * them.
+ */
+
+/**
+ * Byte in front of every tuple column after the first
+ */
+#define ART_KEY_SEP 1
+
+/**
+ * Buffer space for a composite key. Override before
+ * including this header to build longer keys.
+ */
+#ifndef ART_KEY_MAX_LEN
+#define ART_KEY_MAX_LEN 256
+#endif
+
+static inline int art_encode_u32(unsigned char *out, uint32_t v) {
+    out[0] = v >> 24;
+    out[1] = v >> 16;
+    out[2] = v >> 8;
+    out[3] = v;
+    return 4;
+}
+
+static inline int art_encode_u64(unsigned char *out, uint64_t v) {
+    art_encode_u32(out, v >> 32);
+    art_encode_u32(out + 4, (uint32_t)v);
+    return 8;
+}
+
+static inline int art_encode_i32(unsigned char *out, int32_t v) {
+    return art_encode_u32(out, (uint32_t)v ^ 0x80000000u);
+}
+
+static inline int art_encode_i64(unsigned char *out, int64_t v) {
+    return art_encode_u64(out, (uint64_t)v ^ 0x8000000000000000ull);
+}
+
+static inline int art_encode_float(unsigned char *out, float v) {
+    uint32_t b;
+    memcpy(&b, &v, 4);
+    b ^= (b >> 31) ? 0xffffffffu : 0x80000000u;
+    return art_encode_u32(out, b);
+}
+
+static inline int art_encode_double(unsigned char *out, double v) {
+    uint64_t b;
+    memcpy(&b, &v, 8);
+    b ^= (b >> 63) ? 0xffffffffffffffffull : 0x8000000000000000ull;
+    return art_encode_u64(out, b);
+}
+
+static inline uint32_t art_decode_u32(const unsigned char *in) {
+    return (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 |
+           (uint32_t)in[2] << 8 | in[3];
+}
+
+static inline uint64_t art_decode_u64(const unsigned char *in) {
+    return (uint64_t)art_decode_u32(in) << 32 | art_decode_u32(in + 4);
+}
+
+static inline int32_t art_decode_i32(const unsigned char *in) {
+    return (int32_t)(art_decode_u32(in) ^ 0x80000000u);
+}
+
+static inline int64_t art_decode_i64(const unsigned char *in) {
+    return (int64_t)(art_decode_u64(in) ^ 0x8000000000000000ull);
+}
+
+static inline float art_decode_float(const unsigned char *in) {
+    uint32_t b = art_decode_u32(in);
+    float v;
+    b ^= (b >> 31) ? 0x80000000u : 0xffffffffu;
+    memcpy(&v, &b, 4);
+    return v;
+}
+
+static inline double art_decode_double(const unsigned char *in) {
+    uint64_t b = art_decode_u64(in);
+    double v;
+    b ^= (b >> 63) ? 0x8000000000000000ull : 0xffffffffffffffffull;
+    memcpy(&v, &b, 8);
+    return v;
+}
+
+/**
+ * Returns the encoded length of a string: one byte per
+ * byte, one more per 0x00, and two for the terminator.
+ */
+static inline size_t art_encoded_str_len(const unsigned char *s, size_t len) {
+    size_t n = len + 2;
+    for (size_t i = 0; i < len; i++)
+        n += s[i] == 0;
+    return n;
+}
+
+/**
+ * Encodes a string into out, which must hold
+ * art_encoded_str_len bytes.
+ * @return The number of bytes written.
+ */
+static inline size_t art_encode_str(unsigned char *out, const unsigned char *s, size_t len) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        out[n++] = s[i];
+        if (!s[i]) out[n++] = 0xff;
+    }
+    out[n++] = 0;
+    out[n++] = 1;
+    return n;
+}
+
+/**
+ * Decodes a string from the front of in. out may be NULL
+ * to only measure it, otherwise it needs in_len bytes.
+ * @arg out_len Set to the length of the decoded string
+ * @return The number of encoded bytes consumed, or
+ * -1 if in does not start with an encoded string.
+ */
+static inline int art_decode_str(const unsigned char *in, size_t in_len,
+        unsigned char *out, size_t *out_len) {
+    size_t n = 0;
+    for (size_t i = 0; i < in_len; i++) {
+        if (in[i]) {
+            if (out) out[n] = in[i];
+            n++;
+            continue;
+        }
+        if (++i == in_len) break;
+        if (in[i] == 1) {
+            *out_len = n;
+            return (int)i + 1;
+        }
+        if (in[i] != 0xff) break;
+        if (out) out[n] = 0;
+        n++;
+    }
+    return -1;
+}
+
+/**
+ * A composite key built up one column at a time. Pushing
+ * past ART_KEY_MAX_LEN, separator included, sets overflow
+ * and drops the column.
+ */
+typedef struct {
+    uint32_t len;
+    int overflow;
+    unsigned char key[ART_KEY_MAX_LEN];
+} art_key_buf;
+
+static inline void art_key_init(art_key_buf *k) {
+    k->len = 0;
+    k->overflow = 0;
+}
+
+static inline int art_key_room(art_key_buf *k, size_t n) {
+    size_t sep = k->len > 0;
+    if (k->overflow || n + sep > ART_KEY_MAX_LEN - k->len) {
+        k->overflow = 1;
+        return 0;
+    }
+    if (sep) k->key[k->len++] = ART_KEY_SEP;
+    return 1;
+}
+
+static inline void art_key_push_u32(art_key_buf *k, uint32_t v) {
+    if (art_key_room(k, 4)) k->len += art_encode_u32(k->key + k->len, v);
+}
+
+static inline void art_key_push_u64(art_key_buf *k, uint64_t v) {
+    if (art_key_room(k, 8)) k->len += art_encode_u64(k->key + k->len, v);
+}
+
+static inline void art_key_push_i32(art_key_buf *k, int32_t v) {
+    if (art_key_room(k, 4)) k->len += art_encode_i32(k->key + k->len, v);
+}
+
+static inline void art_key_push_i64(art_key_buf *k, int64_t v) {
+    if (art_key_room(k, 8)) k->len += art_encode_i64(k->key + k->len, v);
+}
+
+static inline void art_key_push_float(art_key_buf *k, float v) {
+    if (art_key_room(k, 4)) k->len += art_encode_float(k->key + k->len, v);
+}
+
+static inline void art_key_push_double(art_key_buf *k, double v) {
+    if (art_key_room(k, 8)) k->len += art_encode_double(k->key + k->len, v);
+}
+
+static inline void art_key_push_str(art_key_buf *k, const unsigned char *s, size_t len) {
+    if (art_key_room(k, art_encoded_str_len(s, len)))
+        k->len += art_encode_str(k->key + k->len, s, len);
+}
+
+/**
+ * Reads the columns of a composite key back in the order
+ * they were pushed. Reading past the end, a malformed string
+ * or a missing separator sets error and returns zero values
+ * from then on.
+ */
+typedef struct {
+    const unsigned char *key;
+    uint32_t len;
+    uint32_t pos;
+    int error;
+} art_key_reader;
+
+static inline void art_key_reader_init(art_key_reader *r, const unsigned char *key, uint32_t len) {
+    r->key = key;
+    r->len = len;
+    r->pos = 0;
+    r->error = 0;
+}
+
+// Steps over the separator in front of every column but the first
+static inline int art_key_next(art_key_reader *r) {
+    if (!r->error && r->pos && (r->pos == r->len || r->key[r->pos++] != ART_KEY_SEP))
+        r->error = 1;
+    return !r->error;
+}
+
+static inline const unsigned char* art_key_take(art_key_reader *r, uint32_t n) {
+    if (!art_key_next(r) || n > r->len - r->pos) {
+        r->error = 1;
+        return NULL;
+    }
+    r->pos += n;
+    return r->key + r->pos - n;
+}
+
+static inline uint32_t art_key_pop_u32(art_key_reader *r) {
+    const unsigned char *p = art_key_take(r, 4);
+    return p ? art_decode_u32(p) : 0;
+}
+
+static inline uint64_t art_key_pop_u64(art_key_reader *r) {
+    const unsigned char *p = art_key_take(r, 8);
+    return p ? art_decode_u64(p) : 0;
+}
+
+static inline int32_t art_key_pop_i32(art_key_reader *r) {
+    const unsigned char *p = art_key_take(r, 4);
+    return p ? art_decode_i32(p) : 0;
+}
+
+static inline int64_t art_key_pop_i64(art_key_reader *r) {
+    const unsigned char *p = art_key_take(r, 8);
+    return p ? art_decode_i64(p) : 0;
+}
+
+static inline float art_key_pop_float(art_key_reader *r) {
+    const unsigned char *p = art_key_take(r, 4);
+    return p ? art_decode_float(p) : 0;
+}
+
+static inline double art_key_pop_double(art_key_reader *r) {
+    const unsigned char *p = art_key_take(r, 8);
+    return p ? art_decode_double(p) : 0;
+}
+
+/**
+ * Decodes the next string column into out, which
+ * needs room for the rest of the key.
+ * @return The length of the string, 0 on error.
+ */
+static inline size_t art_key_pop_str(art_key_reader *r, unsigned char *out) {
+    size_t n = 0;
+    int used;
+    if (!art_key_next(r)) return 0;
+    used = art_decode_str(r->key + r->pos, r->len - r->pos, out, &n);
+    if (used < 0) {
+        r->error = 1;
+        return 0;
+    }
+    r->pos += used;
+    return n;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
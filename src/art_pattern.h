@@ -0,0 +1,221 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef ART_PATTERN_H
+#define ART_PATTERN_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Glob patterns compiled to a DFA over key bytes, for
+ * art_iter_pattern. A pattern matches whole keys:
+ *
+ *   *       any run of bytes, including none
+ *   ?       any one byte
+ *   [a-z_]  one byte from a set of bytes and ranges,
+ *           [!...] or [^...] for one byte outside it
+ *   \c      the byte c itself
+ *
+ * Any other byte matches itself, so "user:*:session" finds
+ * the session key of every user.
+ */
+
+/**
+ * Most pattern elements and DFA states a glob may compile
+ * to. Override before including this header if needed.
+ */
+#ifndef ART_GLOB_MAX_ITEMS
+#define ART_GLOB_MAX_ITEMS 63
+#endif
+#ifndef ART_DFA_MAX_STATES
+#define ART_DFA_MAX_STATES 1024
+#endif
+
+/**
+ * State 0 is dead: it is where every byte goes once no key
+ * with the bytes so far can match, so a walk can stop there.
+ * A state that accepts and loops on every byte matches all
+ * keys below it, which is_all marks.
+ */
+typedef struct art_dfa {
+    int states;
+    int start;
+    int32_t *next;          // states * 256 transitions
+    unsigned char *accept;
+    unsigned char *is_all;
+} art_dfa;
+
+static inline int art_dfa_step(const art_dfa *d, int state, unsigned char c) {
+    return d->next[state * 256 + c];
+}
+
+/**
+ * Frees the tables of a compiled pattern.
+ */
+static inline void art_dfa_free(art_dfa *d) {
+    free(d->next);
+    free(d->accept);
+    free(d->is_all);
+    memset(d, 0, sizeof(art_dfa));
+}
+
+/**
+ * One element of a glob, a byte set or a star
+ */
+typedef struct {
+    int star;
+    unsigned char set[32];
+} art_glob_item;
+
+static inline void art_glob_set(art_glob_item *it, unsigned char c) {
+    it->set[c >> 3] |= 1 << (c & 7);
+}
+
+// Splits a glob into elements, merging runs of stars
+static inline int art_glob_parse(const char *glob, art_glob_item *items) {
+    const unsigned char *p = (const unsigned char*)glob;
+    int n = 0, i;
+    while (*p) {
+        if (*p == '*' && n && items[n-1].star) {
+            p++;
+            continue;
+        }
+        if (n == ART_GLOB_MAX_ITEMS) return -1;
+        art_glob_item *it = &items[n++];
+        memset(it, 0, sizeof(art_glob_item));
+        if (*p == '*') {
+            it->star = 1;
+            p++;
+        } else if (*p == '?') {
+            memset(it->set, 0xff, sizeof(it->set));
+            p++;
+        } else if (*p == '[') {
+            int negate = 0;
+            p++;
+            if (*p == '!' || *p == '^') {
+                negate = 1;
+                p++;
+            }
+
+            // A ] right after the bracket is a member
+            const unsigned char *first = p;
+            while (*p && (*p != ']' || p == first)) {
+                unsigned char lo = *p++, hi = lo;
+                if (*p == '-' && p[1] && p[1] != ']') {
+                    hi = p[1];
+                    p += 2;
+                }
+                for (i = lo; i <= hi; i++)
+                    art_glob_set(it, i);
+            }
+            if (!*p) return -1;
+            p++;
+            if (negate) {
+                for (i = 0; i < 32; i++)
+                    it->set[i] = ~it->set[i];
+            }
+        } else {
+            if (*p == '\\' && p[1]) p++;
+            art_glob_set(it, *p++);
+        }
+    }
+    return n;
+}
+
+// Adds the positions a star can skip to, as it may match nothing
+static inline uint64_t art_glob_closure(const art_glob_item *items, int n, uint64_t set) {
+    for (int i = 0; i < n; i++) {
+        if ((set >> i & 1) && items[i].star)
+            set |= 1ull << (i + 1);
+    }
+    return set;
+}
+
+/**
+ * Compiles a glob by subset construction. Each DFA state is
+ * a set of positions in the glob, and states that can no
+ * longer reach a match are folded into the dead one.
+ * @return 0 on success, -1 if the glob is malformed or
+ * too large, or on allocation failure.
+ */
+static inline int art_dfa_compile_glob(art_dfa *d, const char *glob) {
+    art_glob_item items[ART_GLOB_MAX_ITEMS];
+    uint64_t sets[ART_DFA_MAX_STATES];
+    int n = art_glob_parse(glob, items);
+    int s, c, i;
+    memset(d, 0, sizeof(art_dfa));
+    if (n < 0) return -1;
+    d->next = (int32_t*)calloc(ART_DFA_MAX_STATES * 256, sizeof(int32_t));
+    d->accept = (unsigned char*)calloc(ART_DFA_MAX_STATES, 1);
+    d->is_all = (unsigned char*)calloc(ART_DFA_MAX_STATES, 1);
+    if (!d->next || !d->accept || !d->is_all) {
+        art_dfa_free(d);
+        return -1;
+    }
+
+    // States are numbered as they are found, so the
+    // ones before s are done
+    sets[0] = 0;
+    sets[1] = art_glob_closure(items, n, 1);
+    d->states = 2;
+    d->start = 1;
+    for (s = 1; s < d->states; s++) {
+        d->accept[s] = sets[s] >> n & 1;
+        for (c = 0; c < 256; c++) {
+            uint64_t to = 0;
+            for (i = 0; i < n; i++) {
+                if (!(sets[s] >> i & 1)) continue;
+                if (items[i].star)
+                    to |= 1ull << i;
+                else if (items[i].set[c >> 3] >> (c & 7) & 1)
+                    to |= 1ull << (i + 1);
+            }
+            to = art_glob_closure(items, n, to);
+            int t;
+            for (t = 0; t < d->states && sets[t] != to; t++);
+            if (t == d->states) {
+                if (t == ART_DFA_MAX_STATES) {
+                    art_dfa_free(d);
+                    return -1;
+                }
+                sets[d->states++] = to;
+            }
+            d->next[s * 256 + c] = t;
+        }
+    }
+
+    // Keep the states that can still reach a match
+    unsigned char live[ART_DFA_MAX_STATES];
+    memcpy(live, d->accept, d->states);
+    for (int changed = 1; changed; ) {
+        changed = 0;
+        for (s = 1; s < d->states; s++) {
+            for (c = 0; c < 256 && !live[s]; c++) {
+                if (live[d->next[s * 256 + c]])
+                    live[s] = changed = 1;
+            }
+        }
+    }
+    for (s = 0; s < d->states; s++) {
+        d->is_all[s] = d->accept[s];
+        for (c = 0; c < 256; c++) {
+            int32_t *t = &d->next[s * 256 + c];
+            if (!live[*t]) *t = 0;
+            if (*t != s) d->is_all[s] = 0;
+        }
+    }
+    if (!live[d->start]) d->start = 0;
+
+    // Give back the rows no state took
+    int32_t *next = (int32_t*)realloc(d->next, d->states * 256 * sizeof(int32_t));
+    if (next) d->next = next;
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -18,11 +18,32 @@ int main(void)
     tcase_add_test(tc1, test_art_insert);
     tcase_add_test(tc1, test_art_insert_verylong);
     tcase_add_test(tc1, test_art_insert_search);
+    tcase_add_test(tc1, test_art_search_batch);
+    tcase_add_test(tc1, test_art_bulk_load);
+    tcase_add_test(tc1, test_art_node_resize);
     tcase_add_test(tc1, test_art_insert_delete);
+    tcase_add_test(tc1, test_art_insert_delete_pooled);
+    tcase_add_test(tc1, test_art_insert_delete_arena);
     tcase_add_test(tc1, test_art_insert_random_delete);
     tcase_add_test(tc1, test_art_insert_iter);
+    tcase_add_test(tc1, test_art_iterator);
+    tcase_add_test(tc1, test_art_iter_range);
     tcase_add_test(tc1, test_art_iter_prefix);
+    tcase_add_test(tc1, test_art_map);
     tcase_add_test(tc1, test_art_long_prefix);
+    tcase_add_test(tc1, test_art_optimistic_prefix);
+    tcase_add_test(tc1, test_art_inline_values);
+    tcase_add_test(tc1, test_art_key_encoding);
+    tcase_add_test(tc1, test_art_insert_hint);
+    tcase_add_test(tc1, test_art_subtree_count);
+    tcase_add_test(tc1, test_art_prefix_keys);
+    tcase_add_test(tc1, test_art_prefix_conflict);
+    tcase_add_test(tc1, test_art_longest_prefix_match);
+    tcase_add_test(tc1, test_art_topk_prefix);
+    tcase_add_test(tc1, test_art_fuzzy_search);
+    tcase_add_test(tc1, test_art_iter_pattern);
+    tcase_add_test(tc1, test_art_stats);
+    tcase_add_test(tc1, test_art_analyze);
     tcase_add_test(tc1, test_art_insert_search_uuid);
     tcase_add_test(tc1, test_art_max_prefix_len_scan_prefix);
     tcase_set_timeout(tc1, 180);
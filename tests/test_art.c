@@ -1,11 +1,16 @@
 #include <fcntl.h>
 #include <inttypes.h>
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <check.h>
 
 #include "art.h"
+#include "art_key.h"
+#include "art_pattern.h"
 
 START_TEST(test_art_init_and_destroy)
 {
@@ -145,6 +150,210 @@ START_TEST(test_art_insert_search)
 }
 END_TEST
 
+START_TEST(test_art_search_batch)
+{
+    art_tree t;
+    int res = art_tree_init(&t);
+    fail_unless(res == 0);
+
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+
+    uintptr_t line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(NULL ==
+            art_insert(&t, (unsigned char*)buf, len, (void*)line));
+        line++;
+    }
+
+    // Look the words up in batches of 100, mixing in a
+    // miss after every word
+    char words[100][512];
+    const unsigned char *keys[200];
+    int lens[200];
+    void *vals[200];
+    uintptr_t first = 1;
+    fseek(f, 0, SEEK_SET);
+    line = 1;
+    int n = 0;
+    while (1) {
+        char *ok = fgets(buf, sizeof buf, f);
+        if (ok) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            memcpy(words[n/2], buf, len);
+            keys[n] = (unsigned char*)words[n/2];
+            lens[n] = len;
+            keys[n+1] = (unsigned char*)"not:a:word";
+            lens[n+1] = 11;
+            n += 2;
+            line++;
+        }
+        if (n == 200 || (!ok && n)) {
+            int found = art_search_batch(&t, keys, lens, n, vals);
+            fail_unless(found == n / 2, "Found: %d", found);
+            for (int i = 0; i < n; i += 2) {
+                fail_unless(vals[i] == (void*)(first + i/2),
+                        "Str: %s Val: %" PRIuPTR, keys[i], (uintptr_t)vals[i]);
+                fail_unless(vals[i+1] == NULL);
+            }
+            first = line;
+            n = 0;
+        }
+        if (!ok) break;
+    }
+
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static int cmp_str(const void *a, const void *b) {
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+START_TEST(test_art_bulk_load)
+{
+    int len, n = 0;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+
+    char **words = malloc(256 * 1024 * sizeof(char*));
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(n < 256 * 1024);
+        words[n++] = strdup(buf);
+    }
+    fclose(f);
+    qsort(words, n, sizeof(char*), cmp_str);
+
+    const unsigned char **keys = malloc(n * sizeof(char*));
+    int *key_lens = malloc(n * sizeof(int));
+    void **values = malloc(n * sizeof(void*));
+    for (int i=0; i < n; i++) {
+        keys[i] = (const unsigned char*)words[i];
+        key_lens[i] = strlen(words[i]) + 1;
+        values[i] = words[i];
+    }
+
+    for (int flags=0; flags <= (ART_NODE_POOL|ART_LEAF_ARENA); flags++) {
+        art_tree t;
+        int res = art_tree_init_flags(&t, flags);
+        fail_unless(res == 0);
+
+        // Rejects unsorted, duplicate and prefix keys
+        const unsigned char *bad[] = {keys[1], keys[0]};
+        int bad_lens[] = {key_lens[1], key_lens[0]};
+        fail_unless(art_bulk_load(&t, bad, bad_lens, 2, values) == -1);
+        bad[1] = keys[1];
+        bad_lens[1] = key_lens[1];
+        fail_unless(art_bulk_load(&t, bad, bad_lens, 2, values) == -1);
+        bad_lens[0] = key_lens[1] - 1;
+        fail_unless(art_bulk_load(&t, bad, bad_lens, 2, values) == -1);
+        fail_unless(art_size(&t) == 0);
+
+        fail_unless(art_bulk_load(&t, keys, key_lens, n, values) == 0);
+        fail_unless(art_size(&t) == (uint64_t)n);
+        fail_unless(art_bulk_load(&t, keys, key_lens, n, values) == -1);
+
+        // Same contents and order as inserting one at a time
+        art_iterator it;
+        art_iterator_init(&it, &t);
+        art_leaf *l = art_iterator_first(&it);
+        for (int i=0; i < n; i++) {
+            fail_unless(l && l->value == values[i]);
+            fail_unless(art_search(&t, keys[i], key_lens[i]) == values[i]);
+            l = art_iterator_next(&it);
+        }
+        fail_unless(l == NULL);
+        art_iterator_destroy(&it);
+
+        // The tree stays usable for updates
+        for (int i=0; i < n; i += 2)
+            fail_unless(art_delete(&t, keys[i], key_lens[i]) == values[i]);
+        for (int i=0; i < n; i++)
+            fail_unless(art_search(&t, keys[i], key_lens[i]) == (i % 2 ? values[i] : NULL));
+        for (int i=0; i < n; i += 2)
+            fail_unless(art_insert(&t, keys[i], key_lens[i], values[i]) == NULL);
+        fail_unless(art_size(&t) == (uint64_t)n);
+
+        res = art_tree_destroy(&t);
+        fail_unless(res == 0);
+    }
+
+    for (int i=0; i < n; i++)
+        free(words[i]);
+    free(words);
+    free(keys);
+    free(key_lens);
+    free(values);
+}
+END_TEST
+
+// Node type expected after growing to n children
+static int grown_type(int n) {
+    return n <= 4 ? NODE4 : n <= 16 ? NODE16 : n <= 32 ? NODE32 : n <= 48 ? NODE48 : NODE256;
+}
+
+// Node type expected after shrinking to n children
+static int shrunk_type(int n) {
+    return n <= 3 ? NODE4 : n <= 12 ? NODE16 : n <= 24 ? NODE32 : n <= 37 ? NODE48 : NODE256;
+}
+
+START_TEST(test_art_node_resize)
+{
+    for (int flags=0; flags <= ART_NODE_POOL; flags += ART_NODE_POOL) {
+        art_tree t;
+        int res = art_tree_init_flags(&t, flags);
+        fail_unless(res == 0);
+
+        // Every key hangs off the root, so its type
+        // follows the number of keys
+        unsigned char keys[256][2];
+        for (int i=0; i < 256; i++) {
+            keys[i][0] = (i * 167) & 255;
+            keys[i][1] = 0;
+        }
+        for (int i=0; i < 256; i++) {
+            fail_unless(NULL == art_insert(&t, keys[i], 2, (void*)(uintptr_t)(i+1)));
+            if (i) fail_unless(t.root->type == grown_type(i+1), "Children: %d", i+1);
+            for (int j=0; j < 256; j++) {
+                uintptr_t val = (uintptr_t)art_search(&t, keys[j], 2);
+                fail_unless(val == (j <= i ? (uintptr_t)(j+1) : 0));
+            }
+        }
+
+        for (int i=0; i < 255; i++) {
+            fail_unless((uintptr_t)art_delete(&t, keys[i], 2) == (uintptr_t)(i+1));
+            if (i < 254) fail_unless(t.root->type == shrunk_type(255-i), "Children: %d", 255-i);
+            for (int j=0; j < 256; j++) {
+                uintptr_t val = (uintptr_t)art_search(&t, keys[j], 2);
+                fail_unless(val == (j > i ? (uintptr_t)(j+1) : 0));
+            }
+
+            // Children stay in key order through every resize
+            art_iterator it;
+            art_iterator_init(&it, &t);
+            int count = 0, prev = -1;
+            for (art_leaf *l = art_iterator_first(&it); l; l = art_iterator_next(&it)) {
+                fail_unless(l->key[0] > prev);
+                prev = l->key[0];
+                count++;
+            }
+            fail_unless(count == 255-i);
+            art_iterator_destroy(&it);
+        }
+
+        res = art_tree_destroy(&t);
+        fail_unless(res == 0);
+    }
+}
+END_TEST
+
 START_TEST(test_art_insert_delete)
 {
     art_tree t;
@@ -200,6 +409,125 @@ START_TEST(test_art_insert_delete)
 }
 END_TEST
 
+START_TEST(test_art_insert_delete_pooled)
+{
+    art_tree t;
+    int res = art_tree_init_flags(&t, ART_NODE_POOL);
+    fail_unless(res == 0);
+
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+
+    // Insert, delete everything, then insert again so the
+    // second pass runs off the free lists
+    for (int pass = 0; pass < 2; pass++) {
+        uintptr_t line = 1, nlines;
+        fseek(f, 0, SEEK_SET);
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            fail_unless(NULL ==
+                art_insert(&t, (unsigned char*)buf, len, (void*)line));
+            line++;
+        }
+        nlines = line - 1;
+
+        fseek(f, 0, SEEK_SET);
+        line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+
+            uintptr_t val = (uintptr_t)art_search(&t, (unsigned char*)buf, len);
+            fail_unless(line == val, "Line: %d Val: %" PRIuPTR " Str: %s\n", line,
+                val, buf);
+
+            if (pass == 0) {
+                val = (uintptr_t)art_delete(&t, (unsigned char*)buf, len);
+                fail_unless(line == val, "Line: %d Val: %" PRIuPTR " Str: %s\n", line,
+                    val, buf);
+                fail_unless(art_size(&t) == nlines - line);
+            }
+            line++;
+        }
+    }
+
+    // Destroy releases the slabs without freeing each node
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_art_insert_delete_arena)
+{
+    art_tree t;
+    int res = art_tree_init_flags(&t, ART_NODE_POOL | ART_LEAF_ARENA);
+    fail_unless(res == 0);
+
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+
+    uintptr_t line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(NULL ==
+            art_insert(&t, (unsigned char*)buf, len, (void*)line));
+        line++;
+    }
+
+    // Delete every other line, then put them back
+    // so the freed leaves get reused
+    for (int pass = 0; pass < 2; pass++) {
+        fseek(f, 0, SEEK_SET);
+        line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            if (line % 2) {
+                if (pass == 0) {
+                    uintptr_t val = (uintptr_t)art_delete(&t, (unsigned char*)buf, len);
+                    fail_unless(line == val);
+                } else {
+                    fail_unless(NULL ==
+                        art_insert(&t, (unsigned char*)buf, len, (void*)line));
+                }
+            }
+            line++;
+        }
+    }
+
+    fseek(f, 0, SEEK_SET);
+    line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        uintptr_t val = (uintptr_t)art_search(&t, (unsigned char*)buf, len);
+        fail_unless(line == val, "Line: %d Val: %" PRIuPTR " Str: %s\n", line,
+            val, buf);
+        line++;
+    }
+
+    // Leaves past the size classes and past a whole chunk
+    int sizes[] = {1000, 3 * ART_ARENA_CHUNK_SIZE / 2};
+    for (int i = 0; i < 2; i++) {
+        unsigned char *big = calloc(1, sizes[i]);
+        memset(big, 'z', sizes[i] - 1);
+        fail_unless(NULL == art_insert(&t, big, sizes[i], big));
+        fail_unless(big == art_search(&t, big, sizes[i]));
+        fail_unless(big == art_delete(&t, big, sizes[i]));
+        fail_unless(NULL == art_insert(&t, big, sizes[i], big));
+        fail_unless(big == art_search(&t, big, sizes[i]));
+        free(big);
+    }
+
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
 START_TEST(test_art_insert_random_delete)
 {
     art_tree t;
@@ -285,6 +613,170 @@ START_TEST(test_art_insert_iter)
 }
 END_TEST
 
+static int leaf_cmp(const art_leaf *a, const art_leaf *b) {
+    int len = a->key_len < b->key_len ? a->key_len : b->key_len;
+    int res = memcmp(a->key, b->key, len);
+    return res ? res : (int)a->key_len - (int)b->key_len;
+}
+
+START_TEST(test_art_iterator)
+{
+    art_tree t;
+    int res = art_tree_init(&t);
+    fail_unless(res == 0);
+
+    art_iterator it;
+    fail_unless(art_iterator_init(&it, &t) == 0);
+    fail_unless(art_iterator_first(&it) == NULL);
+    fail_unless(art_iterator_seek(&it, (unsigned char*)"a", 2) == NULL);
+
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+
+    uintptr_t line = 1, nlines;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(NULL ==
+            art_insert(&t, (unsigned char*)buf, len, (void*)line));
+        line++;
+    }
+    nlines = line - 1;
+
+    // Forward and backward walks see every key in order
+    uint64_t count = 1;
+    art_leaf *prev = art_iterator_first(&it), *l;
+    fail_unless(prev == art_minimum(&t));
+    while ((l = art_iterator_next(&it))) {
+        fail_unless(leaf_cmp(prev, l) < 0);
+        prev = l;
+        count++;
+    }
+    fail_unless(count == nlines);
+    fail_unless(prev == art_maximum(&t));
+
+    count = 1;
+    prev = art_iterator_last(&it);
+    fail_unless(prev == art_maximum(&t));
+    while ((l = art_iterator_prev(&it))) {
+        fail_unless(leaf_cmp(l, prev) < 0);
+        prev = l;
+        count++;
+    }
+    fail_unless(count == nlines);
+
+    // Seek to every key, and to every key without its
+    // terminator, which lands on the same key
+    fseek(f, 0, SEEK_SET);
+    line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        l = art_iterator_seek(&it, (unsigned char*)buf, len);
+        fail_unless(l && (uintptr_t)l->value == line);
+        l = art_iterator_seek(&it, (unsigned char*)buf, len-1);
+        fail_unless(l && (uintptr_t)l->value == line);
+        prev = art_iterator_prev(&it);
+        if (prev) {
+            fail_unless(leaf_cmp(prev, l) < 0);
+            fail_unless(art_iterator_next(&it) == l);
+        }
+        line++;
+    }
+
+    // Keys between words land on the next word
+    l = art_iterator_seek(&it, (unsigned char*)"aardvarj\xff", 10);
+    fail_unless(l && !strcmp((char*)l->key, "aardvark"));
+    fail_unless(art_iterator_seek(&it, (unsigned char*)"", 0) == art_minimum(&t));
+    fail_unless(art_iterator_seek(&it, (unsigned char*)"\xff", 1) == NULL);
+    fail_unless(art_iterator_next(&it) == NULL);
+
+    art_iterator_destroy(&it);
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
+typedef struct {
+    uint64_t count;
+    const char *prev;
+    const char *start;
+    const char *end;
+} range_data;
+
+static int range_cb(void *data, const unsigned char *k, uint32_t k_len, void *val) {
+    range_data *r = (range_data*)data;
+    fail_unless(strcmp((const char*)k, r->start) >= 0);
+    fail_unless(!r->end || strcmp((const char*)k, r->end) < 0);
+    fail_unless(!r->prev || strcmp(r->prev, (const char*)k) < 0);
+    r->prev = (const char*)k;
+    r->count++;
+    return 0;
+}
+
+START_TEST(test_art_iter_range)
+{
+    art_tree t;
+    int res = art_tree_init(&t);
+    fail_unless(res == 0);
+
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+
+    uintptr_t line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(NULL ==
+            art_insert(&t, (unsigned char*)buf, len, (void*)line));
+        line++;
+    }
+
+    const char *ranges[][2] = {
+        {"a", "b"}, {"aardvark", "abandon"}, {"m", NULL}, {"", "b"},
+        {"zz", "zzzzzzzzzzzzzzzz"}, {"b", "a"}, {"A", "a"},
+    };
+    for (unsigned i=0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+        const char *start = ranges[i][0], *end = ranges[i][1];
+        uint64_t expected = 0;
+        fseek(f, 0, SEEK_SET);
+        while (fgets(buf, sizeof buf, f)) {
+            buf[strlen(buf)-1] = '\0';
+            if (strcmp(buf, start) >= 0 && (!end || strcmp(buf, end) < 0))
+                expected++;
+        }
+
+        range_data r = {0, NULL, start, end};
+        fail_unless(!art_iter_range(&t, (unsigned char*)start, strlen(start),
+                    (unsigned char*)end, end ? strlen(end) : 0, range_cb, &r));
+        fail_unless(r.count == expected, "Range %s-%s: %d != %d", start, end,
+                (int)r.count, (int)expected);
+    }
+
+    // Bounds of every key agree with the iterator
+    art_iterator it;
+    art_iterator_init(&it, &t);
+    fseek(f, 0, SEEK_SET);
+    line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        art_leaf *l = art_lower_bound(&t, (unsigned char*)buf, len);
+        fail_unless(l && (uintptr_t)l->value == line);
+        fail_unless(art_lower_bound(&t, (unsigned char*)buf, len-1) == l);
+        fail_unless(art_iterator_seek(&it, (unsigned char*)buf, len) == l);
+        fail_unless(art_upper_bound(&t, (unsigned char*)buf, len) == art_iterator_next(&it));
+        line++;
+    }
+    art_iterator_destroy(&it);
+
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
 typedef struct {
     int count;
     int max_count;
@@ -369,6 +861,111 @@ START_TEST(test_art_iter_prefix)
 }
 END_TEST
 
+static int count_cb(void *data, const unsigned char *k, uint32_t k_len, void *val) {
+    (*(uint64_t*)data)++;
+    return 0;
+}
+
+START_TEST(test_art_map)
+{
+    art_tree t;
+    int res = art_tree_init(&t);
+    fail_unless(res == 0);
+
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+
+    uint64_t xor_mask = 0;
+    uintptr_t line = 1, nlines;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(NULL ==
+            art_insert(&t, (unsigned char*)buf, len, (void*)line));
+        xor_mask ^= (line * (buf[0] + len));
+        line++;
+    }
+    nlines = line - 1;
+
+    // A long shared prefix exercises the minimum() fallback
+    const char *s = "api.foo.bar.long.prefix.one";
+    fail_unless(NULL == art_insert(&t, (unsigned char*)s, strlen(s)+1, (void*)line));
+    xor_mask ^= (line++ * (s[0] + strlen(s)+1));
+    s = "api.foo.bar.long.prefix.two";
+    fail_unless(NULL == art_insert(&t, (unsigned char*)s, strlen(s)+1, (void*)line));
+    xor_mask ^= (line++ * (s[0] + strlen(s)+1));
+    nlines += 2;
+
+    const char *path = "/tmp/test_art_map.bin";
+    fail_unless(art_tree_save(&t, path) == 0);
+
+    art_map m;
+    fail_unless(art_map_open(&m, path) == 0);
+    fail_unless(m.size == nlines);
+
+    // Every key is found in the mapping
+    f = fopen("tests/words.txt", "r");
+    line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless((uintptr_t)art_map_search(&m, (unsigned char*)buf, len) == line);
+        fail_unless(art_map_search(&m, (unsigned char*)buf, len-1) ==
+                art_search(&t, (unsigned char*)buf, len-1));
+        line++;
+    }
+    fclose(f);
+
+    uint64_t out[] = {0, 0};
+    fail_unless(art_map_iter(&m, iter_cb, &out) == 0);
+    fail_unless(out[0] == nlines);
+    fail_unless(out[1] == xor_mask);
+
+    // Prefix scans agree with the tree they were saved from
+    const char *prefixes[] = {"", "a", "ab", "zz", "api.foo.bar.long",
+        "api.foo.bar.long.prefix.o", "api.foo.bar.lonx", "api.foo.bar.long.prefix.one"};
+    for (int i=0; i < (int)(sizeof(prefixes)/sizeof(prefixes[0])); i++) {
+        uint64_t want = 0, got = 0;
+        int plen = strlen(prefixes[i]);
+        art_iter_prefix(&t, (unsigned char*)prefixes[i], plen, count_cb, &want);
+        fail_unless(art_map_iter_prefix(&m, (unsigned char*)prefixes[i], plen, count_cb, &got) == 0);
+        fail_unless(got == want, "Prefix: %s Got: %" PRIu64 " Want: %" PRIu64, prefixes[i], got, want);
+    }
+
+    fail_unless(art_map_close(&m) == 0);
+
+    // Version 1 files, from before NODE32, read the same,
+    // later versions are refused
+    art_tree small;
+    fail_unless(art_tree_init(&small) == 0);
+    fail_unless(art_insert(&small, (unsigned char*)"ab", 2, (void*)1) == NULL);
+    fail_unless(art_insert(&small, (unsigned char*)"ac", 2, (void*)2) == NULL);
+    fail_unless(art_tree_save(&small, path) == 0);
+    fail_unless(art_tree_destroy(&small) == 0);
+    const uint32_t versions[] = {3, 1};
+    for (int i=0; i < 2; i++) {
+        f = fopen(path, "r+b");
+        fseek(f, 8, SEEK_SET);
+        fwrite(&versions[i], sizeof(versions[i]), 1, f);
+        fclose(f);
+        fail_unless(art_map_open(&m, path) == (versions[i] == 1 ? 0 : -1));
+    }
+    fail_unless((uintptr_t)art_map_search(&m, (unsigned char*)"ac", 2) == 2);
+    fail_unless(art_map_close(&m) == 0);
+
+    // Files that are not saved trees are refused
+    f = fopen(path, "wb");
+    fputs("not a tree", f);
+    fclose(f);
+    fail_unless(art_map_open(&m, path) == -1);
+    unlink(path);
+
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
 START_TEST(test_art_long_prefix)
 {
     art_tree t;
@@ -415,6 +1012,1234 @@ START_TEST(test_art_long_prefix)
 }
 END_TEST
 
+START_TEST(test_art_optimistic_prefix)
+{
+    int flags[] = { ART_OPTIMISTIC_PREFIX,
+        ART_OPTIMISTIC_PREFIX | ART_NODE_POOL | ART_LEAF_ARENA };
+    for (int f=0; f < 2; f++) {
+        art_tree t;
+        int res = art_tree_init_flags(&t, flags[f]);
+        fail_unless(res == 0);
+
+        // Every key shares a prefix well past MAX_PREFIX_LEN,
+        // and the numbers add a second long one below it
+        char keys[512][64];
+        for (int i=0; i < 512; i++) {
+            snprintf(keys[i], sizeof(keys[i]),
+                    "https://example.com/a/long/path/%d/and/more/%d", i % 7, i);
+            fail_unless(NULL == art_insert(&t, (unsigned char*)keys[i],
+                        strlen(keys[i])+1, (void*)(uintptr_t)(i+1)));
+        }
+
+        const unsigned char *batch_keys[512];
+        int batch_lens[512];
+        void *batch_vals[512];
+        for (int i=0; i < 512; i++) {
+            fail_unless((uintptr_t)art_search(&t, (unsigned char*)keys[i],
+                        strlen(keys[i])+1) == (uintptr_t)(i+1));
+            batch_keys[i] = (unsigned char*)keys[i];
+            batch_lens[i] = strlen(keys[i])+1;
+        }
+        fail_unless(art_search_batch(&t, batch_keys, batch_lens, 512, batch_vals) == 512);
+        for (int i=0; i < 512; i++)
+            fail_unless(batch_vals[i] == (void*)(uintptr_t)(i+1));
+
+        // Keys that differ only inside a skipped prefix, or end
+        // inside one, reach a leaf or run out and must not match
+        char miss[512][64];
+        for (int i=0; i < 512; i++) {
+            strcpy(miss[i], keys[i]);
+            miss[i][i % 30] ^= 0x20;
+            fail_unless(NULL == art_search(&t, (unsigned char*)miss[i], strlen(miss[i])+1));
+            fail_unless(NULL == art_delete(&t, (unsigned char*)miss[i], strlen(miss[i])+1));
+            fail_unless(NULL == art_search(&t, (unsigned char*)keys[i], 20));
+            batch_keys[i] = (unsigned char*)miss[i];
+            batch_lens[i] = strlen(miss[i])+1;
+        }
+        fail_unless(art_search_batch(&t, batch_keys, batch_lens, 512, batch_vals) == 0);
+        fail_unless(art_size(&t) == 512);
+
+        for (int i=0; i < 512; i += 2) {
+            fail_unless((uintptr_t)art_delete(&t, (unsigned char*)keys[i],
+                        strlen(keys[i])+1) == (uintptr_t)(i+1));
+        }
+        for (int i=0; i < 512; i++) {
+            uintptr_t val = (uintptr_t)art_search(&t, (unsigned char*)keys[i], strlen(keys[i])+1);
+            fail_unless(val == (i % 2 ? (uintptr_t)(i+1) : 0));
+        }
+        fail_unless(art_size(&t) == 256);
+
+        res = art_tree_destroy(&t);
+        fail_unless(res == 0);
+    }
+}
+END_TEST
+
+// Keys of an inline tree live here, value i is words[i-1]
+typedef struct {
+    char **words;
+    uint64_t count;
+    const char *prev;
+} inline_keys;
+
+static const unsigned char* inline_loader(void *data, void *value, uint32_t *key_len) {
+    const char *w = ((inline_keys*)data)->words[(uintptr_t)value - 1];
+    *key_len = strlen(w) + 1;
+    return (const unsigned char*)w;
+}
+
+// Checks an inline tree hands out keys in order
+static int inline_iter_cb(void *data, const unsigned char *k, uint32_t k_len, void *val) {
+    inline_keys *ik = (inline_keys*)data;
+    fail_unless(!strcmp((const char*)k, ik->words[(uintptr_t)val - 1]));
+    fail_unless(k_len == strlen((const char*)k) + 1);
+    if (ik->prev)
+        fail_unless(strcmp(ik->prev, (const char*)k) < 0);
+    ik->prev = (const char*)k;
+    ik->count++;
+    return 0;
+}
+
+START_TEST(test_art_inline_values)
+{
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+    inline_keys ik = {NULL, 0, NULL};
+    uint64_t nwords = 0, cap = 0;
+    while (fgets(buf, sizeof buf, f)) {
+        buf[strlen(buf)-1] = '\0';
+        if (nwords == cap) {
+            cap = cap ? cap * 2 : 1024;
+            ik.words = realloc(ik.words, cap * sizeof(char*));
+        }
+        ik.words[nwords++] = strdup(buf);
+    }
+    fclose(f);
+
+    // A tree with leaves to compare against
+    art_tree ref;
+    fail_unless(art_tree_init(&ref) == 0);
+    for (uint64_t i=0; i < nwords; i++)
+        art_insert(&ref, (unsigned char*)ik.words[i], strlen(ik.words[i])+1, (void*)(uintptr_t)(i+1));
+
+    for (int flags=0; flags <= ART_NODE_POOL; flags += ART_NODE_POOL) {
+        art_tree t;
+        fail_unless(art_tree_init_inline(&t, flags, inline_loader, &ik) == 0);
+        for (uint64_t i=0; i < nwords; i++) {
+            fail_unless(NULL == art_insert(&t, (unsigned char*)ik.words[i],
+                        strlen(ik.words[i])+1, (void*)(uintptr_t)(i+1)));
+        }
+        fail_unless(art_size(&t) == nwords);
+        for (uint64_t i=0; i < nwords; i++) {
+            uintptr_t val = (uintptr_t)art_search(&t, (unsigned char*)ik.words[i], strlen(ik.words[i])+1);
+            fail_unless(val == i+1, "Line: %d Val: %" PRIuPTR, (int)i, val);
+            fail_unless(NULL == art_search(&t, (unsigned char*)ik.words[i], strlen(ik.words[i])));
+        }
+
+        // Keys are loaded for the callback, in order
+        ik.count = 0;
+        ik.prev = NULL;
+        fail_unless(art_iter(&t, inline_iter_cb, &ik) == 0);
+        fail_unless(ik.count == nwords);
+
+        const char *prefixes[] = {"", "A", "a", "ab", "inter", "zz", "qqq"};
+        for (unsigned i=0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+            uint64_t want = 0, got = 0;
+            int plen = strlen(prefixes[i]);
+            art_iter_prefix(&ref, (unsigned char*)prefixes[i], plen, count_cb, &want);
+            art_iter_prefix(&t, (unsigned char*)prefixes[i], plen, count_cb, &got);
+            fail_unless(want == got, "Prefix %s: %d != %d", prefixes[i], (int)got, (int)want);
+
+            want = got = 0;
+            art_iter_range(&ref, (unsigned char*)prefixes[i], plen, (unsigned char*)"m", 1, count_cb, &want);
+            art_iter_range(&t, (unsigned char*)prefixes[i], plen, (unsigned char*)"m", 1, count_cb, &got);
+            fail_unless(want == got);
+        }
+
+        // There is no art_leaf to hand out
+        fail_unless(art_minimum(&t) == NULL);
+        fail_unless(art_lower_bound(&t, (unsigned char*)"a", 1) == NULL);
+
+        // Replacing keeps the slot, the value must
+        // still load the same key
+        fail_unless((uintptr_t)art_insert(&t, (unsigned char*)ik.words[0],
+                    strlen(ik.words[0])+1, (void*)(uintptr_t)1) == 1);
+
+        for (uint64_t i=0; i < nwords; i += 2) {
+            uintptr_t val = (uintptr_t)art_delete(&t, (unsigned char*)ik.words[i], strlen(ik.words[i])+1);
+            fail_unless(val == i+1);
+        }
+        for (uint64_t i=0; i < nwords; i++) {
+            uintptr_t val = (uintptr_t)art_search(&t, (unsigned char*)ik.words[i], strlen(ik.words[i])+1);
+            fail_unless(val == (i % 2 ? i+1 : 0));
+        }
+        fail_unless(art_size(&t) == nwords / 2);
+        fail_unless(art_tree_destroy(&t) == 0);
+    }
+
+    fail_unless(art_tree_destroy(&ref) == 0);
+    for (uint64_t i=0; i < nwords; i++)
+        free(ik.words[i]);
+    free(ik.words);
+}
+END_TEST
+
+typedef struct {
+    double prev;
+    uint64_t count;
+} double_order;
+
+static int double_order_cb(void *data, const unsigned char *key, uint32_t key_len, void *val) {
+    double_order *o = data;
+    double v = art_decode_double(key);
+    fail_unless(key_len == 8);
+    fail_unless(o->count == 0 || v > o->prev || (v == 0 && signbit(o->prev)));
+    fail_unless(*(double*)val == v || (v == 0 && *(double*)val == 0));
+    o->prev = v;
+    o->count++;
+    return 0;
+}
+
+static int tuple_cb(void *data, const unsigned char *key, uint32_t key_len, void *val) {
+    art_key_reader r;
+    unsigned char name[64];
+    art_key_reader_init(&r, key, key_len);
+    int32_t year = art_key_pop_i32(&r);
+    size_t len = art_key_pop_str(&r, name);
+    fail_unless(!r.error && r.pos == key_len);
+    fail_unless(year >= 1999 && year < 2001);
+    fail_unless(len == (uintptr_t)val);
+    (*(uint64_t*)data)++;
+    return 0;
+}
+
+START_TEST(test_art_key_encoding)
+{
+    unsigned char a[8], b[8];
+
+    // Integers compare like their values
+    int64_t ints[] = {INT64_MIN, -1000000, -256, -1, 0, 1, 255, 256, 1000000, INT64_MAX};
+    int n = sizeof(ints) / sizeof(ints[0]);
+    for (int i=0; i < n; i++) {
+        art_encode_i64(a, ints[i]);
+        fail_unless(art_decode_i64(a) == ints[i]);
+        if (i) {
+            art_encode_i64(b, ints[i-1]);
+            fail_unless(memcmp(b, a, 8) < 0);
+        }
+        if (ints[i] >= INT32_MIN && ints[i] <= INT32_MAX) {
+            art_encode_i32(a, ints[i]);
+            fail_unless(art_decode_i32(a) == ints[i]);
+        }
+    }
+    art_encode_u32(a, 0x7fffffff);
+    art_encode_u32(b, 0x80000000);
+    fail_unless(memcmp(a, b, 4) < 0 && art_decode_u32(b) == 0x80000000);
+    art_encode_float(a, -1.5f);
+    art_encode_float(b, 0.25f);
+    fail_unless(memcmp(a, b, 4) < 0 && art_decode_float(a) == -1.5f);
+
+    // Doubles iterate in numeric order
+    double doubles[] = {-INFINITY, -1e300, -2.5, -1, -1e-300, -0.0, 0.0,
+        1e-300, 1, 2.5, 1e300, INFINITY};
+    n = sizeof(doubles) / sizeof(doubles[0]);
+    art_tree t;
+    fail_unless(art_tree_init(&t) == 0);
+    for (int i=n-1; i >= 0; i--) {
+        art_encode_double(a, doubles[i]);
+        fail_unless(art_insert(&t, a, 8, &doubles[i]) == NULL);
+    }
+    double_order o = {0, 0};
+    fail_unless(art_iter(&t, double_order_cb, &o) == 0);
+    fail_unless(o.count == (uint64_t)n);
+    fail_unless(art_tree_destroy(&t) == 0);
+
+    // Strings with zero bytes keep their order and round trip,
+    // and none is a prefix of another once encoded
+    const char *strs[] = {"", "\0", "\0\0", "\0\1", "a", "a\0", "a\0b", "a\1", "ab"};
+    int lens[] = {0, 1, 2, 2, 1, 2, 3, 2, 2};
+    unsigned char enc[9][16], dec[16];
+    size_t enc_lens[9];
+    n = sizeof(lens) / sizeof(lens[0]);
+    for (int i=0; i < n; i++) {
+        const unsigned char *s = (const unsigned char*)strs[i];
+        enc_lens[i] = art_encode_str(enc[i], s, lens[i]);
+        fail_unless(enc_lens[i] == art_encoded_str_len(s, lens[i]));
+        size_t out_len = 0;
+        fail_unless(art_decode_str(enc[i], enc_lens[i], dec, &out_len) == (int)enc_lens[i]);
+        fail_unless(out_len == (size_t)lens[i] && !memcmp(dec, s, out_len));
+        for (int j=0; j < i; j++) {
+            size_t m = enc_lens[i] < enc_lens[j] ? enc_lens[i] : enc_lens[j];
+            fail_unless(memcmp(enc[j], enc[i], m) < 0, "%d %d", j, i);
+        }
+    }
+    size_t out_len;
+    fail_unless(art_decode_str((const unsigned char*)"ab", 2, NULL, &out_len) == -1);
+    fail_unless(art_decode_str((const unsigned char*)"a\0\2", 3, NULL, &out_len) == -1);
+
+    // Tuples of (year, name) scanned by year
+    const char *names[] = {"ann", "bob", "\0x", "", "carol"};
+    fail_unless(art_tree_init(&t) == 0);
+    for (int year=1995; year < 2005; year++) {
+        for (int i=0; i < 5; i++) {
+            art_key_buf k;
+            art_key_init(&k);
+            art_key_push_i32(&k, year);
+            art_key_push_str(&k, (const unsigned char*)names[i], i == 2 ? 2 : strlen(names[i]));
+            fail_unless(!k.overflow);
+            art_insert(&t, k.key, k.len, (void*)(uintptr_t)(i == 2 ? 2 : strlen(names[i])));
+        }
+    }
+    art_key_buf lo, hi;
+    art_key_init(&lo);
+    art_key_init(&hi);
+    art_key_push_i32(&lo, 1999);
+    art_key_push_i32(&hi, 2001);
+    uint64_t count = 0;
+    fail_unless(art_iter_range(&t, lo.key, lo.len, hi.key, hi.len, tuple_cb, &count) == 0);
+    fail_unless(count == 10);
+    fail_unless(art_tree_destroy(&t) == 0);
+
+    // Tuples of every arity share a tree and iterate shorter
+    // first, including ones whose next column starts with 0
+    const unsigned char ab[] = "ab";
+    art_key_buf tuples[6];
+    for (int i=0; i < 6; i++)
+        art_key_init(&tuples[i]);
+    art_key_push_str(&tuples[0], ab, 2);
+    art_key_push_str(&tuples[1], ab, 2);
+    art_key_push_i32(&tuples[1], INT32_MIN);
+    art_key_push_str(&tuples[2], ab, 2);
+    art_key_push_i32(&tuples[2], INT32_MIN);
+    art_key_push_str(&tuples[2], (const unsigned char*)"", 0);
+    art_key_push_str(&tuples[3], ab, 2);
+    art_key_push_i32(&tuples[3], 0);
+    art_key_push_u32(&tuples[4], 0);
+    art_key_push_u32(&tuples[5], 0);
+    art_key_push_u32(&tuples[5], 0);
+    fail_unless(art_tree_init(&t) == 0);
+    for (int i=5; i >= 0; i--)
+        fail_unless(art_insert(&t, tuples[i].key, tuples[i].len, &tuples[i]) == NULL);
+    fail_unless(art_size(&t) == 6);
+    for (int i=0; i < 6; i++)
+        fail_unless(art_search(&t, tuples[i].key, tuples[i].len) == &tuples[i]);
+    art_iterator it;
+    art_iterator_init(&it, &t);
+    art_leaf *l = art_iterator_first(&it);
+    for (int i=0; i < 6; i++, l = art_iterator_next(&it))
+        fail_unless(l && l->value == &tuples[(i + 4) % 6]);
+    fail_unless(l == NULL);
+    art_iterator_destroy(&it);
+    fail_unless(art_tree_destroy(&t) == 0);
+
+    // Columns read back in order, a short tuple runs out
+    art_key_reader r;
+    art_key_reader_init(&r, tuples[2].key, tuples[2].len);
+    fail_unless(art_key_pop_str(&r, a) == 2 && !memcmp(a, ab, 2));
+    fail_unless(art_key_pop_i32(&r) == INT32_MIN);
+    fail_unless(art_key_pop_str(&r, a) == 0 && !r.error && r.pos == tuples[2].len);
+    art_key_reader_init(&r, tuples[0].key, tuples[0].len);
+    art_key_pop_str(&r, a);
+    fail_unless(art_key_pop_i32(&r) == 0 && r.error);
+
+    // A full buffer drops the column
+    const uint32_t full = (ART_KEY_MAX_LEN + 1) / 9 * 9 - 1;
+    art_key_buf big;
+    art_key_init(&big);
+    for (int i=0; i < (ART_KEY_MAX_LEN + 1) / 9; i++)
+        art_key_push_u64(&big, i);
+    fail_unless(!big.overflow && big.len == full);
+    art_key_push_u64(&big, 1);
+    fail_unless(big.overflow && big.len == full);
+}
+END_TEST
+
+START_TEST(test_art_insert_hint)
+{
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+
+    for (int flags=0; flags <= (ART_NODE_POOL|ART_LEAF_ARENA); flags++) {
+        art_tree t, other;
+        art_hint h;
+        fail_unless(art_tree_init_flags(&t, flags) == 0);
+        fail_unless(art_tree_init_flags(&other, flags) == 0);
+        art_hint_init(&h);
+
+        // Words arrive sorted, with a plain insert or delete
+        // now and then to throw the hint off its path
+        fseek(f, 0, SEEK_SET);
+        uintptr_t line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            fail_unless(NULL == art_insert_hint(&t, &h, (unsigned char*)buf, len, (void*)line));
+            if (line % 1000 == 0)
+                art_insert(&t, (unsigned char*)"zzz", 4, NULL);
+            if (line % 1000 == 500)
+                art_delete(&t, (unsigned char*)"zzz", 4);
+            if (line % 777 == 0)
+                art_insert_hint(&other, &h, (unsigned char*)buf, len, (void*)line);
+            line++;
+        }
+        art_delete(&t, (unsigned char*)"zzz", 4);
+        fail_unless(art_size(&t) == line - 1);
+
+        // Replacing keeps the path
+        fseek(f, 0, SEEK_SET);
+        line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            uintptr_t val = (uintptr_t)art_insert_hint(&t, &h, (unsigned char*)buf, len, (void*)line);
+            fail_unless(line == val, "Line: %d Val: %" PRIuPTR " Str: %s\n", line, val, buf);
+            fail_unless(line == (uintptr_t)art_search(&t, (unsigned char*)buf, len));
+            line++;
+        }
+        fail_unless(art_size(&t) == line - 1);
+        fail_unless(art_size(&other) == (line - 1) / 777);
+
+        // Appending sequence numbers
+        art_tree seq;
+        fail_unless(art_tree_init_flags(&seq, flags) == 0);
+        art_hint_init(&h);
+        for (uint64_t i=0; i < 100000; i++) {
+            unsigned char key[8];
+            art_encode_u64(key, i * 3);
+            fail_unless(NULL == art_insert_hint(&seq, &h, key, 8, (void*)(uintptr_t)(i+1)));
+        }
+        for (uint64_t i=0; i < 300000; i++) {
+            unsigned char key[8];
+            art_encode_u64(key, i);
+            uintptr_t val = (uintptr_t)art_search(&seq, key, 8);
+            fail_unless(val == (i % 3 ? 0 : i / 3 + 1));
+        }
+        uint64_t count = 0;
+        fail_unless(art_iter(&seq, count_cb, &count) == 0);
+        fail_unless(count == 100000);
+
+        fail_unless(art_tree_destroy(&seq) == 0);
+        fail_unless(art_tree_destroy(&other) == 0);
+        fail_unless(art_tree_destroy(&t) == 0);
+    }
+    fclose(f);
+}
+END_TEST
+
+// Checks rank and select of every key against the iterator
+static void check_ranks(art_tree *t) {
+    art_iterator it;
+    uint64_t i = 0;
+    art_iterator_init(&it, t);
+    for (art_leaf *l = art_iterator_first(&it); l; l = art_iterator_next(&it), i++) {
+        fail_unless(art_select(t, i) == l);
+        fail_unless(art_rank(t, l->key, l->key_len) == i);
+        fail_unless(art_rank(t, l->key, l->key_len - 1) == i);
+    }
+    fail_unless(i == art_size(t));
+    fail_unless(art_select(t, i) == NULL);
+    fail_unless(art_rank(t, (unsigned char*)"\xff", 1) == i);
+    art_iterator_destroy(&it);
+}
+
+START_TEST(test_art_subtree_count)
+{
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+    const char *ranges[][2] = {
+        {"a", "b"}, {"aardvark", "abandon"}, {"m", NULL}, {"", "b"},
+        {"zz", "zzzzzzzzzzzzzzzz"}, {"b", "a"}, {"A", "a"}, {"", NULL},
+    };
+
+    art_tree plain;
+    fail_unless(art_tree_init(&plain) == 0);
+    int flag_sets[] = {ART_SUBTREE_COUNT, ART_SUBTREE_COUNT|ART_NODE_POOL|ART_LEAF_ARENA};
+    for (int fs=0; fs < 2; fs++) {
+        art_tree t;
+        art_hint h;
+        fail_unless(art_tree_init_flags(&t, flag_sets[fs]) == 0);
+        art_hint_init(&h);
+
+        // Plain and hinted inserts, then a second pass that
+        // only replaces values and must not count them again
+        fseek(f, 0, SEEK_SET);
+        uintptr_t line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            if (line / 1000 % 2)
+                fail_unless(NULL == art_insert(&t, (unsigned char*)buf, len, (void*)line));
+            else
+                fail_unless(NULL == art_insert_hint(&t, &h, (unsigned char*)buf, len, (void*)line));
+            if (!fs) art_insert(&plain, (unsigned char*)buf, len, (void*)line);
+            line++;
+        }
+        fseek(f, 0, SEEK_SET);
+        line = 1;
+        while (fgets(buf, sizeof buf, f) && line < 20000) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            fail_unless(line == (uintptr_t)art_insert_hint(&t, &h, (unsigned char*)buf, len, (void*)line));
+            line++;
+        }
+        check_ranks(&t);
+
+        // Deleting every third word, and missing ones, keeps
+        // the counts in step
+        fseek(f, 0, SEEK_SET);
+        line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            if (line % 3 == 0) {
+                fail_unless(art_delete(&t, (unsigned char*)buf, len) != NULL);
+                if (!fs) art_delete(&plain, (unsigned char*)buf, len);
+            }
+            fail_unless(art_delete(&t, (unsigned char*)buf, len-1) == NULL);
+            line++;
+        }
+        check_ranks(&t);
+
+        // Counted ranges match iterated ones and the
+        // leaf by leaf count of an uncounted tree
+        for (unsigned i=0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+            const char *start = ranges[i][0], *end = ranges[i][1];
+            uint64_t expected = 0;
+            art_iter_range(&t, (unsigned char*)start, strlen(start),
+                    (unsigned char*)end, end ? strlen(end) : 0, count_cb, &expected);
+            uint64_t count = art_count_range(&t, (unsigned char*)start, strlen(start),
+                    (unsigned char*)end, end ? strlen(end) : 0);
+            fail_unless(count == expected, "Range %s-%s: %d != %d", start, end,
+                    (int)count, (int)expected);
+            fail_unless(art_count_range(&plain, (unsigned char*)start, strlen(start),
+                    (unsigned char*)end, end ? strlen(end) : 0) == expected);
+        }
+        fail_unless(!strcmp((char*)art_select(&plain, 12345)->key, (char*)art_select(&t, 12345)->key));
+
+        // A bulk loaded tree starts out counted
+        uint64_t n = art_size(&t), i = 0;
+        const unsigned char **keys = malloc(n * sizeof(unsigned char*));
+        int *key_lens = malloc(n * sizeof(int));
+        void **values = malloc(n * sizeof(void*));
+        art_iterator it;
+        art_iterator_init(&it, &t);
+        for (art_leaf *l = art_iterator_first(&it); l; l = art_iterator_next(&it), i++) {
+            keys[i] = l->key;
+            key_lens[i] = l->key_len;
+            values[i] = l->value;
+        }
+        art_iterator_destroy(&it);
+        art_tree bulk;
+        fail_unless(art_tree_init_flags(&bulk, flag_sets[fs]) == 0);
+        fail_unless(art_bulk_load(&bulk, keys, key_lens, n, values) == 0);
+        check_ranks(&bulk);
+        fail_unless(art_tree_destroy(&bulk) == 0);
+        free(keys);
+        free(key_lens);
+        free(values);
+
+        fail_unless(art_tree_destroy(&t) == 0);
+    }
+    fail_unless(art_tree_destroy(&plain) == 0);
+    fclose(f);
+}
+END_TEST
+
+START_TEST(test_art_prefix_keys)
+{
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+    unsigned char **words = NULL;
+    int *lens = NULL;
+    uint64_t nwords = 0, cap = 0;
+
+    // Keys without their NUL, in buffers of exactly that size,
+    // so words that start other words are proper prefixes
+    while (fgets(buf, sizeof buf, f)) {
+        if (nwords == cap) {
+            cap = cap ? cap * 2 : 1024;
+            words = realloc(words, cap * sizeof(unsigned char*));
+            lens = realloc(lens, cap * sizeof(int));
+        }
+        lens[nwords] = strlen(buf) - 1;
+        words[nwords] = malloc(lens[nwords]);
+        memcpy(words[nwords], buf, lens[nwords]);
+        nwords++;
+    }
+    fclose(f);
+
+    for (int flags=0; flags <= ART_OPTIMISTIC_PREFIX; flags += ART_OPTIMISTIC_PREFIX) {
+        art_tree t;
+        fail_unless(art_tree_init_flags(&t, flags) == 0);
+        for (uint64_t i=0; i < nwords; i++)
+            fail_unless(NULL == art_insert(&t, words[i], lens[i], (void*)(uintptr_t)(i+1)));
+        fail_unless(art_size(&t) == nwords);
+        fail_unless(art_search(&t, (unsigned char*)"a", 1) != NULL);
+        fail_unless(art_search(&t, (unsigned char*)"", 0) == NULL);
+
+        for (uint64_t i=0; i < nwords; i++) {
+            uintptr_t val = (uintptr_t)art_search(&t, words[i], lens[i]);
+            fail_unless(val == i+1, "Line: %d Val: %" PRIuPTR, (int)i, val);
+        }
+
+        // Bounds of every key agree with the iterator
+        art_iterator it;
+        art_iterator_init(&it, &t);
+        for (uint64_t i=0; i < nwords; i++) {
+            art_leaf *l = art_lower_bound(&t, words[i], lens[i]);
+            fail_unless(l && (uintptr_t)l->value == i+1);
+            fail_unless(art_iterator_seek(&it, words[i], lens[i]) == l);
+            fail_unless(art_upper_bound(&t, words[i], lens[i]) == art_iterator_next(&it));
+        }
+        art_iterator_destroy(&it);
+        for (uint64_t i=0; i < nwords; i += 2)
+            fail_unless((uintptr_t)art_delete(&t, words[i], lens[i]) == i+1);
+        for (uint64_t i=0; i < nwords; i++) {
+            uintptr_t val = (uintptr_t)art_search(&t, words[i], lens[i]);
+            fail_unless(val == (i % 2 ? i+1 : 0));
+        }
+        fail_unless(art_tree_destroy(&t) == 0);
+    }
+
+    for (uint64_t i=0; i < nwords; i++)
+        free(words[i]);
+    free(words);
+    free(lens);
+
+    // A key is not above itself when it sits under a 0 edge
+    art_tree t;
+    fail_unless(art_tree_init(&t) == 0);
+    fail_unless(art_insert(&t, (unsigned char*)"ab", 2, (void*)1) == NULL);
+    fail_unless(art_insert(&t, (unsigned char*)"abc", 3, (void*)2) == NULL);
+    fail_unless(art_insert(&t, (unsigned char*)"abcd", 4, (void*)3) == NULL);
+    fail_unless((uintptr_t)art_upper_bound(&t, (unsigned char*)"a", 1)->value == 1);
+    fail_unless((uintptr_t)art_upper_bound(&t, (unsigned char*)"ab", 2)->value == 2);
+    fail_unless((uintptr_t)art_upper_bound(&t, (unsigned char*)"abc", 3)->value == 3);
+    fail_unless(art_upper_bound(&t, (unsigned char*)"abcd", 4) == NULL);
+    fail_unless((uintptr_t)art_lower_bound(&t, (unsigned char*)"ab", 2)->value == 1);
+    fail_unless((uintptr_t)art_lower_bound(&t, (unsigned char*)"abc", 3)->value == 2);
+    fail_unless((uintptr_t)art_lower_bound(&t, (unsigned char*)"abb", 3)->value == 2);
+    fail_unless(art_tree_destroy(&t) == 0);
+}
+END_TEST
+
+static int conflict_top_cb(void *data, const unsigned char *k, uint32_t k_len, void *val) {
+    (void)k;
+    (void)k_len;
+    *(uintptr_t*)data = (uintptr_t)val;
+    return 1;
+}
+
+START_TEST(test_art_prefix_conflict)
+{
+    // A key followed by a 0 byte reads the same as the key
+    // itself at its end, whichever way round they come, and
+    // whether the shorter one meets a leaf, an inner node
+    // under its 0 edge or a prefix it ends inside of
+    const unsigned char a[] = {0,0,0,5}, b[] = {0,0,0,5,0,0,0,0}, c[] = {0,0,0,5,0,0,0,7};
+    const unsigned char d[] = {5,1}, e[] = {5,0,1,1}, f[] = {5,0,1,2}, g[] = {5}, dz[] = {5,1,0,9};
+    const unsigned char *keys[3] = {a, b, c};
+    const int lens[3] = {4, 8, 8};
+    const int orders[6][3] = {{0,1,2}, {0,2,1}, {1,0,2}, {1,2,0}, {2,0,1}, {2,1,0}};
+
+    for (int flags=0; flags <= (ART_SUBTREE_COUNT|ART_MAX_SCORE); flags += ART_SUBTREE_COUNT|ART_MAX_SCORE) {
+        for (int o=0; o < 6; o++) {
+            art_tree t;
+            art_hint h;
+            fail_unless(art_tree_init_flags(&t, flags) == 0);
+            art_hint_init(&h);
+            uint64_t stored = 0;
+            for (int i=0; i < 3; i++) {
+                int k = orders[o][i];
+                void *val = (void*)(uintptr_t)(k+1);
+                int status = ART_KEY_FOUND;
+                void *ret = o % 2 ? art_insert_hint_status(&t, &h, keys[k], lens[k], val, &status) :
+                    art_insert_status(&t, keys[k], lens[k], val, 1, &status);
+                fail_unless(ret == NULL);
+                fail_unless(status == ART_KEY_ADDED || status == ART_KEY_CONFLICT);
+                if (status == ART_KEY_ADDED) stored |= 1 << k;
+            }
+
+            // a goes in only ahead of both others
+            fail_unless(stored == (orders[o][0] ? 6 : 1));
+            fail_unless(art_size(&t) == (uint64_t)(stored == 1 ? 1 : 2));
+            for (int k=0; k < 3; k++) {
+                uintptr_t val = (uintptr_t)art_search(&t, keys[k], lens[k]);
+                fail_unless(val == (stored & (1 << k) ? (uintptr_t)k+1 : 0));
+            }
+            if (flags)
+                fail_unless(art_count_range(&t, NULL, 0, NULL, 0) == art_size(&t));
+            fail_unless(art_tree_destroy(&t) == 0);
+        }
+
+        // g ends where d and the node of e and f part. Refused
+        // inserts leave the counts and the best score as they were.
+        art_tree t;
+        int status;
+        fail_unless(art_tree_init_flags(&t, flags) == 0);
+        fail_unless(art_insert(&t, d, 2, (void*)1) == NULL);
+        fail_unless(art_insert(&t, e, 4, (void*)2) == NULL);
+        fail_unless(art_insert(&t, f, 4, (void*)3) == NULL);
+        fail_unless(art_insert(&t, g, 1, (void*)100) == NULL);
+        fail_unless(art_insert_status(&t, g, 1, (void*)100, 0, &status) == NULL);
+        fail_unless(status == ART_KEY_CONFLICT);
+        fail_unless(art_insert_status(&t, dz, 4, (void*)100, 1, &status) == NULL);
+        fail_unless(status == ART_KEY_CONFLICT);
+        fail_unless(art_size(&t) == 3);
+        fail_unless(art_search(&t, g, 1) == NULL);
+        fail_unless((uintptr_t)art_search(&t, e, 4) == 2);
+        if (flags) {
+            uintptr_t top = 0;
+            fail_unless(art_count_range(&t, NULL, 0, NULL, 0) == 3);
+            fail_unless(art_rank(&t, d, 2) == 2);
+            fail_unless(art_topk_prefix(&t, g, 1, 1, conflict_top_cb, &top) == 1);
+            fail_unless(top == 3);
+        }
+
+        // Past MAX_PREFIX_LEN the byte after the end comes from a leaf
+        unsigned char lp1[MAX_PREFIX_LEN * 4] = {7}, lp2[MAX_PREFIX_LEN * 4] = {7};
+        lp2[MAX_PREFIX_LEN * 4 - 1] = 1;
+        fail_unless(art_insert(&t, lp1, sizeof lp1, (void*)1) == NULL);
+        fail_unless(art_insert(&t, lp2, sizeof lp2, (void*)1) == NULL);
+        fail_unless(art_insert_status(&t, lp1, MAX_PREFIX_LEN * 2, (void*)1, 1, &status) == NULL);
+        fail_unless(status == ART_KEY_CONFLICT);
+        fail_unless(art_delete(&t, lp1, sizeof lp1) != NULL);
+        fail_unless(art_delete(&t, lp2, sizeof lp2) != NULL);
+
+        // Prefixes followed by anything but a 0 byte still go in
+        fail_unless(art_insert(&t, g, 0, (void*)4) == NULL);
+        fail_unless(art_insert(&t, e, 3, (void*)5) == NULL);
+        fail_unless(art_size(&t) == 5);
+
+        // Any stored value comes back, all bits set included
+        fail_unless(art_insert(&t, e, 3, (void*)-1) == (void*)5);
+        fail_unless(art_insert_status(&t, e, 3, (void*)6, 1, &status) == (void*)-1);
+        fail_unless(status == ART_KEY_FOUND);
+        fail_unless(art_insert_status(&t, e, 3, (void*)7, 0, &status) == (void*)6);
+        fail_unless(status == ART_KEY_FOUND);
+        fail_unless(art_insert_status(&t, d+1, 1, (void*)8, 1, &status) == NULL);
+        fail_unless(status == ART_KEY_ADDED);
+        fail_unless(art_size(&t) == 6);
+        fail_unless(art_tree_destroy(&t) == 0);
+    }
+}
+END_TEST
+
+START_TEST(test_art_longest_prefix_match)
+{
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+    const char *routes[] = {"10.", "10.1.", "10.1.2.", "192.168.", "192.168.1.7"};
+    int len;
+
+    for (int flags=0; flags <= ART_OPTIMISTIC_PREFIX; flags += ART_OPTIMISTIC_PREFIX) {
+        art_tree t;
+        fail_unless(art_tree_init_flags(&t, flags) == 0);
+        fail_unless(art_longest_prefix_match(&t, (unsigned char*)"10.1", 4, NULL) == NULL);
+
+        for (int i=0; i < 5; i++)
+            art_insert(&t, (unsigned char*)routes[i], strlen(routes[i]), (void*)(uintptr_t)(i+1));
+        fail_unless((uintptr_t)art_longest_prefix_match(&t, (unsigned char*)"10.1.2.3", 8, &len) == 3);
+        fail_unless(len == 7);
+        fail_unless((uintptr_t)art_longest_prefix_match(&t, (unsigned char*)"10.1.3.3", 8, &len) == 2);
+        fail_unless(len == 5);
+        fail_unless((uintptr_t)art_longest_prefix_match(&t, (unsigned char*)"10.2.1.1", 8, NULL) == 1);
+        fail_unless((uintptr_t)art_longest_prefix_match(&t, (unsigned char*)"192.168.1.7", 11, NULL) == 5);
+        fail_unless((uintptr_t)art_longest_prefix_match(&t, (unsigned char*)"192.168.1.70", 12, NULL) == 5);
+        fail_unless((uintptr_t)art_longest_prefix_match(&t, (unsigned char*)"192.168.1.", 10, NULL) == 4);
+        fail_unless(art_longest_prefix_match(&t, (unsigned char*)"192.16", 6, NULL) == NULL);
+        fail_unless(art_longest_prefix_match(&t, (unsigned char*)"11.1.2.3", 8, NULL) == NULL);
+        fail_unless(art_tree_destroy(&t) == 0);
+
+        // Every third word, so most queries have a shorter match
+        // or none, checked against a probe per prefix length
+        fail_unless(art_tree_init_flags(&t, flags) == 0);
+        uintptr_t line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf) - 1;
+            if (line % 3 == 0)
+                art_insert(&t, (unsigned char*)buf, len, (void*)line);
+            line++;
+        }
+        rewind(f);
+        while (fgets(buf, sizeof buf, f)) {
+            int qlen = strlen(buf) - 1;
+            memcpy(buf + qlen, "qz", 2);
+            qlen += 2;
+
+            uintptr_t want = 0;
+            int want_len = qlen;
+            for (; want_len >= 0 && !want; want_len--)
+                want = (uintptr_t)art_search(&t, (unsigned char*)buf, want_len);
+            uintptr_t got = (uintptr_t)art_longest_prefix_match(&t, (unsigned char*)buf, qlen, &len);
+            fail_unless(got == want, "Query: %.*s", qlen, buf);
+            if (want)
+                fail_unless(len == want_len + 1);
+        }
+        rewind(f);
+        fail_unless(art_tree_destroy(&t) == 0);
+    }
+    fclose(f);
+}
+END_TEST
+
+// Scores by line number for the scored trees, values past
+// the word count are replaced ones with half the score
+#define TOPK_LINES (256 * 1024)
+static uint64_t topk_scores[2 * TOPK_LINES];
+
+static uint64_t line_score(void *data, void *value) {
+    (void)data;
+    return topk_scores[(uintptr_t)value];
+}
+
+typedef struct {
+    const art_tree *t;
+    const char *prefix;
+    uint64_t *scores;
+    int n;
+} topk_list;
+
+static int topk_cb(void *data, const unsigned char *k, uint32_t k_len, void *val) {
+    topk_list *l = (topk_list*)data;
+    fail_unless(k_len >= strlen(l->prefix) && !memcmp(k, l->prefix, strlen(l->prefix)));
+    l->scores[l->n++] = l->t->scorer ? l->t->scorer(l->t->scorer_data, val) : (uintptr_t)val;
+    return 0;
+}
+
+static int cmp_score_desc(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x < y) - (x > y);
+}
+
+// Checks the top scores under some prefixes against
+// sorting everything art_iter_prefix finds
+static void check_topk(art_tree *t) {
+    const char *prefixes[] = {"", "a", "ab", "th", "zyg", "aardvark", "q", "xyzzyx"};
+    topk_list all = {t, NULL, malloc(TOPK_LINES * sizeof(uint64_t)), 0};
+    topk_list top = {t, NULL, malloc(100 * sizeof(uint64_t)), 0};
+    for (unsigned i=0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+        const unsigned char *p = (const unsigned char*)prefixes[i];
+        all.prefix = top.prefix = prefixes[i];
+        all.n = 0;
+        art_iter_prefix(t, p, strlen(prefixes[i]), topk_cb, &all);
+        qsort(all.scores, all.n, sizeof(uint64_t), cmp_score_desc);
+        for (int k=1; k <= 100; k *= 10) {
+            top.n = 0;
+            fail_unless(art_topk_prefix(t, p, strlen(prefixes[i]), k, topk_cb, &top) == 0);
+            fail_unless(top.n == (all.n < k ? all.n : k), "Prefix %s: %d", prefixes[i], top.n);
+            fail_unless(!memcmp(top.scores, all.scores, top.n * sizeof(uint64_t)),
+                    "Prefix %s k %d", prefixes[i], k);
+        }
+    }
+    free(all.scores);
+    free(top.scores);
+}
+
+START_TEST(test_art_topk_prefix)
+{
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+    for (uintptr_t i=0; i < TOPK_LINES; i++) {
+        topk_scores[i] = (i * 2654435761u) % 1000003;
+        topk_scores[TOPK_LINES + i] = topk_scores[i] / 2;
+    }
+
+    // Values that are their own score against a scorer,
+    // with plain inserts, and hinted runs that resume
+    // below nodes the hint has to raise. The unscored
+    // tree gives the same answers by scanning.
+    art_tree plain;
+    fail_unless(art_tree_init(&plain) == 0);
+    for (int scorer=0; scorer < 2; scorer++) {
+        art_tree t;
+        art_hint h;
+        if (scorer)
+            fail_unless(art_tree_init_scored(&t, ART_NODE_POOL|ART_SUBTREE_COUNT, line_score, NULL) == 0);
+        else
+            fail_unless(art_tree_init_flags(&t, ART_MAX_SCORE) == 0);
+        art_hint_init(&h);
+
+        fseek(f, 0, SEEK_SET);
+        uintptr_t line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            void *val = scorer ? (void*)line : (void*)topk_scores[line];
+            if (line / 1000 % 2)
+                art_insert(&t, (unsigned char*)buf, len, val);
+            else
+                art_insert_hint(&t, &h, (unsigned char*)buf, len, val);
+            if (!scorer) art_insert(&plain, (unsigned char*)buf, len, val);
+            line++;
+        }
+        check_topk(&t);
+
+        // Lower every other score, delete every third word
+        fseek(f, 0, SEEK_SET);
+        line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            void *val = scorer ? (void*)(TOPK_LINES + line) : (void*)topk_scores[TOPK_LINES + line];
+            if (line % 2)
+                art_insert(&t, (unsigned char*)buf, len, val);
+            if (line % 3 == 0)
+                art_delete(&t, (unsigned char*)buf, len);
+            if (!scorer && line % 2)
+                art_insert(&plain, (unsigned char*)buf, len, val);
+            if (!scorer && line % 3 == 0)
+                art_delete(&plain, (unsigned char*)buf, len);
+            line++;
+        }
+        check_topk(&t);
+        if (!scorer) check_topk(&plain);
+
+        // A bulk loaded tree starts out scored
+        uint64_t n = art_size(&t), i = 0;
+        const unsigned char **keys = malloc(n * sizeof(unsigned char*));
+        int *key_lens = malloc(n * sizeof(int));
+        void **values = malloc(n * sizeof(void*));
+        art_iterator it;
+        art_iterator_init(&it, &t);
+        for (art_leaf *l = art_iterator_first(&it); l; l = art_iterator_next(&it), i++) {
+            keys[i] = l->key;
+            key_lens[i] = l->key_len;
+            values[i] = l->value;
+        }
+        art_iterator_destroy(&it);
+        art_tree bulk;
+        if (scorer)
+            fail_unless(art_tree_init_scored(&bulk, 0, line_score, NULL) == 0);
+        else
+            fail_unless(art_tree_init_flags(&bulk, ART_MAX_SCORE) == 0);
+        fail_unless(art_bulk_load(&bulk, keys, key_lens, n, values) == 0);
+        check_topk(&bulk);
+        fail_unless(art_tree_destroy(&bulk) == 0);
+        free(keys);
+        free(key_lens);
+        free(values);
+
+        fail_unless(art_tree_destroy(&t) == 0);
+    }
+    fail_unless(art_tree_destroy(&plain) == 0);
+    fclose(f);
+}
+END_TEST
+
+// Edit distance by the full table, for checking art_fuzzy_search
+static int edit_distance(const unsigned char *a, int a_len, const unsigned char *b, int b_len) {
+    int *prev = malloc((b_len + 1) * sizeof(int)), *row = malloc((b_len + 1) * sizeof(int));
+    for (int j=0; j <= b_len; j++)
+        prev[j] = j;
+    for (int i=1; i <= a_len; i++) {
+        row[0] = i;
+        for (int j=1; j <= b_len; j++) {
+            int d = prev[j-1] + (a[i-1] != b[j-1]);
+            if (prev[j] + 1 < d) d = prev[j] + 1;
+            if (row[j-1] + 1 < d) d = row[j-1] + 1;
+            row[j] = d;
+        }
+        int *tmp = prev; prev = row; row = tmp;
+    }
+    int d = prev[b_len];
+    free(prev);
+    free(row);
+    return d;
+}
+
+typedef struct {
+    const unsigned char *query;
+    int query_len;
+    int max_edits;
+    void **values;
+    int n;
+} fuzzy_list;
+
+static int fuzzy_cb(void *data, const unsigned char *k, uint32_t k_len, void *val) {
+    fuzzy_list *l = (fuzzy_list*)data;
+    fail_unless(l->n < 4096);
+    l->values[l->n++] = val;
+    return 0;
+}
+
+static int brute_fuzzy_cb(void *data, const unsigned char *k, uint32_t k_len, void *val) {
+    fuzzy_list *l = (fuzzy_list*)data;
+    if (edit_distance(k, k_len, l->query, l->query_len) <= l->max_edits)
+        return fuzzy_cb(data, k, k_len, val);
+    return 0;
+}
+
+START_TEST(test_art_fuzzy_search)
+{
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+    const char *queries[] = {"helo", "wrod", "aardvark", "zzz", "a", "",
+        "internationalization", "qeustion", "abcdefghijklmnopqrstuvwxyz"};
+
+    art_tree t;
+    fail_unless(art_tree_init(&t) == 0);
+    uintptr_t line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        art_insert(&t, (unsigned char*)buf, len, (void*)line);
+        line++;
+    }
+    fclose(f);
+
+    fuzzy_list got = {0}, want = {0};
+    int matches = 0;
+    got.values = malloc(4096 * sizeof(void*));
+    want.values = malloc(4096 * sizeof(void*));
+    for (unsigned i=0; i < sizeof(queries) / sizeof(queries[0]); i++) {
+        for (int edits=0; edits <= 2; edits++) {
+            // Keys carry their NUL, and so does the query
+            got.query = want.query = (const unsigned char*)queries[i];
+            got.query_len = want.query_len = strlen(queries[i]) + 1;
+            got.max_edits = want.max_edits = edits;
+            got.n = want.n = 0;
+            fail_unless(art_fuzzy_search(&t, got.query, got.query_len, edits, fuzzy_cb, &got) == 0);
+            art_iter(&t, brute_fuzzy_cb, &want);
+            fail_unless(got.n == want.n, "Query %s edits %d: %d != %d", queries[i], edits, got.n, want.n);
+            fail_unless(!memcmp(got.values, want.values, got.n * sizeof(void*)));
+            matches += got.n;
+        }
+    }
+    fail_unless(matches > 100);
+
+    // Exact matches only with no edits
+    got.n = 0;
+    fail_unless(art_fuzzy_search(&t, (const unsigned char*)"hello", 6, 0, fuzzy_cb, &got) == 0);
+    fail_unless(got.n == 1 && got.values[0] == art_search(&t, (const unsigned char*)"hello", 6));
+
+    free(got.values);
+    free(want.values);
+    fail_unless(art_tree_destroy(&t) == 0);
+}
+END_TEST
+
+typedef struct {
+    const art_dfa *dfa;
+    void **values;
+    int n;
+} pattern_list;
+
+static int pattern_cb(void *data, const unsigned char *k, uint32_t k_len, void *val) {
+    pattern_list *l = (pattern_list*)data;
+    l->values[l->n++] = val;
+    return 0;
+}
+
+static int brute_pattern_cb(void *data, const unsigned char *k, uint32_t k_len, void *val) {
+    pattern_list *l = (pattern_list*)data;
+    int state = l->dfa->start;
+    for (uint32_t i=0; i < k_len && state; i++)
+        state = art_dfa_step(l->dfa, state, k[i]);
+    return l->dfa->accept[state] ? pattern_cb(data, k, k_len, val) : 0;
+}
+
+START_TEST(test_art_iter_pattern)
+{
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+    const char *globs[] = {"user:*:session", "a*", "?b*", "[a-c]*z", "*ing", "*",
+        "[!a-y]*", "*q*u*", "user:1?:*", "nomatch", "\\*", "*:profile"};
+
+    art_tree t;
+    fail_unless(art_tree_init(&t) == 0);
+
+    // Keys without their NUL, so some are prefixes of others
+    uintptr_t line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        art_insert(&t, (unsigned char*)buf, len - 1, (void*)line);
+        line++;
+    }
+    fclose(f);
+    for (int i=0; i < 100; i++) {
+        len = sprintf(buf, "user:%d:session", i * 7919);
+        art_insert(&t, (unsigned char*)buf, len, (void*)line++);
+        len = sprintf(buf, "user:%d:profile", i * 7919);
+        art_insert(&t, (unsigned char*)buf, len, (void*)line++);
+    }
+
+    art_dfa d;
+    pattern_list got = {&d}, want = {&d};
+    got.values = malloc(line * sizeof(void*));
+    want.values = malloc(line * sizeof(void*));
+    for (unsigned i=0; i < sizeof(globs) / sizeof(globs[0]); i++) {
+        fail_unless(art_dfa_compile_glob(&d, globs[i]) == 0);
+        got.n = want.n = 0;
+        fail_unless(art_iter_pattern(&t, &d, pattern_cb, &got) == 0);
+        art_iter(&t, brute_pattern_cb, &want);
+        fail_unless(got.n == want.n, "Glob %s: %d != %d", globs[i], got.n, want.n);
+        fail_unless(!memcmp(got.values, want.values, got.n * sizeof(void*)));
+        if (!strcmp(globs[i], "user:*:session") || !strcmp(globs[i], "*:profile"))
+            fail_unless(got.n == 100);
+        if (!strcmp(globs[i], "*"))
+            fail_unless(got.n == (int)art_size(&t));
+        if (!strcmp(globs[i], "nomatch"))
+            fail_unless(got.n == 0);
+        art_dfa_free(&d);
+    }
+
+    // Malformed globs do not compile
+    fail_unless(art_dfa_compile_glob(&d, "[abc") == -1);
+
+    free(got.values);
+    free(want.values);
+    fail_unless(art_tree_destroy(&t) == 0);
+}
+END_TEST
+
+START_TEST(test_art_stats)
+{
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+
+    art_tree t;
+    fail_unless(art_tree_init(&t) == 0);
+    art_stats_reset();
+
+    uintptr_t line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        art_insert(&t, (unsigned char*)buf, len, (void*)line);
+        line++;
+    }
+    uint64_t keys = line - 1;
+
+    art_stats s, sum = {{0}};
+    art_stats_get(&s);
+    if (!s.leaf_allocs) {
+        // Built without ART_STATS, so nothing is counted
+        fail_unless(!memcmp(&s, &sum, sizeof(art_stats)));
+        fail_unless(art_tree_destroy(&t) == 0);
+        fclose(f);
+        return;
+    }
+    fail_unless(s.leaf_allocs == keys);
+    fail_unless(s.grows[NODE4-1] > 0 && s.grows[NODE16-1] > 0);
+
+    // Inserts only grow, so each bigger node came from a full smaller one
+    fail_unless(s.node_allocs[NODE16-1] == s.grows[NODE4-1]);
+    fail_unless(s.node_allocs[NODE32-1] == s.grows[NODE16-1]);
+    fail_unless(s.node_frees[NODE4-1] == s.grows[NODE4-1]);
+    fail_unless(s.shrinks[NODE4-1] == 0 && s.leaf_frees == 0);
+
+    // Every key is found, and a key cut short ends on another leaf
+    rewind(f);
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(art_search(&t, (unsigned char*)buf, len) != NULL);
+    }
+    fail_unless(art_search(&t, (unsigned char*)"A", 1) == NULL);
+    art_stats_get(&s);
+    fail_unless(s.searches == keys + 1);
+    fail_unless(s.leaf_mismatches <= 1);
+    fail_unless(s.search_depth > keys && s.max_search_depth > 1);
+    fail_unless(s.search_depth <= keys * s.max_search_depth + s.max_search_depth);
+
+    // Deletes give back every leaf and shrink nodes on the way
+    rewind(f);
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        art_delete(&t, (unsigned char*)buf, len);
+    }
+    fclose(f);
+    art_stats_get(&s);
+    fail_unless(s.leaf_frees == keys);
+    fail_unless(s.shrinks[NODE4-1] > 0 && s.shrinks[NODE16-1] > 0);
+
+    // Merging adds counts and keeps the deepest search
+    art_stats_merge(&sum, &s);
+    art_stats_merge(&sum, &s);
+    fail_unless(sum.leaf_allocs == 2 * keys);
+    fail_unless(sum.max_search_depth == s.max_search_depth);
+
+    art_stats_reset();
+    art_stats_get(&s);
+    fail_unless(s.leaf_allocs == 0 && s.searches == 0);
+    fail_unless(art_tree_destroy(&t) == 0);
+}
+END_TEST
+
+START_TEST(test_art_analyze)
+{
+    // Longer than a node keeps inline, whatever MAX_PREFIX_LEN is
+    const int pre = MAX_PREFIX_LEN + 13;
+    int len;
+    char buf[512 + MAX_PREFIX_LEN + 13];
+    const int flags[] = {0, ART_NODE_POOL | ART_LEAF_ARENA};
+
+    for (int f=0; f < 2; f++) {
+        art_tree t;
+        fail_unless(art_tree_init_flags(&t, flags[f]) == 0);
+
+        // Words, and the same words behind the long prefix
+        FILE *fp = fopen("tests/words.txt", "r");
+        uint64_t keys = 0, key_bytes = 0;
+        uintptr_t line = 1;
+        memset(buf, '/', pre);
+        while (fgets(buf + pre, sizeof buf - pre, fp)) {
+            len = strlen(buf + pre);
+            buf[pre + len - 1] = '\0';
+            art_insert(&t, (unsigned char*)buf + pre, len, (void*)line++);
+            art_insert(&t, (unsigned char*)buf, len + pre, (void*)line++);
+            keys += 2;
+            key_bytes += 2 * len + pre;
+        }
+        fclose(fp);
+
+        art_analysis a;
+        art_analyze(&t, &a);
+        fail_unless(a.leaves == keys && a.leaves == art_size(&t));
+        fail_unless(a.key_bytes == key_bytes);
+        if (!flags[f])
+            fail_unless(a.leaf_bytes == keys * sizeof(art_leaf) + key_bytes);
+        else
+            fail_unless(a.leaf_bytes >= keys * sizeof(art_leaf) + key_bytes);
+
+        // Every node and leaf lands in one bucket of each histogram
+        uint64_t nodes = 0, prefixes = 0, depths = 0;
+        for (int i=0; i < 5; i++) {
+            uint64_t filled = 0;
+            for (int b=0; b < ART_FILL_BUCKETS; b++)
+                filled += a.fill[i][b];
+            fail_unless(filled == a.nodes[i]);
+            nodes += a.nodes[i];
+        }
+        for (int i=0; i < MAX_PREFIX_LEN + 2; i++)
+            prefixes += a.partial_len[i];
+        for (int i=0; i < ART_DEPTH_BUCKETS; i++)
+            depths += a.leaf_depth[i];
+        fail_unless(prefixes == nodes && depths == keys);
+        fail_unless(a.nodes[NODE4-1] > 0 && a.nodes[NODE256-1] > 0);
+        fail_unless(a.node_bytes[NODE16-1] == a.nodes[NODE16-1] * sizeof(art_node16));
+
+        // The prefixed words share more than a node keeps inline
+        fail_unless(a.partial_len[MAX_PREFIX_LEN + 1] > 0);
+        fail_unless(a.max_partial_len > MAX_PREFIX_LEN);
+        fail_unless(a.max_leaf_depth > 1 && a.leaf_depth[0] == 0);
+
+        // The allocator holds at least what was asked for
+        fail_unless(a.usable >= a.bytes);
+        fail_unless(a.bytes > a.leaf_bytes);
+        fail_unless(art_tree_destroy(&t) == 0);
+    }
+}
+END_TEST
+
 START_TEST(test_art_insert_search_uuid)
 {
     art_tree t;